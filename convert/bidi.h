@@ -0,0 +1,47 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_BIDI_H
+#define CONVERT_BIDI_H
+// bidi.h - definitions shared by the bidirectional converters.
+
+/*
+	Some characters in bidirectional tables require left-to-right or
+	right-to-left context. When converting to UTF-8, these characters are
+	surrounded by direction overrides if the context would otherwise be wrong.
+	When converting from UTF-8, the context chooses between characters which
+	have the same Unicode string but different directions.
+
+	Both converters track the context the same way: the direction of the
+	override which is open, if any, and otherwise the direction of the last
+	strong character on the line, defaulting to left-to-right. This is simpler
+	than the Unicode bidirectional algorithm, but it always gives the same
+	result for text which was converted to UTF-8 by the forward converter.
+*/
+
+enum {
+	// Directions. A table entry's flags contain the direction the character
+	// requires in bits 0-1, and the character's strong direction in bits 2-3.
+	kBidiAny,
+	kBidiLR,
+	kBidiRL,
+
+	// Mask for the required direction in a table entry's flags.
+	kBidiDirMask = 3,
+	// Shift for the strong direction in a table entry's flags.
+	kBidiStrongShift = 2,
+
+	// UTF-8 encoding of POP DIRECTIONAL FORMATTING, LEFT-TO-RIGHT OVERRIDE,
+	// and RIGHT-TO-LEFT OVERRIDE. The last byte is kBidiControl3 plus the
+	// direction, or plus zero for PDF.
+	kBidiControl1 = 0xe2,
+	kBidiControl2 = 0x80,
+	kBidiControl3 = 0xac
+};
+
+// Get the direction context, given the direction of the open override and the
+// direction of the last strong character.
+#define BidiContext(override, lastdir) \
+	((override) != 0 ? (override) : (lastdir) != 0 ? (lastdir) : kBidiLR)
+
+#endif
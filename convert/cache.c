@@ -0,0 +1,72 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// cache.c - shared converters for built-in charmaps.
+#include "convert/cache.h"
+
+#include "convert/data.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+enum {
+	// Maximum number of charmaps in the cache. This is much larger than the
+	// number of charmaps that exist.
+	kMaxCharmaps = 256,
+
+	// Number of directions.
+	kDirectionCount = kToUTF32LE + 1
+};
+
+// Cached converters, indexed by charmap and direction. An entry is only valid
+// after its ready flag is set. The entries are written once, while holding the
+// lock, and never modified afterwards.
+static struct Converter gCache[kMaxCharmaps][kDirectionCount];
+static atomic_uchar gReady[kMaxCharmaps][kDirectionCount];
+static pthread_mutex_t gCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+int ConverterCacheGet(struct Converter *c, int cmap,
+                      ConvertDirection direction)
+{
+	struct Converter *entry;
+	struct HandleScope scope;
+	atomic_uchar *ready;
+	ErrorCode err;
+
+	if (cmap < 0 || kMaxCharmaps <= cmap || (int)direction < 0 ||
+	    kDirectionCount <= (int)direction) {
+		return kErrorBadData;
+	}
+	entry = &gCache[cmap][direction];
+	ready = &gReady[cmap][direction];
+
+	// Fast path: the converter was already built.
+	if (atomic_load_explicit(ready, memory_order_acquire) == 0) {
+		pthread_mutex_lock(&gCacheLock);
+		err = 0;
+		if (atomic_load_explicit(ready, memory_order_relaxed) == 0) {
+			// The entry lives until exit, so it must not be allocated in the
+			// caller's handle scope.
+			HandleScopeSuspend(&scope);
+			err = ConverterBuildCharmap(entry, cmap, direction);
+			HandleScopeResume(&scope);
+			if (err == 0) {
+				atomic_store_explicit(ready, 1, memory_order_release);
+			}
+		}
+		pthread_mutex_unlock(&gCacheLock);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	c->data = entry->data;
+	c->staticdata = entry->staticdata;
+	c->run = entry->run;
+	c->count = entry->count;
+	c->split = entry->split;
+	c->owned = false;
+	c->unitsize = entry->unitsize;
+	return 0;
+}
@@ -0,0 +1,20 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_CACHE_H
+#define CONVERT_CACHE_H
+// cache.h - shared converters for built-in charmaps, not used for classic Mac
+// OS builds.
+#include "convert/convert.h"
+
+// Get a shared converter for the given charmap and direction. The converter is
+// built the first time it is requested, and the same converter data is returned
+// after that. This is safe to call from multiple threads.
+//
+// The converter data is read-only and lives until the process exits. The
+// converter does not own its data, so ConverterDispose does nothing. Each user
+// of the converter needs its own ConverterState.
+int ConverterCacheGet(struct Converter *c, int cmap,
+                      ConvertDirection direction);
+
+#endif
@@ -0,0 +1,160 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "convert/cache.h"
+
+#include "convert/data.h"
+#include "lib/test.h"
+
+#include <pthread.h>
+#include <string.h>
+
+enum {
+	kThreadCount = 8,
+	kMaxCharmaps = 64
+};
+
+struct ThreadResult {
+	const void *data[kMaxCharmaps][2];
+	ErrorCode err[kMaxCharmaps][2];
+};
+
+static int gCharmapCount;
+static struct ThreadResult gResults[kThreadCount];
+
+static void *GetConverters(void *arg)
+{
+	struct ThreadResult *r = arg;
+	struct Converter c;
+	int i, j;
+
+	for (i = 0; i < gCharmapCount; i++) {
+		for (j = 0; j < 2; j++) {
+			r->err[i][j] = ConverterCacheGet(&c, i, j);
+			r->data[i][j] = r->err[i][j] == 0 ? ConverterData(&c) : NULL;
+		}
+	}
+	return NULL;
+}
+
+// Test that all threads get the same converters.
+static void TestThreads(void)
+{
+	pthread_t threads[kThreadCount];
+	const struct ThreadResult *r, *r0;
+	int i, j, k;
+
+	for (k = 0; k < kThreadCount; k++) {
+		if (pthread_create(&threads[k], NULL, GetConverters, &gResults[k]) !=
+		    0) {
+			Failf("pthread_create failed");
+			return;
+		}
+	}
+	for (k = 0; k < kThreadCount; k++) {
+		pthread_join(threads[k], NULL);
+	}
+
+	r0 = &gResults[0];
+	for (i = 0; i < gCharmapCount; i++) {
+		for (j = 0; j < 2; j++) {
+			SetTestNamef("%s %s", CharmapID(i),
+			             j == kToUTF8 ? "forward" : "reverse");
+			if (CharmapData(i).ptr == NULL) {
+				if (r0->err[i][j] == 0) {
+					Failf("expected error for charmap without table");
+				}
+				continue;
+			}
+			for (k = 0; k < kThreadCount; k++) {
+				r = &gResults[k];
+				if (r->err[i][j] != 0) {
+					Failf("thread %d: %s", k,
+					      ErrorDescriptionOrDie(r->err[i][j]));
+				} else if (r->data[i][j] == NULL ||
+				           r->data[i][j] != r0->data[i][j]) {
+					Failf("thread %d: converter is not shared", k);
+				}
+			}
+		}
+	}
+}
+
+// Test that a cached converter works, and is unaffected by ConverterDispose.
+static void TestConvert(void)
+{
+	static const char kText[] = "Hello, world!";
+	struct Converter c;
+	struct ConverterState st;
+	UInt8 buf[64], *optr;
+	const UInt8 *iptr;
+	Handle data;
+	int i;
+	ErrorCode err;
+
+	SetTestName("convert");
+	for (i = 0; i < 2; i++) {
+		err = ConverterCacheGet(&c, 0, kToUTF8);
+		if (err != 0) {
+			Failf("ConverterCacheGet: %s", ErrorDescriptionOrDie(err));
+			return;
+		}
+		if (i == 0) {
+			data = c.data;
+		} else if (c.data != data) {
+			Failf("converter is not shared");
+		}
+		MemClear(&st, sizeof(st));
+		iptr = (const UInt8 *)kText;
+		optr = buf;
+		c.run(ConverterData(&c), kLineBreakKeep, &st, &optr, buf + sizeof(buf),
+		      &iptr, iptr + sizeof(kText) - 1);
+		if (optr - buf != sizeof(kText) - 1 ||
+		    memcmp(buf, kText, sizeof(kText) - 1) != 0) {
+			Failf("incorrect output");
+		}
+		ConverterDispose(&c);
+	}
+
+	SetTestName("invalid");
+	if (ConverterCacheGet(&c, -1, kToUTF8) == 0) {
+		Failf("expected error for invalid charmap");
+	}
+}
+
+// Test that a converter built while a handle scope is active is not allocated
+// in the scope.
+static void TestScope(void)
+{
+	struct HandleScope scope;
+	struct Converter c;
+	Ptr ptr;
+	ErrorCode err;
+
+	SetTestName("scope");
+	HandleScopeBegin(&scope);
+	err = ConverterCacheGet(&c, 0, kToUTF16LE);
+	ptr = err == 0 ? *c.data : NULL;
+	HandleScopeEnd(&scope);
+	if (err != 0) {
+		Failf("ConverterCacheGet: %s", ErrorDescriptionOrDie(err));
+		return;
+	}
+	if (*c.data != ptr) {
+		Failf("converter data moved when the scope ended");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	while (gCharmapCount < kMaxCharmaps && CharmapID(gCharmapCount) != NULL) {
+		gCharmapCount++;
+	}
+	TestThreads();
+	TestConvert();
+	TestScope();
+	return TestsDone();
+}
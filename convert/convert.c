@@ -3,13 +3,106 @@
 // Mozilla Public License, version 2.0. See LICENSE.txt for details.
 #include "convert/convert.h"
 
+#include "convert/wide.h"
+#include "lib/utf8.h"
+
+#include <string.h>
+
 struct ConvertEngine {
 	ConvertBuildf build;
 	ConvertRunf run;
+	ConvertCountf count;
+	ConvertSplitf split;
 };
 
 const struct ConvertEngine kEngines[][2] = {
-	{{Convert1fBuild, Convert1fRun}, {Convert1rBuild, Convert1rRun}}};
+	{{Convert1fBuild, Convert1fRun, Convert1fCount, Convert1fSplit},
+	 {Convert1rBuild, Convert1rRun, Convert1rCount, Convert1rSplit}},
+	{{Convert2Build, Convert2Run, Convert2Count, Convert2Split},
+	 {Convert2Build, Convert2Run, Convert2Count, Convert2Split}},
+	{{Convert3fBuild, Convert3fRun, Convert3fCount, Convert3fSplit},
+	 {Convert3rBuild, Convert3rRun, Convert3rCount, Convert3rSplit}},
+	{{Convert4fBuild, Convert4fRun, Convert4fCount, Convert4fSplit},
+	 {Convert4rBuild, Convert4rRun, Convert4rCount, Convert4rSplit}},
+	{{Convert5fBuild, Convert5fRun, Convert5fCount, Convert5fSplit},
+	 {Convert3rBuild, Convert3rRun, Convert3rCount, Convert3rSplit}}};
+
+// Run functions for kFromUTF8Strict, for each table format. Text which is
+// only converted for line breaks has no unmappable characters. Strict
+// converters can't be counted or split.
+static const ConvertRunf kStrictRun[] = {
+	Convert1rRunStrict, Convert2Run, Convert3rRunStrict, Convert4rRunStrict,
+	Convert3rRunStrict};
+
+// Engines for UTF-16 and UTF-32 output, with a run and count function for each
+// output form, in the same order as ConvertDirection.
+struct ConvertWideEngine {
+	ConvertBuildf build;
+	ConvertRunf run[4];
+	ConvertCountf count[4];
+	ConvertSplitf split;
+};
+
+// Wide engines for each table format. Formats without a build function use
+// the forward engine and widen its output, with kWideAdapter.
+static const struct ConvertWideEngine kWideEngines[] = {
+	{Convert1wBuild,
+	 {Convert1wRun16BE, Convert1wRun16LE, Convert1wRun32BE, Convert1wRun32LE},
+	 {Convert1wCount16, Convert1wCount16, Convert1wCount32, Convert1wCount32},
+	 Convert1fSplit},
+	{Convert2Build,
+	 {Convert2wRun16BE, Convert2wRun16LE, Convert2wRun32BE, Convert2wRun32LE},
+	 {Convert2wCount16, Convert2wCount16, Convert2wCount32, Convert2wCount32},
+	 Convert2wSplit},
+	{NULL},
+	{NULL},
+	{NULL}};
+
+static const struct ConvertWideEngine kWideAdapter = {
+	NULL,
+	{ConvertWideRun16BE, ConvertWideRun16LE, ConvertWideRun32BE,
+	 ConvertWideRun32LE},
+	{ConvertWideCount16, ConvertWideCount16, ConvertWideCount32,
+	 ConvertWideCount32},
+	ConvertWideSplit};
+
+// Build a converter with UTF-16 or UTF-32 output.
+static int ConverterBuildWide(struct Converter *c, int engine, Handle data,
+                              Size datasz, ConvertDirection direction)
+{
+	const struct ConvertWideEngine *wide;
+	const struct ConvertEngine *funcs;
+	Handle out, fwd;
+	ErrorCode err;
+
+	wide = &kWideEngines[engine];
+	if (wide->build != NULL) {
+		err = wide->build(&out, data, datasz);
+		if (err != 0) {
+			return err;
+		}
+	} else {
+		funcs = &kEngines[engine][kToUTF8];
+		err = funcs->build(&fwd, data, datasz);
+		if (err != 0) {
+			return err;
+		}
+		err = ConvertWideBuild(&out, fwd, funcs->run, funcs->split);
+		DisposeHandle(fwd);
+		if (err != 0) {
+			return err;
+		}
+		wide = &kWideAdapter;
+	}
+	c->data = out;
+	c->staticdata = NULL;
+	c->run = wide->run[direction - kToUTF16BE];
+	c->count = wide->count[direction - kToUTF16BE];
+	c->split = wide->split;
+	c->owned = true;
+	c->unitsize = WideUnitSize(direction);
+	return 0;
+}
 
 int ConverterBuild(struct Converter *c, Handle data, Size datasz,
                    ConvertDirection direction)
@@ -27,7 +120,10 @@ int ConverterBuild(struct Converter *c, Handle data, Size datasz,
 		// Invalid engine.
 		return kErrorBadData;
 	}
-	funcs = &kEngines[engine][direction];
+	if (direction >= kToUTF16BE) {
+		return ConverterBuildWide(c, engine, data, datasz, direction);
+	}
+	funcs = &kEngines[engine][direction == kToUTF8 ? kToUTF8 : kFromUTF8];
 	if (funcs->build == NULL || funcs->run == NULL) {
 		// Invalid engine.
 		return kErrorBadData;
@@ -37,6 +133,219 @@ int ConverterBuild(struct Converter *c, Handle data, Size datasz,
 		return err;
 	}
 	c->data = out;
-	c->run = funcs->run;
+	c->staticdata = NULL;
+	if (direction == kFromUTF8Strict) {
+		c->run = kStrictRun[engine];
+		c->count = NULL;
+		c->split = NULL;
+	} else {
+		c->run = funcs->run;
+		c->count = funcs->count;
+		c->split = funcs->split;
+	}
+	c->owned = true;
+	c->unitsize = 1;
 	return 0;
 }
+
+int ConverterBuildStatic(struct Converter *c, int format, const void *cvtdata,
+                         Size cvtsize, ConvertDirection direction)
+{
+	int engine;
+	const struct ConvertWideEngine *wide;
+	const struct ConvertEngine *funcs;
+	ConvertRunf run;
+	ConvertCountf count;
+	ConvertSplitf split;
+
+	if (cvtdata == NULL || cvtsize <= 0) {
+		return kErrorBadData;
+	}
+	engine = format - 1;
+	if (engine < 0 || (int)(sizeof(kEngines) / sizeof(*kEngines)) <= engine) {
+		// Invalid engine.
+		return kErrorBadData;
+	}
+	if (direction >= kToUTF16BE) {
+		wide = kWideEngines[engine].build != NULL ? &kWideEngines[engine] :
+		                                            &kWideAdapter;
+		run = wide->run[direction - kToUTF16BE];
+		count = wide->count[direction - kToUTF16BE];
+		split = wide->split;
+	} else if (direction == kFromUTF8Strict) {
+		run = kStrictRun[engine];
+		count = NULL;
+		split = NULL;
+	} else {
+		funcs = &kEngines[engine][direction];
+		run = funcs->run;
+		count = funcs->count;
+		split = funcs->split;
+	}
+	if (run == NULL) {
+		// Invalid engine.
+		return kErrorBadData;
+	}
+	c->data = NULL;
+	c->staticdata = cvtdata;
+	c->run = run;
+	c->count = count;
+	c->split = split;
+	c->owned = false;
+	c->unitsize = WideUnitSize(direction);
+	return 0;
+}
+
+void ConverterDispose(struct Converter *c)
+{
+	if (c->owned && c->data != NULL) {
+		DisposeHandle(c->data);
+	}
+	c->data = NULL;
+	c->staticdata = NULL;
+	c->owned = false;
+}
+
+const void *ConverterData(const struct Converter *c)
+{
+	return c->data != NULL ? *c->data : c->staticdata;
+}
+
+int ConverterBuildLineBreak(struct Converter *c)
+{
+	static const UInt8 kTable[1] = {kTableLineBreak};
+	Ptr ptr;
+
+	ptr = (Ptr)kTable;
+	return ConverterBuild(c, &ptr, sizeof(kTable), kToUTF8);
+}
+
+void ConverterRun(const struct Converter *c, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend)
+{
+	struct ConvertStats *stats = stateptr->stats;
+	UInt8 *ostart = *optr;
+	const UInt8 *istart = *iptr;
+
+	c->run(ConverterData(c), lc, stateptr, optr, oend, iptr, iend);
+	if (stats != NULL) {
+		stats->insize += *iptr - istart;
+		stats->outsize += *optr - ostart;
+	}
+}
+
+ErrorCode ConverterFlush(const struct Converter *c, LineBreakConversion lc,
+                         struct ConverterState *stateptr, UInt8 **optr,
+                         UInt8 *oend, const UInt8 *ptr, const UInt8 *end)
+{
+	struct ConvertStats *stats = stateptr->stats;
+	UInt8 tail[kConverterMaxSequence + 1];
+	const UInt8 *tpos, *tend, *tstart;
+	UInt8 *obuf, *opos, *ostart;
+	Size n;
+	int i;
+	ErrorCode err;
+
+	assert(oend - *optr >= kConverterFlushRoom);
+	n = end - ptr;
+	if (n > kConverterMaxSequence) {
+		return kErrorBadData;
+	}
+	memcpy(tail, ptr, n);
+	tail[n] = 0;
+	tpos = tail;
+	tend = tpos + n + 1;
+	obuf = *optr;
+	opos = obuf;
+	err = 0;
+	for (;;) {
+		tstart = tpos;
+		ostart = opos;
+		ConverterRun(c, lc, stateptr, &opos, oend, &tpos, tend);
+		if (stateptr->unmapped != 0) {
+			err = kErrorUnmappable;
+			break;
+		}
+		if (tpos == tend) {
+			break;
+		}
+		// With kConverterFlushRoom of output, this is never because the output
+		// is full.
+		if (tpos == tstart && opos == ostart) {
+			err = kErrorBadData;
+			break;
+		}
+	}
+	if (err == 0 && opos - obuf < c->unitsize) {
+		err = kErrorBadData;
+	}
+	for (i = 1; err == 0 && i <= c->unitsize; i++) {
+		if (opos[-i] != 0) {
+			err = kErrorBadData;
+		}
+	}
+	if (err == 0) {
+		opos -= c->unitsize;
+		if (stats != NULL) {
+			stats->insize--;
+			stats->outsize -= c->unitsize;
+		}
+	}
+	*optr = opos;
+	return err;
+}
+
+Size ConverterCount(const struct Converter *c, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend)
+{
+	if (c->count == NULL) {
+		return -1;
+	}
+	return c->count(ConverterData(c), lc, stateptr, iptr, iend);
+}
+
+const UInt8 *ConverterSplit(const struct Converter *c, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end)
+{
+	if (c->split == NULL) {
+		return NULL;
+	}
+	return c->split(ConverterData(c), start, ptr, end);
+}
+
+void ConvertStatsLineBreak(struct ConvertStats *stats, LineBreakConversion lc,
+                           unsigned ch, unsigned lastch)
+{
+	if (lc == kLineBreakKeep) {
+		return;
+	}
+	if (ch == kCharLF) {
+		if (lastch == kCharCR) {
+			// The CR was already counted by itself, but it is the start of a
+			// CR LF.
+			if (lc != kLineBreakCR) {
+				stats->linebreaks[kLineBreakTypeCR]--;
+			}
+			if (lc != kLineBreakCRLF) {
+				stats->linebreaks[kLineBreakTypeCRLF]++;
+			}
+		} else if (lc != kLineBreakLF) {
+			stats->linebreaks[kLineBreakTypeLF]++;
+		}
+	} else if (lc != kLineBreakCR) {
+		stats->linebreaks[kLineBreakTypeCR]++;
+	}
+}
+
+void ConvertSetUnmapped(struct ConverterState *stateptr, const UInt8 *ptr,
+                        const UInt8 *end)
+{
+	UInt32 ch;
+
+	if (UTF8Decode(ptr, end, &ch) <= 0) {
+		ch = kCharInvalid;
+	}
+	stateptr->unmapped = ch;
+}
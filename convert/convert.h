@@ -17,7 +17,21 @@ enum {
 	kCharCR = 13,
 
 	// Constant for substitution character: '?'.
-	kCharSubstitute = 63
+	kCharSubstitute = 63,
+
+	// Value reported for an unmappable character which is not valid UTF-8.
+	// This is not a Unicode code point.
+	kCharInvalid = 0x110000,
+
+	// Longest incomplete sequence that a converter leaves unconsumed at the
+	// end of the input. Tables map sequences of up to eight code points, which
+	// is at most 32 bytes of UTF-8, and bidirectional tables may add direction
+	// controls between them.
+	kConverterMaxSequence = 64,
+
+	// Output space that ConverterFlush requires. This is enough for the
+	// longest tail in any output encoding, with line break conversion.
+	kConverterFlushRoom = 1024
 };
 
 typedef enum {
@@ -34,19 +48,69 @@ typedef enum {
 	kLineBreakCRLF
 } LineBreakConversion;
 
-// Directions that the converter runs in.
+// Types of line breaks in the input, for statistics.
+enum {
+	kLineBreakTypeCR,
+	kLineBreakTypeLF,
+	kLineBreakTypeCRLF,
+
+	kLineBreakTypeCount
+};
+
+// Conversion table formats. The first byte of each table identifies its
+// format. See Formats.md.
+enum {
+	kTableExtendedASCII = 1,
+	kTableLineBreak = 2,
+	kTableMultibyte = 3,
+	kTableBidirectional = 4,
+	kTableDigraph = 5
+};
+
+// Directions that the converter runs in. The UTF-16 and UTF-32 directions
+// convert to Unicode, like kToUTF8, but with a different output encoding.
+// kFromUTF8Strict is like kFromUTF8, but the converter stops before the first
+// character which has no mapping instead of writing a substitute, and sets
+// the unmapped field in the state.
 typedef enum {
 	kToUTF8,
 	kFromUTF8,
+	kFromUTF8Strict,
+	kToUTF16BE,
+	kToUTF16LE,
+	kToUTF32BE,
+	kToUTF32LE
 } ConvertDirection;
 
 // Get the character map used for the given Mac OS script and region codes.
 // Return -1 if no known character map exists.
 int GetCharmap(int script, int region);
 
+// Statistics about a conversion, to find out how lossy it was.
+struct ConvertStats {
+	// Number of characters or sequences in the input which could not be
+	// converted, and were replaced with a substitution character.
+	Size substitutions;
+	// Number of line breaks which were changed by line break conversion, by
+	// their type in the input. A CR at the end of the input is counted as a CR
+	// until the following LF, if any, is converted.
+	Size linebreaks[kLineBreakTypeCount];
+	// Amount of input consumed and output produced, in bytes. Only counted by
+	// ConverterRun.
+	Size insize;
+	Size outsize;
+};
+
 // The state of a converter. Must be zeroed prior to first conversion.
 struct ConverterState {
 	UInt32 data;
+	// Statistics to update, or NULL. The run functions add to the statistics,
+	// and the count functions do not.
+	struct ConvertStats *stats;
+	// For strict converters, the code point of the character which has no
+	// mapping, if conversion stopped there, or zero. The input pointer is left
+	// at the start of the character.
+	UInt32 unmapped;
 };
 
 // Implementation function for building a converter.
@@ -57,26 +121,279 @@ typedef void (*ConvertRunf)(const void *cvtptr, LineBreakConversion lc,
                             struct ConverterState *stateptr, UInt8 **optr,
                             UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
 
-// A converter. The converter can be freed by disposing the handle.
+// Implementation function for counting the output of a converter. Return the
+// amount of output that the run function would produce with unlimited output
+// space, without writing anything. The state and input pointer are updated the
+// same way.
+typedef Size (*ConvertCountf)(const void *cvtptr, LineBreakConversion lc,
+                              struct ConverterState *stateptr,
+                              const UInt8 **iptr, const UInt8 *iend);
+
+// Implementation function for finding a place to split the input. Return the
+// first position in [ptr, end) where the input can be split, so the data before
+// and after it can be converted separately, each starting with a zeroed state,
+// with the same output as converting it all at once. Return NULL if there is no
+// such position. The data from start to ptr may also be examined. The ptr must
+// be after start.
+typedef const UInt8 *(*ConvertSplitf)(const void *cvtptr, const UInt8 *start,
+                                      const UInt8 *ptr, const UInt8 *end);
+
+// A converter. The converter can be freed with ConverterDispose.
 struct Converter {
+	// Converter data in a handle, or NULL if the converter uses static data.
 	Handle data;
+	// Static converter data, used if data is NULL. See ConverterBuildStatic.
+	const void *staticdata;
 	ConvertRunf run;
+	// Count and split functions for the run function, or NULL if the converter
+	// does not support them.
+	ConvertCountf count;
+	ConvertSplitf split;
+	// True if the converter owns the data handle.
+	Boolean owned;
+	// Size of each code unit in the output, in bytes: 2 for UTF-16, 4 for
+	// UTF-32, and 1 otherwise. A NUL byte in the input is converted to one zero
+	// code unit.
+	UInt8 unitsize;
 };
 
 // Build a converter from the given conversion table data.
 int ConverterBuild(struct Converter *c, Handle data, Size datasz,
                    ConvertDirection direction);
 
+// Build a converter which uses precompiled converter data, which must be
+// identical to the data that ConverterBuild would create for a table in the
+// given format. The data is static and used directly, without copying or
+// allocating memory, and it is never freed.
+int ConverterBuildStatic(struct Converter *c, int format, const void *cvtdata,
+                         Size cvtsize, ConvertDirection direction);
+
+// Free the data owned by a converter.
+void ConverterDispose(struct Converter *c);
+
+// Get the converter data to pass to the run, count, and split functions. If the
+// data is in a handle, the pointer is only valid until memory moves.
+const void *ConverterData(const struct Converter *c);
+
+// Run the given converter, and count the input and output in the statistics,
+// if the state has statistics.
+void ConverterRun(const struct Converter *c, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend);
+
+// Flush the converter at the end of the input. The incomplete input at the end,
+// from ptr to end, and any partial sequence saved in the converter state are
+// converted by running the converter over a copy of the input followed by a NUL
+// byte, which can't continue any sequence, and the NUL is removed from the
+// output. Output is written the same way as ConverterRun, and the output buffer
+// must have at least kConverterFlushRoom bytes of space, so the converter never
+// stops because the output is full. Returns kErrorUnmappable if a strict
+// converter stops at a character with no mapping, and kErrorBadData if the
+// tail is longer than kConverterMaxSequence or the input is not consumed.
+ErrorCode ConverterFlush(const struct Converter *c, LineBreakConversion lc,
+                         struct ConverterState *stateptr, UInt8 **optr,
+                         UInt8 *oend, const UInt8 *ptr, const UInt8 *end);
+
+// Count the output of the given converter. See ConvertCountf. Returns -1 if the
+// converter does not support counting. Strict converters do not support
+// counting.
+Size ConverterCount(const struct Converter *c, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend);
+
+// Find a place to split the input for the given converter. See ConvertSplitf.
+// Strict converters never split the input.
+const UInt8 *ConverterSplit(const struct Converter *c, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end);
+
+// Build a converter which only converts line breaks, for text which is already
+// ASCII or UTF-8.
+int ConverterBuildLineBreak(struct Converter *c);
+
+// Record a line break in the statistics, if line break conversion changes it.
+// The character is CR or LF, and lastch is the character before it. Called by
+// the run functions.
+void ConvertStatsLineBreak(struct ConvertStats *stats, LineBreakConversion lc,
+                           unsigned ch, unsigned lastch);
+
+// Record the character from ptr to end, which has no mapping, in the state of
+// a strict converter. Called by the run functions.
+void ConvertSetUnmapped(struct ConverterState *stateptr, const UInt8 *ptr,
+                        const UInt8 *end);
+
 // Engine 1: extended ASCII.
 
 ErrorCode Convert1fBuild(Handle *out, Handle data, Size datasz);
 void Convert1fRun(const void *cvtptr, LineBreakConversion lc,
                   struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
                   const UInt8 **iptr, const UInt8 *iend);
+Size Convert1fCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend);
+const UInt8 *Convert1fSplit(const void *cvtptr, const UInt8 *start,
+                             const UInt8 *ptr, const UInt8 *end);
 
 ErrorCode Convert1rBuild(Handle *out, Handle data, Size datasz);
 void Convert1rRun(const void *cvtptr, LineBreakConversion lc,
                   struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
                   const UInt8 **iptr, const UInt8 *iend);
+void Convert1rRunStrict(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+Size Convert1rCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend);
+const UInt8 *Convert1rSplit(const void *cvtptr, const UInt8 *start,
+                             const UInt8 *ptr, const UInt8 *end);
+
+// Engine 1: extended ASCII to UTF-16 and UTF-32, using the same tables.
+// Splitting uses Convert1fSplit.
+
+ErrorCode Convert1wBuild(Handle *out, Handle data, Size datasz);
+void Convert1wRun16BE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+void Convert1wRun16LE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+void Convert1wRun32BE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+void Convert1wRun32LE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+Size Convert1wCount16(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, const UInt8 **iptr,
+                      const UInt8 *iend);
+Size Convert1wCount32(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, const UInt8 **iptr,
+                      const UInt8 *iend);
+
+// Engine 2: line breaks only.
+
+ErrorCode Convert2Build(Handle *out, Handle data, Size datasz);
+void Convert2Run(const void *cvtptr, LineBreakConversion lc,
+                 struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                 const UInt8 **iptr, const UInt8 *iend);
+Size Convert2Count(const void *cvtptr, LineBreakConversion lc,
+                   struct ConverterState *stateptr, const UInt8 **iptr,
+                   const UInt8 *iend);
+const UInt8 *Convert2Split(const void *cvtptr, const UInt8 *start,
+                           const UInt8 *ptr, const UInt8 *end);
+
+// Engine 2: UTF-8 to UTF-16 and UTF-32, with line break conversion. Invalid
+// UTF-8 is converted to U+FFFD, once for each maximal subpart of an invalid
+// sequence. Building uses Convert2Build.
+
+void Convert2wRun16BE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+void Convert2wRun16LE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+void Convert2wRun32BE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+void Convert2wRun32LE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+Size Convert2wCount16(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, const UInt8 **iptr,
+                      const UInt8 *iend);
+Size Convert2wCount32(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, const UInt8 **iptr,
+                      const UInt8 *iend);
+const UInt8 *Convert2wSplit(const void *cvtptr, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end);
+
+// Engine 3: multibyte.
+
+ErrorCode Convert3fBuild(Handle *out, Handle data, Size datasz);
+void Convert3fRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend);
+Size Convert3fCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend);
+const UInt8 *Convert3fSplit(const void *cvtptr, const UInt8 *start,
+                             const UInt8 *ptr, const UInt8 *end);
+
+ErrorCode Convert3rBuild(Handle *out, Handle data, Size datasz);
+void Convert3rRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend);
+void Convert3rRunStrict(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+Size Convert3rCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend);
+const UInt8 *Convert3rSplit(const void *cvtptr, const UInt8 *start,
+                             const UInt8 *ptr, const UInt8 *end);
+
+// Engine 4: bidirectional extended ASCII.
+
+ErrorCode Convert4fBuild(Handle *out, Handle data, Size datasz);
+void Convert4fRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend);
+Size Convert4fCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend);
+const UInt8 *Convert4fSplit(const void *cvtptr, const UInt8 *start,
+                             const UInt8 *ptr, const UInt8 *end);
+
+ErrorCode Convert4rBuild(Handle *out, Handle data, Size datasz);
+void Convert4rRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend);
+void Convert4rRunStrict(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+Size Convert4rCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend);
+const UInt8 *Convert4rSplit(const void *cvtptr, const UInt8 *start,
+                             const UInt8 *ptr, const UInt8 *end);
+
+// Engine 5: digraph extended ASCII. Conversion from UTF-8 uses the multibyte
+// reverse converter, Convert3r.
+
+ErrorCode Convert5fBuild(Handle *out, Handle data, Size datasz);
+void Convert5fRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend);
+Size Convert5fCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend);
+const UInt8 *Convert5fSplit(const void *cvtptr, const UInt8 *start,
+                             const UInt8 *ptr, const UInt8 *end);
+
+// UTF-16 and UTF-32 output for the other engines. The converter data contains
+// a UTF-8 converter, and its output is widened. Data is built with
+// ConvertWideBuild.
+
+ErrorCode ConvertWideBuild(Handle *out, Handle data, ConvertRunf run,
+                           ConvertSplitf split);
+void ConvertWideRun16BE(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+void ConvertWideRun16LE(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+void ConvertWideRun32BE(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+void ConvertWideRun32LE(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+Size ConvertWideCount16(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, const UInt8 **iptr,
+                        const UInt8 *iend);
+Size ConvertWideCount32(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, const UInt8 **iptr,
+                        const UInt8 *iend);
+const UInt8 *ConvertWideSplit(const void *cvtptr, const UInt8 *start,
+                              const UInt8 *ptr, const UInt8 *end);
 
 #endif
@@ -2,67 +2,136 @@
 // This file is part of SyncFiles. SyncFiles is licensed under the terms of the
 // Mozilla Public License, version 2.0. See LICENSE.txt for details.
 
-// convert_1f.c - Forward conversion from extended ASCII to UTF-8.
+// convert_1f.c - Forward conversion from extended ASCII to UTF-8, UTF-16, or
+// UTF-32.
 #include "convert/convert.h"
+#include "convert/scan.h"
+#include "convert/wide.h"
 #include "lib/defs.h"
 
+#include <string.h>
+
 struct Convert1fData {
-	// Unicode characters, encoded in UTF-8, and packed MSB first. Always either
-	// 2 bytes or 3 bytes.
-	UInt32 chars[128];
+	// Output for each input byte: the character encoded in UTF-8, padded to
+	// four bytes, with the length of the encoding in the last byte. Every
+	// character is written with one four-byte store, and the output pointer
+	// advances by the length. The length is zero for CR and LF, which need
+	// line break conversion.
+	UInt8 chars[256][4];
+};
+
+struct Convert1wData {
+	// Unicode characters, which are all in the BMP.
+	UInt16 chars[128];
 };
 
 struct Convert1fState {
 	UInt8 lastch;
 };
 
-ErrorCode Convert1fBuild(Handle *out, Handle data, Size datasz)
+// Read the characters from a conversion table.
+static ErrorCode ReadTable(UInt32 *chars, Handle data, Size datasz)
 {
-	Handle h;
-	struct Convert1fData *cvt;
 	int i, n;
 	UInt32 uch;
 	const UInt8 *dptr, *dend;
 
-	h = NewHandle(sizeof(struct Convert1fData));
-	if (h == NULL) {
-		return kErrorNoMemory;
-	}
-	cvt = (void *)*h;
 	dptr = (void *)*data;
 	dptr++;
 	dend = dptr + datasz;
 	for (i = 0; i < 128; i++) {
 		if (dptr == dend) {
-			goto bad_table;
+			return kErrorBadData;
 		}
 		n = *dptr++;
 		if (n < 2 || 3 < n) {
-			goto bad_table;
+			return kErrorBadData;
 		}
 		if (dend - dptr < n) {
-			goto bad_table;
+			return kErrorBadData;
 		}
 		uch = 0;
 		while (n-- > 0) {
 			uch = (uch << 8) | *dptr++;
 		}
-		cvt->chars[i] = uch;
+		chars[i] = uch;
 		if (dptr == dend) {
-			goto bad_table;
+			return kErrorBadData;
 		}
 		n = *dptr++;
 		if (dend - dptr < n) {
-			goto bad_table;
+			return kErrorBadData;
 		}
 		dptr += n;
 	}
+	return 0;
+}
+
+ErrorCode Convert1fBuild(Handle *out, Handle data, Size datasz)
+{
+	Handle h;
+	struct Convert1fData *cvt;
+	UInt32 chars[128], uch;
+	UInt8 *entry;
+	int i;
+	ErrorCode err;
+
+	err = ReadTable(chars, data, datasz);
+	if (err != 0) {
+		return err;
+	}
+	h = NewHandle(sizeof(struct Convert1fData));
+	if (h == NULL) {
+		return kErrorNoMemory;
+	}
+	cvt = (void *)*h;
+	MemClear(cvt, sizeof(*cvt));
+	for (i = 0; i < 128; i++) {
+		if (i != kCharLF && i != kCharCR) {
+			entry = cvt->chars[i];
+			entry[0] = i;
+			entry[3] = 1;
+		}
+	}
+	for (i = 0; i < 128; i++) {
+		uch = chars[i];
+		entry = cvt->chars[i + 128];
+		if (uch > 0xffff) {
+			entry[0] = uch >> 16;
+			entry[1] = uch >> 8;
+			entry[2] = uch;
+			entry[3] = 3;
+		} else {
+			entry[0] = uch >> 8;
+			entry[1] = uch;
+			entry[3] = 2;
+		}
+	}
 	*out = h;
 	return 0;
+}
 
-bad_table:
-	DisposeHandle(h);
-	return kErrorBadData;
+// Return true if the eight bytes at ptr are all ASCII.
+static Boolean IsASCII8(const UInt8 *ptr)
+{
+	UInt32 w[2];
+
+	memcpy(w, ptr, 8);
+	return ((w[0] | w[1]) & 0x80808080) == 0;
+}
+
+const UInt8 *Convert1fSplit(const void *cvtptr, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end)
+{
+	// The state only matters for an LF following CR.
+	(void)cvtptr;
+	(void)start;
+	for (; ptr < end; ptr++) {
+		if (*ptr != kCharLF) {
+			return ptr;
+		}
+	}
+	return NULL;
 }
 
 void Convert1fRun(const void *cvtptr, LineBreakConversion lc,
@@ -72,55 +141,232 @@ void Convert1fRun(const void *cvtptr, LineBreakConversion lc,
 	const struct Convert1fData *cvt = cvtptr;
 	struct Convert1fState *state = (struct Convert1fState *)stateptr;
 	UInt8 *opos = *optr;
+	const UInt8 *ipos = *iptr, *istart, *istop, *entry;
+	unsigned ch, lastch;
+	Size n, room;
+
+	ch = state->lastch;
+	for (;;) {
+		// Convert everything up to the next line break. Each character takes
+		// at most three bytes, but writes four.
+		n = iend - ipos;
+		room = (oend - opos - 1) / 3;
+		if (n > room) {
+			n = room;
+		}
+		if (n <= 0) {
+			break;
+		}
+		// The store does not depend on the length of the encoding, but the
+		// loop still has two branches for each character. The branch on a
+		// zero length is only taken at line breaks. The check for an ASCII
+		// run is taken rarely in dense text, and is mispredicted in text
+		// which mixes short ASCII runs with high bytes.
+		istart = ipos;
+		istop = ipos + n;
+		while (ipos < istop) {
+			entry = cvt->chars[*ipos];
+			if (entry[3] == 0) {
+				break;
+			}
+			memcpy(opos, entry, 4);
+			opos += entry[3];
+			ipos++;
+			if (istop - ipos >= 8 && IsASCII8(ipos)) {
+				// A run of ASCII characters. Copy the rest of the run at once.
+				// Short runs, like spaces between words in dense text, go
+				// through the table instead.
+				n = ScanASCII(ipos, istop);
+				memcpy(opos, ipos, n);
+				opos += n;
+				ipos += n;
+			}
+		}
+		if (ipos != istart) {
+			ch = ipos[-1];
+		}
+		if (ipos == istop) {
+			continue;
+		}
+
+		// Line breaks. There is room for CR LF.
+		lastch = ch;
+		ch = *ipos++;
+		if (stateptr->stats != NULL) {
+			ConvertStatsLineBreak(stateptr->stats, lc, ch, lastch);
+		}
+		if (ch == kCharLF && lastch == kCharCR) {
+			if (lc == kLineBreakKeep) {
+				*opos++ = ch;
+			}
+		} else {
+			switch (lc) {
+			case kLineBreakKeep:
+				*opos++ = ch;
+				break;
+			case kLineBreakLF:
+				*opos++ = kCharLF;
+				break;
+			case kLineBreakCR:
+				*opos++ = kCharCR;
+				break;
+			case kLineBreakCRLF:
+				*opos++ = kCharCR;
+				*opos++ = kCharLF;
+				break;
+			}
+		}
+	}
+	state->lastch = ch;
+
+	*optr = opos;
+	*iptr = ipos;
+}
+
+Size Convert1fCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend)
+{
+	const struct Convert1fData *cvt = cvtptr;
+	struct Convert1fState *state = (struct Convert1fState *)stateptr;
 	const UInt8 *ipos = *iptr;
 	unsigned ch, lastch;
-	UInt32 uch;
+	Size n, count;
+
+	count = 0;
+	ch = state->lastch;
+	while (ipos < iend) {
+		lastch = ch;
+		ch = *ipos++;
+		if (ch >= 128) {
+			count += cvt->chars[ch][3];
+		} else if (ch == kCharLF && lastch == kCharCR) {
+			if (lc == kLineBreakKeep) {
+				count++;
+			}
+		} else if (ch == kCharLF || ch == kCharCR) {
+			count += lc == kLineBreakCRLF ? 2 : 1;
+		} else {
+			// Count the rest of the ASCII run at once.
+			n = ScanASCII(ipos, iend);
+			count += n + 1;
+			ipos += n;
+			ch = ipos[-1];
+		}
+	}
+	state->lastch = ch;
+
+	*iptr = ipos;
+	return count;
+}
+
+ErrorCode Convert1wBuild(Handle *out, Handle data, Size datasz)
+{
+	Handle h;
+	struct Convert1wData *cvt;
+	UInt32 chars[128], uch;
+	int i;
+	ErrorCode err;
+
+	err = ReadTable(chars, data, datasz);
+	if (err != 0) {
+		return err;
+	}
+	h = NewHandle(sizeof(struct Convert1wData));
+	if (h == NULL) {
+		return kErrorNoMemory;
+	}
+	cvt = (void *)*h;
+	for (i = 0; i < 128; i++) {
+		// Decode the packed UTF-8.
+		uch = chars[i];
+		if (uch > 0xffff) {
+			if ((uch & 0xf0c0c0) != 0xe08080) {
+				goto bad_table;
+			}
+			uch = ((uch >> 4) & 0xf000) | ((uch >> 2) & 0x0fc0) | (uch & 0x3f);
+		} else {
+			if ((uch & 0xe0c0) != 0xc080) {
+				goto bad_table;
+			}
+			uch = ((uch >> 2) & 0x07c0) | (uch & 0x3f);
+		}
+		cvt->chars[i] = uch;
+	}
+	*out = h;
+	return 0;
+
+bad_table:
+	DisposeHandle(h);
+	return kErrorBadData;
+}
+
+static void Convert1wRun(const void *cvtptr, LineBreakConversion lc,
+                         struct ConverterState *stateptr, UInt8 **optr,
+                         UInt8 *oend, const UInt8 **iptr, const UInt8 *iend,
+                         ConvertDirection form)
+{
+	const struct Convert1wData *cvt = cvtptr;
+	struct Convert1fState *state = (struct Convert1fState *)stateptr;
+	UInt8 *opos = *optr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch;
+	Size n, room;
+	int unit;
 
+	unit = WideUnitSize(form);
 	ch = state->lastch;
-	while (ipos < iend && oend - opos >= 3) {
+	// Room for CR LF.
+	while (ipos < iend && oend - opos >= unit * 2) {
 		lastch = ch;
 		ch = *ipos++;
 		if (ch < 128) {
 			if (ch == kCharLF || ch == kCharCR) {
 				// Line breaks.
+				if (stateptr->stats != NULL) {
+					ConvertStatsLineBreak(stateptr->stats, lc, ch, lastch);
+				}
 				if (ch == kCharLF && lastch == kCharCR) {
 					if (lc == kLineBreakKeep) {
-						*opos++ = ch;
+						opos = WideWriteChar(opos, ch, form);
 					}
 				} else {
 					switch (lc) {
 					case kLineBreakKeep:
-						*opos++ = ch;
+						opos = WideWriteChar(opos, ch, form);
 						break;
 					case kLineBreakLF:
-						*opos++ = kCharLF;
+						opos = WideWriteChar(opos, kCharLF, form);
 						break;
 					case kLineBreakCR:
-						*opos++ = kCharCR;
+						opos = WideWriteChar(opos, kCharCR, form);
 						break;
 					case kLineBreakCRLF:
-						*opos++ = kCharCR;
-						*opos++ = kCharLF;
+						opos = WideWriteChar(opos, kCharCR, form);
+						opos = WideWriteChar(opos, kCharLF, form);
 						break;
 					}
 				}
 			} else {
-				// ASCII characters.
-				*opos++ = ch;
+				// ASCII characters. Widen the rest of the run at once.
+				opos = WideWriteChar(opos, ch, form);
+				n = iend - ipos;
+				room = (oend - opos) / unit;
+				if (n > room) {
+					n = room;
+				}
+				if (n > 0 && *ipos < 128) {
+					n = ScanASCII(ipos, ipos + n);
+					if (n > 0) {
+						opos = WideCopyASCII(opos, ipos, ipos + n, form);
+						ipos += n;
+						ch = ipos[-1];
+					}
+				}
 			}
 		} else {
 			// Unicode characters.
-			uch = cvt->chars[ch - 128];
-			if (uch > 0xffff) {
-				opos[0] = uch >> 16;
-				opos[1] = uch >> 8;
-				opos[2] = uch;
-				opos += 3;
-			} else {
-				opos[0] = uch >> 8;
-				opos[1] = uch;
-				opos += 2;
-			}
+			opos = WideWriteChar(opos, cvt->chars[ch - 128], form);
 		}
 	}
 	state->lastch = ch;
@@ -128,3 +374,84 @@ void Convert1fRun(const void *cvtptr, LineBreakConversion lc,
 	*optr = opos;
 	*iptr = ipos;
 }
+
+void Convert1wRun16BE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	Convert1wRun(cvtptr, lc, stateptr, optr, oend, iptr, iend, kToUTF16BE);
+}
+
+void Convert1wRun16LE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	Convert1wRun(cvtptr, lc, stateptr, optr, oend, iptr, iend, kToUTF16LE);
+}
+
+void Convert1wRun32BE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	Convert1wRun(cvtptr, lc, stateptr, optr, oend, iptr, iend, kToUTF32BE);
+}
+
+void Convert1wRun32LE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	Convert1wRun(cvtptr, lc, stateptr, optr, oend, iptr, iend, kToUTF32LE);
+}
+
+// Count the output in code units. Every character is one code unit.
+static Size Convert1wCount(LineBreakConversion lc,
+                           struct ConverterState *stateptr, const UInt8 **iptr,
+                           const UInt8 *iend)
+{
+	struct Convert1fState *state = (struct Convert1fState *)stateptr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch;
+	Size n, count;
+
+	count = 0;
+	ch = state->lastch;
+	while (ipos < iend) {
+		lastch = ch;
+		ch = *ipos++;
+		if (ch == kCharLF && lastch == kCharCR) {
+			if (lc == kLineBreakKeep) {
+				count++;
+			}
+		} else if (ch == kCharLF || ch == kCharCR) {
+			count += lc == kLineBreakCRLF ? 2 : 1;
+		} else if (ch >= 128) {
+			count++;
+		} else {
+			// Count the rest of the ASCII run at once.
+			n = ScanASCII(ipos, iend);
+			count += n + 1;
+			ipos += n;
+			ch = ipos[-1];
+		}
+	}
+	state->lastch = ch;
+
+	*iptr = ipos;
+	return count;
+}
+
+Size Convert1wCount16(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, const UInt8 **iptr,
+                      const UInt8 *iend)
+{
+	(void)cvtptr;
+	return Convert1wCount(lc, stateptr, iptr, iend) * 2;
+}
+
+Size Convert1wCount32(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, const UInt8 **iptr,
+                      const UInt8 *iend)
+{
+	(void)cvtptr;
+	return Convert1wCount(lc, stateptr, iptr, iend) * 4;
+}
@@ -4,8 +4,11 @@
 
 // convert_1r.c - Reverse conversion from UTF-8 to extended ASCII.
 #include "convert/convert.h"
+#include "convert/scan.h"
 #include "lib/defs.h"
 
+#include <string.h>
+
 enum {
 	// Maximum length of encoded character.
 	kMaxEncodedLength = 8,
@@ -34,7 +37,7 @@ struct TTree {
 static ErrorCode CreateTree(struct TTree *tree, Handle data, Size datasz)
 {
 	struct TNode **nodes, *node;
-	int i, j, dpos, enclen, encend, state, cur, nodecount, nodealloc;
+	int i, j, k, dpos, enclen, encend, state, cur, nodecount, nodealloc;
 	unsigned ch;
 
 	// Create a tree with a root node mapping all the ASCII characters except
@@ -71,6 +74,13 @@ static ErrorCode CreateTree(struct TTree *tree, Handle data, Size datasz)
 				    enclen > kMaxEncodedLength) {
 					goto bad_table;
 				}
+				// Only the first byte may be ASCII. This means that the input
+				// can be split before any ASCII character.
+				for (encend = dpos + enclen, k = dpos + 1; k < encend; k++) {
+					if ((UInt8)(*data)[k] < 128) {
+						goto bad_table;
+					}
+				}
 				// Iterate over all but last byte in encoding, to find the node
 				// which will produce the decoded byte as output.
 				state = 0;
@@ -130,12 +140,14 @@ struct CEntry {
 	UInt16 next;
 };
 
-// A compressed table node. Followed by an array of centry.
+// A compressed table node. Followed by an array of centry. The fields are
+// 16-bit so the compacted tree is an array of UInt16, which lets the generator
+// emit precompiled trees that work with either byte order.
 struct CNode {
 	// First byte in table.
-	UInt8 base;
+	UInt16 base;
 	// Number of entries in table, minus one.
-	UInt8 span;
+	UInt16 span;
 };
 
 static ErrorCode CompactTree(Handle *out, struct TNode **nodes, int nodecount)
@@ -224,32 +236,75 @@ struct Convert1rState {
 	UInt16 tableoffset;
 };
 
-void Convert1rRun(const void *cvtptr, LineBreakConversion lc,
-                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
-                  const UInt8 **iptr, const UInt8 *iend)
+// Write a byte of output, or count it if there is no output buffer.
+#define PUT(x)              \
+	do {                    \
+		if (opos != NULL) { \
+			*opos++ = (x);  \
+		} else {            \
+			count++;        \
+		}                   \
+	} while (0)
+
+// Run the reverse converter. If strict is true, stop at the first character
+// with no mapping instead of writing a substitute. If optr is NULL, count the
+// output instead of writing it, without limit, and without updating the
+// statistics. Returns the amount of output counted.
+static Size RunReverse(const void *cvtptr, LineBreakConversion lc,
+                       struct ConverterState *stateptr, UInt8 **optr,
+                       UInt8 *oend, const UInt8 **iptr, const UInt8 *iend,
+                       Boolean strict)
 {
 	struct Convert1rState *state = (struct Convert1rState *)stateptr;
 	const struct CNode *node;
 	const struct CEntry *entry;
-	UInt8 *opos = *optr;
+	UInt8 *opos = optr != NULL ? *optr : NULL;
 	const UInt8 *ipos = *iptr, *savein;
 	unsigned ch, lastch, chlen, output, saveout, toffset, savetoffset;
+	Size n, count;
 
+	count = 0;
 	ch = state->lastch;
 	savein = ipos;
 	saveout = state->output;
 	toffset = state->tableoffset;
 	savetoffset = toffset;
-	if (oend - opos < 2) {
+	if (opos != NULL && oend - opos < 2) {
 		goto done;
 	}
 	goto resume;
 
 next_out:
-	if (oend - opos < 2) {
+	// The previous character is complete. If the output is full, stop here
+	// rather than at the start of the previous character.
+	savein = ipos;
+	saveout = 0;
+	savetoffset = 0;
+	if (opos != NULL && oend - opos < 2) {
 		goto done;
 	}
 
+	// Copy runs of ASCII characters directly, without walking the tree. The
+	// last character in the run is left for the tree, because it may be the
+	// start of a longer sequence, like a letter followed by a combining mark.
+	n = iend - ipos;
+	if (opos != NULL && n > oend - opos - 1) {
+		n = oend - opos - 1;
+	}
+	if (n >= 2 && *ipos < 128) {
+		n = ScanASCII(ipos, ipos + n) - 1;
+		if (n > 0) {
+			if (opos != NULL) {
+				memcpy(opos, ipos, n);
+				opos += n;
+			} else {
+				count += n;
+			}
+			ipos += n;
+			ch = ipos[-1];
+		}
+	}
+
 	// Follow state machine to the end.
 	savein = ipos;
 	saveout = 0;
@@ -279,7 +334,7 @@ resume:
 			if (output == 0) {
 				goto bad_char;
 			}
-			*opos++ = output;
+			PUT(output);
 			goto next_out;
 		}
 		if (output != 0) {
@@ -296,7 +351,7 @@ bad_char:
 	ipos = savein;
 	if (saveout != 0) {
 		// Produce saved output.
-		*opos++ = saveout;
+		PUT(saveout);
 		ch = 0;
 	} else {
 		// No saved output, this really is a bad character. Consume one UTF-8
@@ -305,26 +360,29 @@ bad_char:
 		if ((ch & 0x80) == 0) {
 			// ASCII character: either NUL, CR, or LF, because only these
 			// characters will result in a transition to state 0.
+			if (ch != 0 && opos != NULL && stateptr->stats != NULL) {
+				ConvertStatsLineBreak(stateptr->stats, lc, ch, lastch);
+			}
 			if (ch == 0) {
-				*opos++ = ch;
+				PUT(ch);
 			} else if (ch == kCharLF && lastch == kCharCR) {
 				if (lc == kLineBreakKeep) {
-					*opos++ = ch;
+					PUT(ch);
 				}
 			} else {
 				switch (lc) {
 				case kLineBreakKeep:
-					*opos++ = ch;
+					PUT(ch);
 					break;
 				case kLineBreakLF:
-					*opos++ = kCharLF;
+					PUT(kCharLF);
 					break;
 				case kLineBreakCR:
-					*opos++ = kCharCR;
+					PUT(kCharCR);
 					break;
 				case kLineBreakCRLF:
-					*opos++ = kCharCR;
-					*opos++ = kCharLF;
+					PUT(kCharCR);
+					PUT(kCharLF);
 					break;
 				}
 			}
@@ -348,7 +406,16 @@ bad_char:
 				}
 				ipos++;
 			}
-			*opos++ = kCharSubstitute;
+			if (strict) {
+				// Stop before the character, as if it were never read.
+				ConvertSetUnmapped(stateptr, savein, ipos);
+				ch = lastch;
+				goto done;
+			}
+			PUT(kCharSubstitute);
+			if (opos != NULL && stateptr->stats != NULL) {
+				stateptr->stats->substitutions++;
+			}
 		}
 	}
 	goto next_out;
@@ -357,6 +424,47 @@ done:
 	state->lastch = ch;
 	state->output = saveout;
 	state->tableoffset = savetoffset;
-	*optr = opos;
+	if (optr != NULL) {
+		*optr = opos;
+	}
 	*iptr = savein;
+	return count;
+}
+
+#undef PUT
+
+void Convert1rRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend)
+{
+	RunReverse(cvtptr, lc, stateptr, optr, oend, iptr, iend, false);
+}
+
+void Convert1rRunStrict(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	RunReverse(cvtptr, lc, stateptr, optr, oend, iptr, iend, true);
+}
+
+Size Convert1rCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend)
+{
+	return RunReverse(cvtptr, lc, stateptr, NULL, NULL, iptr, iend, false);
+}
+
+const UInt8 *Convert1rSplit(const void *cvtptr, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end)
+{
+	// ASCII bytes only appear at the start of sequences, so no match can
+	// continue past an ASCII byte.
+	(void)cvtptr;
+	(void)start;
+	for (; ptr < end; ptr++) {
+		if (*ptr < 128 && *ptr != kCharLF) {
+			return ptr;
+		}
+	}
+	return NULL;
 }
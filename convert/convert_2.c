@@ -0,0 +1,441 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// convert_2.c - Line break conversion only, for ASCII or UTF-8 text. Runs the
+// same way in both directions. Can also convert UTF-8 to UTF-16 or UTF-32.
+#include "convert/convert.h"
+#include "convert/scan.h"
+#include "convert/wide.h"
+#include "lib/defs.h"
+#include "lib/utf8.h"
+
+#include <string.h>
+
+struct Convert2State {
+	UInt8 lastch;
+};
+
+struct Convert2wState {
+	UInt8 lastch;
+	// Incomplete UTF-8 sequence at the end of the previous input, terminated
+	// by a zero byte if it is shorter than 3 bytes.
+	UInt8 partial[3];
+};
+
+ErrorCode Convert2Build(Handle *out, Handle data, Size datasz)
+{
+	Handle h;
+
+	(void)data;
+	if (datasz != 1) {
+		return kErrorBadData;
+	}
+	// The converter has no data, but it still needs a handle.
+	h = NewHandle(0);
+	if (h == NULL) {
+		return kErrorNoMemory;
+	}
+	*out = h;
+	return 0;
+}
+
+void Convert2Run(const void *cvtptr, LineBreakConversion lc,
+                 struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                 const UInt8 **iptr, const UInt8 *iend)
+{
+	struct Convert2State *state = (struct Convert2State *)stateptr;
+	UInt8 *opos = *optr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch;
+	Size n;
+
+	(void)cvtptr;
+	ch = state->lastch;
+	while (ipos < iend && oend - opos >= 2) {
+		// Copy everything up to the next line break.
+		n = iend - ipos;
+		if (n > oend - opos) {
+			n = oend - opos;
+		}
+		if (lc != kLineBreakKeep) {
+			n = ScanLineBreak(ipos, ipos + n);
+		}
+		if (n > 0) {
+			memcpy(opos, ipos, n);
+			opos += n;
+			ipos += n;
+			ch = ipos[-1];
+			if (ipos == iend || oend - opos < 2) {
+				break;
+			}
+		}
+
+		// Line breaks.
+		lastch = ch;
+		ch = *ipos++;
+		if (stateptr->stats != NULL) {
+			ConvertStatsLineBreak(stateptr->stats, lc, ch, lastch);
+		}
+		if (ch == kCharLF && lastch == kCharCR) {
+			continue;
+		}
+		switch (lc) {
+		case kLineBreakKeep:
+			*opos++ = ch;
+			break;
+		case kLineBreakLF:
+			*opos++ = kCharLF;
+			break;
+		case kLineBreakCR:
+			*opos++ = kCharCR;
+			break;
+		case kLineBreakCRLF:
+			*opos++ = kCharCR;
+			*opos++ = kCharLF;
+			break;
+		}
+	}
+	state->lastch = ch;
+
+	*optr = opos;
+	*iptr = ipos;
+}
+
+const UInt8 *Convert2Split(const void *cvtptr, const UInt8 *start,
+                           const UInt8 *ptr, const UInt8 *end)
+{
+	// The state only matters for an LF following CR.
+	(void)cvtptr;
+	(void)start;
+	for (; ptr < end; ptr++) {
+		if (*ptr != kCharLF) {
+			return ptr;
+		}
+	}
+	return NULL;
+}
+
+Size Convert2Count(const void *cvtptr, LineBreakConversion lc,
+                   struct ConverterState *stateptr, const UInt8 **iptr,
+                   const UInt8 *iend)
+{
+	struct Convert2State *state = (struct Convert2State *)stateptr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch;
+	Size n, count;
+
+	(void)cvtptr;
+	count = 0;
+	ch = state->lastch;
+	if (lc == kLineBreakKeep) {
+		// Everything is copied.
+		count = iend - ipos;
+		ipos = iend;
+		if (count > 0) {
+			ch = ipos[-1];
+		}
+	} else {
+		while (ipos < iend) {
+			n = ScanLineBreak(ipos, iend);
+			if (n > 0) {
+				count += n;
+				ipos += n;
+				ch = ipos[-1];
+				if (ipos == iend) {
+					break;
+				}
+			}
+			lastch = ch;
+			ch = *ipos++;
+			if (ch == kCharLF && lastch == kCharCR) {
+				continue;
+			}
+			count += lc == kLineBreakCRLF ? 2 : 1;
+		}
+	}
+	state->lastch = ch;
+
+	*iptr = ipos;
+	return count;
+}
+
+// Get the incomplete sequence saved in the state, and return its length.
+static int GetPartial(const struct Convert2wState *state, UInt8 *buf)
+{
+	int n;
+
+	for (n = 0; n < 3 && state->partial[n] != 0; n++) {
+		buf[n] = state->partial[n];
+	}
+	return n;
+}
+
+// Save an incomplete sequence in the state.
+static void SetPartial(struct Convert2wState *state, const UInt8 *ptr, int n)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		state->partial[i] = i < n ? ptr[i] : 0;
+	}
+}
+
+// Decode the character at the start of the input, combined with the saved
+// incomplete sequence. Return the number of input bytes used. If the input
+// ends before the sequence is complete, the input is added to the saved
+// sequence. Invalid sequences are counted in the statistics, if not NULL.
+static Size DecodePartial(struct Convert2wState *state,
+                          struct ConvertStats *stats, UInt32 *chp,
+                          const UInt8 *ipos, const UInt8 *iend)
+{
+	UInt8 tmp[4];
+	int npartial, len;
+	Size n;
+
+	npartial = GetPartial(state, tmp);
+	n = iend - ipos;
+	if (n > 4 - npartial) {
+		n = 4 - npartial;
+	}
+	memcpy(tmp + npartial, ipos, n);
+	len = UTF8Decode(tmp, tmp + npartial + n, chp);
+	if (len == 0) {
+		SetPartial(state, tmp, npartial + n);
+		return n;
+	}
+	SetPartial(state, tmp, 0);
+	if (len < 0) {
+		// The saved bytes are a valid prefix, so the invalid byte is in the
+		// new input.
+		*chp = kCharReplacement;
+		len = -len;
+		if (stats != NULL) {
+			stats->substitutions++;
+		}
+	}
+	return len - npartial;
+}
+
+static void Convert2wRun(LineBreakConversion lc,
+                         struct ConverterState *stateptr, UInt8 **optr,
+                         UInt8 *oend, const UInt8 **iptr, const UInt8 *iend,
+                         ConvertDirection form)
+{
+	struct Convert2wState *state = (struct Convert2wState *)stateptr;
+	UInt8 *opos = *optr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch;
+	UInt32 uch;
+	Size n, room;
+	int unit, len;
+
+	unit = WideUnitSize(form);
+	ch = state->lastch;
+	// Room for CR LF, or a surrogate pair.
+	while (ipos < iend && oend - opos >= unit * 2) {
+		if (state->partial[0] != 0) {
+			// Finish the sequence from the previous input.
+			ipos += DecodePartial(state, stateptr->stats, &uch, ipos, iend);
+			if (state->partial[0] == 0) {
+				opos = WideWriteChar(opos, uch, form);
+			}
+			continue;
+		}
+
+		// Widen everything up to the next high byte or line break.
+		n = iend - ipos;
+		room = (oend - opos) / unit;
+		if (n > room) {
+			n = room;
+		}
+		if (lc == kLineBreakKeep) {
+			n = ScanHighByte(ipos, ipos + n);
+		} else {
+			n = ScanASCII(ipos, ipos + n);
+		}
+		if (n > 0) {
+			opos = WideCopyASCII(opos, ipos, ipos + n, form);
+			ipos += n;
+			ch = ipos[-1];
+			continue;
+		}
+
+		lastch = ch;
+		ch = *ipos;
+		if (ch >= 128) {
+			len = UTF8Decode(ipos, iend, &uch);
+			if (len == 0) {
+				// Incomplete sequence at the end of the input.
+				SetPartial(state, ipos, iend - ipos);
+				ipos = iend;
+				break;
+			}
+			if (len < 0) {
+				uch = kCharReplacement;
+				len = -len;
+				if (stateptr->stats != NULL) {
+					stateptr->stats->substitutions++;
+				}
+			}
+			opos = WideWriteChar(opos, uch, form);
+			ipos += len;
+			continue;
+		}
+
+		// Line breaks.
+		ipos++;
+		if (stateptr->stats != NULL) {
+			ConvertStatsLineBreak(stateptr->stats, lc, ch, lastch);
+		}
+		if (ch == kCharLF && lastch == kCharCR) {
+			continue;
+		}
+		switch (lc) {
+		case kLineBreakKeep:
+			opos = WideWriteChar(opos, ch, form);
+			break;
+		case kLineBreakLF:
+			opos = WideWriteChar(opos, kCharLF, form);
+			break;
+		case kLineBreakCR:
+			opos = WideWriteChar(opos, kCharCR, form);
+			break;
+		case kLineBreakCRLF:
+			opos = WideWriteChar(opos, kCharCR, form);
+			opos = WideWriteChar(opos, kCharLF, form);
+			break;
+		}
+	}
+	state->lastch = ch;
+
+	*optr = opos;
+	*iptr = ipos;
+}
+
+void Convert2wRun16BE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	(void)cvtptr;
+	Convert2wRun(lc, stateptr, optr, oend, iptr, iend, kToUTF16BE);
+}
+
+void Convert2wRun16LE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	(void)cvtptr;
+	Convert2wRun(lc, stateptr, optr, oend, iptr, iend, kToUTF16LE);
+}
+
+void Convert2wRun32BE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	(void)cvtptr;
+	Convert2wRun(lc, stateptr, optr, oend, iptr, iend, kToUTF32BE);
+}
+
+void Convert2wRun32LE(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, UInt8 **optr,
+                      UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	(void)cvtptr;
+	Convert2wRun(lc, stateptr, optr, oend, iptr, iend, kToUTF32LE);
+}
+
+static Size Convert2wCount(LineBreakConversion lc,
+                           struct ConverterState *stateptr, const UInt8 **iptr,
+                           const UInt8 *iend, int unit)
+{
+	struct Convert2wState *state = (struct Convert2wState *)stateptr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch;
+	UInt32 uch;
+	Size n, count;
+	int len;
+
+	count = 0;
+	ch = state->lastch;
+	while (ipos < iend) {
+		if (state->partial[0] != 0) {
+			ipos += DecodePartial(state, NULL, &uch, ipos, iend);
+			if (state->partial[0] == 0) {
+				count += uch > 0xffff ? 4 : unit;
+			}
+			continue;
+		}
+
+		if (lc == kLineBreakKeep) {
+			n = ScanHighByte(ipos, iend);
+		} else {
+			n = ScanASCII(ipos, iend);
+		}
+		if (n > 0) {
+			count += n * unit;
+			ipos += n;
+			ch = ipos[-1];
+			continue;
+		}
+
+		lastch = ch;
+		ch = *ipos;
+		if (ch >= 128) {
+			len = UTF8Decode(ipos, iend, &uch);
+			if (len == 0) {
+				SetPartial(state, ipos, iend - ipos);
+				ipos = iend;
+				break;
+			}
+			if (len < 0) {
+				uch = kCharReplacement;
+				len = -len;
+			}
+			count += uch > 0xffff ? 4 : unit;
+			ipos += len;
+			continue;
+		}
+
+		ipos++;
+		if (ch == kCharLF && lastch == kCharCR) {
+			continue;
+		}
+		count += lc == kLineBreakCRLF ? unit * 2 : unit;
+	}
+	state->lastch = ch;
+
+	*iptr = ipos;
+	return count;
+}
+
+Size Convert2wCount16(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, const UInt8 **iptr,
+                      const UInt8 *iend)
+{
+	(void)cvtptr;
+	return Convert2wCount(lc, stateptr, iptr, iend, 2);
+}
+
+Size Convert2wCount32(const void *cvtptr, LineBreakConversion lc,
+                      struct ConverterState *stateptr, const UInt8 **iptr,
+                      const UInt8 *iend)
+{
+	(void)cvtptr;
+	return Convert2wCount(lc, stateptr, iptr, iend, 4);
+}
+
+const UInt8 *Convert2wSplit(const void *cvtptr, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end)
+{
+	// The state matters for an LF following CR, and for UTF-8 continuation
+	// bytes.
+	(void)cvtptr;
+	(void)start;
+	for (; ptr < end; ptr++) {
+		if (*ptr != kCharLF && (*ptr & 0xc0) != 0x80) {
+			return ptr;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,397 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// convert_3f.c - Forward conversion from multibyte encodings to UTF-8.
+#include "convert/convert.h"
+#include "convert/scan.h"
+#include "lib/defs.h"
+
+#include <string.h>
+
+enum {
+	// Maximum length of a cell's Unicode string which is stored in the cell
+	// itself. Longer strings are stored separately.
+	kMaxInlineLength = 3
+};
+
+/*
+	Each character is stored in a 32-bit cell. The high byte contains the
+	length of the UTF-8 string, or zero if the character is not mapped. If the
+	length is 3 or less, the low 24 bits contain the UTF-8 string, packed MSB
+	first. Otherwise, the low 24 bits contain the offset of the string in the
+	extra data.
+*/
+
+struct Convert3fLead {
+	// First trail byte.
+	UInt16 min;
+	// Number of trail bytes, or zero if this is not a lead byte.
+	UInt16 count;
+	// Index of the cell for the first trail byte.
+	UInt32 cell;
+};
+
+// Forward conversion table. Followed by an array of cells: first the cells
+// for the 256 one-byte characters, then the cells for each lead byte. The
+// extra data follows the cells.
+struct Convert3fData {
+	// Maximum length of the output for one input character, at least 2.
+	UInt32 maxlen;
+	// Offset of the extra data from the start of the table.
+	UInt32 extra;
+	// True if ASCII characters map to themselves.
+	UInt32 asciicopy;
+	struct Convert3fLead leads[256];
+};
+
+struct Convert3fState {
+	UInt8 lastch;
+	// Pending lead byte, or zero.
+	UInt8 lead;
+};
+
+// Parse the table, and fill in the converter if it is not NULL. Store the
+// number of cells and size of extra data.
+static ErrorCode Parse3f(struct Convert3fData *cvt, UInt32 *ncellsptr,
+                         UInt32 *nextraptr, const UInt8 *dptr,
+                         const UInt8 *dend)
+{
+	UInt32 *cells, ncells, nextra, cell, maxlen;
+	UInt8 *extra;
+	int i, j, n, type, count;
+	unsigned asciicopy;
+
+	cells = NULL;
+	extra = NULL;
+	if (cvt != NULL) {
+		cells = (UInt32 *)(cvt + 1);
+		extra = (UInt8 *)cvt + cvt->extra;
+	}
+	ncells = 256;
+	nextra = 0;
+	maxlen = 2;
+	asciicopy = 1;
+	for (i = 0; i < 256; i++) {
+		if (dptr == dend) {
+			return kErrorBadData;
+		}
+		type = *dptr++;
+		switch (type) {
+		case 0:
+			count = 0;
+			break;
+		case 1:
+			count = 1;
+			break;
+		case 2:
+			if (dend - dptr < 2) {
+				return kErrorBadData;
+			}
+			count = dptr[1] + 1;
+			if (cvt != NULL) {
+				cvt->leads[i].min = dptr[0];
+				cvt->leads[i].count = count;
+				cvt->leads[i].cell = ncells;
+			}
+			dptr += 2;
+			break;
+		default:
+			return kErrorBadData;
+		}
+		if (type != 1 && i < 128) {
+			asciicopy = 0;
+		}
+		for (j = 0; j < count; j++) {
+			if (dptr == dend) {
+				return kErrorBadData;
+			}
+			n = *dptr++;
+			if (dend - dptr < n) {
+				return kErrorBadData;
+			}
+			if (n > (int)maxlen) {
+				maxlen = n;
+			}
+			if (n <= kMaxInlineLength) {
+				cell = 0;
+				if (n > 0) {
+					cell = (UInt32)n << 24;
+					while (n-- > 0) {
+						cell = (cell & 0xff000000) | ((cell << 8) & 0xffffff) |
+						       *dptr++;
+					}
+				}
+			} else {
+				cell = ((UInt32)n << 24) | nextra;
+				if (extra != NULL) {
+					memcpy(extra + nextra, dptr, n);
+				}
+				nextra += n;
+				dptr += n;
+			}
+			if (type == 1) {
+				if (i < 128 && cell != (0x01000000 | (UInt32)i)) {
+					asciicopy = 0;
+				}
+				if (cells != NULL) {
+					cells[i] = cell;
+				}
+			} else {
+				if (cells != NULL) {
+					cells[ncells] = cell;
+				}
+				ncells++;
+			}
+		}
+	}
+	if (cvt != NULL) {
+		cvt->maxlen = maxlen;
+		cvt->asciicopy = asciicopy;
+	}
+	*ncellsptr = ncells;
+	*nextraptr = nextra;
+	return 0;
+}
+
+ErrorCode Convert3fBuild(Handle *out, Handle data, Size datasz)
+{
+	Handle h;
+	struct Convert3fData *cvt;
+	const UInt8 *dptr, *dend;
+	UInt32 ncells, nextra, extraoff;
+	ErrorCode err;
+
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	err = Parse3f(NULL, &ncells, &nextra, dptr, dend);
+	if (err != 0) {
+		return err;
+	}
+	extraoff = sizeof(struct Convert3fData) + ncells * sizeof(UInt32);
+	h = NewHandle(extraoff + nextra);
+	if (h == NULL) {
+		return kErrorNoMemory;
+	}
+	cvt = (void *)*h;
+	MemClear(cvt, extraoff);
+	cvt->extra = extraoff;
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	err = Parse3f(cvt, &ncells, &nextra, dptr, dend);
+	if (err != 0) {
+		DisposeHandle(h);
+		return err;
+	}
+	*out = h;
+	return 0;
+}
+
+void Convert3fRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend)
+{
+	const struct Convert3fData *cvt = cvtptr;
+	const struct Convert3fLead *lead;
+	const UInt32 *cells = (const UInt32 *)(cvt + 1);
+	const UInt8 *extra = (const UInt8 *)cvt + cvt->extra;
+	struct Convert3fState *state = (struct Convert3fState *)stateptr;
+	UInt8 *opos = *optr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch, leadch, len, idx;
+	UInt32 cell;
+	Size n;
+
+	ch = state->lastch;
+	leadch = state->lead;
+	while (ipos < iend && oend - opos >= (Size)cvt->maxlen) {
+		lastch = ch;
+		ch = *ipos++;
+		if (leadch != 0) {
+			// Second byte of a two-byte character.
+			lead = &cvt->leads[leadch];
+			leadch = 0;
+			idx = ch - lead->min;
+			if (idx >= lead->count) {
+				// Not a valid trail byte. Emit a substitute for the lead byte
+				// and process this byte again as a new character.
+				*opos++ = kCharSubstitute;
+				if (stateptr->stats != NULL) {
+					stateptr->stats->substitutions++;
+				}
+				ipos--;
+				ch = lastch;
+				continue;
+			}
+			cell = cells[lead->cell + idx];
+		} else if (cvt->leads[ch].count != 0) {
+			// First byte of a two-byte character.
+			leadch = ch;
+			continue;
+		} else if (ch == kCharLF || ch == kCharCR) {
+			// Line breaks.
+			if (stateptr->stats != NULL) {
+				ConvertStatsLineBreak(stateptr->stats, lc, ch, lastch);
+			}
+			if (ch == kCharLF && lastch == kCharCR) {
+				if (lc == kLineBreakKeep) {
+					*opos++ = ch;
+				}
+			} else {
+				switch (lc) {
+				case kLineBreakKeep:
+					*opos++ = ch;
+					break;
+				case kLineBreakLF:
+					*opos++ = kCharLF;
+					break;
+				case kLineBreakCR:
+					*opos++ = kCharCR;
+					break;
+				case kLineBreakCRLF:
+					*opos++ = kCharCR;
+					*opos++ = kCharLF;
+					break;
+				}
+			}
+			continue;
+		} else if (ch < 128 && cvt->asciicopy) {
+			// ASCII characters. Copy the rest of the run at once.
+			*opos++ = ch;
+			n = iend - ipos;
+			if (n > oend - opos) {
+				n = oend - opos;
+			}
+			if (n > 0 && *ipos < 128) {
+				n = ScanASCII(ipos, ipos + n);
+				if (n > 0) {
+					memcpy(opos, ipos, n);
+					opos += n;
+					ipos += n;
+					ch = ipos[-1];
+				}
+			}
+			continue;
+		} else {
+			cell = cells[ch];
+		}
+
+		len = cell >> 24;
+		switch (len) {
+		case 0:
+			*opos++ = kCharSubstitute;
+			if (stateptr->stats != NULL) {
+				stateptr->stats->substitutions++;
+			}
+			break;
+		case 1:
+			opos[0] = cell;
+			opos += 1;
+			break;
+		case 2:
+			opos[0] = cell >> 8;
+			opos[1] = cell;
+			opos += 2;
+			break;
+		case 3:
+			opos[0] = cell >> 16;
+			opos[1] = cell >> 8;
+			opos[2] = cell;
+			opos += 3;
+			break;
+		default:
+			memcpy(opos, extra + (cell & 0xffffff), len);
+			opos += len;
+			break;
+		}
+	}
+	state->lastch = ch;
+	state->lead = leadch;
+
+	*optr = opos;
+	*iptr = ipos;
+}
+
+const UInt8 *Convert3fSplit(const void *cvtptr, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end)
+{
+	const struct Convert3fData *cvt = cvtptr;
+
+	// Split after any byte which is never a lead byte. The previous byte is
+	// either a complete character or the trail byte of one.
+	(void)start;
+	for (; ptr < end; ptr++) {
+		if (*ptr != kCharLF && cvt->leads[ptr[-1]].count == 0) {
+			return ptr;
+		}
+	}
+	return NULL;
+}
+
+Size Convert3fCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend)
+{
+	const struct Convert3fData *cvt = cvtptr;
+	const struct Convert3fLead *lead;
+	const UInt32 *cells = (const UInt32 *)(cvt + 1);
+	struct Convert3fState *state = (struct Convert3fState *)stateptr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch, leadch, len, idx;
+	Size n, count;
+
+	count = 0;
+	ch = state->lastch;
+	leadch = state->lead;
+	while (ipos < iend) {
+		lastch = ch;
+		ch = *ipos++;
+		if (leadch != 0) {
+			// Second byte of a two-byte character.
+			lead = &cvt->leads[leadch];
+			leadch = 0;
+			idx = ch - lead->min;
+			if (idx >= lead->count) {
+				// Not a valid trail byte, see Convert3fRun.
+				count++;
+				ipos--;
+				ch = lastch;
+				continue;
+			}
+			len = cells[lead->cell + idx] >> 24;
+		} else if (cvt->leads[ch].count != 0) {
+			// First byte of a two-byte character.
+			leadch = ch;
+			continue;
+		} else if (ch == kCharLF && lastch == kCharCR) {
+			if (lc == kLineBreakKeep) {
+				count++;
+			}
+			continue;
+		} else if (ch == kCharLF || ch == kCharCR) {
+			count += lc == kLineBreakCRLF ? 2 : 1;
+			continue;
+		} else if (ch < 128 && cvt->asciicopy) {
+			// Count the rest of the ASCII run at once.
+			count++;
+			if (ipos < iend && *ipos < 128) {
+				n = ScanASCII(ipos, iend);
+				if (n > 0) {
+					count += n;
+					ipos += n;
+					ch = ipos[-1];
+				}
+			}
+			continue;
+		} else {
+			len = cells[ch] >> 24;
+		}
+		// Unmapped characters are replaced with one substitute byte.
+		count += len != 0 ? len : 1;
+	}
+	state->lastch = ch;
+	state->lead = leadch;
+
+	*iptr = ipos;
+	return count;
+}
@@ -0,0 +1,650 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// convert_3r.c - Reverse conversion from UTF-8 to multibyte encodings. This is
+// also used for digraph encodings.
+#include "convert/convert.h"
+#include "convert/scan.h"
+#include "lib/defs.h"
+
+#include <string.h>
+
+/*
+	This works like the extended ASCII reverse converter: the UTF-8 input is
+	matched against a tree with one node for each prefix, and the tree is
+	compacted after it is built. The differences are that the output may be one
+	or two bytes, and the compacted tree is larger, so it is addressed in 4-byte
+	units. A lookup takes one step per byte of input, no matter how many
+	characters are in the table.
+*/
+
+enum {
+	// Initial number of nodes to allocate when building the tree.
+	kInitialTableAlloc = 64,
+
+	// Maximum size of the compacted tree, in 4-byte units.
+	kMaxTableUnits = 0x10000,
+
+	// Value for splitlen, when the input can't be split.
+	kNoSplit = 0xffff
+};
+
+struct TEntry {
+	// The output character, or zero if no output. One-byte characters are
+	// stored as 0x00XX, and two-byte characters as 0xXXYY, with nonzero XX.
+	UInt16 output;
+	// The next node, or zero if no next node.
+	UInt16 next;
+};
+
+// A node for building the converter.
+struct TNode {
+	struct TEntry entries[256];
+};
+
+struct TTree {
+	struct TNode **nodes;
+	int count;
+	int alloc;
+};
+
+// Add the given UTF-8 string to the tree, producing the given output.
+static ErrorCode TreeAdd(struct TTree *tree, const UInt8 *str, int len,
+                         unsigned output)
+{
+	struct TNode *node;
+	int i, state, next;
+	unsigned ch;
+
+	state = 0;
+	for (i = 0; i < len - 1; i++) {
+		ch = str[i];
+		next = (*tree->nodes)[state].entries[ch].next;
+		if (next == 0) {
+			if (tree->count >= tree->alloc) {
+				if (tree->alloc >= 0x8000) {
+					return kErrorBadData;
+				}
+				tree->alloc *= 2;
+				if (!ResizeHandle((Handle)tree->nodes,
+				                  tree->alloc * sizeof(struct TNode))) {
+					return kErrorNoMemory;
+				}
+			}
+			next = tree->count++;
+			MemClear(*tree->nodes + next, sizeof(struct TNode));
+			(*tree->nodes)[state].entries[ch].next = next;
+		}
+		state = next;
+	}
+	node = *tree->nodes + state;
+	ch = str[len - 1];
+	if (node->entries[ch].output != 0) {
+		return kErrorBadData;
+	}
+	node->entries[ch].output = output;
+	return 0;
+}
+
+// Add the characters in a multibyte table to the tree.
+static ErrorCode AddMultibyte(struct TTree *tree, const UInt8 *dptr,
+                              const UInt8 *dend)
+{
+	int i, j, n, type, min, count;
+	unsigned output;
+	ErrorCode err;
+
+	for (i = 0; i < 256; i++) {
+		if (dptr == dend) {
+			return kErrorBadData;
+		}
+		type = *dptr++;
+		switch (type) {
+		case 0:
+			continue;
+		case 1:
+			min = 0;
+			count = 1;
+			break;
+		case 2:
+			if (dend - dptr < 2) {
+				return kErrorBadData;
+			}
+			min = dptr[0];
+			count = dptr[1] + 1;
+			dptr += 2;
+			break;
+		default:
+			return kErrorBadData;
+		}
+		for (j = 0; j < count; j++) {
+			if (dptr == dend) {
+				return kErrorBadData;
+			}
+			n = *dptr++;
+			if (dend - dptr < n) {
+				return kErrorBadData;
+			}
+			output = type == 1 ? (unsigned)i : ((unsigned)i << 8) | (min + j);
+			// NUL, CR, and LF are handled by the decoder.
+			if (n > 0 && output != 0 && output != kCharCR &&
+			    output != kCharLF) {
+				err = TreeAdd(tree, dptr, n, output);
+				if (err != 0) {
+					return err;
+				}
+			}
+			dptr += n;
+		}
+	}
+	return 0;
+}
+
+// Add the characters in a digraph table to the tree. Digraphs are two-byte
+// outputs, like the characters in a multibyte table.
+static ErrorCode AddDigraph(struct TTree *tree, const UInt8 *dptr,
+                            const UInt8 *dend)
+{
+	int i, n, count;
+	unsigned output;
+	ErrorCode err;
+
+	for (i = 0; i < 256; i++) {
+		if (dptr == dend) {
+			return kErrorBadData;
+		}
+		n = *dptr++;
+		if (dend - dptr < n) {
+			return kErrorBadData;
+		}
+		// NUL, CR, and LF are handled by the decoder.
+		if (n > 0 && i != 0 && i != kCharCR && i != kCharLF) {
+			err = TreeAdd(tree, dptr, n, i);
+			if (err != 0) {
+				return err;
+			}
+		}
+		dptr += n;
+	}
+	if (dptr == dend) {
+		return kErrorBadData;
+	}
+	count = *dptr++;
+	for (i = 0; i < count; i++) {
+		if (dend - dptr < 3) {
+			return kErrorBadData;
+		}
+		output = ((unsigned)dptr[0] << 8) | dptr[1];
+		n = dptr[2];
+		dptr += 3;
+		if (dend - dptr < n || output < 0x8080 || (output & 0x80) == 0) {
+			return kErrorBadData;
+		}
+		if (n > 0) {
+			err = TreeAdd(tree, dptr, n, output);
+			if (err != 0) {
+				return err;
+			}
+		}
+		dptr += n;
+	}
+	return 0;
+}
+
+static ErrorCode CreateTree(struct TTree *tree, Handle data, Size datasz)
+{
+	const UInt8 *dptr, *dend;
+	ErrorCode err;
+
+	tree->nodes =
+		(struct TNode **)NewHandle(kInitialTableAlloc * sizeof(struct TNode));
+	if (tree->nodes == NULL) {
+		return kErrorNoMemory;
+	}
+	tree->count = 1;
+	tree->alloc = kInitialTableAlloc;
+	MemClear(*tree->nodes, sizeof(struct TNode));
+
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	switch (**data) {
+	case kTableMultibyte:
+		err = AddMultibyte(tree, dptr, dend);
+		break;
+	case kTableDigraph:
+		err = AddDigraph(tree, dptr, dend);
+		break;
+	default:
+		err = kErrorBadData;
+		break;
+	}
+	if (err != 0) {
+		DisposeHandle((Handle)tree->nodes);
+		return err;
+	}
+	return 0;
+}
+
+struct CEntry {
+	UInt16 output;
+	// Offset of the next node, in 4-byte units, or zero.
+	UInt16 next;
+};
+
+// A compressed table node. Followed by an array of CEntry. Like the rest of
+// the compacted tree, this only contains UInt16 fields, so precompiled trees
+// work with either byte order.
+struct CNode {
+	// First byte in table.
+	UInt16 base;
+	// Number of entries in table, minus one.
+	UInt16 span;
+};
+
+// Header for the compacted tree. The root node follows the header.
+struct CHeader {
+	// True if all ASCII characters other than NUL, CR, and LF map to
+	// themselves, and never start longer sequences containing ASCII.
+	UInt16 asciicopy;
+	// Number of ASCII bytes which must come before an ASCII byte to split the
+	// input there, or kNoSplit. This is zero if ASCII bytes are never part
+	// of longer sequences, except at the start.
+	UInt16 splitlen;
+};
+
+// Return true if runs of ASCII text can be copied without using the tree.
+static Boolean CanCopyASCII(struct TNode **nodes)
+{
+	const struct TNode *root, *node;
+	int i, j;
+
+	root = *nodes;
+	for (i = 1; i < 128; i++) {
+		if (i == kCharCR || i == kCharLF) {
+			continue;
+		}
+		if (root->entries[i].output != i) {
+			return false;
+		}
+		if (root->entries[i].next != 0) {
+			node = *nodes + root->entries[i].next;
+			for (j = 0; j < 128; j++) {
+				if (node->entries[j].output != 0 ||
+				    node->entries[j].next != 0) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// Return the number of ASCII bytes needed before an ASCII byte to split the
+// input there. If a sequence contains an ASCII byte after the first byte, then
+// the input can only be split after enough ASCII bytes that no sequence could
+// span the split. Nodes are always created after their parents.
+static int SplitLength(struct TNode **nodes, int nodecount)
+{
+	UInt8 **info;
+	const struct TEntry *entry;
+	int i, j, next, depth, maxdepth;
+	Boolean asciicont;
+	unsigned flags;
+
+	// For each node, the depth, and flag 0x80 if the sequence starts with
+	// ASCII.
+	info = (UInt8 **)NewHandle(nodecount);
+	if (info == NULL) {
+		return -1;
+	}
+	(*info)[0] = 0;
+	maxdepth = 0;
+	asciicont = false;
+	for (i = 0; i < nodecount; i++) {
+		depth = (*info)[i] & 0x7f;
+		flags = (*info)[i] & 0x80;
+		if (depth > maxdepth) {
+			maxdepth = depth;
+		}
+		for (j = 0; j < 256; j++) {
+			entry = &(*nodes)[i].entries[j];
+			if (entry->output == 0 && entry->next == 0) {
+				continue;
+			}
+			if (i != 0 && j < 128) {
+				if (flags != 0) {
+					DisposeHandle((Handle)info);
+					return kNoSplit;
+				}
+				asciicont = true;
+			}
+			next = entry->next;
+			if (next != 0) {
+				if (depth >= 0x7f) {
+					DisposeHandle((Handle)info);
+					return kNoSplit;
+				}
+				(*info)[next] = (depth + 1) | (i == 0 && j < 128 ? 0x80 : flags);
+			}
+		}
+	}
+	DisposeHandle((Handle)info);
+	return asciicont ? maxdepth : 0;
+}
+
+static ErrorCode CompactTree(Handle *out, struct TNode **nodes, int nodecount)
+{
+	Handle ctree;
+	struct TNode *node;
+	UInt32 **infos, *info;
+	struct CNode *cnode;
+	struct CEntry *centry;
+	int i, j, min, max, next;
+	UInt32 offset;
+	int splitlen;
+
+	splitlen = SplitLength(nodes, nodecount);
+	if (splitlen < 0) {
+		return kErrorNoMemory;
+	}
+
+	// Figure out where each compacted node will go. Each node and entry takes
+	// one unit.
+	infos = (UInt32 **)NewHandle(sizeof(UInt32) * nodecount);
+	if (infos == NULL) {
+		return kErrorNoMemory;
+	}
+	offset = sizeof(struct CHeader) / 4;
+	for (i = 0; i < nodecount; i++) {
+		node = *nodes + i;
+		min = 0;
+		while (min < 255 && node->entries[min].output == 0 &&
+		       node->entries[min].next == 0) {
+			min++;
+		}
+		max = 255;
+		while (max > min && node->entries[max].output == 0 &&
+		       node->entries[max].next == 0) {
+			max--;
+		}
+		(*infos)[i] = offset | ((UInt32)min << 24) | ((UInt32)max << 16);
+		offset += 1 + max - min + 1;
+		if (offset >= kMaxTableUnits) {
+			DisposeHandle((Handle)infos);
+			return kErrorBadData;
+		}
+	}
+
+	// Create the compacted tree.
+	ctree = NewHandle(offset * 4);
+	if (ctree == NULL) {
+		DisposeHandle((Handle)infos);
+		return kErrorNoMemory;
+	}
+	((struct CHeader *)*ctree)->asciicopy = CanCopyASCII(nodes);
+	((struct CHeader *)*ctree)->splitlen = splitlen;
+	for (i = 0; i < nodecount; i++) {
+		node = *nodes + i;
+		info = *infos + i;
+		min = *info >> 24;
+		max = (*info >> 16) & 0xff;
+		offset = *info & 0xffff;
+		cnode = (void *)(*ctree + offset * 4);
+		cnode->base = min;
+		cnode->span = max - min;
+		centry = (void *)(cnode + 1);
+		for (j = min; j <= max; j++) {
+			centry->output = node->entries[j].output;
+			next = node->entries[j].next;
+			if (next != 0) {
+				next = (*infos)[next] & 0xffff;
+			}
+			centry->next = next;
+			centry++;
+		}
+	}
+
+	DisposeHandle((Handle)infos);
+	*out = ctree;
+	return 0;
+}
+
+ErrorCode Convert3rBuild(Handle *out, Handle data, Size datasz)
+{
+	struct TTree table;
+	ErrorCode err;
+
+	err = CreateTree(&table, data, datasz);
+	if (err != 0) {
+		return err;
+	}
+	err = CompactTree(out, table.nodes, table.count);
+	DisposeHandle((Handle)table.nodes);
+	return err;
+}
+
+struct Convert3rState {
+	UInt8 lastch;
+};
+
+// Write a byte of output, or count it if there is no output buffer.
+#define PUT(x)              \
+	do {                    \
+		if (opos != NULL) { \
+			*opos++ = (x);  \
+		} else {            \
+			count++;        \
+		}                   \
+	} while (0)
+
+// Run the reverse converter. If strict is true, stop at the first character
+// with no mapping instead of writing a substitute. If optr is NULL, count the
+// output instead of writing it, without limit, and without updating the
+// statistics. Returns the amount of output counted.
+static Size RunReverse(const void *cvtptr, LineBreakConversion lc,
+                       struct ConverterState *stateptr, UInt8 **optr,
+                       UInt8 *oend, const UInt8 **iptr, const UInt8 *iend,
+                       Boolean strict)
+{
+	struct Convert3rState *state = (struct Convert3rState *)stateptr;
+	const UInt8 *base = cvtptr;
+	const struct CNode *node;
+	const struct CEntry *entry;
+	UInt8 *opos = optr != NULL ? *optr : NULL;
+	const UInt8 *ipos = *iptr, *start, *savein;
+	unsigned ch, lastch, chlen, output, saveout, toffset;
+	Boolean asciicopy;
+	Size n, count;
+
+	asciicopy = ((const struct CHeader *)cvtptr)->asciicopy != 0;
+	count = 0;
+	ch = state->lastch;
+	while (opos == NULL || oend - opos >= 2) {
+		if (asciicopy) {
+			// Copy runs of ASCII characters directly, except for the last one,
+			// which may be the start of a longer sequence.
+			n = iend - ipos;
+			if (opos != NULL && n > oend - opos - 1) {
+				n = oend - opos - 1;
+			}
+			if (n >= 2 && *ipos < 128) {
+				n = ScanASCII(ipos, ipos + n) - 1;
+				if (n > 0) {
+					if (opos != NULL) {
+						memcpy(opos, ipos, n);
+						opos += n;
+					} else {
+						count += n;
+					}
+					ipos += n;
+				}
+			}
+		}
+
+		// Follow the tree to find the longest match. If the input ends before
+		// the match is complete, stop before the start of the match, so the
+		// caller can supply the rest of the input next time.
+		start = ipos;
+		savein = ipos;
+		saveout = 0;
+		toffset = sizeof(struct CHeader) / 4;
+		for (;;) {
+			if (ipos >= iend) {
+				ipos = start;
+				goto done;
+			}
+			ch = *ipos++;
+			node = (const void *)(base + toffset * 4);
+			ch -= node->base;
+			if (ch > node->span) {
+				break;
+			}
+			entry = (const struct CEntry *)(node + 1) + ch;
+			output = entry->output;
+			toffset = entry->next;
+			if (output != 0) {
+				saveout = output;
+				savein = ipos;
+			}
+			if (toffset == 0) {
+				break;
+			}
+		}
+
+		if (saveout != 0) {
+			ipos = savein;
+			if (saveout > 0xff) {
+				PUT(saveout >> 8);
+			}
+			PUT(saveout & 0xff);
+			continue;
+		}
+
+		// No match. Consume one UTF-8 character, and emit a fallback.
+		ipos = start;
+		lastch = start == *iptr ? state->lastch : start[-1];
+		ch = *ipos++;
+		if ((ch & 0x80) == 0) {
+			// ASCII character: NUL, CR, LF, or a character that is not mapped,
+			// which are passed through.
+			if ((ch == kCharLF || ch == kCharCR) && opos != NULL &&
+			    stateptr->stats != NULL) {
+				ConvertStatsLineBreak(stateptr->stats, lc, ch, lastch);
+			}
+			if (ch == kCharLF && lastch == kCharCR) {
+				if (lc == kLineBreakKeep) {
+					PUT(ch);
+				}
+			} else if (ch == kCharLF || ch == kCharCR) {
+				switch (lc) {
+				case kLineBreakKeep:
+					PUT(ch);
+					break;
+				case kLineBreakLF:
+					PUT(kCharLF);
+					break;
+				case kLineBreakCR:
+					PUT(kCharCR);
+					break;
+				case kLineBreakCRLF:
+					PUT(kCharCR);
+					PUT(kCharLF);
+					break;
+				}
+			} else {
+				PUT(ch);
+			}
+		} else {
+			if ((ch & 0xe0) == 0xc0) {
+				chlen = 1;
+			} else if ((ch & 0xf0) == 0xe0) {
+				chlen = 2;
+			} else if ((ch & 0xf8) == 0xf0) {
+				chlen = 3;
+			} else {
+				chlen = 0;
+			}
+			for (; chlen > 0; chlen--) {
+				if (ipos == iend) {
+					ipos = start;
+					goto done;
+				}
+				if ((*ipos & 0xc0) != 0x80) {
+					break;
+				}
+				ipos++;
+			}
+			if (strict) {
+				ConvertSetUnmapped(stateptr, start, ipos);
+				ipos = start;
+				goto done;
+			}
+			PUT(kCharSubstitute);
+			if (opos != NULL && stateptr->stats != NULL) {
+				stateptr->stats->substitutions++;
+			}
+		}
+	}
+
+done:
+	if (ipos != *iptr) {
+		state->lastch = ipos[-1];
+	}
+	if (optr != NULL) {
+		*optr = opos;
+	}
+	*iptr = ipos;
+	return count;
+}
+
+#undef PUT
+
+void Convert3rRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend)
+{
+	RunReverse(cvtptr, lc, stateptr, optr, oend, iptr, iend, false);
+}
+
+void Convert3rRunStrict(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	RunReverse(cvtptr, lc, stateptr, optr, oend, iptr, iend, true);
+}
+
+Size Convert3rCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend)
+{
+	return RunReverse(cvtptr, lc, stateptr, NULL, NULL, iptr, iend, false);
+}
+
+const UInt8 *Convert3rSplit(const void *cvtptr, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos;
+	int splitlen, n;
+
+	splitlen = ((const struct CHeader *)cvtptr)->splitlen;
+	if (splitlen == kNoSplit) {
+		return NULL;
+	}
+	// Count the ASCII bytes before ptr, up to splitlen.
+	n = 0;
+	for (pos = ptr; pos > start && n < splitlen && pos[-1] < 128; pos--) {
+		n++;
+	}
+	for (; ptr < end; ptr++) {
+		if (*ptr >= 128) {
+			n = 0;
+		} else {
+			if (n >= splitlen && *ptr != kCharLF) {
+				return ptr;
+			}
+			n++;
+		}
+	}
+	return NULL;
+}
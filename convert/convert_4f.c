@@ -0,0 +1,348 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// convert_4f.c - Forward conversion from bidirectional extended ASCII to
+// UTF-8.
+#include "convert/bidi.h"
+#include "convert/convert.h"
+#include "lib/defs.h"
+
+#include <string.h>
+
+enum {
+	// Maximum length of a cell's Unicode string which is stored in the cell
+	// itself. Longer strings are stored separately.
+	kMaxInlineLength = 3,
+
+	// Space for a direction override and the pop before it.
+	kOverrideLength = 6
+};
+
+/*
+	Each character is stored in a 32-bit cell, the same way as in the multibyte
+	converter. The high byte contains the length of the UTF-8 string, or zero
+	if the character is not mapped. If the length is 3 or less, the low 24 bits
+	contain the UTF-8 string, packed MSB first. Otherwise, the low 24 bits
+	contain the offset of the string in the extra data.
+*/
+
+// Forward conversion table. The extra data follows.
+struct Convert4fData {
+	// Maximum length of the output for one input character, including
+	// direction overrides.
+	UInt32 maxlen;
+	// Offset of the extra data from the start of the table.
+	UInt32 extra;
+	UInt32 cells[256];
+	// Direction flags for each character, see bidi.h.
+	UInt8 flags[256];
+};
+
+struct Convert4fState {
+	UInt8 lastch;
+	// Direction of the override which is open in the output, or zero.
+	UInt8 override;
+	// Direction of the last strong character on the line, or zero.
+	UInt8 lastdir;
+};
+
+// Parse the table, and fill in the converter if it is not NULL. Store the size
+// of the extra data.
+static ErrorCode Parse4f(struct Convert4fData *cvt, UInt32 *nextraptr,
+                         const UInt8 *dptr, const UInt8 *dend)
+{
+	UInt8 *extra;
+	UInt32 nextra, cell, maxlen;
+	int i, n;
+	unsigned flags;
+
+	extra = NULL;
+	if (cvt != NULL) {
+		extra = (UInt8 *)cvt + cvt->extra;
+	}
+	nextra = 0;
+	maxlen = 2;
+	for (i = 0; i < 256; i++) {
+		if (dend - dptr < 2) {
+			return kErrorBadData;
+		}
+		flags = *dptr++;
+		if ((flags & kBidiDirMask) == kBidiDirMask ||
+		    (flags >> kBidiStrongShift) >= kBidiDirMask) {
+			return kErrorBadData;
+		}
+		// NUL and line breaks are handled by the converter.
+		if ((i == 0 || i == kCharCR || i == kCharLF) && flags != 0) {
+			return kErrorBadData;
+		}
+		n = *dptr++;
+		if (dend - dptr < n) {
+			return kErrorBadData;
+		}
+		if (n > (int)maxlen) {
+			maxlen = n;
+		}
+		if (n <= kMaxInlineLength) {
+			cell = 0;
+			if (n > 0) {
+				cell = (UInt32)n << 24;
+				while (n-- > 0) {
+					cell = (cell & 0xff000000) | ((cell << 8) & 0xffffff) |
+					       *dptr++;
+				}
+			}
+		} else {
+			cell = ((UInt32)n << 24) | nextra;
+			if (extra != NULL) {
+				memcpy(extra + nextra, dptr, n);
+			}
+			nextra += n;
+			dptr += n;
+		}
+		if (cvt != NULL) {
+			cvt->cells[i] = cell;
+			cvt->flags[i] = flags;
+		}
+		// Skip the NFD string, which is only used by the reverse converter.
+		if (dptr == dend) {
+			return kErrorBadData;
+		}
+		n = *dptr++;
+		if (dend - dptr < n) {
+			return kErrorBadData;
+		}
+		dptr += n;
+	}
+	if (cvt != NULL) {
+		cvt->maxlen = maxlen + kOverrideLength;
+	}
+	*nextraptr = nextra;
+	return 0;
+}
+
+ErrorCode Convert4fBuild(Handle *out, Handle data, Size datasz)
+{
+	Handle h;
+	struct Convert4fData *cvt;
+	const UInt8 *dptr, *dend;
+	UInt32 nextra;
+	ErrorCode err;
+
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	err = Parse4f(NULL, &nextra, dptr, dend);
+	if (err != 0) {
+		return err;
+	}
+	h = NewHandle(sizeof(struct Convert4fData) + nextra);
+	if (h == NULL) {
+		return kErrorNoMemory;
+	}
+	cvt = (void *)*h;
+	MemClear(cvt, sizeof(struct Convert4fData));
+	cvt->extra = sizeof(struct Convert4fData);
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	err = Parse4f(cvt, &nextra, dptr, dend);
+	if (err != 0) {
+		DisposeHandle(h);
+		return err;
+	}
+	*out = h;
+	return 0;
+}
+
+void Convert4fRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend)
+{
+	const struct Convert4fData *cvt = cvtptr;
+	const UInt8 *extra = (const UInt8 *)cvt + cvt->extra;
+	struct Convert4fState *state = (struct Convert4fState *)stateptr;
+	UInt8 *opos = *optr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch, flags, dir, strong, override, lastdir, len;
+	UInt32 cell;
+
+	ch = state->lastch;
+	override = state->override;
+	lastdir = state->lastdir;
+	while (ipos < iend && oend - opos >= (Size)cvt->maxlen) {
+		lastch = ch;
+		ch = *ipos++;
+		flags = cvt->flags[ch];
+		dir = flags & kBidiDirMask;
+		if (dir == kBidiAny ? override != 0
+		                    : dir != BidiContext(override, lastdir)) {
+			// Close the open override, and open a new one if the character
+			// requires a different direction. Characters with no direction
+			// always close the override, so it does not affect them.
+			if (override != 0) {
+				opos[0] = kBidiControl1;
+				opos[1] = kBidiControl2;
+				opos[2] = kBidiControl3;
+				opos += 3;
+				lastdir = override;
+			}
+			if (dir != kBidiAny) {
+				opos[0] = kBidiControl1;
+				opos[1] = kBidiControl2;
+				opos[2] = kBidiControl3 + dir;
+				opos += 3;
+			}
+			override = dir;
+		}
+		strong = flags >> kBidiStrongShift;
+		if (strong != 0) {
+			lastdir = strong;
+		}
+
+		if (ch == kCharLF || ch == kCharCR) {
+			// Line breaks. The direction context starts over on each line.
+			lastdir = 0;
+			if (stateptr->stats != NULL) {
+				ConvertStatsLineBreak(stateptr->stats, lc, ch, lastch);
+			}
+			if (ch == kCharLF && lastch == kCharCR) {
+				if (lc == kLineBreakKeep) {
+					*opos++ = ch;
+				}
+			} else {
+				switch (lc) {
+				case kLineBreakKeep:
+					*opos++ = ch;
+					break;
+				case kLineBreakLF:
+					*opos++ = kCharLF;
+					break;
+				case kLineBreakCR:
+					*opos++ = kCharCR;
+					break;
+				case kLineBreakCRLF:
+					*opos++ = kCharCR;
+					*opos++ = kCharLF;
+					break;
+				}
+			}
+			continue;
+		}
+
+		cell = cvt->cells[ch];
+		len = cell >> 24;
+		switch (len) {
+		case 0:
+			*opos++ = kCharSubstitute;
+			if (stateptr->stats != NULL) {
+				stateptr->stats->substitutions++;
+			}
+			break;
+		case 1:
+			opos[0] = cell;
+			opos += 1;
+			break;
+		case 2:
+			opos[0] = cell >> 8;
+			opos[1] = cell;
+			opos += 2;
+			break;
+		case 3:
+			opos[0] = cell >> 16;
+			opos[1] = cell >> 8;
+			opos[2] = cell;
+			opos += 3;
+			break;
+		default:
+			memcpy(opos, extra + (cell & 0xffffff), len);
+			opos += len;
+			break;
+		}
+	}
+	state->lastch = ch;
+	state->override = override;
+	state->lastdir = lastdir;
+
+	*optr = opos;
+	*iptr = ipos;
+}
+
+Size Convert4fCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend)
+{
+	const struct Convert4fData *cvt = cvtptr;
+	struct Convert4fState *state = (struct Convert4fState *)stateptr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch, flags, dir, strong, override, lastdir, len;
+	Size count;
+
+	count = 0;
+	ch = state->lastch;
+	override = state->override;
+	lastdir = state->lastdir;
+	while (ipos < iend) {
+		lastch = ch;
+		ch = *ipos++;
+		flags = cvt->flags[ch];
+		dir = flags & kBidiDirMask;
+		if (dir == kBidiAny ? override != 0
+		                    : dir != BidiContext(override, lastdir)) {
+			if (override != 0) {
+				count += 3;
+				lastdir = override;
+			}
+			if (dir != kBidiAny) {
+				count += 3;
+			}
+			override = dir;
+		}
+		strong = flags >> kBidiStrongShift;
+		if (strong != 0) {
+			lastdir = strong;
+		}
+		if (ch == kCharLF || ch == kCharCR) {
+			lastdir = 0;
+			if (ch == kCharLF && lastch == kCharCR) {
+				if (lc == kLineBreakKeep) {
+					count++;
+				}
+			} else {
+				count += lc == kLineBreakCRLF ? 2 : 1;
+			}
+			continue;
+		}
+		// Unmapped characters are replaced with one substitute byte.
+		len = cvt->cells[ch] >> 24;
+		count += len != 0 ? len : 1;
+	}
+	state->lastch = ch;
+	state->override = override;
+	state->lastdir = lastdir;
+
+	*iptr = ipos;
+	return count;
+}
+
+const UInt8 *Convert4fSplit(const void *cvtptr, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end)
+{
+	const struct Convert4fData *cvt = cvtptr;
+	unsigned flags;
+
+	// Split before a strong character with no required direction, which
+	// closes any override and sets the direction context, or at the start of
+	// a line.
+	(void)start;
+	for (; ptr < end; ptr++) {
+		if (*ptr == kCharLF) {
+			continue;
+		}
+		flags = cvt->flags[*ptr];
+		if (ptr[-1] == kCharCR || ptr[-1] == kCharLF ||
+		    ((flags & kBidiDirMask) == kBidiAny &&
+		     (flags >> kBidiStrongShift) != 0)) {
+			return ptr;
+		}
+	}
+	return NULL;
+}
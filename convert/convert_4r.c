@@ -0,0 +1,864 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// convert_4r.c - Reverse conversion from UTF-8 to bidirectional extended
+// ASCII.
+#include "convert/bidi.h"
+#include "convert/convert.h"
+#include "lib/defs.h"
+
+#include <string.h>
+
+/*
+	This works like the extended ASCII reverse converter, except that each tree
+	output contains two characters: the character to use in left-to-right
+	context in the low byte, and the character to use in right-to-left context
+	in the high byte. Direction control characters are also in the tree, with
+	the action in the high byte and zero in the low byte.
+
+	The compacted tree is preceded by a header with information about each
+	byte. Offsets in the tree are in bytes, from the start of the root node.
+*/
+
+enum {
+	// Initial number of nodes to allocate when building the tree.
+	kInitialTableAlloc = 32,
+
+	// Maximum number of nodes in the tree.
+	kMaxNodes = 0x10000,
+
+	// Maximum size of the compacted tree, in bytes.
+	kMaxTableSize = 0x10000,
+
+	// Flag in the header for ASCII characters which can be copied without
+	// walking the tree. The low bits contain the strong direction.
+	kInfoCopy = 4,
+
+	// Size of the header before the compacted tree.
+	kHeaderSize = 256 * sizeof(UInt16)
+};
+
+// Actions for direction control characters.
+enum {
+	kActionPop = 1,
+	kActionOverrideLR,
+	kActionOverrideRL,
+	kActionMarkLR,
+	kActionMarkRL
+};
+
+// Direction control characters, and the actions taken for them. Embeddings and
+// isolates are treated as overrides.
+static const struct {
+	UInt8 encoding[3];
+	UInt8 action;
+} kControls[] = {
+	{{0xe2, 0x80, 0x8e}, kActionMarkLR},     // U+200E LEFT-TO-RIGHT MARK
+	{{0xe2, 0x80, 0x8f}, kActionMarkRL},     // U+200F RIGHT-TO-LEFT MARK
+	{{0xe2, 0x80, 0xaa}, kActionOverrideLR}, // U+202A LEFT-TO-RIGHT EMBEDDING
+	{{0xe2, 0x80, 0xab}, kActionOverrideRL}, // U+202B RIGHT-TO-LEFT EMBEDDING
+	{{0xe2, 0x80, 0xac}, kActionPop},        // U+202C POP DIRECTIONAL FORMATTING
+	{{0xe2, 0x80, 0xad}, kActionOverrideLR}, // U+202D LEFT-TO-RIGHT OVERRIDE
+	{{0xe2, 0x80, 0xae}, kActionOverrideRL}, // U+202E RIGHT-TO-LEFT OVERRIDE
+	{{0xe2, 0x81, 0xa6}, kActionOverrideLR}, // U+2066 LEFT-TO-RIGHT ISOLATE
+	{{0xe2, 0x81, 0xa7}, kActionOverrideRL}, // U+2067 RIGHT-TO-LEFT ISOLATE
+	{{0xe2, 0x81, 0xa9}, kActionPop},        // U+2069 POP DIRECTIONAL ISOLATE
+};
+
+struct TEntry {
+	// Left-to-right output in the low byte, right-to-left output in the high
+	// byte, or zero if no output.
+	UInt16 output;
+	// The next node, or zero if no next node.
+	UInt16 next;
+};
+
+// A node for building the converter.
+struct TNode {
+	struct TEntry entries[256];
+};
+
+struct TTree {
+	struct TNode **nodes;
+	int count;
+	int alloc;
+};
+
+// A character in the table data.
+struct TChar {
+	// Direction flags, see bidi.h.
+	unsigned flags;
+	// The UTF-8 string, and its NFD form, which is empty if it is the same.
+	const UInt8 *str[2];
+	int len[2];
+};
+
+// Parse the table entry for one character. Return the position of the next
+// entry, or NULL if the data is invalid.
+static const UInt8 *ReadChar(struct TChar *c, const UInt8 *dptr,
+                             const UInt8 *dend)
+{
+	int i, n;
+
+	if (dptr == dend) {
+		return NULL;
+	}
+	c->flags = *dptr++;
+	if ((c->flags & kBidiDirMask) == kBidiDirMask ||
+	    (c->flags >> kBidiStrongShift) >= kBidiDirMask) {
+		return NULL;
+	}
+	for (i = 0; i < 2; i++) {
+		if (dptr == dend) {
+			return NULL;
+		}
+		n = *dptr++;
+		if (dend - dptr < n) {
+			return NULL;
+		}
+		c->str[i] = dptr;
+		c->len[i] = n;
+		dptr += n;
+	}
+	return dptr;
+}
+
+// Get the entry for the last byte of a UTF-8 string, creating nodes for the
+// prefixes as necessary. The entry is valid until the tree is modified.
+static ErrorCode TreeLeaf(struct TTree *tree, const UInt8 *str, int len,
+                          struct TEntry **entry)
+{
+	int i, state, next;
+	unsigned ch;
+
+	state = 0;
+	for (i = 0; i < len - 1; i++) {
+		ch = str[i];
+		next = (*tree->nodes)[state].entries[ch].next;
+		if (next == 0) {
+			if (tree->count >= tree->alloc) {
+				if (tree->alloc >= kMaxNodes) {
+					return kErrorBadData;
+				}
+				tree->alloc *= 2;
+				if (!ResizeHandle((Handle)tree->nodes,
+				                  tree->alloc * sizeof(struct TNode))) {
+					return kErrorNoMemory;
+				}
+			}
+			next = tree->count++;
+			MemClear(*tree->nodes + next, sizeof(struct TNode));
+			(*tree->nodes)[state].entries[ch].next = next;
+		}
+		state = next;
+	}
+	*entry = &(*tree->nodes)[state].entries[str[len - 1]];
+	return 0;
+}
+
+// Get the entry for the last byte of a UTF-8 string, or NULL if the string's
+// prefix is not in the tree.
+static struct TEntry *TreeFind(struct TTree *tree, const UInt8 *str, int len)
+{
+	int i, state;
+
+	state = 0;
+	for (i = 0; i < len - 1; i++) {
+		state = (*tree->nodes)[state].entries[str[i]].next;
+		if (state == 0) {
+			return NULL;
+		}
+	}
+	return &(*tree->nodes)[state].entries[str[len - 1]];
+}
+
+// Add the characters in the table to the tree, for the given pass.
+static ErrorCode AddChars(struct TTree *tree, Handle data, Size datasz,
+                          int pass)
+{
+	struct TChar c;
+	struct TEntry *entry;
+	const UInt8 *dptr, *dend, *str;
+	int i, j, len;
+	unsigned dir, output;
+	ErrorCode err;
+
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	for (i = 0; i < 256; i++) {
+		dptr = ReadChar(&c, dptr, dend);
+		if (dptr == NULL) {
+			return kErrorBadData;
+		}
+		dir = c.flags & kBidiDirMask;
+		// NUL, CR, and LF are handled by the decoder.
+		if (i == 0 || i == kCharCR || i == kCharLF ||
+		    (dir != kBidiAny) != ((pass & 1) == 0)) {
+			continue;
+		}
+		str = c.str[pass >> 1];
+		len = c.len[pass >> 1];
+		if (len == 0) {
+			continue;
+		}
+		// Only the first byte may be ASCII.
+		for (j = 1; j < len; j++) {
+			if (str[j] < 128) {
+				return kErrorBadData;
+			}
+		}
+		switch (dir) {
+		case kBidiLR:
+			output = i;
+			break;
+		case kBidiRL:
+			output = i << 8;
+			break;
+		default:
+			output = i | (i << 8);
+			break;
+		}
+		err = TreeLeaf(tree, str, len, &entry);
+		if (err != 0) {
+			return err;
+		}
+		if ((entry->output & 0xff) == 0) {
+			entry->output |= output & 0xff;
+		}
+		if ((entry->output & 0xff00) == 0) {
+			entry->output |= output & 0xff00;
+		}
+	}
+	return 0;
+}
+
+// Check that every character converts back to itself, in the context it
+// requires.
+static ErrorCode CheckChars(struct TTree *tree, Handle data, Size datasz)
+{
+	struct TChar c;
+	const struct TEntry *entry;
+	const UInt8 *dptr, *dend;
+	int i;
+	unsigned dir;
+
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	for (i = 0; i < 256; i++) {
+		dptr = ReadChar(&c, dptr, dend);
+		if (dptr == NULL) {
+			return kErrorBadData;
+		}
+		if (i == 0 || i == kCharCR || i == kCharLF || c.len[0] == 0) {
+			continue;
+		}
+		entry = TreeFind(tree, c.str[0], c.len[0]);
+		dir = c.flags & kBidiDirMask;
+		if (entry == NULL ||
+		    (dir != kBidiRL && (entry->output & 0xff) != (unsigned)i) ||
+		    (dir != kBidiLR && (entry->output >> 8) != (unsigned)i)) {
+			return kErrorBadData;
+		}
+	}
+	return 0;
+}
+
+static ErrorCode CreateTree(struct TTree *tree, Handle data, Size datasz)
+{
+	struct TEntry *entry;
+	int i, j, pass;
+	ErrorCode err;
+
+	tree->nodes =
+		(struct TNode **)NewHandle(kInitialTableAlloc * sizeof(struct TNode));
+	if (tree->nodes == NULL) {
+		return kErrorNoMemory;
+	}
+	tree->count = 1;
+	tree->alloc = kInitialTableAlloc;
+	MemClear(*tree->nodes, sizeof(struct TNode));
+
+	// Characters which require a direction take priority over characters which
+	// don't, and exact strings take priority over NFD strings.
+	for (pass = 0; pass < 4; pass++) {
+		err = AddChars(tree, data, datasz, pass);
+		if (err != 0) {
+			goto error;
+		}
+	}
+	// Characters which only appear with one direction are used for both.
+	for (i = 0; i < tree->count; i++) {
+		for (j = 0; j < 256; j++) {
+			entry = &(*tree->nodes)[i].entries[j];
+			if ((entry->output & 0xff) == 0) {
+				entry->output |= entry->output >> 8;
+			} else if ((entry->output & 0xff00) == 0) {
+				entry->output |= entry->output << 8;
+			}
+		}
+	}
+	err = CheckChars(tree, data, datasz);
+	if (err != 0) {
+		goto error;
+	}
+	for (i = 0; i < (int)ARRAY_COUNT(kControls); i++) {
+		err = TreeLeaf(tree, kControls[i].encoding,
+		               sizeof(kControls[i].encoding), &entry);
+		if (err != 0) {
+			goto error;
+		}
+		if (entry->output == 0) {
+			entry->output = kControls[i].action << 8;
+		}
+	}
+	return 0;
+
+error:
+	DisposeHandle((Handle)tree->nodes);
+	return err;
+}
+
+struct CEntry {
+	UInt16 output;
+	// Offset of the next node, in bytes from the root, or zero.
+	UInt16 next;
+};
+
+// A compressed table node. Followed by an array of CEntry.
+struct CNode {
+	// First byte in table.
+	UInt16 base;
+	// Number of entries in table, minus one.
+	UInt16 span;
+};
+
+static ErrorCode CompactTree(Handle *out, struct TNode **nodes, int nodecount,
+                             Handle data, Size datasz)
+{
+	Handle ctree;
+	struct TNode *node;
+	UInt32 **infos, *info;
+	struct CNode *cnode;
+	struct CEntry *centry;
+	UInt16 *header;
+	struct TChar c;
+	const UInt8 *dptr, *dend;
+	int i, j, min, max, next;
+	UInt32 offset;
+
+	// Figure out where each compacted node will go.
+	infos = (UInt32 **)NewHandle(sizeof(UInt32) * nodecount);
+	if (infos == NULL) {
+		return kErrorNoMemory;
+	}
+	offset = 0;
+	for (i = 0; i < nodecount; i++) {
+		node = *nodes + i;
+		min = 0;
+		while (min < 255 && node->entries[min].output == 0 &&
+		       node->entries[min].next == 0) {
+			min++;
+		}
+		max = 255;
+		while (max > min && node->entries[max].output == 0 &&
+		       node->entries[max].next == 0) {
+			max--;
+		}
+		(*infos)[i] = offset | ((UInt32)min << 24) | ((UInt32)max << 16);
+		offset += sizeof(struct CNode) + (max - min + 1) * sizeof(struct CEntry);
+		if (offset >= kMaxTableSize) {
+			DisposeHandle((Handle)infos);
+			return kErrorBadData;
+		}
+	}
+
+	// Create the compacted tree.
+	ctree = NewHandle(kHeaderSize + offset);
+	if (ctree == NULL) {
+		DisposeHandle((Handle)infos);
+		return kErrorNoMemory;
+	}
+	header = (void *)*ctree;
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	for (i = 0; i < 256; i++) {
+		// Already validated when the tree was created.
+		dptr = ReadChar(&c, dptr, dend);
+		header[i] = c.flags >> kBidiStrongShift;
+		if (i < 128 && (*nodes)->entries[i].output == (i | (i << 8))) {
+			header[i] |= kInfoCopy;
+		}
+	}
+	for (i = 0; i < nodecount; i++) {
+		node = *nodes + i;
+		info = *infos + i;
+		min = *info >> 24;
+		max = (*info >> 16) & 0xff;
+		offset = *info & 0xffff;
+		cnode = (void *)(*ctree + kHeaderSize + offset);
+		cnode->base = min;
+		cnode->span = max - min;
+		centry = (void *)(cnode + 1);
+		for (j = min; j <= max; j++) {
+			centry->output = node->entries[j].output;
+			next = node->entries[j].next;
+			if (next != 0) {
+				next = (*infos)[next] & 0xffff;
+			}
+			centry->next = next;
+			centry++;
+		}
+	}
+
+	DisposeHandle((Handle)infos);
+	*out = ctree;
+	return 0;
+}
+
+ErrorCode Convert4rBuild(Handle *out, Handle data, Size datasz)
+{
+	struct TTree table;
+	ErrorCode err;
+
+	err = CreateTree(&table, data, datasz);
+	if (err != 0) {
+		return err;
+	}
+	err = CompactTree(out, table.nodes, table.count, data, datasz);
+	DisposeHandle((Handle)table.nodes);
+	return err;
+}
+
+enum {
+	// State flags: last character was CR, direction of the open override, and
+	// direction of the last strong character.
+	kStateCR = 1,
+	kStateOverrideShift = 1,
+	kStateLastDirShift = 3
+};
+
+struct Convert4rState {
+	UInt16 tableoffset;
+	UInt8 output;
+	UInt8 flags;
+};
+
+// Choose the output for the current direction context.
+#define ResolveOutput(output, override, lastdir)                 \
+	(BidiContext(override, lastdir) == kBidiRL ? (output) >> 8 : \
+	                                             (output)&0xff)
+
+// Run the reverse converter. If strict is true, stop at the first character
+// with no mapping instead of writing a substitute.
+static void RunReverse(const void *cvtptr, LineBreakConversion lc,
+                       struct ConverterState *stateptr, UInt8 **optr,
+                       UInt8 *oend, const UInt8 **iptr, const UInt8 *iend,
+                       Boolean strict)
+{
+	struct Convert4rState *state = (struct Convert4rState *)stateptr;
+	const UInt16 *info = cvtptr;
+	const UInt8 *root = (const UInt8 *)cvtptr + kHeaderSize;
+	const struct CNode *node;
+	const struct CEntry *entry;
+	UInt8 *opos = *optr;
+	const UInt8 *ipos = *iptr, *savein;
+	unsigned ch, chlen, output, saveout, toffset, savetoffset, strong;
+	unsigned lastcr, override, lastdir;
+
+	lastcr = state->flags & kStateCR;
+	override = (state->flags >> kStateOverrideShift) & kBidiDirMask;
+	lastdir = (state->flags >> kStateLastDirShift) & kBidiDirMask;
+	savein = ipos;
+	saveout = state->output;
+	toffset = state->tableoffset;
+	savetoffset = toffset;
+	if (oend - opos < 2) {
+		goto done;
+	}
+	goto resume;
+
+next_out:
+	// The previous character is complete. If the output is full, stop here
+	// rather than at the start of the previous character.
+	savein = ipos;
+	saveout = 0;
+	savetoffset = 0;
+	if (oend - opos < 2) {
+		goto done;
+	}
+
+	// Copy ASCII characters directly, without walking the tree, if they are
+	// followed by ASCII, so they can't start a longer sequence.
+	while (iend - ipos >= 2 && oend - opos > 2 && ipos[1] < 128 &&
+	       (info[ipos[0]] & kInfoCopy) != 0) {
+		ch = *ipos++;
+		*opos++ = ch;
+		strong = info[ch] & kBidiDirMask;
+		if (strong != 0) {
+			lastdir = strong;
+		}
+		lastcr = 0;
+	}
+
+	// Follow state machine to the end.
+	savein = ipos;
+	saveout = 0;
+	toffset = 0;
+	savetoffset = 0;
+resume:
+	for (;;) {
+		if (ipos >= iend) {
+			goto done;
+		}
+		ch = *ipos++;
+
+		node = (const void *)(root + toffset);
+		ch -= node->base;
+		if (ch > node->span) {
+			toffset = 0;
+			goto bad_char;
+		}
+		entry = (const struct CEntry *)(node + 1) + ch;
+		output = entry->output;
+		toffset = entry->next;
+		if (output != 0 && (output & 0xff) == 0) {
+			// Direction control character.
+			switch (output >> 8) {
+			case kActionPop:
+				if (override != 0) {
+					lastdir = override;
+				}
+				override = 0;
+				break;
+			case kActionOverrideLR:
+				override = kBidiLR;
+				break;
+			case kActionOverrideRL:
+				override = kBidiRL;
+				break;
+			case kActionMarkLR:
+				lastdir = kBidiLR;
+				break;
+			case kActionMarkRL:
+				lastdir = kBidiRL;
+				break;
+			}
+			lastcr = 0;
+			goto next_out;
+		}
+		if (toffset == 0) {
+			// Reached end of tree.
+			if (output == 0) {
+				goto bad_char;
+			}
+			ch = ResolveOutput(output, override, lastdir);
+			*opos++ = ch;
+			strong = info[ch] & kBidiDirMask;
+			if (strong != 0) {
+				lastdir = strong;
+			}
+			lastcr = 0;
+			goto next_out;
+		}
+		if (output != 0) {
+			// Can produce output here, or can consume more input. We try
+			// consuming more input, but save the state to rewind if that fails.
+			savein = ipos;
+			saveout = ResolveOutput(output, override, lastdir);
+			savetoffset = toffset;
+		}
+	}
+
+bad_char:
+	// Bad character. Back up and try again.
+	ipos = savein;
+	if (saveout != 0) {
+		// Produce saved output.
+		*opos++ = saveout;
+		strong = info[saveout] & kBidiDirMask;
+		if (strong != 0) {
+			lastdir = strong;
+		}
+		lastcr = 0;
+	} else {
+		// No saved output, this really is a bad character. Consume one UTF-8
+		// character, emit it as a fallback, and continue.
+		ch = *ipos++;
+		if ((ch & 0x80) == 0) {
+			// ASCII character: NUL, CR, LF, or a character that is not mapped,
+			// which are passed through.
+			if ((ch == kCharLF || ch == kCharCR) &&
+			    stateptr->stats != NULL) {
+				ConvertStatsLineBreak(stateptr->stats, lc, ch,
+				                      lastcr ? kCharCR : 0);
+			}
+			if (ch == kCharLF && lastcr) {
+				if (lc == kLineBreakKeep) {
+					*opos++ = ch;
+				}
+			} else if (ch == kCharLF || ch == kCharCR) {
+				switch (lc) {
+				case kLineBreakKeep:
+					*opos++ = ch;
+					break;
+				case kLineBreakLF:
+					*opos++ = kCharLF;
+					break;
+				case kLineBreakCR:
+					*opos++ = kCharCR;
+					break;
+				case kLineBreakCRLF:
+					*opos++ = kCharCR;
+					*opos++ = kCharLF;
+					break;
+				}
+			} else {
+				*opos++ = ch;
+			}
+			if (ch == kCharLF || ch == kCharCR) {
+				// The direction context starts over on each line.
+				override = 0;
+				lastdir = 0;
+			}
+			lastcr = ch == kCharCR;
+		} else {
+			if ((ch & 0xe0) == 0xc0) {
+				chlen = 1;
+			} else if ((ch & 0xf0) == 0xe0) {
+				chlen = 2;
+			} else if ((ch & 0xf8) == 0xf0) {
+				chlen = 3;
+			} else {
+				chlen = 0;
+			}
+			for (; chlen > 0; chlen--) {
+				if (ipos == iend) {
+					goto done;
+				}
+				if ((*ipos & 0xc0) != 0x80) {
+					break;
+				}
+				ipos++;
+			}
+			if (strict) {
+				// Stop before the character, as if it were never read.
+				ConvertSetUnmapped(stateptr, savein, ipos);
+				goto done;
+			}
+			*opos++ = kCharSubstitute;
+			if (stateptr->stats != NULL) {
+				stateptr->stats->substitutions++;
+			}
+			lastcr = 0;
+		}
+	}
+	goto next_out;
+
+done:
+	state->tableoffset = savetoffset;
+	state->output = saveout;
+	state->flags = lastcr | (override << kStateOverrideShift) |
+	               (lastdir << kStateLastDirShift);
+	*optr = opos;
+	*iptr = savein;
+}
+
+void Convert4rRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend)
+{
+	RunReverse(cvtptr, lc, stateptr, optr, oend, iptr, iend, false);
+}
+
+void Convert4rRunStrict(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	RunReverse(cvtptr, lc, stateptr, optr, oend, iptr, iend, true);
+}
+
+Size Convert4rCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend)
+{
+	struct Convert4rState *state = (struct Convert4rState *)stateptr;
+	const UInt16 *info = cvtptr;
+	const UInt8 *root = (const UInt8 *)cvtptr + kHeaderSize;
+	const struct CNode *node;
+	const struct CEntry *entry;
+	const UInt8 *ipos = *iptr, *savein;
+	unsigned ch, chlen, output, saveout, toffset, savetoffset, strong;
+	unsigned lastcr, override, lastdir;
+	Size count;
+
+	count = 0;
+	lastcr = state->flags & kStateCR;
+	override = (state->flags >> kStateOverrideShift) & kBidiDirMask;
+	lastdir = (state->flags >> kStateLastDirShift) & kBidiDirMask;
+	savein = ipos;
+	saveout = state->output;
+	toffset = state->tableoffset;
+	savetoffset = toffset;
+	goto resume;
+
+next_out:
+	// Skip ASCII characters, like Convert4rRun.
+	while (iend - ipos >= 2 && ipos[1] < 128 &&
+	       (info[ipos[0]] & kInfoCopy) != 0) {
+		strong = info[*ipos++] & kBidiDirMask;
+		if (strong != 0) {
+			lastdir = strong;
+		}
+		lastcr = 0;
+		count++;
+	}
+
+	// Follow state machine to the end.
+	savein = ipos;
+	saveout = 0;
+	toffset = 0;
+	savetoffset = 0;
+resume:
+	for (;;) {
+		if (ipos >= iend) {
+			goto done;
+		}
+		ch = *ipos++;
+
+		node = (const void *)(root + toffset);
+		ch -= node->base;
+		if (ch > node->span) {
+			toffset = 0;
+			goto bad_char;
+		}
+		entry = (const struct CEntry *)(node + 1) + ch;
+		output = entry->output;
+		toffset = entry->next;
+		if (output != 0 && (output & 0xff) == 0) {
+			// Direction control character.
+			switch (output >> 8) {
+			case kActionPop:
+				if (override != 0) {
+					lastdir = override;
+				}
+				override = 0;
+				break;
+			case kActionOverrideLR:
+				override = kBidiLR;
+				break;
+			case kActionOverrideRL:
+				override = kBidiRL;
+				break;
+			case kActionMarkLR:
+				lastdir = kBidiLR;
+				break;
+			case kActionMarkRL:
+				lastdir = kBidiRL;
+				break;
+			}
+			lastcr = 0;
+			goto next_out;
+		}
+		if (toffset == 0) {
+			// Reached end of tree.
+			if (output == 0) {
+				goto bad_char;
+			}
+			strong = info[ResolveOutput(output, override, lastdir)] &
+			         kBidiDirMask;
+			if (strong != 0) {
+				lastdir = strong;
+			}
+			lastcr = 0;
+			count++;
+			goto next_out;
+		}
+		if (output != 0) {
+			// Can produce output here, or can consume more input. We try
+			// consuming more input, but save the state to rewind if that fails.
+			savein = ipos;
+			saveout = ResolveOutput(output, override, lastdir);
+			savetoffset = toffset;
+		}
+	}
+
+bad_char:
+	// Bad character. Back up and try again.
+	ipos = savein;
+	if (saveout != 0) {
+		// Produce saved output.
+		strong = info[saveout] & kBidiDirMask;
+		if (strong != 0) {
+			lastdir = strong;
+		}
+		lastcr = 0;
+		count++;
+	} else {
+		// No saved output, this really is a bad character. Consume one UTF-8
+		// character, emit it as a fallback, and continue.
+		ch = *ipos++;
+		if ((ch & 0x80) == 0) {
+			if (ch == kCharLF && lastcr) {
+				if (lc == kLineBreakKeep) {
+					count++;
+				}
+			} else if ((ch == kCharLF || ch == kCharCR) &&
+			           lc == kLineBreakCRLF) {
+				count += 2;
+			} else {
+				count++;
+			}
+			if (ch == kCharLF || ch == kCharCR) {
+				override = 0;
+				lastdir = 0;
+			}
+			lastcr = ch == kCharCR;
+		} else {
+			if ((ch & 0xe0) == 0xc0) {
+				chlen = 1;
+			} else if ((ch & 0xf0) == 0xe0) {
+				chlen = 2;
+			} else if ((ch & 0xf8) == 0xf0) {
+				chlen = 3;
+			} else {
+				chlen = 0;
+			}
+			for (; chlen > 0; chlen--) {
+				if (ipos == iend) {
+					goto done;
+				}
+				if ((*ipos & 0xc0) != 0x80) {
+					break;
+				}
+				ipos++;
+			}
+			lastcr = 0;
+			count++;
+		}
+	}
+	goto next_out;
+
+done:
+	state->tableoffset = savetoffset;
+	state->output = saveout;
+	state->flags = lastcr | (override << kStateOverrideShift) |
+	               (lastdir << kStateLastDirShift);
+	*iptr = savein;
+	return count;
+}
+
+const UInt8 *Convert4rSplit(const void *cvtptr, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end)
+{
+	// The direction context depends on everything since the start of the
+	// line, so only split at the start of a line.
+	(void)cvtptr;
+	(void)start;
+	for (; ptr < end; ptr++) {
+		if ((ptr[-1] == kCharCR || ptr[-1] == kCharLF) && *ptr != kCharLF) {
+			return ptr;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,410 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// convert_5f.c - Forward conversion from digraph encodings to UTF-8.
+#include "convert/convert.h"
+#include "convert/scan.h"
+#include "lib/defs.h"
+
+#include <string.h>
+
+enum {
+	// Maximum length of a cell's Unicode string which is stored in the cell
+	// itself. Longer strings are stored separately.
+	kMaxInlineLength = 3,
+
+	// Maximum number of digraphs in a table.
+	kMaxDigraphs = 255
+};
+
+/*
+	Characters are stored in 32-bit cells, the same way as in the multibyte
+	converter. The high byte contains the length of the UTF-8 string, or zero
+	if the character is not mapped. If the length is 3 or less, the low 24 bits
+	contain the UTF-8 string, packed MSB first. Otherwise, the low 24 bits
+	contain the offset of the string in the extra data.
+
+	A byte which starts a digraph is held until the next byte is seen. If the
+	two bytes form a digraph, the digraph is emitted, otherwise the first byte
+	is emitted by itself and the second byte is processed normally. This only
+	needs one byte of lookahead, which is kept in the state.
+*/
+
+struct Convert5fLead {
+	// Index of the first digraph starting with this byte.
+	UInt8 first;
+	// Number of digraphs starting with this byte, or zero.
+	UInt8 count;
+};
+
+// Forward conversion table. The extra data follows.
+struct Convert5fData {
+	// Maximum length of the output for one input character, at least 2.
+	UInt32 maxlen;
+	// Offset of the extra data from the start of the table.
+	UInt32 extra;
+	// True if ASCII characters map to themselves.
+	UInt32 asciicopy;
+	UInt32 cells[256];
+	struct Convert5fLead leads[256];
+	// Second byte and cell for each digraph, sorted.
+	UInt8 trails[kMaxDigraphs];
+	UInt32 digraphs[kMaxDigraphs];
+};
+
+struct Convert5fState {
+	UInt8 lastch;
+	// Pending first byte of a possible digraph, or zero.
+	UInt8 lead;
+};
+
+// Read a UTF-8 string from the table, and return its cell.
+static UInt32 ReadCell(UInt8 *extra, UInt32 *nextra, UInt32 *maxlen,
+                       const UInt8 *dptr, int n)
+{
+	UInt32 cell;
+
+	if (n > (int)*maxlen) {
+		*maxlen = n;
+	}
+	if (n <= kMaxInlineLength) {
+		cell = 0;
+		if (n > 0) {
+			cell = (UInt32)n << 24;
+			while (n-- > 0) {
+				cell = (cell & 0xff000000) | ((cell << 8) & 0xffffff) | *dptr++;
+			}
+		}
+	} else {
+		cell = ((UInt32)n << 24) | *nextra;
+		if (extra != NULL) {
+			memcpy(extra + *nextra, dptr, n);
+		}
+		*nextra += n;
+	}
+	return cell;
+}
+
+// Parse the table, and fill in the converter if it is not NULL. Store the size
+// of the extra data.
+static ErrorCode Parse5f(struct Convert5fData *cvt, UInt32 *nextraptr,
+                         const UInt8 *dptr, const UInt8 *dend)
+{
+	UInt8 *extra;
+	UInt32 nextra, cell, maxlen;
+	int i, n, count;
+	unsigned asciicopy, lead, trail, last;
+
+	extra = NULL;
+	if (cvt != NULL) {
+		extra = (UInt8 *)cvt + cvt->extra;
+	}
+	nextra = 0;
+	maxlen = 2;
+	asciicopy = 1;
+	for (i = 0; i < 256; i++) {
+		if (dptr == dend) {
+			return kErrorBadData;
+		}
+		n = *dptr++;
+		if (dend - dptr < n) {
+			return kErrorBadData;
+		}
+		cell = ReadCell(extra, &nextra, &maxlen, dptr, n);
+		dptr += n;
+		// NUL and line breaks are handled by the converter.
+		if ((i == 0 || i == kCharCR || i == kCharLF) &&
+		    cell != (0x01000000 | (UInt32)i)) {
+			return kErrorBadData;
+		}
+		if (i < 128 && cell != (0x01000000 | (UInt32)i)) {
+			asciicopy = 0;
+		}
+		if (cvt != NULL) {
+			cvt->cells[i] = cell;
+		}
+	}
+	if (dptr == dend) {
+		return kErrorBadData;
+	}
+	count = *dptr++;
+	last = 0;
+	for (i = 0; i < count; i++) {
+		if (dend - dptr < 3) {
+			return kErrorBadData;
+		}
+		lead = dptr[0];
+		trail = dptr[1];
+		n = dptr[2];
+		dptr += 3;
+		// Digraphs must be sorted, and only contain high bytes, so the input
+		// can be split before any ASCII byte.
+		if (dend - dptr < n || lead < 128 || trail < 128 ||
+		    ((lead << 8) | trail) <= last) {
+			return kErrorBadData;
+		}
+		last = (lead << 8) | trail;
+		cell = ReadCell(extra, &nextra, &maxlen, dptr, n);
+		dptr += n;
+		if (cvt != NULL) {
+			if (cvt->leads[lead].count == 0) {
+				cvt->leads[lead].first = i;
+			}
+			cvt->leads[lead].count++;
+			cvt->trails[i] = trail;
+			cvt->digraphs[i] = cell;
+		}
+	}
+	if (cvt != NULL) {
+		cvt->maxlen = maxlen;
+		cvt->asciicopy = asciicopy;
+	}
+	*nextraptr = nextra;
+	return 0;
+}
+
+ErrorCode Convert5fBuild(Handle *out, Handle data, Size datasz)
+{
+	Handle h;
+	struct Convert5fData *cvt;
+	const UInt8 *dptr, *dend;
+	UInt32 nextra;
+	ErrorCode err;
+
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	err = Parse5f(NULL, &nextra, dptr, dend);
+	if (err != 0) {
+		return err;
+	}
+	h = NewHandle(sizeof(struct Convert5fData) + nextra);
+	if (h == NULL) {
+		return kErrorNoMemory;
+	}
+	cvt = (void *)*h;
+	MemClear(cvt, sizeof(struct Convert5fData));
+	cvt->extra = sizeof(struct Convert5fData);
+	dptr = (const UInt8 *)*data + 1;
+	dend = (const UInt8 *)*data + datasz;
+	err = Parse5f(cvt, &nextra, dptr, dend);
+	if (err != 0) {
+		DisposeHandle(h);
+		return err;
+	}
+	*out = h;
+	return 0;
+}
+
+// Find the cell for a digraph, or return zero if the bytes do not form a
+// digraph.
+static UInt32 FindDigraph(const struct Convert5fData *cvt, unsigned lead,
+                          unsigned trail)
+{
+	int i, end;
+
+	i = cvt->leads[lead].first;
+	end = i + cvt->leads[lead].count;
+	for (; i < end; i++) {
+		if (cvt->trails[i] == trail) {
+			return cvt->digraphs[i];
+		}
+	}
+	return 0;
+}
+
+void Convert5fRun(const void *cvtptr, LineBreakConversion lc,
+                  struct ConverterState *stateptr, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend)
+{
+	const struct Convert5fData *cvt = cvtptr;
+	const UInt8 *extra = (const UInt8 *)cvt + cvt->extra;
+	struct Convert5fState *state = (struct Convert5fState *)stateptr;
+	UInt8 *opos = *optr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch, leadch, len;
+	UInt32 cell;
+	Size n;
+
+	ch = state->lastch;
+	leadch = state->lead;
+	while (ipos < iend && oend - opos >= (Size)cvt->maxlen) {
+		lastch = ch;
+		ch = *ipos++;
+		if (leadch != 0) {
+			// Byte after the first byte of a possible digraph.
+			cell = FindDigraph(cvt, leadch, ch);
+			if (cell == 0) {
+				// Not a digraph. Emit the first byte by itself, and process
+				// this byte again as a new character.
+				cell = cvt->cells[leadch];
+				ipos--;
+				ch = lastch;
+			}
+			leadch = 0;
+		} else if (cvt->leads[ch].count != 0) {
+			// First byte of a possible digraph.
+			leadch = ch;
+			continue;
+		} else if (ch == kCharLF || ch == kCharCR) {
+			// Line breaks.
+			if (stateptr->stats != NULL) {
+				ConvertStatsLineBreak(stateptr->stats, lc, ch, lastch);
+			}
+			if (ch == kCharLF && lastch == kCharCR) {
+				if (lc == kLineBreakKeep) {
+					*opos++ = ch;
+				}
+			} else {
+				switch (lc) {
+				case kLineBreakKeep:
+					*opos++ = ch;
+					break;
+				case kLineBreakLF:
+					*opos++ = kCharLF;
+					break;
+				case kLineBreakCR:
+					*opos++ = kCharCR;
+					break;
+				case kLineBreakCRLF:
+					*opos++ = kCharCR;
+					*opos++ = kCharLF;
+					break;
+				}
+			}
+			continue;
+		} else if (ch < 128 && cvt->asciicopy) {
+			// ASCII characters. Copy the rest of the run at once.
+			*opos++ = ch;
+			n = iend - ipos;
+			if (n > oend - opos) {
+				n = oend - opos;
+			}
+			if (n > 0 && *ipos < 128) {
+				n = ScanASCII(ipos, ipos + n);
+				if (n > 0) {
+					memcpy(opos, ipos, n);
+					opos += n;
+					ipos += n;
+					ch = ipos[-1];
+				}
+			}
+			continue;
+		} else {
+			cell = cvt->cells[ch];
+		}
+
+		len = cell >> 24;
+		switch (len) {
+		case 0:
+			*opos++ = kCharSubstitute;
+			if (stateptr->stats != NULL) {
+				stateptr->stats->substitutions++;
+			}
+			break;
+		case 1:
+			opos[0] = cell;
+			opos += 1;
+			break;
+		case 2:
+			opos[0] = cell >> 8;
+			opos[1] = cell;
+			opos += 2;
+			break;
+		case 3:
+			opos[0] = cell >> 16;
+			opos[1] = cell >> 8;
+			opos[2] = cell;
+			opos += 3;
+			break;
+		default:
+			memcpy(opos, extra + (cell & 0xffffff), len);
+			opos += len;
+			break;
+		}
+	}
+	state->lastch = ch;
+	state->lead = leadch;
+
+	*optr = opos;
+	*iptr = ipos;
+}
+
+Size Convert5fCount(const void *cvtptr, LineBreakConversion lc,
+                    struct ConverterState *stateptr, const UInt8 **iptr,
+                    const UInt8 *iend)
+{
+	const struct Convert5fData *cvt = cvtptr;
+	struct Convert5fState *state = (struct Convert5fState *)stateptr;
+	const UInt8 *ipos = *iptr;
+	unsigned ch, lastch, leadch, len;
+	UInt32 cell;
+	Size n, count;
+
+	count = 0;
+	ch = state->lastch;
+	leadch = state->lead;
+	while (ipos < iend) {
+		lastch = ch;
+		ch = *ipos++;
+		if (leadch != 0) {
+			// Byte after the first byte of a possible digraph, see
+			// Convert5fRun.
+			cell = FindDigraph(cvt, leadch, ch);
+			if (cell == 0) {
+				cell = cvt->cells[leadch];
+				ipos--;
+				ch = lastch;
+			}
+			leadch = 0;
+			len = cell >> 24;
+		} else if (cvt->leads[ch].count != 0) {
+			leadch = ch;
+			continue;
+		} else if (ch == kCharLF && lastch == kCharCR) {
+			if (lc == kLineBreakKeep) {
+				count++;
+			}
+			continue;
+		} else if (ch == kCharLF || ch == kCharCR) {
+			count += lc == kLineBreakCRLF ? 2 : 1;
+			continue;
+		} else if (ch < 128 && cvt->asciicopy) {
+			// Count the rest of the ASCII run at once.
+			count++;
+			if (ipos < iend && *ipos < 128) {
+				n = ScanASCII(ipos, iend);
+				if (n > 0) {
+					count += n;
+					ipos += n;
+					ch = ipos[-1];
+				}
+			}
+			continue;
+		} else {
+			len = cvt->cells[ch] >> 24;
+		}
+		// Unmapped characters are replaced with one substitute byte.
+		count += len != 0 ? len : 1;
+	}
+	state->lastch = ch;
+	state->lead = leadch;
+
+	*iptr = ipos;
+	return count;
+}
+
+const UInt8 *Convert5fSplit(const void *cvtptr, const UInt8 *start,
+                            const UInt8 *ptr, const UInt8 *end)
+{
+	// Digraphs only contain high bytes, so the input can be split before any
+	// ASCII byte. A pending first byte is emitted by itself either way.
+	(void)cvtptr;
+	(void)start;
+	for (; ptr < end; ptr++) {
+		if (*ptr < 128 && *ptr != kCharLF) {
+			return ptr;
+		}
+	}
+	return NULL;
+}
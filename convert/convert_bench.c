@@ -0,0 +1,400 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// convert_bench.c - converter throughput benchmark.
+#include "convert/convert.h"
+#include "convert/data.h"
+#include "convert/normalize.h"
+#include "lib/test.h"
+#include "lib/utf8.h"
+#include "lib/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	// Default size of each corpus, in bytes.
+	kDefaultCorpusSize = 1024 * 1024,
+
+	// Largest character code used in a corpus, plus one.
+	kMaxCharCode = 0x10000
+};
+
+// Default minimum time to run each benchmark, in seconds.
+static const double kDefaultMinTime = 0.05;
+
+static const char *const kLineBreakName[4] = {"keep", "LF", "CR", "CRLF"};
+
+static const int kBufferSizes[] = {256, 4096, 65536, 1024 * 1024};
+
+// Kinds of generated text.
+typedef enum {
+	// Source code: mostly ASCII, a few high characters, CR line breaks.
+	kCorpusSource,
+	// Dense text: mostly high characters, CR line breaks.
+	kCorpusDense,
+	// Short ASCII lines with CR LF line breaks.
+	kCorpusCRLF,
+} CorpusType;
+
+static const char *const kCorpusName[] = {"source", "dense", "crlf"};
+
+// A source of high characters in a charmap.
+struct CharList {
+	UInt16 *codes;
+	int count;
+};
+
+// Benchmark options.
+struct Options {
+	Size corpussize;
+	double mintime;
+	const char *filter;
+};
+
+// Get the list of characters 128 and above in a charmap table.
+static void GetCharList(struct CharList *list, struct CharmapData data)
+{
+	const UInt8 *dptr = data.ptr + 1;
+	int i, j, type, min, count;
+
+	list->codes = malloc(sizeof(*list->codes) * kMaxCharCode);
+	if (list->codes == NULL) {
+		Fatalf("out of memory");
+	}
+	list->count = 0;
+	switch (data.ptr[0]) {
+	case kTableExtendedASCII:
+	case kTableBidirectional:
+		for (i = 128; i < 256; i++) {
+			list->codes[list->count++] = i;
+		}
+		break;
+	case kTableDigraph:
+		for (i = 0; i < 256; i++) {
+			if (i >= 128 && *dptr != 0) {
+				list->codes[list->count++] = i;
+			}
+			dptr += *dptr + 1;
+		}
+		count = *dptr++;
+		for (i = 0; i < count; i++) {
+			list->codes[list->count++] = (dptr[0] << 8) | dptr[1];
+			dptr += dptr[2] + 3;
+		}
+		break;
+	case kTableMultibyte:
+		for (i = 0; i < 256; i++) {
+			type = *dptr++;
+			if (type == 1) {
+				if (i >= 128 && *dptr != 0) {
+					list->codes[list->count++] = i;
+				}
+				dptr += *dptr + 1;
+			} else if (type == 2) {
+				min = dptr[0];
+				count = dptr[1] + 1;
+				dptr += 2;
+				for (j = 0; j < count; j++) {
+					if (*dptr != 0) {
+						list->codes[list->count++] = (i << 8) | (min + j);
+					}
+					dptr += *dptr + 1;
+				}
+			}
+		}
+		break;
+	}
+}
+
+// Append a random high character to the buffer.
+static UInt8 *PutHighChar(UInt8 *ptr, const struct CharList *list)
+{
+	unsigned code;
+
+	if (list->count == 0) {
+		*ptr++ = 'x';
+		return ptr;
+	}
+	code = list->codes[TestRand() % list->count];
+	if (code > 0xff) {
+		*ptr++ = code >> 8;
+	}
+	*ptr++ = code;
+	return ptr;
+}
+
+// Fill a buffer with generated text. Return the length, which may be slightly
+// less than the buffer size.
+static Size MakeCorpus(UInt8 *buf, Size size, CorpusType type,
+                       const struct CharList *list)
+{
+	static const char kSourceChars[] =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+		"    ;;(){}[]=+-*/,.<>&|!#\"'_";
+	UInt8 *ptr, *end;
+	int i, n, indent;
+	UInt32 r;
+
+	ptr = buf;
+	end = buf + size - 256;
+	TestRandReset();
+	while (ptr < end) {
+		switch (type) {
+		case kCorpusSource:
+			indent = TestRand() % 4;
+			for (i = 0; i < indent; i++) {
+				*ptr++ = 9;
+			}
+			n = TestRand() % 60;
+			for (i = 0; i < n; i++) {
+				r = TestRand();
+				if (r % 200 == 0) {
+					ptr = PutHighChar(ptr, list);
+				} else {
+					*ptr++ = kSourceChars[r % (sizeof(kSourceChars) - 1)];
+				}
+			}
+			*ptr++ = kCharCR;
+			break;
+		case kCorpusDense:
+			n = TestRand() % 120;
+			for (i = 0; i < n; i++) {
+				r = TestRand();
+				if (r % 8 == 0) {
+					*ptr++ = ' ';
+				} else {
+					ptr = PutHighChar(ptr, list);
+				}
+			}
+			*ptr++ = kCharCR;
+			break;
+		case kCorpusCRLF:
+			n = TestRand() % 16;
+			for (i = 0; i < n; i++) {
+				*ptr++ = kSourceChars[TestRand() % 26];
+			}
+			*ptr++ = kCharCR;
+			*ptr++ = kCharLF;
+			break;
+		}
+	}
+	return ptr - buf;
+}
+
+// Convert the input, using input and output buffers of the given size. Return
+// the amount of output.
+static Size Convert(struct Converter *c, LineBreakConversion lc,
+                    Boolean normalize, Size bufsize, UInt8 *obuf,
+                    const UInt8 *ibuf, Size isize)
+{
+	static struct NormalizedConverterState nst;
+	struct ConverterState st;
+	const UInt8 *iptr, *iend, *ilast;
+	UInt8 *optr;
+	Size total;
+
+	MemClear(&st, sizeof(st));
+	if (normalize) {
+		MemClear(&nst, sizeof(nst));
+	}
+	iptr = ibuf;
+	ilast = ibuf + isize;
+	total = 0;
+	while (iptr < ilast) {
+		iend = iptr + bufsize;
+		if (iend > ilast) {
+			iend = ilast;
+		}
+		optr = obuf;
+		if (normalize) {
+			ConvertNormalized(c, lc, &nst, &optr, obuf + bufsize, &iptr, iend);
+		} else {
+			c->run(ConverterData(c), lc, &st, &optr, obuf + bufsize, &iptr,
+			       iend);
+		}
+		if (optr == obuf && iend == ilast) {
+			// Incomplete character at end.
+			break;
+		}
+		total += optr - obuf;
+	}
+	return total;
+}
+
+// Run one benchmark and print the result.
+static void Bench(const char *name, const char *corpus, const char *direction,
+                  struct Converter *c, LineBreakConversion lc,
+                  Boolean normalize, Size bufsize, UInt8 *obuf,
+                  const UInt8 *ibuf, Size isize, const struct Options *opts)
+{
+	double start, elapsed;
+	long reps;
+
+	reps = 0;
+	start = TimeNow();
+	do {
+		Convert(c, lc, normalize, bufsize, obuf, ibuf, isize);
+		reps++;
+		elapsed = TimeNow() - start;
+	} while (elapsed < opts->mintime);
+	printf("%s\t%s\t%s\t%s\t%ld\t%ld\t%.1f\n", name, corpus, direction,
+	       kLineBreakName[lc], (long)bufsize, (long)isize,
+	       (double)isize * (double)reps / elapsed * 1e-6);
+	fflush(stdout);
+}
+
+// Run the UTF-8 validator on the input and print the result.
+static void BenchValidate(const char *name, const char *corpus,
+                          const UInt8 *ibuf, Size isize,
+                          const struct Options *opts)
+{
+	double start, elapsed;
+	long reps;
+
+	reps = 0;
+	start = TimeNow();
+	do {
+		if (UTF8Validate(ibuf, ibuf + isize) != isize) {
+			Fatalf("%s: %s: invalid UTF-8", name, corpus);
+		}
+		reps++;
+		elapsed = TimeNow() - start;
+	} while (elapsed < opts->mintime);
+	printf("%s\t%s\tvalidate\t%s\t%ld\t%ld\t%.1f\n", name, corpus,
+	       kLineBreakName[kLineBreakKeep], (long)isize, (long)isize,
+	       (double)isize * (double)reps / elapsed * 1e-6);
+	fflush(stdout);
+}
+
+static void BenchCharmap(const char *name, struct CharmapData data,
+                         UInt8 **buf, const struct Options *opts)
+{
+	struct Converter cf, cr, cw;
+	struct CharList list;
+	Ptr datap;
+	Handle datah;
+	Size len0, len1;
+	int type, lc, i;
+	ErrorCode err;
+
+	datap = (void *)data.ptr;
+	datah = &datap;
+	err = ConverterBuild(&cf, datah, data.size, kToUTF8);
+	if (err != 0) {
+		Fatalf("%s: ConverterBuild: %s", name, ErrorDescription(err));
+	}
+	err = ConverterBuild(&cr, datah, data.size, kFromUTF8);
+	if (err != 0) {
+		Fatalf("%s: ConverterBuild: %s", name, ErrorDescription(err));
+	}
+	err = ConverterBuild(&cw, datah, data.size, kToUTF16LE);
+	if (err != 0) {
+		Fatalf("%s: ConverterBuild: %s", name, ErrorDescription(err));
+	}
+	GetCharList(&list, data);
+
+	for (type = 0; type < (int)ARRAY_COUNT(kCorpusName); type++) {
+		len0 = MakeCorpus(buf[0], opts->corpussize, type, &list);
+		len1 = Convert(&cf, kLineBreakKeep, false, opts->corpussize * 8,
+		               buf[1], buf[0], len0);
+		BenchValidate(name, kCorpusName[type], buf[1], len1, opts);
+		for (lc = 0; lc < 4; lc++) {
+			for (i = 0; i < (int)ARRAY_COUNT(kBufferSizes); i++) {
+				if (kBufferSizes[i] > opts->corpussize) {
+					continue;
+				}
+				Bench(name, kCorpusName[type], "forward", &cf, lc, false,
+				      kBufferSizes[i], buf[2], buf[0], len0, opts);
+				Bench(name, kCorpusName[type], "utf16", &cw, lc, false,
+				      kBufferSizes[i], buf[2], buf[0], len0, opts);
+				Bench(name, kCorpusName[type], "reverse", &cr, lc, false,
+				      kBufferSizes[i], buf[2], buf[1], len1, opts);
+				Bench(name, kCorpusName[type], "normalize", &cr, lc, true,
+				      kBufferSizes[i], buf[2], buf[1], len1, opts);
+			}
+		}
+	}
+
+	free(list.codes);
+	ConverterDispose(&cf);
+	ConverterDispose(&cr);
+	ConverterDispose(&cw);
+}
+
+static void Usage(void)
+{
+	fputs(
+		"Usage: convert_bench [-size=<MB>] [-time=<seconds>] [<charmap>]\n"
+		"\n"
+		"Prints tab-separated results: charmap, corpus, direction, line break "
+		"mode,\n"
+		"buffer size, corpus size, throughput in MB/s.\n",
+		stderr);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static const UInt8 kLineBreakTable[1] = {kTableLineBreak};
+	struct Options opts;
+	struct CharmapData data;
+	const char *name, *arg;
+	UInt8 *buf[3];
+	int i;
+
+	opts.corpussize = kDefaultCorpusSize;
+	opts.mintime = kDefaultMinTime;
+	opts.filter = NULL;
+	for (i = 1; i < argc; i++) {
+		arg = argv[i];
+		if (strncmp(arg, "-size=", 6) == 0) {
+			opts.corpussize = (Size)(atof(arg + 6) * 1024 * 1024);
+			if (opts.corpussize < 4096) {
+				Usage();
+			}
+		} else if (strncmp(arg, "-time=", 6) == 0) {
+			opts.mintime = atof(arg + 6);
+		} else if (arg[0] == '-' || opts.filter != NULL) {
+			Usage();
+		} else {
+			opts.filter = arg;
+		}
+	}
+
+	// Forward conversion can make text up to 7.5 times larger, for two-byte
+	// characters which map to five code points.
+	for (i = 0; i < 3; i++) {
+		buf[i] = malloc(opts.corpussize * 8);
+		if (buf[i] == NULL) {
+			Fatalf("out of memory");
+		}
+	}
+
+	puts("charmap\tcorpus\tdirection\tlinebreak\tbufsize\tsize\tmbps");
+	if (opts.filter == NULL || strcmp(opts.filter, "LineBreak") == 0) {
+		data.ptr = kLineBreakTable;
+		data.size = sizeof(kLineBreakTable);
+		BenchCharmap("LineBreak", data, buf, &opts);
+	}
+	for (i = 0;; i++) {
+		name = CharmapID(i);
+		if (name == NULL) {
+			break;
+		}
+		if (opts.filter != NULL && strcmp(opts.filter, name) != 0) {
+			continue;
+		}
+		data = CharmapData(i);
+		if (data.ptr != NULL) {
+			BenchCharmap(name, data, buf, &opts);
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		free(buf[i]);
+	}
+	return 0;
+}
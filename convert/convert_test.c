@@ -94,6 +94,195 @@ static const char *const kLineBreakData[4] = {
 
 static const char *const kLineBreakName[4] = {"keep", "LF", "CR", "CRLF"};
 
+static const UInt8 kLineBreakTable[1] = {kTableLineBreak};
+
+// Create sample text with long ASCII runs between high characters and line
+// breaks. Return the length.
+static int MakeLongText(UInt8 *ptr)
+{
+	int i, j, n, pos;
+
+	pos = 0;
+	for (i = 0; pos < 400; i++) {
+		n = (i * 7) % 40 + 1;
+		for (j = 0; j < n; j++) {
+			ptr[pos++] = 'a' + (i + j) % 26;
+		}
+		ptr[pos++] = 128 + (i * 37) % 128;
+		if (i % 3 == 0) {
+			ptr[pos++] = kCharCR;
+		}
+	}
+	ptr[pos++] = kCharCR;
+	return pos;
+}
+
+// Test converting long text in a round trip, with different input sizes for
+// each call.
+static void TestLongText(const char *name, struct Converter *cf,
+                         struct Converter *cr)
+{
+	struct ConverterState st;
+	int len0, len1, len2, chunk;
+	const UInt8 *iptr, *iend;
+	UInt8 *optr, *oend;
+
+	len0 = MakeLongText(gBuffer[0]);
+	SetTestNamef("%s long text forward", name);
+	MemClear(&st, sizeof(st));
+	iptr = gBuffer[0];
+	iend = iptr + len0;
+	optr = gBuffer[1];
+	oend = optr + kConvertBufferSize;
+	cf->run(ConverterData(cf), kLineBreakKeep, &st, &optr, oend, &iptr, iend);
+	if (iptr != iend) {
+		Failf("some data failed to convert");
+		return;
+	}
+	len1 = optr - gBuffer[1];
+
+	for (chunk = 1; chunk <= 65; chunk += 4) {
+		SetTestNamef("%s long text reverse chunk=%d", name, chunk);
+		MemClear(&st, sizeof(st));
+		iptr = gBuffer[1];
+		optr = gBuffer[2];
+		oend = optr + kConvertBufferSize;
+		iend = gBuffer[1];
+		do {
+			iend += chunk;
+			if (iend > gBuffer[1] + len1) {
+				iend = gBuffer[1] + len1;
+			}
+			cr->run(ConverterData(cr), kLineBreakKeep, &st, &optr, oend, &iptr,
+			        iend);
+		} while (iend < gBuffer[1] + len1);
+		if (iptr != iend) {
+			Failf("some data failed to convert");
+		} else {
+			len2 = optr - gBuffer[2];
+			Check(gBuffer[0], len0, gBuffer[1], len1, gBuffer[2], len2);
+		}
+	}
+}
+
+// Create sample text containing every character in a multibyte or digraph
+// table. Return the length.
+static int MakeMultibyteText(UInt8 *ptr, struct CharmapData data)
+{
+	const UInt8 *dptr = data.ptr + 1;
+	int i, j, type, min, count, pos;
+
+	pos = 0;
+	if (data.ptr[0] == kTableDigraph) {
+		for (i = 0; i < 256; i++) {
+			if (*dptr != 0) {
+				ptr[pos++] = i;
+			}
+			dptr += *dptr + 1;
+		}
+		count = *dptr++;
+		for (i = 0; i < count; i++) {
+			ptr[pos++] = dptr[0];
+			ptr[pos++] = dptr[1];
+			dptr += dptr[2] + 3;
+		}
+		return pos;
+	}
+	for (i = 0; i < 256; i++) {
+		type = *dptr++;
+		if (type == 1) {
+			dptr += *dptr + 1;
+			ptr[pos++] = i;
+		} else if (type == 2) {
+			min = dptr[0];
+			count = dptr[1] + 1;
+			dptr += 2;
+			for (j = 0; j < count; j++) {
+				if (*dptr != 0) {
+					ptr[pos++] = i;
+					ptr[pos++] = min + j;
+				}
+				dptr += *dptr + 1;
+			}
+		}
+	}
+	return pos;
+}
+
+// Run a converter on the input, supplying the input in chunks of the given
+// size. Return the output length, or -1 if not all data was converted.
+static int RunChunked(struct Converter *c, int chunk, UInt8 *obuf, Size osize,
+                      const UInt8 *ibuf, int ilen)
+{
+	struct ConverterState st;
+	const UInt8 *iptr, *iend;
+	UInt8 *optr;
+
+	MemClear(&st, sizeof(st));
+	iptr = ibuf;
+	optr = obuf;
+	iend = ibuf;
+	do {
+		iend += chunk;
+		if (iend > ibuf + ilen) {
+			iend = ibuf + ilen;
+		}
+		c->run(ConverterData(c), kLineBreakKeep, &st, &optr, obuf + osize,
+		       &iptr, iend);
+	} while (iend < ibuf + ilen);
+	if (iptr != iend) {
+		return -1;
+	}
+	return optr - obuf;
+}
+
+// Test converting every character in a multibyte table in a round trip.
+static void TestMultibyte(const char *name, struct CharmapData data,
+                          struct Converter *cf, struct Converter *cr)
+{
+	static const int kChunks[] = {1, 2, 3, 5, 64, 1 << 20};
+	UInt8 *buf[3];
+	Size size;
+	int i, len0, len1, len2, ref1;
+
+	size = data.size * 4;
+	for (i = 0; i < 3; i++) {
+		buf[i] = malloc(size);
+		if (buf[i] == NULL) {
+			Fatalf("malloc failed");
+		}
+	}
+	len0 = MakeMultibyteText(buf[0], data);
+	ref1 = -1;
+	for (i = 0; i < (int)ARRAY_COUNT(kChunks); i++) {
+		SetTestNamef("%s multibyte forward chunk=%d", name, kChunks[i]);
+		len1 = RunChunked(cf, kChunks[i], buf[1], size, buf[0], len0);
+		if (len1 < 0) {
+			Failf("some data failed to convert");
+			goto done;
+		}
+		if (ref1 >= 0 && len1 != ref1) {
+			Failf("output length %d, expected %d", len1, ref1);
+			goto done;
+		}
+		ref1 = len1;
+	}
+	for (i = 0; i < (int)ARRAY_COUNT(kChunks); i++) {
+		SetTestNamef("%s multibyte reverse chunk=%d", name, kChunks[i]);
+		len2 = RunChunked(cr, kChunks[i], buf[2], size, buf[1], len1);
+		if (len2 < 0) {
+			Failf("some data failed to convert");
+		} else {
+			Check(buf[0], len0, buf[1], len1, buf[2], len2);
+		}
+	}
+
+done:
+	for (i = 0; i < 3; i++) {
+		free(buf[i]);
+	}
+}
+
 static void TestConverter(const char *name, struct CharmapData data)
 {
 	Ptr datap;
@@ -126,6 +315,11 @@ static void TestConverter(const char *name, struct CharmapData data)
 		goto done;
 	}
 
+	if (data.ptr[0] == kTableMultibyte || data.ptr[0] == kTableDigraph) {
+		TestMultibyte(name, data, &cf, &cr);
+		goto linebreak;
+	}
+
 	// Create sample data to convert: 0-255, followed by 0.
 	len0 = 257;
 	ptr = gBuffer[0];
@@ -139,8 +333,8 @@ static void TestConverter(const char *name, struct CharmapData data)
 	iend = iptr + 257;
 	optr = gBuffer[1];
 	oend = optr + kConvertBufferSize;
-	st.data = 0;
-	cf.run(*cf.data, kLineBreakKeep, &st, &optr, oend, &iptr, iend);
+	MemClear(&st, sizeof(st));
+	cf.run(ConverterData(&cf), kLineBreakKeep, &st, &optr, oend, &iptr, iend);
 	if (iptr != iend) {
 		Failf("some data failed to convert");
 		goto done;
@@ -156,16 +350,19 @@ static void TestConverter(const char *name, struct CharmapData data)
 		}
 		for (j = 1; j <= jmax; j++) {
 			SetTestNamef("%s reverse i=%d j=%d", name, i, j);
-			st.data = 0;
+			MemClear(&st, sizeof(st));
 			iptr = gBuffer[1];
 			optr = gBuffer[2];
 			oend = optr + kConvertBufferSize;
 			iend = gBuffer[1] + i;
-			cr.run(*cr.data, kLineBreakKeep, &st, &optr, oend, &iptr, iend);
+			cr.run(ConverterData(&cr), kLineBreakKeep, &st, &optr, oend, &iptr,
+			       iend);
 			iend = gBuffer[1] + i + j;
-			cr.run(*cr.data, kLineBreakKeep, &st, &optr, oend, &iptr, iend);
+			cr.run(ConverterData(&cr), kLineBreakKeep, &st, &optr, oend, &iptr,
+			       iend);
 			iend = gBuffer[1] + len1;
-			cr.run(*cr.data, kLineBreakKeep, &st, &optr, oend, &iptr, iend);
+			cr.run(ConverterData(&cr), kLineBreakKeep, &st, &optr, oend, &iptr,
+			       iend);
 			if (iptr != iend) {
 				Failf("some data failed to convert");
 			} else {
@@ -175,6 +372,9 @@ static void TestConverter(const char *name, struct CharmapData data)
 		}
 	}
 
+	TestLongText(name, &cf, &cr);
+
+linebreak:
 	for (i = 0; i < 4; i++) {
 		lblen[i] = strlen(kLineBreakData[i]) + 1;
 	}
@@ -188,14 +388,14 @@ static void TestConverter(const char *name, struct CharmapData data)
 				SetTestNamef("%s %s linebreak %s split=%d", name,
 				             k == 0 ? "forward" : "backward", kLineBreakName[i],
 				             j);
-				st.data = 0;
+				MemClear(&st, sizeof(st));
 				iptr = istart;
 				optr = gBuffer[0];
 				oend = optr + kConvertBufferSize;
 				iend = istart + j;
-				cc.run(*cc.data, i, &st, &optr, oend, &iptr, iend);
+				cc.run(ConverterData(&cc), i, &st, &optr, oend, &iptr, iend);
 				iend = istart + len1;
-				cc.run(*cc.data, i, &st, &optr, oend, &iptr, iend);
+				cc.run(ConverterData(&cc), i, &st, &optr, oend, &iptr, iend);
 				if (iptr != iend) {
 					Failf("some data failed to convert");
 				} else {
@@ -208,12 +408,459 @@ static void TestConverter(const char *name, struct CharmapData data)
 	}
 
 done:
-	if (cf.data != NULL) {
-		DisposeHandle(cf.data);
+	ConverterDispose(&cf);
+	ConverterDispose(&cr);
+}
+
+// Count the output of a converter and run it, supplying the input in chunks of
+// the given size, and check that the count matches the output.
+static void CheckCount(struct Converter *c, LineBreakConversion lc, int chunk,
+                       UInt8 *obuf, Size osize, const UInt8 *ibuf, int ilen)
+{
+	struct ConverterState rst, cst;
+	const UInt8 *rptr, *cptr, *iend;
+	UInt8 *optr;
+	Size count, n;
+
+	MemClear(&rst, sizeof(rst));
+	MemClear(&cst, sizeof(cst));
+	rptr = ibuf;
+	cptr = ibuf;
+	optr = obuf;
+	iend = ibuf;
+	count = 0;
+	do {
+		iend += chunk;
+		if (iend > ibuf + ilen) {
+			iend = ibuf + ilen;
+		}
+		c->run(ConverterData(c), lc, &rst, &optr, obuf + osize, &rptr, iend);
+		n = ConverterCount(c, lc, &cst, &cptr, iend);
+		if (n < 0) {
+			Failf("counting not supported");
+			return;
+		}
+		count += n;
+		if (cptr != rptr || cst.data != rst.data) {
+			Failf("count state does not match run state at offset %ld",
+			      (long)(iend - ibuf));
+			return;
+		}
+	} while (iend < ibuf + ilen);
+	if (count != optr - obuf) {
+		Failf("count = %ld, expect %ld", (long)count, (long)(optr - obuf));
 	}
-	if (cr.data != NULL) {
-		DisposeHandle(cr.data);
+}
+
+// Test that counting the output gives the same length as conversion, in both
+// directions and with each line break conversion.
+static void TestCount(const char *name, struct CharmapData data)
+{
+	static const int kChunks[] = {1, 3, 64, 1 << 20};
+	Ptr datap;
+	struct Converter cf, cr;
+	struct ConverterState st;
+	UInt8 *buf[3];
+	const UInt8 *iptr;
+	UInt8 *optr;
+	Size size;
+	int i, lc, len0, len1;
+	ErrorCode err;
+
+	SetTestNamef("%s count", name);
+	datap = (void *)data.ptr;
+	err = ConverterBuild(&cf, &datap, data.size, kToUTF8);
+	if (err != 0) {
+		Failf("ConverterBuild: to UTF-8: %s", ErrorDescriptionOrDie(err));
+		return;
+	}
+	err = ConverterBuild(&cr, &datap, data.size, kFromUTF8);
+	if (err != 0) {
+		Failf("ConverterBuild: from UTF-8: %s", ErrorDescriptionOrDie(err));
+		ConverterDispose(&cf);
+		return;
+	}
+	size = data.size * 16 + kConvertBufferSize * 16;
+	for (i = 0; i < 3; i++) {
+		buf[i] = malloc(size);
+		if (buf[i] == NULL) {
+			Fatalf("malloc failed");
+		}
+	}
+
+	// Sample text with line breaks, ASCII runs, and high characters.
+	len0 = strlen(kLineBreakData[0]);
+	memcpy(buf[0], kLineBreakData[0], len0);
+	if (data.ptr[0] == kTableMultibyte || data.ptr[0] == kTableDigraph) {
+		len0 += MakeMultibyteText(buf[0] + len0, data);
+	} else {
+		len0 += MakeLongText(buf[0] + len0);
+		for (i = 0; i < 256; i++) {
+			buf[0][len0++] = i;
+		}
+	}
+	memcpy(buf[0] + len0, kLineBreakData[0], strlen(kLineBreakData[0]));
+	len0 += strlen(kLineBreakData[0]);
+
+	// Forward conversion output is the reverse conversion input.
+	MemClear(&st, sizeof(st));
+	iptr = buf[0];
+	optr = buf[1];
+	cf.run(ConverterData(&cf), kLineBreakKeep, &st, &optr, buf[1] + size, &iptr,
+	       buf[0] + len0);
+	len1 = optr - buf[1];
+
+	for (lc = 0; lc < 4; lc++) {
+		for (i = 0; i < (int)ARRAY_COUNT(kChunks); i++) {
+			SetTestNamef("%s count forward %s chunk=%d", name,
+			             kLineBreakName[lc], kChunks[i]);
+			CheckCount(&cf, lc, kChunks[i], buf[2], size, buf[0], len0);
+			SetTestNamef("%s count reverse %s chunk=%d", name,
+			             kLineBreakName[lc], kChunks[i]);
+			CheckCount(&cr, lc, kChunks[i], buf[2], size, buf[1], len1);
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		free(buf[i]);
 	}
+	ConverterDispose(&cf);
+	ConverterDispose(&cr);
+}
+
+// Run a converter with statistics, supplying the input in chunks of the given
+// size, and check the statistics.
+static void CheckStats(struct Converter *c, LineBreakConversion lc, int chunk,
+                       const UInt8 *ibuf, int ilen, Size substitutions,
+                       const Size *linebreaks)
+{
+	struct ConvertStats stats, cstats;
+	struct ConverterState st;
+	const UInt8 *iptr, *iend;
+	UInt8 *optr, *obuf;
+	int i;
+
+	MemClear(&stats, sizeof(stats));
+	MemClear(&st, sizeof(st));
+	st.stats = &stats;
+	iptr = ibuf;
+	obuf = gBuffer[2];
+	optr = obuf;
+	iend = ibuf;
+	do {
+		iend += chunk;
+		if (iend > ibuf + ilen) {
+			iend = ibuf + ilen;
+		}
+		ConverterRun(c, lc, &st, &optr, obuf + kConvertBufferSize, &iptr,
+		             iend);
+	} while (iend < ibuf + ilen);
+	if (stats.insize != iptr - ibuf) {
+		Failf("insize = %ld, expect %ld", (long)stats.insize,
+		      (long)(iptr - ibuf));
+	}
+	if (stats.outsize != optr - obuf) {
+		Failf("outsize = %ld, expect %ld", (long)stats.outsize,
+		      (long)(optr - obuf));
+	}
+	if (stats.substitutions != substitutions) {
+		Failf("substitutions = %ld, expect %ld", (long)stats.substitutions,
+		      (long)substitutions);
+	}
+	for (i = 0; i < kLineBreakTypeCount; i++) {
+		if (stats.linebreaks[i] != linebreaks[i]) {
+			Failf("linebreaks[%d] = %ld, expect %ld", i,
+			      (long)stats.linebreaks[i], (long)linebreaks[i]);
+		}
+	}
+
+	// Counting does not change the statistics.
+	cstats = stats;
+	st.data = 0;
+	iptr = ibuf;
+	if (ConverterCount(c, lc, &st, &iptr, ibuf + ilen) >= 0 &&
+	    memcmp(&stats, &cstats, sizeof(stats)) != 0) {
+		Failf("count changed statistics");
+	}
+}
+
+// Test the conversion statistics for substitutions and line breaks.
+static void TestStats(const char *name, struct CharmapData data)
+{
+	static const int kChunks[] = {1, 1 << 20};
+	// Changed line breaks in kLineBreakData[0] for each conversion, by type:
+	// CR, LF, and CR LF.
+	static const Size kLineBreakStats[4][kLineBreakTypeCount] = {
+		{0, 0, 0},
+		{3, 0, 3},
+		{0, 3, 3},
+		{3, 3, 0},
+	};
+	// Invalid UTF-8 and a noncharacter, which are never converted.
+	static const char kBadText[] = "a\xff" "b\xef\xbf\xbf" "c\n";
+	static const ConvertDirection kDirections[] = {kToUTF8, kToUTF16LE,
+	                                               kFromUTF8};
+	static const Size kNoLineBreaks[kLineBreakTypeCount];
+	Ptr datap;
+	struct Converter c;
+	int i, j, lc;
+	Size substitutions;
+	ErrorCode err;
+
+	datap = (void *)data.ptr;
+	for (i = 0; i < (int)ARRAY_COUNT(kDirections); i++) {
+		SetTestNamef("%s stats", name);
+		err = ConverterBuild(&c, &datap, data.size, kDirections[i]);
+		if (err != 0) {
+			Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+			return;
+		}
+		for (lc = 0; lc < 4; lc++) {
+			for (j = 0; j < (int)ARRAY_COUNT(kChunks); j++) {
+				SetTestNamef("%s stats direction=%d %s chunk=%d", name,
+				             (int)kDirections[i], kLineBreakName[lc],
+				             kChunks[j]);
+				CheckStats(&c, lc, kChunks[j],
+				           (const UInt8 *)kLineBreakData[0],
+				           strlen(kLineBreakData[0]), 0, kLineBreakStats[lc]);
+			}
+		}
+		if (kDirections[i] == kFromUTF8) {
+			// Text which is only converted for line breaks is not checked
+			// for invalid UTF-8.
+			substitutions = data.ptr[0] == kTableLineBreak ? 0 : 2;
+			SetTestNamef("%s stats substitutions", name);
+			CheckStats(&c, kLineBreakKeep, 1 << 20, (const UInt8 *)kBadText,
+			           strlen(kBadText), substitutions, kNoLineBreaks);
+		}
+		ConverterDispose(&c);
+	}
+}
+
+// Test that strict conversion stops before characters with no mapping, and
+// otherwise gives the same output as normal conversion.
+static void TestStrict(const char *name, struct CharmapData data)
+{
+	static const int kChunks[] = {1, 3, 1 << 20};
+	static const struct {
+		const char *text;
+		int offset;
+		UInt32 unmapped;
+	} kCases[] = {
+		{"ab\xef\xbf\xbf" "cd\n", 2, 0xffff},
+		{"ab\xff" "cd\n", 2, kCharInvalid},
+		{"\r\n\xf4\x8f\xbf\xbf\n", 2, 0x10ffff},
+		{"ab\xe3\x81" "cd\n", 2, kCharInvalid},
+	};
+	Ptr datap;
+	struct Converter cf, cr, cs;
+	struct ConverterState st;
+	const UInt8 *iptr, *iend;
+	UInt8 *optr;
+	int i, j, len0, len1, len2, ilen, offset;
+	UInt32 unmapped;
+	ErrorCode err;
+
+	SetTestNamef("%s strict", name);
+	datap = (void *)data.ptr;
+	err = ConverterBuild(&cf, &datap, data.size, kToUTF8);
+	if (err != 0) {
+		Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		return;
+	}
+	err = ConverterBuild(&cr, &datap, data.size, kFromUTF8);
+	if (err != 0) {
+		Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		ConverterDispose(&cf);
+		return;
+	}
+	err = ConverterBuild(&cs, &datap, data.size, kFromUTF8Strict);
+	if (err != 0) {
+		Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		ConverterDispose(&cf);
+		ConverterDispose(&cr);
+		return;
+	}
+
+	// Text from forward conversion has a mapping for every character.
+	len0 = MakeLongText(gBuffer[0]);
+	len1 = RunChunked(&cf, len0, gBuffer[1], kConvertBufferSize, gBuffer[0],
+	                  len0);
+	len0 = RunChunked(&cr, len1, gBuffer[0], kConvertBufferSize, gBuffer[1],
+	                  len1);
+	for (i = 0; i < (int)ARRAY_COUNT(kChunks); i++) {
+		SetTestNamef("%s strict valid chunk=%d", name, kChunks[i]);
+		len2 = RunChunked(&cs, kChunks[i], gBuffer[2], kConvertBufferSize,
+		                  gBuffer[1], len1);
+		if (len2 < 0) {
+			Failf("conversion stopped");
+		} else {
+			Check(gBuffer[0], len0, gBuffer[1], len1, gBuffer[2], len2);
+		}
+	}
+
+	for (i = 0; i < (int)ARRAY_COUNT(kCases); i++) {
+		ilen = strlen(kCases[i].text);
+		// Text which is only converted for line breaks is never checked.
+		if (data.ptr[0] == kTableLineBreak) {
+			offset = ilen;
+			unmapped = 0;
+		} else {
+			offset = kCases[i].offset;
+			unmapped = kCases[i].unmapped;
+		}
+		for (j = 0; j < (int)ARRAY_COUNT(kChunks); j++) {
+			SetTestNamef("%s strict case %d chunk=%d", name, i, kChunks[j]);
+			MemClear(&st, sizeof(st));
+			iptr = (const UInt8 *)kCases[i].text;
+			iend = iptr;
+			optr = gBuffer[2];
+			do {
+				iend += kChunks[j];
+				if (iend > (const UInt8 *)kCases[i].text + ilen) {
+					iend = (const UInt8 *)kCases[i].text + ilen;
+				}
+				cs.run(ConverterData(&cs), kLineBreakKeep, &st, &optr,
+				       gBuffer[2] + kConvertBufferSize, &iptr, iend);
+			} while (st.unmapped == 0 &&
+			         iend < (const UInt8 *)kCases[i].text + ilen);
+			if (iptr - (const UInt8 *)kCases[i].text != offset) {
+				Failf("stopped at offset %d, expect %d",
+				      (int)(iptr - (const UInt8 *)kCases[i].text), offset);
+			}
+			if (st.unmapped != unmapped) {
+				Failf("unmapped = U+%04lX, expect U+%04lX",
+				      (unsigned long)st.unmapped, (unsigned long)unmapped);
+			}
+			// The output is the same as converting the text before the
+			// character, with a NUL byte to flush the state.
+			len2 = optr - gBuffer[2];
+			memcpy(gBuffer[1], kCases[i].text, offset);
+			gBuffer[1][offset] = 0;
+			len0 = RunChunked(&cr, offset + 1, gBuffer[0], kConvertBufferSize,
+			                  gBuffer[1], offset + 1);
+			if (len0 > 0) {
+				Check(gBuffer[0], len0 - 1, kCases[i].text, ilen, gBuffer[2],
+				      len2);
+			}
+		}
+	}
+
+	ConverterDispose(&cf);
+	ConverterDispose(&cr);
+	ConverterDispose(&cs);
+}
+
+// Test that the reverse converter gives the same output when it runs out of
+// output space after almost every character.
+static void TestOutputLimit(const char *name, struct CharmapData data)
+{
+	static const int kRoom[] = {2, 3, 4, 5};
+	Ptr datap;
+	struct Converter cf, cr;
+	struct ConverterState st;
+	const UInt8 *iptr, *iend, *istart;
+	UInt8 *optr, *oend, *ostart;
+	int i, len0, len1;
+	ErrorCode err;
+
+	SetTestNamef("%s output limit", name);
+	datap = (void *)data.ptr;
+	err = ConverterBuild(&cf, &datap, data.size, kToUTF8);
+	if (err != 0) {
+		Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		return;
+	}
+	err = ConverterBuild(&cr, &datap, data.size, kFromUTF8);
+	if (err != 0) {
+		Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		ConverterDispose(&cf);
+		return;
+	}
+
+	len0 = MakeLongText(gBuffer[0]);
+	len1 = RunChunked(&cf, len0, gBuffer[1], kConvertBufferSize, gBuffer[0],
+	                  len0);
+	len0 = RunChunked(&cr, len1, gBuffer[0], kConvertBufferSize, gBuffer[1],
+	                  len1);
+	if (len1 < 0 || len0 < 0) {
+		Failf("some data failed to convert");
+		goto done;
+	}
+	for (i = 0; i < (int)ARRAY_COUNT(kRoom); i++) {
+		SetTestNamef("%s output limit room=%d", name, kRoom[i]);
+		MemClear(&st, sizeof(st));
+		iptr = gBuffer[1];
+		iend = iptr + len1;
+		optr = gBuffer[2];
+		for (;;) {
+			istart = iptr;
+			ostart = optr;
+			oend = optr + kRoom[i];
+			if (oend > gBuffer[2] + kConvertBufferSize) {
+				oend = gBuffer[2] + kConvertBufferSize;
+			}
+			cr.run(ConverterData(&cr), kLineBreakKeep, &st, &optr, oend, &iptr,
+			       iend);
+			if (iptr == iend) {
+				break;
+			}
+			if (iptr == istart && optr == ostart) {
+				Failf("no progress at offset %d", (int)(iptr - gBuffer[1]));
+				break;
+			}
+		}
+		if (iptr == iend) {
+			Check(gBuffer[0], len0, gBuffer[1], len1, gBuffer[2],
+			      optr - gBuffer[2]);
+		}
+	}
+
+done:
+	ConverterDispose(&cf);
+	ConverterDispose(&cr);
+}
+
+// Test that the precompiled reverse converter data matches the data built at
+// runtime.
+static void TestReverseData(const char *name, int cmap,
+                            struct CharmapData data)
+{
+	Ptr datap;
+	const UInt8 *rdata;
+	Size rsize, size;
+	struct Converter c;
+	ErrorCode err;
+
+	SetTestNamef("%s precompiled", name);
+	rdata = CharmapReverseData(cmap, &rsize);
+	if (rdata == NULL) {
+		Failf("no precompiled data");
+		return;
+	}
+	datap = (void *)data.ptr;
+	err = ConverterBuild(&c, &datap, data.size, kFromUTF8);
+	if (err != 0) {
+		Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		return;
+	}
+	size = GetHandleSize(c.data);
+	if (size != rsize) {
+		Failf("size = %ld, expect %ld", (long)rsize, (long)size);
+	} else if (memcmp(*c.data, rdata, size) != 0) {
+		Failf("data does not match");
+	}
+	ConverterDispose(&c);
+
+	err = ConverterBuildCharmap(&c, cmap, kFromUTF8);
+	if (err != 0) {
+		Failf("ConverterBuildCharmap: %s", ErrorDescriptionOrDie(err));
+		return;
+	}
+	if (c.data != NULL || c.staticdata != rdata || c.owned) {
+		Failf("converter does not use precompiled data");
+	}
+	ConverterDispose(&c);
 }
 
 int main(int argc, char **argv)
@@ -234,6 +881,14 @@ int main(int argc, char **argv)
 		gBuffer[i] = buf;
 	}
 
+	data.ptr = kLineBreakTable;
+	data.size = sizeof(kLineBreakTable);
+	TestConverter("LineBreak", data);
+	TestCount("LineBreak", data);
+	TestStats("LineBreak", data);
+	TestStrict("LineBreak", data);
+	TestOutputLimit("LineBreak", data);
+
 	for (i = 0;; i++) {
 		name = CharmapName(i);
 		if (name == NULL) {
@@ -242,6 +897,11 @@ int main(int argc, char **argv)
 		data = CharmapData(i);
 		if (data.ptr != NULL) {
 			TestConverter(name, data);
+			TestCount(name, data);
+			TestStats(name, data);
+			TestStrict(name, data);
+			TestOutputLimit(name, data);
+			TestReverseData(name, i, data);
 		}
 	}
 
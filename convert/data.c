@@ -0,0 +1,30 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// data.c - converters for built-in charmaps, not used for classic Mac OS
+// builds.
+#include "convert/data.h"
+
+int ConverterBuildCharmap(struct Converter *c, int cmap,
+                          ConvertDirection direction)
+{
+	struct CharmapData data;
+	const UInt8 *cvtdata;
+	Ptr ptr;
+	Size size;
+
+	data = CharmapData(cmap);
+	if (data.ptr == NULL) {
+		return kErrorBadData;
+	}
+	if (direction == kFromUTF8 || direction == kFromUTF8Strict) {
+		cvtdata = CharmapReverseData(cmap, &size);
+		if (cvtdata != NULL) {
+			return ConverterBuildStatic(c, data.ptr[0], cvtdata, size,
+			                            direction);
+		}
+	}
+	ptr = (Ptr)data.ptr;
+	return ConverterBuild(c, &ptr, data.size, direction);
+}
@@ -4,6 +4,7 @@
 #ifndef CONVERT_DATA_H
 #define CONVERT_DATA_H
 // data.h - charmap data, not used for classic Mac OS builds
+#include "convert/convert.h"
 #include "lib/defs.h"
 
 // Get the ID of the given character map. Return NULL if no such character map
@@ -25,4 +26,16 @@ struct CharmapData {
 // table exists for that character map.
 struct CharmapData CharmapData(int cmap);
 
+// Get the precompiled converter data for converting the given charmap from
+// UTF-8, and store its size in bytes. The data is identical to the data that
+// ConverterBuild creates, and is passed to ConverterBuildStatic. Returns NULL
+// and stores zero if no precompiled data exists.
+const UInt8 *CharmapReverseData(int cmap, Size *size);
+
+// Build a converter for the given character map. Converters from UTF-8 use the
+// precompiled data, so they are created without allocating memory or parsing
+// the conversion table.
+int ConverterBuildCharmap(struct Converter *c, int cmap,
+                          ConvertDirection direction);
+
 #endif
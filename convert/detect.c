@@ -0,0 +1,714 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// detect.c - automatic charmap detection, not used for classic Mac OS builds.
+#include "convert/detect.h"
+
+#include "convert/cache.h"
+#include "convert/data.h"
+#include "convert/wide.h"
+#include "lib/utf8.h"
+
+#include <string.h>
+
+// Classes of characters, for scoring legacy text.
+enum {
+	// Byte or pair of bytes which has no mapping.
+	kClassUndefined,
+	// Punctuation, symbols, and other characters which are uncommon in text.
+	kClassSymbol,
+	// Letters which are uncommon in text, like halfwidth katakana.
+	kClassRare,
+	// Letters.
+	kClassLetter
+};
+
+enum {
+	// UTF-8 candidates are dropped when they have more unmapped characters than
+	// twice the best candidate plus this amount.
+	kDetectSlack = 16,
+
+	// Amount of each piece that DetectorSample examines at a time, in bytes.
+	kDetectSampleChunk = 512,
+
+	// Runs of ASCII longer than this are not passed to the reverse converters.
+	kDetectASCIIRun = 16
+};
+
+// Score for each byte 128-255 in legacy text, by the class of its character.
+static const signed char kClassWeight[] = {-8, 0, 1, 2};
+
+// Score for each pair of neighboring letters in legacy text, by whether they
+// belong to the same script. A letter made from two bytes 128-255 in a
+// multibyte charmap scores more, because random text rarely forms one.
+enum {
+	kPairSame = 1,
+	kPairDifferent = -2,
+	kPairMultibyte = 4
+};
+
+// Get the class of a Unicode character.
+static int ClassifyChar(UInt32 ch)
+{
+	if (ch < 0xc0 || ch == 0xd7 || ch == 0xf7) {
+		return kClassSymbol;
+	}
+	if ((ch >= 0x2000 && ch < 0x2c00) || (ch >= 0x3000 && ch < 0x3040) ||
+	    (ch >= 0xe000 && ch < 0xf900) || (ch >= 0xfe30 && ch < 0xfe70) ||
+	    (ch >= 0xff01 && ch < 0xff21)) {
+		return kClassSymbol;
+	}
+	if ((ch >= 0xf900 && ch < 0xfb00) || (ch >= 0xff61 && ch < 0xffdd)) {
+		return kClassRare;
+	}
+	return kClassLetter;
+}
+
+// Get the script of a letter, to check that neighboring letters belong to the
+// same script. Return 0 for characters which are not letters.
+static int GetScript(UInt32 ch)
+{
+	if (ClassifyChar(ch) != kClassLetter) {
+		return 0;
+	}
+	if ((ch >= 0xc0 && ch < 0x250) || (ch >= 0x1e00 && ch < 0x1f00)) {
+		return 1;
+	}
+	if (ch >= 0xfd00) {
+		return 255;
+	}
+	return (ch >> 8) + 2;
+}
+
+// Read a length-prefixed string from a conversion table, and return its first
+// character, or 0 if the string is empty or invalid. Return -1 if the table is
+// truncated.
+static long ReadString(const UInt8 **dptr, const UInt8 *dend)
+{
+	const UInt8 *pos = *dptr;
+	UInt32 ch;
+	int len;
+
+	if (pos == dend) {
+		return -1;
+	}
+	len = *pos++;
+	if (dend - pos < len) {
+		return -1;
+	}
+	*dptr = pos + len;
+	if (len == 0 || UTF8Decode(pos, pos + len, &ch) <= 0) {
+		return 0;
+	}
+	return ch;
+}
+
+// Set the class and script of a one-byte character.
+static void SetSingle(struct DetectCandidate *c, int byte, long ch)
+{
+	if (byte < 128) {
+		return;
+	}
+	if (ch == 0) {
+		c->single[byte] = kClassUndefined;
+	} else if (ch < 128) {
+		// Right-to-left copies of ASCII characters in bidirectional charmaps.
+		// These are common in text.
+		c->single[byte] = kClassLetter;
+	} else {
+		c->single[byte] = ClassifyChar(ch);
+		c->script[byte] = GetScript(ch);
+	}
+}
+
+// Read the character classes from a conversion table. For multibyte tables,
+// the classes for trail bytes are written to trail, if it is not NULL, and the
+// number of lead bytes is stored in nlead.
+static ErrorCode ReadTable(struct DetectCandidate *c, const UInt8 *ptr,
+                           Size size, UInt8 *trail, int *nlead)
+{
+	const UInt8 *dptr = ptr + 1, *dend = ptr + size;
+	int i, j, type, min, count, n;
+	long ch;
+
+	n = 0;
+	for (i = 0; i < 256; i++) {
+		c->single[i] = kClassSymbol;
+		c->script[i] = 0;
+		c->lead[i] = 0;
+	}
+	// ASCII letters are Latin, so letters 128-255 in words with ASCII letters
+	// should be Latin too.
+	for (i = 'A'; i <= 'Z'; i++) {
+		c->script[i] = 1;
+		c->script[i + ('a' - 'A')] = 1;
+	}
+	switch (ptr[0]) {
+	case kTableExtendedASCII:
+		for (i = 128; i < 256; i++) {
+			ch = ReadString(&dptr, dend);
+			if (ch < 0 || ReadString(&dptr, dend) < 0) {
+				return kErrorBadData;
+			}
+			SetSingle(c, i, ch);
+		}
+		break;
+	case kTableBidirectional:
+		for (i = 0; i < 256; i++) {
+			if (dptr == dend) {
+				return kErrorBadData;
+			}
+			dptr++;
+			ch = ReadString(&dptr, dend);
+			if (ch < 0 || ReadString(&dptr, dend) < 0) {
+				return kErrorBadData;
+			}
+			SetSingle(c, i, ch);
+		}
+		break;
+	case kTableDigraph:
+		// Digraphs are ignored, each byte is scored by itself.
+		for (i = 0; i < 256; i++) {
+			ch = ReadString(&dptr, dend);
+			if (ch < 0) {
+				return kErrorBadData;
+			}
+			SetSingle(c, i, ch);
+		}
+		break;
+	case kTableMultibyte:
+		for (i = 0; i < 256; i++) {
+			if (dptr == dend) {
+				return kErrorBadData;
+			}
+			type = *dptr++;
+			if (type == 0) {
+				SetSingle(c, i, 0);
+			} else if (type == 1) {
+				ch = ReadString(&dptr, dend);
+				if (ch < 0) {
+					return kErrorBadData;
+				}
+				SetSingle(c, i, ch);
+			} else if (type == 2) {
+				if (dend - dptr < 2 || n == 255) {
+					return kErrorBadData;
+				}
+				min = dptr[0];
+				count = dptr[1] + 1;
+				dptr += 2;
+				if (min + count > 256) {
+					return kErrorBadData;
+				}
+				c->lead[i] = ++n;
+				if (trail != NULL) {
+					for (j = 0; j < 256; j++) {
+						trail[j] = kClassUndefined;
+					}
+				}
+				for (j = 0; j < count; j++) {
+					ch = ReadString(&dptr, dend);
+					if (ch < 0) {
+						return kErrorBadData;
+					}
+					if (trail != NULL && ch != 0) {
+						trail[min + j] = ClassifyChar(ch);
+					}
+				}
+				if (trail != NULL) {
+					trail += 256;
+				}
+			} else {
+				return kErrorBadData;
+			}
+		}
+		break;
+	default:
+		return kErrorBadData;
+	}
+	c->letters = 0;
+	for (i = 128; i < 256; i++) {
+		if (c->single[i] == kClassLetter) {
+			c->letters++;
+		}
+	}
+	*nlead = n;
+	return 0;
+}
+
+// Set up a candidate for the given charmap.
+static ErrorCode InitCandidate(struct DetectCandidate *c, int cmap,
+                               struct CharmapData data)
+{
+	Handle h;
+	int nlead;
+	ErrorCode err;
+
+	c->cmap = cmap;
+	c->format = data.ptr[0];
+	err = ReadTable(c, data.ptr, data.size, NULL, &nlead);
+	if (err != 0) {
+		return err;
+	}
+	if (nlead > 0) {
+		h = NewHandle(nlead * 256);
+		if (h == NULL) {
+			return kErrorNoMemory;
+		}
+		c->trail = h;
+		err = ReadTable(c, data.ptr, data.size, (UInt8 *)*h, &nlead);
+		if (err != 0) {
+			return err;
+		}
+	}
+	return ConverterCacheGet(&c->reverse, cmap, kFromUTF8);
+}
+
+ErrorCode DetectorInit(struct CharmapDetector *d, int prefer)
+{
+	struct CharmapData data;
+	int cmap;
+	ErrorCode err;
+
+	MemClear(d, sizeof(*d));
+	d->prefer = prefer;
+	for (cmap = 0; CharmapID(cmap) != NULL; cmap++) {
+		data = CharmapData(cmap);
+		if (data.ptr == NULL || data.size == 0 ||
+		    data.ptr[0] == kTableLineBreak) {
+			continue;
+		}
+		if (d->count == kDetectMaxCandidates) {
+			break;
+		}
+		err = InitCandidate(&d->candidates[d->count], cmap, data);
+		d->count++;
+		if (err != 0) {
+			DetectorDispose(d);
+			return err;
+		}
+	}
+	DetectorReset(d);
+	return 0;
+}
+
+void DetectorDispose(struct CharmapDetector *d)
+{
+	int i;
+
+	for (i = 0; i < d->count; i++) {
+		if (d->candidates[i].trail != NULL) {
+			DisposeHandle(d->candidates[i].trail);
+		}
+	}
+	MemClear(d, sizeof(*d));
+}
+
+// Forget the state which depends on the previous input, before examining text
+// which does not follow it.
+static void DetectorBreak(struct CharmapDetector *d)
+{
+	struct DetectCandidate *c;
+	int i;
+
+	d->npartial = 0;
+	d->last = 0;
+	for (i = 0; i < d->count; i++) {
+		c = &d->candidates[i];
+		c->pending = 0;
+		c->ncarry = 0;
+		MemClear(&c->state, sizeof(c->state));
+	}
+}
+
+void DetectorReset(struct CharmapDetector *d)
+{
+	struct DetectCandidate *c;
+	int i;
+
+	d->done = false;
+	d->utf8 = true;
+	d->sampled = 0;
+	d->high = 0;
+	MemClear(d->histogram, sizeof(d->histogram));
+	for (i = 0; i < d->count; i++) {
+		c = &d->candidates[i];
+		c->active = true;
+		c->score = 0;
+		c->unmapped = 0;
+		c->outsize = 0;
+	}
+	DetectorBreak(d);
+}
+
+// Score legacy text with a multibyte charmap.
+static void ScoreMultibyte(struct DetectCandidate *c, const UInt8 *ptr,
+                           const UInt8 *end)
+{
+	const UInt8 *trail = (const UInt8 *)*c->trail;
+	unsigned ch, lead, cls;
+	long score;
+
+	lead = c->pending;
+	score = c->score;
+	for (; ptr < end; ptr++) {
+		ch = *ptr;
+		if (lead != 0) {
+			// Both bytes of a pair count, if they are 128-255.
+			cls = trail[(c->lead[lead] - 1) * 256 + ch];
+			score += kClassWeight[cls];
+			if (ch >= 128) {
+				score += kClassWeight[cls];
+				if (cls == kClassLetter) {
+					score += kPairMultibyte;
+				}
+			}
+			lead = 0;
+		} else if (ch >= 128) {
+			if (c->lead[ch] != 0) {
+				lead = ch;
+			} else {
+				score += kClassWeight[c->single[ch]];
+			}
+		}
+	}
+	c->pending = lead;
+	c->score = score;
+}
+
+// Run a candidate's reverse converter until it stops making progress, and
+// return the end of the input it consumed. The converter may stop before the
+// end, if the text there may continue in the next input.
+static const UInt8 *RunReverse(struct CharmapDetector *d,
+                               struct DetectCandidate *c, const UInt8 *ptr,
+                               const UInt8 *end)
+{
+	const UInt8 *start;
+	UInt8 *optr;
+
+	while (ptr < end) {
+		start = ptr;
+		optr = d->scratch;
+		ConverterRun(&c->reverse, kLineBreakKeep, &c->state, &optr,
+		             d->scratch + kDetectScratchSize, &ptr, end);
+		if (ptr == start && optr == d->scratch) {
+			break;
+		}
+	}
+	return ptr;
+}
+
+// Run a candidate's reverse converter on UTF-8 text, after the input it did
+// not consume last time.
+static void ScoreReverse(struct CharmapDetector *d, struct DetectCandidate *c,
+                         const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos;
+	Size n, take;
+
+	if (c->ncarry != 0) {
+		n = c->ncarry;
+		take = end - ptr;
+		if (take > kDetectCarrySize) {
+			take = kDetectCarrySize;
+		}
+		memcpy(d->join, c->carry, n);
+		memcpy(d->join + n, ptr, take);
+		c->ncarry = 0;
+		pos = RunReverse(d, c, d->join, d->join + n + take);
+		if (pos >= d->join + n) {
+			ptr += pos - (d->join + n);
+		} else if (ptr + take == end) {
+			// All of the input is in the join buffer. Save what is left.
+			ptr = pos;
+			end = d->join + n + take;
+		}
+		// Otherwise, the converter needs more lookahead than the carry buffer
+		// holds, and the saved input is dropped.
+	}
+	pos = RunReverse(d, c, ptr, end);
+	n = end - pos;
+	if (n <= kDetectCarrySize) {
+		memcpy(c->carry, pos, n);
+		c->ncarry = n;
+	}
+}
+
+// Count the characters in UTF-8 text which each remaining candidate cannot
+// map, and drop candidates which are far behind the best.
+static void ScoreSpan(struct CharmapDetector *d, const UInt8 *ptr,
+                      const UInt8 *end)
+{
+	struct DetectCandidate *c;
+	struct ConvertStats stats;
+	Size best;
+	int i;
+
+	best = -1;
+	for (i = 0; i < d->count; i++) {
+		c = &d->candidates[i];
+		if (!c->active) {
+			continue;
+		}
+		MemClear(&stats, sizeof(stats));
+		c->state.stats = &stats;
+		ScoreReverse(d, c, ptr, end);
+		c->state.stats = NULL;
+		c->unmapped += stats.substitutions;
+		c->outsize += stats.outsize;
+		if (best < 0 || c->unmapped < best) {
+			best = c->unmapped;
+		}
+	}
+	for (i = 0; i < d->count; i++) {
+		c = &d->candidates[i];
+		if (c->active && c->unmapped > best * 2 + kDetectSlack) {
+			c->active = false;
+		}
+	}
+}
+
+// Score complete UTF-8 characters. Long runs of ASCII are skipped, since every
+// charmap maps them the same way.
+static void ScoreUTF8(struct CharmapDetector *d, const UInt8 *ptr,
+                      const UInt8 *end)
+{
+	const UInt8 *pos, *run, *seg;
+
+	seg = ptr;
+	pos = ptr;
+	while (pos < end) {
+		run = pos;
+		while (pos < end && *pos < 0x80) {
+			pos++;
+		}
+		if (pos - run > kDetectASCIIRun) {
+			// Keep one byte of ASCII on each side of the run, which ends any
+			// sequence the converters are matching.
+			ScoreSpan(d, seg, run + 1);
+			seg = pos - 1;
+		}
+		while (pos < end && *pos >= 0x80) {
+			pos++;
+		}
+	}
+	ScoreSpan(d, seg, end);
+}
+
+// Return the length of the UTF-8 sequence starting with the given byte, or 0
+// if the byte cannot start a sequence.
+static int SequenceLength(unsigned ch)
+{
+	if (ch < 0x80) {
+		return 1;
+	} else if (ch < 0xc2) {
+		return 0;
+	} else if (ch < 0xe0) {
+		return 2;
+	} else if (ch < 0xf0) {
+		return 3;
+	} else if (ch < 0xf5) {
+		return 4;
+	}
+	return 0;
+}
+
+// Check that the text is UTF-8, and score it. An incomplete sequence at the
+// end is saved, and completed by the next input.
+static void FeedUTF8(struct CharmapDetector *d, const UInt8 *ptr,
+                     const UInt8 *end)
+{
+	const UInt8 *valid;
+	int need;
+
+	if (d->npartial != 0) {
+		need = SequenceLength(d->partial[0]);
+		while (d->npartial < need && ptr < end) {
+			d->partial[d->npartial++] = *ptr++;
+		}
+		if (d->npartial < need) {
+			return;
+		}
+		d->npartial = 0;
+		if (UTF8Validate(d->partial, d->partial + need) != (Size)need) {
+			d->utf8 = false;
+			return;
+		}
+		ScoreUTF8(d, d->partial, d->partial + need);
+	}
+	valid = ptr + UTF8Validate(ptr, end);
+	if (valid < end) {
+		if (SequenceLength(*valid) <= end - valid) {
+			d->utf8 = false;
+			return;
+		}
+		d->npartial = end - valid;
+		for (need = 0; need < d->npartial; need++) {
+			d->partial[need] = valid[need];
+		}
+		end = valid;
+	}
+	ScoreUTF8(d, ptr, end);
+}
+
+Boolean DetectorFeed(struct CharmapDetector *d, const UInt8 *ptr,
+                     const UInt8 *end)
+{
+	struct DetectCandidate *c;
+	const UInt8 *pos;
+	Size high;
+	unsigned ch, last, s1, s2;
+	int i;
+
+	if (d->done) {
+		return true;
+	}
+	if (end - ptr > kDetectMaxSample - d->sampled) {
+		end = ptr + (kDetectMaxSample - d->sampled);
+	}
+	d->sampled += end - ptr;
+	high = 0;
+	last = d->last;
+	for (pos = ptr; pos < end; pos++) {
+		ch = *pos;
+		d->histogram[ch]++;
+		high += ch >> 7;
+		if ((ch | last) >= 128) {
+			// Score neighboring letters in one-byte charmaps.
+			for (i = 0; i < d->count; i++) {
+				c = &d->candidates[i];
+				s1 = c->script[last];
+				s2 = c->script[ch];
+				if (c->trail == NULL && s1 != 0 && s2 != 0) {
+					c->score += s1 == s2 ? kPairSame : kPairDifferent;
+				}
+			}
+		}
+		last = ch;
+	}
+	d->last = last;
+	d->high += high;
+	for (i = 0; i < d->count; i++) {
+		c = &d->candidates[i];
+		if (c->trail != NULL && (high != 0 || c->pending != 0)) {
+			ScoreMultibyte(c, ptr, end);
+		}
+	}
+	if (d->utf8) {
+		FeedUTF8(d, ptr, end);
+	}
+	if (d->sampled >= kDetectMaxSample || d->high >= kDetectEnoughHigh) {
+		d->done = true;
+	}
+	return d->done;
+}
+
+// Return true if the candidate with the given score should replace the best
+// candidate so far. Ties go to the preferred charmap, then to the charmap with
+// the fewest letters, then to the first charmap.
+static Boolean IsBetter(const struct CharmapDetector *d,
+                        const struct DetectCandidate *c, long score,
+                        const struct DetectCandidate *best, long bestscore)
+{
+	if (best == NULL || score > bestscore) {
+		return true;
+	}
+	if (score < bestscore || best->cmap == d->prefer) {
+		return false;
+	}
+	// Charmaps which are variants of another charmap usually replace symbols
+	// with letters, so the charmap with fewer letters is the more likely one.
+	return c->cmap == d->prefer || c->letters < best->letters;
+}
+
+struct DetectResult DetectorResult(struct CharmapDetector *d)
+{
+	struct DetectResult r;
+	const struct DetectCandidate *c, *best;
+	long score, bestscore;
+	int i, j;
+
+	best = NULL;
+	bestscore = 0;
+	if (d->high == 0) {
+		r.encoding = kDetectASCII;
+		for (i = 0; i < d->count; i++) {
+			c = &d->candidates[i];
+			if (IsBetter(d, c, 0, best, bestscore)) {
+				best = c;
+			}
+		}
+	} else if (d->utf8) {
+		// Fewest unmapped characters, then shortest output.
+		r.encoding = kDetectUTF8;
+		for (i = 0; i < d->count; i++) {
+			c = &d->candidates[i];
+			if (c->active &&
+			    (best == NULL || c->unmapped < best->unmapped ||
+			     (c->unmapped == best->unmapped &&
+			      IsBetter(d, c, -(long)c->outsize, best, bestscore)))) {
+				best = c;
+				bestscore = -(long)c->outsize;
+			}
+		}
+	} else {
+		r.encoding = kDetectLegacy;
+		for (i = 0; i < d->count; i++) {
+			c = &d->candidates[i];
+			score = c->score;
+			if (c->trail == NULL) {
+				for (j = 128; j < 256; j++) {
+					score += (long)d->histogram[j] * kClassWeight[c->single[j]];
+				}
+			}
+			if (IsBetter(d, c, score, best, bestscore)) {
+				best = c;
+				bestscore = score;
+			}
+		}
+	}
+	r.cmap = best != NULL ? best->cmap : -1;
+	return r;
+}
+
+struct DetectResult DetectorSample(struct CharmapDetector *d, const UInt8 *ptr,
+                                   Size size)
+{
+	const UInt8 *start, *end, *chunk;
+	Size piece, step, budget;
+	int i, n;
+
+	DetectorReset(d);
+	if (size <= kDetectMaxSample) {
+		DetectorFeed(d, ptr, ptr + size);
+		return DetectorResult(d);
+	}
+	// Each piece gets an equal share of the text the detector examines, so
+	// the pieces at the end are not skipped.
+	piece = kDetectMaxSample / kDetectSamplePieces;
+	step = (size - piece) / (kDetectSamplePieces - 1);
+	for (i = 0; i < kDetectSamplePieces; i++) {
+		start = ptr + step * i;
+		end = start + piece;
+		budget = (Size)kDetectEnoughHigh * (i + 1) / kDetectSamplePieces;
+		if (i > 0) {
+			// Start at a character boundary, if this is UTF-8.
+			for (n = 0; n < 3 && (*start & 0xc0) == 0x80; n++) {
+				start++;
+			}
+			DetectorBreak(d);
+		}
+		while (start < end && d->high < budget) {
+			chunk = start + kDetectSampleChunk;
+			if (chunk > end) {
+				chunk = end;
+			}
+			if (DetectorFeed(d, start, chunk)) {
+				return DetectorResult(d);
+			}
+			start = chunk;
+		}
+	}
+	return DetectorResult(d);
+}
@@ -0,0 +1,133 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_DETECT_H
+#define CONVERT_DETECT_H
+// detect.h - automatic charmap detection, not used for classic Mac OS builds.
+#include "convert/convert.h"
+
+enum {
+	// Maximum number of charmaps the detector considers.
+	kDetectMaxCandidates = 32,
+
+	// Maximum amount of text the detector examines in each file, in bytes.
+	kDetectMaxSample = 64 * 1024,
+
+	// Number of pieces that DetectorSample reads from a large buffer.
+	kDetectSamplePieces = 8,
+
+	// Number of bytes 128-255 after which the detector has enough text.
+	kDetectEnoughHigh = 1024,
+
+	// Size of the scratch buffer for conversion output.
+	kDetectScratchSize = 1024,
+
+	// Maximum amount of UTF-8 input saved when a reverse converter stops
+	// before the end of the input.
+	kDetectCarrySize = 32
+};
+
+// Encodings that the detector recognizes.
+typedef enum {
+	// Plain ASCII, which is the same in every charmap.
+	kDetectASCII,
+	// UTF-8 text, which is converted with a charmap's reverse converter.
+	kDetectUTF8,
+	// Text in one of the charmaps.
+	kDetectLegacy
+} DetectEncoding;
+
+// The detector's recommendation for a file.
+struct DetectResult {
+	DetectEncoding encoding;
+	// For UTF-8 text, the charmap which can represent the most characters in
+	// the text, with the shortest output if there is a tie. For legacy text,
+	// the most likely charmap of the text. For ASCII text, the preferred
+	// charmap.
+	int cmap;
+};
+
+// A candidate charmap, and its score for the current file.
+struct DetectCandidate {
+	int cmap;
+	int format;
+	struct Converter reverse;
+	// Class of each byte as a one-byte character, and its script if it is a
+	// letter, or zero.
+	UInt8 single[256];
+	UInt8 script[256];
+	// Number of bytes 128-255 which are one-byte letters.
+	int letters;
+	// For multibyte charmaps, the index of the class table for trail bytes
+	// following each lead byte, plus one, or zero if the byte is not a lead
+	// byte. The class tables are stored in the trail handle, 256 bytes each.
+	UInt8 lead[256];
+	Handle trail;
+
+	// Per-file state.
+	Boolean active;
+	UInt8 pending;
+	long score;
+	Size unmapped;
+	Size outsize;
+	struct ConverterState state;
+	UInt8 ncarry;
+	UInt8 carry[kDetectCarrySize];
+};
+
+// A charmap detector. Scores every charmap with conversion data in a single
+// pass over the text. Legacy text is scored by how many of its bytes 128-255
+// decode to letters in each charmap, using a histogram for one-byte charmaps,
+// and by whether neighboring letters belong to the same script.
+// UTF-8 text is scored by how many characters each charmap's reverse converter
+// can map, and candidates which fall far behind are dropped. The detector can
+// be reused for many files.
+//
+// Charmaps with the same structure can only be told apart by the characters
+// they contain. When candidates have the same score, the preferred charmap
+// wins, then the charmap with the fewest letters, and then the charmap with
+// the lowest number.
+struct CharmapDetector {
+	int prefer;
+	int count;
+	struct DetectCandidate candidates[kDetectMaxCandidates];
+
+	// Per-file state.
+	Boolean done;
+	Boolean utf8;
+	UInt8 last;
+	UInt8 npartial;
+	UInt8 partial[4];
+	Size sampled;
+	Size high;
+	Size histogram[256];
+	UInt8 scratch[kDetectScratchSize];
+	UInt8 join[kDetectCarrySize * 2];
+};
+
+// Initialize a detector with all built-in charmaps that have conversion data.
+// The preferred charmap wins ties, or -1 for no preference. Uses the shared
+// converter cache.
+ErrorCode DetectorInit(struct CharmapDetector *d, int prefer);
+
+// Free the memory used by a detector.
+void DetectorDispose(struct CharmapDetector *d);
+
+// Start examining a new file.
+void DetectorReset(struct CharmapDetector *d);
+
+// Examine the next part of the file. Return true if the detector has seen
+// enough text, and the rest of the file can be skipped.
+Boolean DetectorFeed(struct CharmapDetector *d, const UInt8 *ptr,
+                     const UInt8 *end);
+
+// Get the recommendation for the text examined so far.
+struct DetectResult DetectorResult(struct CharmapDetector *d);
+
+// Examine a complete file in memory, and return the recommendation. Large files
+// are sampled in pieces spread across the file, instead of reading only the
+// start.
+struct DetectResult DetectorSample(struct CharmapDetector *d, const UInt8 *ptr,
+                                   Size size);
+
+#endif
@@ -0,0 +1,256 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "convert/detect.h"
+
+#include "convert/convert.h"
+#include "convert/data.h"
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	kBufferSize = 256 * 1024,
+};
+
+static UInt8 gText[kBufferSize];
+static UInt8 gLegacy[kBufferSize];
+
+struct DetectCase {
+	const char *charmap;
+	// Sample text, in UTF-8.
+	const char *text;
+};
+
+static const struct DetectCase kCases[] = {
+	{"Roman",
+	 "Le c\xc5\x93ur a ses raisons que la raison ne conna\xc3\xaet point. "
+	 "O\xc3\xb9 est la biblioth\xc3\xa8que? \xc3\x87" "a co\xc3\xbbte tr\xc3\xa8s "
+	 "cher, m\xc3\xaame en \xc3\xa9t\xc3\xa9. "},
+	{"Cyrillic",
+	 "\xd0\xa1\xd1\x8a\xd0\xb5\xd1\x88\xd1\x8c \xd0\xb6\xd0\xb5 \xd0\xb5\xd1\x89"
+	 "\xd1\x91 \xd1\x8d\xd1\x82\xd0\xb8\xd1\x85 \xd0\xbc\xd1\x8f\xd0\xb3\xd0\xba"
+	 "\xd0\xb8\xd1\x85 \xd1\x84\xd1\x80\xd0\xb0\xd0\xbd\xd1\x86\xd1\x83\xd0\xb7"
+	 "\xd1\x81\xd0\xba\xd0\xb8\xd1\x85 \xd0\xb1\xd1\x83\xd0\xbb\xd0\xbe\xd0\xba, "
+	 "\xd0\xb4\xd0\xb0 \xd0\xb2\xd1\x8b\xd0\xbf\xd0\xb5\xd0\xb9 \xd1\x87\xd0\xb0"
+	 "\xd1\x8e. "},
+	{"Greek",
+	 "\xce\x9e\xce\xb5\xcf\x83\xce\xba\xce\xb5\xcf\x80\xce\xac\xce\xb6\xcf\x89 "
+	 "\xcf\x84\xce\xb7\xce\xbd \xcf\x88\xcf\x85\xcf\x87\xce\xbf\xcf\x86\xce\xb8"
+	 "\xcf\x8c\xcf\x81\xce\xb1 \xce\xb2\xce\xb4\xce\xb5\xce\xbb\xcf\x85\xce\xb3"
+	 "\xce\xbc\xce\xaf\xce\xb1. "},
+	{"Hebrew",
+	 "\xd7\x93\xd7\x92 \xd7\xa1\xd7\xa7\xd7\xa8\xd7\x9f \xd7\xa9\xd7\x98 \xd7\x91"
+	 "\xd7\x99\xd7\x9d \xd7\x9e\xd7\x90\xd7\x95\xd7\x9b\xd7\x96\xd7\x91 \xd7\x95"
+	 "\xd7\x9c\xd7\xa4\xd7\xaa\xd7\xa2 \xd7\x9e\xd7\xa6\xd7\x90 \xd7\x97\xd7\x91"
+	 "\xd7\xa8\xd7\x94. "},
+	{"Japanese",
+	 "\xe3\x81\x84\xe3\x82\x8d\xe3\x81\xaf\xe3\x81\xab\xe3\x81\xbb\xe3\x81\xb8"
+	 "\xe3\x81\xa8 \xe3\x81\xa1\xe3\x82\x8a\xe3\x81\xac\xe3\x82\x8b\xe3\x82\x92 "
+	 "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe6\x96\x87\xe7\xab\xa0"
+	 "\xe3\x82\x92\xe5\x88\xa4\xe5\xae\x9a\xe3\x81\x97\xe3\x81\xbe\xe3\x81\x99"
+	 "\xe3\x80\x82"},
+};
+
+// Find a charmap by name.
+static int FindCharmap(const char *name)
+{
+	const char *id;
+	int i;
+
+	for (i = 0;; i++) {
+		id = CharmapID(i);
+		if (id == NULL) {
+			Failf("no charmap: %s", name);
+			return -1;
+		}
+		if (strcmp(id, name) == 0) {
+			return i;
+		}
+	}
+}
+
+// Fill the buffer with copies of the text, with CR line breaks. Return the
+// total length.
+static Size RepeatText(UInt8 *buf, const char *text, Size size)
+{
+	Size len, pos;
+
+	len = strlen(text);
+	pos = 0;
+	while (pos + len + 1 <= size) {
+		memcpy(buf + pos, text, len);
+		pos += len;
+		buf[pos++] = kCharCR;
+	}
+	return pos;
+}
+
+// Convert UTF-8 text to the given charmap. Return the length of the output.
+static Size ToLegacy(UInt8 *obuf, int cmap, const UInt8 *ibuf, Size isize)
+{
+	struct Converter c;
+	struct ConverterState st;
+	const UInt8 *iptr;
+	UInt8 *optr;
+	int err;
+
+	err = ConverterBuildCharmap(&c, cmap, kFromUTF8);
+	if (err != 0) {
+		Failf("ConverterBuildCharmap: %s", ErrorDescriptionOrDie(err));
+		return 0;
+	}
+	MemClear(&st, sizeof(st));
+	iptr = ibuf;
+	optr = obuf;
+	c.run(ConverterData(&c), kLineBreakKeep, &st, &optr, obuf + kBufferSize,
+	      &iptr, ibuf + isize);
+	ConverterDispose(&c);
+	return optr - obuf;
+}
+
+static void CheckResult(struct DetectResult r, DetectEncoding encoding,
+                        int cmap)
+{
+	if (r.encoding != encoding || r.cmap != cmap) {
+		Failf("got encoding %d charmap %s, expect encoding %d charmap %s",
+		      r.encoding, r.cmap < 0 ? "none" : CharmapID(r.cmap), encoding,
+		      CharmapID(cmap));
+	}
+}
+
+static void TestDetect(struct CharmapDetector *d)
+{
+	const struct DetectCase *c;
+	Size len, llen, pos, n;
+	int i, cmap;
+
+	for (i = 0; i < (int)ARRAY_COUNT(kCases); i++) {
+		c = &kCases[i];
+		cmap = FindCharmap(c->charmap);
+		if (cmap < 0) {
+			continue;
+		}
+		len = RepeatText(gText, c->text, 4096);
+
+		SetTestNamef("%s UTF-8", c->charmap);
+		CheckResult(DetectorSample(d, gText, len), kDetectUTF8, cmap);
+
+		SetTestNamef("%s legacy", c->charmap);
+		llen = ToLegacy(gLegacy, cmap, gText, len);
+		CheckResult(DetectorSample(d, gLegacy, llen), kDetectLegacy, cmap);
+
+		// Feed the text in small pieces, which splits characters.
+		SetTestNamef("%s UTF-8 pieces", c->charmap);
+		DetectorReset(d);
+		for (pos = 0; pos < len; pos += n) {
+			n = 1 + pos % 7;
+			if (n > len - pos) {
+				n = len - pos;
+			}
+			DetectorFeed(d, gText + pos, gText + pos + n);
+		}
+		CheckResult(DetectorResult(d), kDetectUTF8, cmap);
+
+		SetTestNamef("%s legacy pieces", c->charmap);
+		DetectorReset(d);
+		for (pos = 0; pos < llen; pos += n) {
+			n = 1 + pos % 7;
+			if (n > llen - pos) {
+				n = llen - pos;
+			}
+			DetectorFeed(d, gLegacy + pos, gLegacy + pos + n);
+		}
+		CheckResult(DetectorResult(d), kDetectLegacy, cmap);
+	}
+}
+
+static void TestASCII(struct CharmapDetector *d)
+{
+	static const char kText[] = "Plain ASCII text.";
+
+	SetTestName("ASCII");
+	CheckResult(DetectorSample(d, (const UInt8 *)kText, sizeof(kText) - 1),
+	            kDetectASCII, d->prefer);
+}
+
+// Test that the preferred charmap wins a tie.
+static void TestPrefer(void)
+{
+	static const char kText[] = "caf\xc3\xa9";
+	struct CharmapDetector *d;
+	int cmap, err;
+
+	SetTestName("prefer");
+	cmap = FindCharmap("Turkish");
+	if (cmap < 0) {
+		return;
+	}
+	d = malloc(sizeof(*d));
+	if (d == NULL) {
+		Failf("out of memory");
+		return;
+	}
+	err = DetectorInit(d, cmap);
+	if (err != 0) {
+		Failf("DetectorInit: %s", ErrorDescriptionOrDie(err));
+	} else {
+		CheckResult(DetectorSample(d, (const UInt8 *)kText, sizeof(kText) - 1),
+		            kDetectUTF8, cmap);
+		DetectorDispose(d);
+	}
+	free(d);
+}
+
+// Test that large files are sampled, and that invalid UTF-8 near the end is
+// found.
+static void TestSample(struct CharmapDetector *d)
+{
+	Size len, pos;
+	int cmap;
+
+	SetTestName("sample");
+	cmap = FindCharmap("Cyrillic");
+	if (cmap < 0) {
+		return;
+	}
+	len = RepeatText(gText, kCases[1].text, kBufferSize);
+	CheckResult(DetectorSample(d, gText, len), kDetectUTF8, cmap);
+	if (d->sampled > kDetectMaxSample) {
+		Failf("sampled %ld bytes", (long)d->sampled);
+	}
+	for (pos = len - len / 8; pos < len; pos += 256) {
+		gText[pos] = 0xff;
+	}
+	DetectorSample(d, gText, len);
+	if (d->utf8) {
+		Failf("invalid UTF-8 not found");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct CharmapDetector *d;
+	int err;
+
+	(void)argc;
+	(void)argv;
+
+	d = malloc(sizeof(*d));
+	if (d == NULL) {
+		Fatalf("out of memory");
+	}
+	err = DetectorInit(d, FindCharmap("Roman"));
+	if (err != 0) {
+		Fatalf("DetectorInit: %s", ErrorDescriptionOrDie(err));
+	}
+	TestDetect(d);
+	TestASCII(d);
+	TestSample(d);
+	DetectorDispose(d);
+	free(d);
+	TestPrefer();
+	return TestsDone();
+}
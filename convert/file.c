@@ -0,0 +1,341 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// file.c - conversion of files using memory mapping.
+#define _POSIX_C_SOURCE 200809L
+
+#include "convert/file.h"
+
+#include "convert/stream.h"
+#include "lib/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Destination for converted data: a memory mapped file.
+struct Output {
+	UInt8 *buf;
+	// Amount of data in the buffer and size of the buffer.
+	Size pos;
+	Size size;
+};
+
+ErrorCode StreamReadFile(void *ctx, UInt8 *buf, Size size, Size *count)
+{
+	struct StreamFile *f = ctx;
+	ssize_t n;
+
+	for (;;) {
+		n = read(f->fd, buf, size);
+		if (n >= 0) {
+			break;
+		}
+		if (errno != EINTR) {
+			*count = 0;
+			return kErrorSystem;
+		}
+	}
+	f->size += n;
+	*count = n;
+	return 0;
+}
+
+ErrorCode StreamWriteFile(void *ctx, const UInt8 *buf, Size size)
+{
+	struct StreamFile *f = ctx;
+	Size rem;
+	ssize_t n;
+
+	rem = size;
+	while (rem > 0) {
+		n = write(f->fd, buf, rem);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return kErrorSystem;
+		}
+		buf += n;
+		rem -= n;
+		f->size += n;
+	}
+	return 0;
+}
+
+// Get the buffer to write output to. Mapped output has exactly the right size,
+// so near the end the converter writes into a small spare buffer instead.
+static UInt8 *OutputBuffer(struct Output *out, UInt8 *spare, UInt8 **oend)
+{
+	if (out->size - out->pos >= kStreamMinOutputRoom) {
+		*oend = out->buf + out->size;
+		return out->buf + out->pos;
+	}
+	*oend = spare + kStreamMinOutputRoom;
+	return spare;
+}
+
+// Add the output written to the buffer from OutputBuffer, copying it into
+// place if it was written to the spare buffer.
+static ErrorCode CommitOutput(struct Output *out, const UInt8 *spare,
+                              const UInt8 *obuf, Size n)
+{
+	if (obuf == spare) {
+		if (n > out->size - out->pos) {
+			// Output does not match the count.
+			return kErrorBadData;
+		}
+		memcpy(out->buf + out->pos, spare, n);
+	}
+	out->pos += n;
+	return 0;
+}
+
+// Run the converter until it stops making progress.
+static ErrorCode RunOutput(const struct Converter *c, LineBreakConversion lc,
+                           struct ConverterState *st, struct Output *out,
+                           const UInt8 **iptr, const UInt8 *iend)
+{
+	UInt8 spare[kStreamMinOutputRoom];
+	const UInt8 *ipos, *istart;
+	UInt8 *obuf, *oend, *optr;
+	ErrorCode err;
+
+	ipos = *iptr;
+	for (;;) {
+		obuf = OutputBuffer(out, spare, &oend);
+		istart = ipos;
+		optr = obuf;
+		ConverterRun(c, lc, st, &optr, oend, &ipos, iend);
+		err = CommitOutput(out, spare, obuf, optr - obuf);
+		if (err != 0) {
+			return err;
+		}
+		if (st->unmapped != 0) {
+			return kErrorUnmappable;
+		}
+		if (ipos == iend || (ipos == istart && optr == obuf)) {
+			break;
+		}
+	}
+	*iptr = ipos;
+	return 0;
+}
+
+// Flush the converter with the incomplete data at the end of the input.
+static ErrorCode RunTail(const struct Converter *c, LineBreakConversion lc,
+                         struct ConverterState *st, struct Output *out,
+                         const UInt8 *ptr, const UInt8 *end)
+{
+	UInt8 spare[kStreamMinOutputRoom];
+	UInt8 *obuf, *oend, *optr;
+	ErrorCode err, cerr;
+
+	obuf = OutputBuffer(out, spare, &oend);
+	optr = obuf;
+	err = ConverterFlush(c, lc, st, &optr, oend, ptr, end);
+	cerr = CommitOutput(out, spare, obuf, optr - obuf);
+	return err != 0 ? err : cerr;
+}
+
+// Count the output from converting the input, including the tail. Return -1 if
+// the converter can't count.
+static Size CountOutput(const struct Converter *c, LineBreakConversion lc,
+                        const UInt8 *ptr, const UInt8 *end)
+{
+	struct ConverterState st;
+	UInt8 spare[kStreamMinOutputRoom];
+	UInt8 *optr;
+	Size count;
+
+	MemClear(&st, sizeof(st));
+	count = ConverterCount(c, lc, &st, &ptr, end);
+	if (count < 0) {
+		return -1;
+	}
+	// The tail is short, so it is converted rather than counted.
+	optr = spare;
+	if (ConverterFlush(c, lc, &st, &optr, spare + sizeof(spare), ptr, end) !=
+	    0) {
+		return -1;
+	}
+	return count + (optr - spare);
+}
+
+// Convert mapped input into the output.
+static ErrorCode ConvertBuffer(const struct Converter *c,
+                               LineBreakConversion lc,
+                               struct ConverterState *st, struct Output *out,
+                               const UInt8 *ptr, const UInt8 *end)
+{
+	ErrorCode err;
+
+	err = RunOutput(c, lc, st, out, &ptr, end);
+	if (err != 0) {
+		return err;
+	}
+	return RunTail(c, lc, st, out, ptr, end);
+}
+
+// Convert mapped input into a mapped output file. Return kErrorOK without
+// converting anything if the output can't be mapped. On error, the output file
+// is truncated to zero length.
+static ErrorCode ConvertMapped(const struct Converter *c,
+                               LineBreakConversion lc, int outfd,
+                               const UInt8 *ptr, const UInt8 *end,
+                               struct ConverterState *cst,
+                               struct ConvertFileStats *stats)
+{
+	struct Output out;
+	struct stat st;
+	Size count, size;
+	void *map;
+	int flags, saved;
+	ErrorCode err;
+
+	if (fstat(outfd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return 0;
+	}
+	flags = fcntl(outfd, F_GETFL);
+	if (flags == -1 || (flags & O_ACCMODE) != O_RDWR) {
+		return 0;
+	}
+	count = CountOutput(c, lc, ptr, end);
+	if (count < 0) {
+		return 0;
+	}
+
+	// The file is mapped with extra space for the NUL used to flush the
+	// converter, and truncated afterwards.
+	size = count + c->unitsize;
+	if (ftruncate(outfd, size) != 0) {
+		return 0;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, outfd, 0);
+	if (map == MAP_FAILED) {
+		if (ftruncate(outfd, 0) != 0) {
+			return kErrorSystem;
+		}
+		return 0;
+	}
+	out.buf = map;
+	out.pos = 0;
+	out.size = size;
+	err = ConvertBuffer(c, lc, cst, &out, ptr, end);
+	if (err == 0 && out.pos != count) {
+		err = kErrorBadData;
+	}
+	if (munmap(map, size) != 0 && err == 0) {
+		err = kErrorSystem;
+	}
+	if (err == 0 && ftruncate(outfd, count) != 0) {
+		err = kErrorSystem;
+	}
+	if (err != 0) {
+		// Don't leave partial output behind.
+		saved = errno;
+		if (ftruncate(outfd, 0) != 0) {
+			return kErrorSystem;
+		}
+		errno = saved;
+		return err;
+	}
+	stats->outsize = count;
+	stats->outmapped = true;
+	return 0;
+}
+
+int ConvertFile(const struct Converter *c, LineBreakConversion lc, int infd,
+                int outfd, struct ConvertFileStats *stats)
+{
+	struct ConvertFileStats tmp;
+	struct ConvertStats cstats;
+	struct ConverterState cst;
+	struct ConvertStream cs;
+	struct StreamFile in, out;
+	struct stat st;
+	void *map;
+	Size size;
+	double start;
+	int saved;
+	ErrorCode err;
+
+	if (stats == NULL) {
+		stats = &tmp;
+	}
+	MemClear(stats, sizeof(*stats));
+	MemClear(&cstats, sizeof(cstats));
+	MemClear(&cst, sizeof(cst));
+	cst.stats = &cstats;
+	start = TimeNow();
+
+	// Map the input if it is a regular file. Empty files can't be mapped.
+	map = MAP_FAILED;
+	size = 0;
+	if (fstat(infd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		size = st.st_size;
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, infd, 0);
+		if (map != MAP_FAILED) {
+			posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+			stats->insize = size;
+			stats->inmapped = true;
+			err = ConvertMapped(c, lc, outfd, map, (const UInt8 *)map + size,
+			                    &cst, stats);
+			if (err != 0 || stats->outmapped) {
+				goto done;
+			}
+		}
+	}
+
+	// Otherwise, stream the input and output.
+	err = ConvertStreamInit(&cs);
+	if (err != 0) {
+		goto done;
+	}
+	ConvertStreamReset(&cs, c, lc);
+	in.fd = infd;
+	in.size = 0;
+	out.fd = outfd;
+	out.size = 0;
+	cs.read = StreamReadFile;
+	cs.readctx = &in;
+	cs.write = StreamWriteFile;
+	cs.writectx = &out;
+	if (map != MAP_FAILED) {
+		err = ConvertStreamWrite(&cs, map, size);
+		if (err == 0 || err == kErrorUnmappable) {
+			err = ConvertStreamFinish(&cs);
+		}
+	} else {
+		err = ConvertStreamCopy(&cs);
+		stats->insize = in.size;
+	}
+	stats->outsize = out.size;
+	cst.unmapped = cs.state.unmapped;
+	cstats = cs.stats;
+	saved = errno;
+	ConvertStreamDispose(&cs);
+	errno = saved;
+
+done:
+	if (map != MAP_FAILED) {
+		saved = errno;
+		munmap(map, size);
+		errno = saved;
+	}
+	if (err == kErrorUnmappable) {
+		stats->unmapped = cst.unmapped;
+		stats->unmappedoffset = cstats.insize;
+	}
+	stats->substitutions = cstats.substitutions;
+	memcpy(stats->linebreaks, cstats.linebreaks, sizeof(stats->linebreaks));
+	stats->seconds = TimeNow() - start;
+	if (stats->seconds > 0) {
+		stats->rate = (double)stats->insize / stats->seconds;
+	}
+	return err;
+}
@@ -0,0 +1,65 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_FILE_H
+#define CONVERT_FILE_H
+// file.h - conversion of files using memory mapping, not used for classic Mac
+// OS builds.
+#include "convert/convert.h"
+
+// Statistics from converting a file.
+struct ConvertFileStats {
+	// Amount of input and output, in bytes.
+	Size insize;
+	Size outsize;
+	// Number of substitutions and changed line breaks, from the converter's
+	// statistics. See struct ConvertStats.
+	Size substitutions;
+	Size linebreaks[kLineBreakTypeCount];
+	// If a strict converter stopped at a character with no mapping, the code
+	// point of the character and its offset in the input. See
+	// kFromUTF8Strict.
+	UInt32 unmapped;
+	Size unmappedoffset;
+	// Time spent converting, in seconds.
+	double seconds;
+	// Throughput, in input bytes per second.
+	double rate;
+	// True if the input and output were memory mapped.
+	Boolean inmapped;
+	Boolean outmapped;
+};
+
+// Convert the contents of one file descriptor and write the result to another.
+// The input is converted all the way to the end, including any incomplete
+// sequence at the end, starting with a zeroed converter state.
+//
+// If the input is a regular file, it is memory mapped. If the output is also a
+// regular file opened for reading and writing, the size of the output is
+// counted first, the output file is resized, and the output is converted
+// directly into the mapped file, starting at offset zero. Otherwise, the input
+// is read and the output is written in blocks, so pipes and sockets work. The
+// output file should be empty.
+//
+// Returns an error code. If the error code is kErrorSystem, the error is
+// stored in errno. With a strict converter, returns kErrorUnmappable if the
+// input contains a character with no mapping, and the output contains the
+// conversion of the input before that character. The statistics are filled in
+// if stats is not NULL.
+int ConvertFile(const struct Converter *c, LineBreakConversion lc, int infd,
+                int outfd, struct ConvertFileStats *stats);
+
+// A file descriptor used as the input or output of a stream, and the amount of
+// data read from it or written to it.
+struct StreamFile {
+	int fd;
+	Size size;
+};
+
+// Stream read and write functions for file descriptors, which retry after
+// interrupted system calls. The context is a struct StreamFile. If the error
+// code is kErrorSystem, the error is stored in errno. See convert/stream.h.
+ErrorCode StreamReadFile(void *ctx, UInt8 *buf, Size size, Size *count);
+ErrorCode StreamWriteFile(void *ctx, const UInt8 *buf, Size size);
+
+#endif
@@ -0,0 +1,393 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#define _POSIX_C_SOURCE 200809L
+
+#include "convert/file.h"
+
+#include "convert/data.h"
+#include "convert/test.h"
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+	// Size of generated input. Larger than the streaming buffers.
+	kInputSize = 150 * 1024,
+
+	// Size of buffer for output.
+	kOutputSize = kInputSize * 16
+};
+
+// Ways to supply input and output.
+typedef enum {
+	// Regular files, both mapped.
+	kModeMapped,
+	// Regular files, output opened write-only so it can't be mapped.
+	kModeWriteOnly,
+	// Input from a pipe.
+	kModePipeIn,
+	// Output to a pipe.
+	kModePipeOut,
+} FileMode;
+
+static const char *const kModeName[] = {"mapped", "write-only", "pipe-in",
+                                        "pipe-out"};
+
+static char gInputPath[256];
+static char gOutputPath[256];
+
+struct PipeData {
+	int fd;
+	UInt8 *buf;
+	Size size;
+};
+
+// Write data to a pipe and close it.
+static void *PipeWriter(void *arg)
+{
+	struct PipeData *p = arg;
+	Size pos;
+	ssize_t n;
+
+	for (pos = 0; pos < p->size; pos += n) {
+		n = write(p->fd, p->buf + pos, p->size - pos);
+		if (n < 0) {
+			Fatalf("write: %s", strerror(errno));
+		}
+	}
+	close(p->fd);
+	return NULL;
+}
+
+// Read data from a pipe until it is closed, storing the amount read.
+static void *PipeReader(void *arg)
+{
+	struct PipeData *p = arg;
+	ssize_t n;
+
+	p->size = 0;
+	for (;;) {
+		n = read(p->fd, p->buf + p->size, kOutputSize - p->size);
+		if (n < 0) {
+			Fatalf("read: %s", strerror(errno));
+		}
+		if (n == 0) {
+			break;
+		}
+		p->size += n;
+	}
+	close(p->fd);
+	return NULL;
+}
+
+static void WriteFile(const char *path, const UInt8 *buf, Size size)
+{
+	FILE *fp;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		Fatalf("%s: %s", path, strerror(errno));
+	}
+	if (size > 0 && fwrite(buf, size, 1, fp) != 1) {
+		Fatalf("%s: write failed", path);
+	}
+	if (fclose(fp) != 0) {
+		Fatalf("%s: %s", path, strerror(errno));
+	}
+}
+
+static Size ReadFile(const char *path, UInt8 *buf)
+{
+	FILE *fp;
+	Size size;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		Fatalf("%s: %s", path, strerror(errno));
+	}
+	size = fread(buf, 1, kOutputSize, fp);
+	fclose(fp);
+	return size;
+}
+
+// Convert a file using the given mode, and return the size of the output,
+// which is stored in obuf.
+static Size RunMode(const struct Converter *c, LineBreakConversion lc,
+                    FileMode mode, UInt8 *obuf, UInt8 *ibuf, Size isize)
+{
+	struct ConvertFileStats stats;
+	struct PipeData pd;
+	pthread_t thread;
+	int fds[2], infd, outfd, flags;
+	Boolean expectmapped;
+	Size size;
+	ErrorCode err;
+
+	WriteFile(gInputPath, ibuf, isize);
+	flags = mode == kModeWriteOnly ? O_WRONLY : O_RDWR;
+	infd = -1;
+	outfd = -1;
+	pd.fd = -1;
+	switch (mode) {
+	case kModeMapped:
+	case kModeWriteOnly:
+		infd = open(gInputPath, O_RDONLY);
+		outfd = open(gOutputPath, flags | O_CREAT | O_TRUNC, 0666);
+		break;
+	case kModePipeIn:
+		if (pipe(fds) != 0) {
+			Fatalf("pipe: %s", strerror(errno));
+		}
+		infd = fds[0];
+		pd.fd = fds[1];
+		pd.buf = ibuf;
+		pd.size = isize;
+		outfd = open(gOutputPath, flags | O_CREAT | O_TRUNC, 0666);
+		if (pthread_create(&thread, NULL, PipeWriter, &pd) != 0) {
+			Fatalf("pthread_create failed");
+		}
+		break;
+	case kModePipeOut:
+		if (pipe(fds) != 0) {
+			Fatalf("pipe: %s", strerror(errno));
+		}
+		infd = open(gInputPath, O_RDONLY);
+		outfd = fds[1];
+		pd.fd = fds[0];
+		pd.buf = obuf;
+		if (pthread_create(&thread, NULL, PipeReader, &pd) != 0) {
+			Fatalf("pthread_create failed");
+		}
+		break;
+	}
+	if (infd == -1 || outfd == -1) {
+		Fatalf("open: %s", strerror(errno));
+	}
+
+	err = ConvertFile(c, lc, infd, outfd, &stats);
+	close(infd);
+	close(outfd);
+	if (pd.fd != -1) {
+		pthread_join(thread, NULL);
+	}
+	if (err != 0) {
+		Failf("ConvertFile: %s",
+		      err == kErrorSystem ? strerror(errno) :
+		                            ErrorDescriptionOrDie(err));
+		return -1;
+	}
+
+	if (mode == kModePipeOut) {
+		size = pd.size;
+	} else {
+		size = ReadFile(gOutputPath, obuf);
+	}
+	if (stats.insize != isize) {
+		Failf("insize = %ld, expect %ld", (long)stats.insize, (long)isize);
+	}
+	if (stats.outsize != size) {
+		Failf("outsize = %ld, expect %ld", (long)stats.outsize, (long)size);
+	}
+	expectmapped = mode == kModeMapped && isize > 0;
+	if (stats.outmapped != expectmapped) {
+		Failf("outmapped = %d, expect %d", stats.outmapped, expectmapped);
+	}
+	if (stats.inmapped != (mode != kModePipeIn && isize > 0)) {
+		Failf("inmapped = %d", stats.inmapped);
+	}
+	return size;
+}
+
+// Test that file conversion gives the same result as converting the input in
+// memory.
+static void TestFile(const char *name, const char *direction,
+                     const struct Converter *c, UInt8 *ibuf, Size isize,
+                     UInt8 **buf)
+{
+	static const LineBreakConversion kLineBreaks[] = {kLineBreakKeep,
+	                                                  kLineBreakCRLF};
+	static const Size kSizes[] = {0, 1, 5000};
+	Size rsize, fsize, size;
+	int mode, i, j;
+
+	for (i = 0; i < (int)ARRAY_COUNT(kLineBreaks); i++) {
+		for (j = 0; j <= (int)ARRAY_COUNT(kSizes); j++) {
+			size = j < (int)ARRAY_COUNT(kSizes) ? kSizes[j] : isize;
+			rsize = ConvertReference(c, kLineBreaks[i], buf[0], kOutputSize,
+			                         ibuf, size);
+			for (mode = 0; mode < (int)ARRAY_COUNT(kModeName); mode++) {
+				SetTestNamef("%s %s lc=%d size=%ld %s", name, direction,
+				             kLineBreaks[i], (long)size, kModeName[mode]);
+				fsize = RunMode(c, kLineBreaks[i], mode, buf[1], ibuf, size);
+				if (fsize < 0) {
+					continue;
+				}
+				if (fsize != rsize) {
+					Failf("output size %ld, expect %ld", (long)fsize,
+					      (long)rsize);
+				} else if (memcmp(buf[0], buf[1], rsize) != 0) {
+					Failf("output does not match");
+				}
+			}
+		}
+	}
+}
+
+// Test that a strict converter stops at the incomplete sequence at the end of
+// the input, which is otherwise valid, and that the output before it matches.
+static void TestStrict(const char *name, const struct Converter *c,
+                       UInt8 *ibuf, Size isize, UInt8 **buf, Size expectsize)
+{
+	static const int kFlags[2] = {O_RDWR, O_WRONLY};
+	struct ConvertFileStats stats;
+	int i, infd, outfd;
+	Size size;
+	ErrorCode err;
+
+	WriteFile(gInputPath, ibuf, isize);
+	for (i = 0; i < 2; i++) {
+		SetTestNamef("%s strict %s", name, kModeName[i]);
+		infd = open(gInputPath, O_RDONLY);
+		outfd = open(gOutputPath, kFlags[i] | O_CREAT | O_TRUNC, 0666);
+		if (infd == -1 || outfd == -1) {
+			Fatalf("open: %s", strerror(errno));
+		}
+		err = ConvertFile(c, kLineBreakKeep, infd, outfd, &stats);
+		close(infd);
+		close(outfd);
+		if (err != kErrorUnmappable) {
+			Failf("ConvertFile: got %s, expect %s",
+			      err == kErrorSystem ? strerror(errno) :
+			                            ErrorDescriptionOrDie(err),
+			      ErrorDescriptionOrDie(kErrorUnmappable));
+			continue;
+		}
+		if (stats.unmapped != kCharInvalid) {
+			Failf("unmapped = U+%04lX, expect invalid",
+			      (unsigned long)stats.unmapped);
+		}
+		if (stats.unmappedoffset != isize - 1) {
+			Failf("unmappedoffset = %ld, expect %ld",
+			      (long)stats.unmappedoffset, (long)(isize - 1));
+		}
+		size = ReadFile(gOutputPath, buf[1]);
+		if (size != expectsize) {
+			Failf("output size %ld, expect %ld", (long)size,
+			      (long)expectsize);
+		} else if (memcmp(buf[0], buf[1], size) != 0) {
+			Failf("output does not match");
+		}
+	}
+}
+
+static void TestCharmap(const char *name, struct CharmapData data, UInt8 **buf)
+{
+	struct TestConverters c;
+	struct Converter cs;
+	Ptr datap;
+	Size size;
+	ErrorCode err;
+
+	SetTestName(name);
+	if (!BuildTestConverters(&c, data, kToUTF16LE)) {
+		return;
+	}
+
+	// Reverse conversion input is the forward conversion output, ending with
+	// an incomplete sequence.
+	MakeText(buf[2], kInputSize);
+	TestFile(name, "forward", &c.forward, buf[2], kInputSize, buf);
+	TestFile(name, "utf16", &c.wide, buf[2], kInputSize, buf);
+	size = ConvertReference(&c.forward, kLineBreakKeep, buf[3], kOutputSize,
+	                        buf[2], kInputSize);
+	if (size > kInputSize * 2) {
+		size = kInputSize * 2;
+	}
+	buf[3][size++] = 0xe3;
+	TestFile(name, "reverse", &c.reverse, buf[3], size, buf);
+
+	// Only text which is converted for line breaks has no unmappable
+	// characters.
+	if (data.ptr[0] != kTableLineBreak) {
+		datap = (Ptr)data.ptr;
+		err = ConverterBuild(&cs, &datap, data.size, kFromUTF8Strict);
+		if (err != 0) {
+			Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		} else {
+			TestStrict(name, &cs, buf[3], size, buf,
+			           ConvertReference(&c.reverse, kLineBreakKeep, buf[0],
+			                            kOutputSize, buf[3], size - 1));
+			ConverterDispose(&cs);
+		}
+	}
+
+	DisposeTestConverters(&c);
+}
+
+// Set the paths of the temporary files.
+static void SetPaths(void)
+{
+	const char *dir;
+
+	dir = getenv("TEST_TMPDIR");
+	if (dir == NULL) {
+		dir = "/tmp";
+	}
+	snprintf(gInputPath, sizeof(gInputPath), "%s/file_test_in.%ld", dir,
+	         (long)getpid());
+	snprintf(gOutputPath, sizeof(gOutputPath), "%s/file_test_out.%ld", dir,
+	         (long)getpid());
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const kCharmaps[] = {"Roman", "Greek", "Japanese",
+	                                        "Korean"};
+	struct CharmapData data;
+	const char *name;
+	UInt8 *buf[4];
+	int i, j;
+
+	(void)argc;
+	(void)argv;
+
+	SetPaths();
+	for (i = 0; i < 4; i++) {
+		buf[i] = malloc(kOutputSize);
+		if (buf[i] == NULL) {
+			Fatalf("malloc failed");
+		}
+	}
+
+	TestCharmap("LineBreak", TestLineBreakData(), buf);
+	for (i = 0;; i++) {
+		name = CharmapID(i);
+		if (name == NULL) {
+			break;
+		}
+		for (j = 0; j < (int)ARRAY_COUNT(kCharmaps); j++) {
+			if (strcmp(name, kCharmaps[j]) == 0) {
+				break;
+			}
+		}
+		data = CharmapData(i);
+		if (j < (int)ARRAY_COUNT(kCharmaps) && data.ptr != NULL) {
+			TestCharmap(name, data, buf);
+		}
+	}
+
+	unlink(gInputPath);
+	unlink(gOutputPath);
+	for (i = 0; i < 4; i++) {
+		free(buf[i]);
+	}
+	return TestsDone();
+}
@@ -0,0 +1,517 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// normalize.c - Unicode normalization of text before conversion from UTF-8.
+#include "convert/normalize.h"
+
+#include "convert/normalize_data.h"
+#include "convert/scan.h"
+#include "lib/defs.h"
+#include "lib/utf8.h"
+
+#include <string.h>
+
+/*
+	The reverse converters only recognize the forms of each character which
+	are stored in their tables. The extended ASCII and bidirectional tables
+	contain both NFC and NFD forms, but the other tables only contain one
+	form, and no table contains every possible ordering of combining marks. So
+	text is normalized to NFC before it is converted.
+
+	Starters which NFC would replace, like U+212B ANGSTROM SIGN or the CJK
+	compatibility ideographs, are left unchanged. Conversion tables map these
+	to different bytes than the characters they decompose to, so replacing them
+	would break round trips.
+
+	Most text is already normalized, so the normalizer is only used for the
+	parts of the text which need it. Each code point has two flags: "slow" code
+	points may change when normalized, or may combine with the code point
+	before them, and "hold" code points may combine with the code point after
+	them. Text which contains no slow code points is already normalized, and
+	can be split before any code point which is not slow.
+
+	The normalizer collects a segment of code points, starting with a code
+	point which is not slow, followed by any number of slow code points. Each
+	segment is normalized separately, using the algorithm in UAX #15.
+*/
+
+enum {
+	// Maximum number of code points after decomposing a segment.
+	kMaxDecomposed = kNormalizeSegmentLength * kNormalizeMaxDecomposition,
+
+	// Maximum amount of normalized text which the converter can leave
+	// unconverted when there is room in the output.
+	kMaxPending = kNormalizeBufferSize - kNormalizeMaxOutput,
+
+	// Output space needed to convert a full buffer of normalized text.
+	// Converters from UTF-8 produce at most two bytes for each byte of input.
+	kMinOutputForEnd = kNormalizeBufferSize * 2 + 16,
+
+	// Amount of normalized input to copy after the normalized text in the
+	// buffer, so the converter can finish a sequence.
+	kCopyLength = 64,
+
+	// Hangul syllables, decomposed and composed algorithmically.
+	kHangulSBase = 0xac00,
+	kHangulLBase = 0x1100,
+	kHangulVBase = 0x1161,
+	kHangulTBase = 0x11a7,
+	kHangulLCount = 19,
+	kHangulVCount = 21,
+	kHangulTCount = 28,
+	kHangulNCount = kHangulVCount * kHangulTCount,
+	kHangulSCount = kHangulLCount * kHangulNCount
+};
+
+// Return the normalization flags for a code point.
+static unsigned GetFlags(UInt32 c)
+{
+	const UInt8 *block;
+
+	block = kNormalizeFlags[kNormalizeBlocks[c >> 8]];
+	return (block[(c & 255) >> 2] >> ((c & 3) * 2)) & 3;
+}
+
+// Return the canonical combining class of a code point.
+static unsigned GetCombiningClass(UInt32 c)
+{
+	int lo, hi, mid;
+	UInt32 x;
+
+	lo = 0;
+	hi = kNormalizeCombiningCount;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		x = kNormalizeCombining[mid] >> 8;
+		if (x == c) {
+			return kNormalizeCombining[mid] & 255;
+		}
+		if (x < c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return 0;
+}
+
+// Write the full canonical decomposition of a code point, and return its
+// length.
+static int Decompose(UInt32 *out, UInt32 c)
+{
+	int lo, hi, mid, n;
+	UInt32 s, x;
+	const UInt32 *dptr;
+
+	s = c - kHangulSBase;
+	if (s < kHangulSCount) {
+		out[0] = kHangulLBase + s / kHangulNCount;
+		out[1] = kHangulVBase + (s % kHangulNCount) / kHangulTCount;
+		if (s % kHangulTCount == 0) {
+			return 2;
+		}
+		out[2] = kHangulTBase + s % kHangulTCount;
+		return 3;
+	}
+	lo = 0;
+	hi = kNormalizeDecompositionCount;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		x = kNormalizeDecompositionChars[mid];
+		if (x == c) {
+			dptr = kNormalizeDecompositionData +
+			       kNormalizeDecompositionIndex[mid];
+			n = kNormalizeDecompositionIndex[mid + 1] -
+			    kNormalizeDecompositionIndex[mid];
+			memcpy(out, dptr, n * sizeof(UInt32));
+			return n;
+		}
+		if (x < c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	out[0] = c;
+	return 1;
+}
+
+// Return the primary composite of two code points, or zero if they do not
+// compose.
+static UInt32 Compose(UInt32 a, UInt32 b)
+{
+	int lo, hi, mid;
+	const struct NormalizePair *p;
+	UInt32 l, v, t;
+
+	l = a - kHangulLBase;
+	v = b - kHangulVBase;
+	if (l < kHangulLCount && v < kHangulVCount) {
+		return kHangulSBase + (l * kHangulVCount + v) * kHangulTCount;
+	}
+	l = a - kHangulSBase;
+	t = b - kHangulTBase;
+	if (l < kHangulSCount && l % kHangulTCount == 0 && t != 0 &&
+	    t < kHangulTCount) {
+		return a + t;
+	}
+	lo = 0;
+	hi = kNormalizeCompositionCount;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		p = &kNormalizeComposition[mid];
+		if (p->first == a && p->second == b) {
+			return p->composite;
+		}
+		if (p->first < a || (p->first == a && p->second < b)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return 0;
+}
+
+static UInt8 *EncodeUTF8(UInt8 *ptr, UInt32 c)
+{
+	if (c < 0x80) {
+		ptr[0] = c;
+		return ptr + 1;
+	} else if (c < 0x800) {
+		ptr[0] = 0xc0 | (c >> 6);
+		ptr[1] = 0x80 | (c & 0x3f);
+		return ptr + 2;
+	} else if (c < 0x10000) {
+		ptr[0] = 0xe0 | (c >> 12);
+		ptr[1] = 0x80 | ((c >> 6) & 0x3f);
+		ptr[2] = 0x80 | (c & 0x3f);
+		return ptr + 3;
+	} else {
+		ptr[0] = 0xf0 | (c >> 18);
+		ptr[1] = 0x80 | ((c >> 12) & 0x3f);
+		ptr[2] = 0x80 | ((c >> 6) & 0x3f);
+		ptr[3] = 0x80 | (c & 0x3f);
+		return ptr + 4;
+	}
+}
+
+// Normalize the segment in the state, write it to the output, and clear it.
+// The output must have room for kNormalizeSegmentLength * 16 bytes.
+static UInt8 *FlushSegment(struct NormalizeState *state, UInt8 *opos)
+{
+	UInt32 chars[kMaxDecomposed], c, starter, composite;
+	UInt8 classes[kMaxDecomposed], cls, lastcls;
+	int i, j, n, spos, cpos;
+
+	// Decompose, and put combining marks in canonical order.
+	n = 0;
+	for (i = 0; i < state->count; i++) {
+		j = n;
+		n += Decompose(chars + n, state->segment[i]);
+		for (; j < n; j++) {
+			c = chars[j];
+			cls = GetCombiningClass(c);
+			for (spos = j; spos > 0 && cls != 0 && classes[spos - 1] > cls;
+			     spos--) {
+				chars[spos] = chars[spos - 1];
+				classes[spos] = classes[spos - 1];
+			}
+			chars[spos] = c;
+			classes[spos] = cls;
+		}
+	}
+	state->count = 0;
+
+	// Compose. A character composes with the last starter if there is no
+	// character between them with the same or higher combining class.
+	if (n > 0) {
+		spos = 0;
+		starter = chars[0];
+		lastcls = classes[0] != 0 ? 255 : 0;
+		cpos = 1;
+		for (i = 1; i < n; i++) {
+			c = chars[i];
+			cls = classes[i];
+			composite = Compose(starter, c);
+			if (composite != 0 && (lastcls < cls || lastcls == 0)) {
+				chars[spos] = composite;
+				starter = composite;
+				continue;
+			}
+			if (cls == 0) {
+				spos = cpos;
+				starter = c;
+			}
+			lastcls = cls;
+			chars[cpos++] = c;
+		}
+		n = cpos;
+	}
+
+	for (i = 0; i < n; i++) {
+		opos = EncodeUTF8(opos, chars[i]);
+	}
+	return opos;
+}
+
+Size NormalizeQuickCheck(const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *start = ptr, *last;
+	UInt32 c;
+	int n;
+
+	// The text can be split before the last code point which is not slow,
+	// because the code point before it may combine with it.
+	last = ptr;
+	while (ptr < end) {
+		if (*ptr < 0x80) {
+			// ASCII is never slow.
+			ptr += ScanHighByte(ptr, end);
+			last = ptr - 1;
+			continue;
+		}
+		if (end - ptr >= 3 && 0xc2 <= *ptr && *ptr < 0xf0 && *ptr != 0xe0 &&
+		    *ptr != 0xed) {
+			// Two and three byte sequences which are valid if the trail bytes
+			// are valid. This avoids branching on the length.
+			n = 2 + (*ptr >= 0xe0);
+			if (((ptr[1] & ptr[n - 1]) & 0xc0) == 0x80 &&
+			    ((ptr[1] | ptr[n - 1]) & 0x40) == 0) {
+				c = ((UInt32)ptr[0] << 12) | ((UInt32)(ptr[1] & 0x3f) << 6) |
+				    (ptr[2] & 0x3f);
+				c = n == 2 ? (c >> 6) & 0x7ff : c & 0xffff;
+				if ((GetFlags(c) & kNormalizeSlow) != 0) {
+					break;
+				}
+				last = ptr;
+				ptr += n;
+				continue;
+			}
+		}
+		n = UTF8Decode(ptr, end, &c);
+		if (n == 0) {
+			break;
+		}
+		if (n < 0) {
+			// Invalid bytes are copied unchanged, like characters which are
+			// not slow.
+			last = ptr;
+			ptr++;
+			continue;
+		}
+		if ((GetFlags(c) & kNormalizeSlow) != 0) {
+			break;
+		}
+		last = ptr;
+		ptr += n;
+	}
+	return last - start;
+}
+
+void NormalizeRun(struct NormalizeState *state, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend)
+{
+	UInt8 *opos = *optr;
+	const UInt8 *ipos = *iptr;
+	UInt8 tmp[4];
+	UInt32 c;
+	unsigned flags;
+	int n, m, len;
+
+	while (ipos < iend && oend - opos >= kNormalizeMaxOutput) {
+		if (state->npartial != 0) {
+			// Finish the incomplete sequence from the previous input.
+			n = state->npartial;
+			m = 4 - n;
+			if (m > iend - ipos) {
+				m = iend - ipos;
+			}
+			memcpy(tmp, state->partial, n);
+			memcpy(tmp + n, ipos, m);
+			len = UTF8Decode(tmp, tmp + n + m, &c);
+			if (len == 0) {
+				memcpy(state->partial + n, ipos, m);
+				state->npartial = n + m;
+				ipos += m;
+				continue;
+			}
+			state->npartial = 0;
+			if (len < 0) {
+				// None of the saved bytes can start a valid sequence, so they
+				// are all copied unchanged.
+				if (state->count != 0) {
+					opos = FlushSegment(state, opos);
+				}
+				memcpy(opos, tmp, n);
+				opos += n;
+				continue;
+			}
+			ipos += len - n;
+		} else if (*ipos < 0x80) {
+			// ASCII characters are never slow. All but the last character in
+			// the run can be copied directly.
+			if (state->count != 0) {
+				opos = FlushSegment(state, opos);
+			}
+			n = iend - ipos;
+			if (n > oend - opos) {
+				n = oend - opos;
+			}
+			for (len = 1; len < n && ipos[len] < 0x80; len++) {}
+			memcpy(opos, ipos, len - 1);
+			opos += len - 1;
+			ipos += len;
+			c = ipos[-1];
+		} else {
+			len = UTF8Decode(ipos, iend, &c);
+			if (len == 0) {
+				n = iend - ipos;
+				memcpy(state->partial, ipos, n);
+				state->npartial = n;
+				ipos += n;
+				continue;
+			}
+			if (len < 0) {
+				if (state->count != 0) {
+					opos = FlushSegment(state, opos);
+				}
+				*opos++ = *ipos++;
+				continue;
+			}
+			ipos += len;
+		}
+
+		flags = GetFlags(c);
+		if ((flags & kNormalizeSlow) != 0) {
+			if (state->count >= kNormalizeSegmentLength) {
+				opos = FlushSegment(state, opos);
+			}
+			state->segment[state->count++] = c;
+		} else {
+			if (state->count != 0) {
+				opos = FlushSegment(state, opos);
+			}
+			if ((flags & kNormalizeHold) != 0) {
+				state->segment[0] = c;
+				state->count = 1;
+			} else {
+				opos = EncodeUTF8(opos, c);
+			}
+		}
+	}
+
+	*optr = opos;
+	*iptr = ipos;
+}
+
+void ConvertNormalized(const struct Converter *c, LineBreakConversion lc,
+                       struct NormalizedConverterState *state, UInt8 **optr,
+                       UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	const UInt8 *ipos, *istop, *istart;
+	UInt8 *bpos, *bend;
+	Size n, m;
+
+	bend = state->buf + kNormalizeBufferSize;
+	for (;;) {
+		// Convert the normalized text. The converter may stop before the
+		// end, either because the output is full or because it needs more
+		// input to finish a sequence.
+		if (state->pos < state->end) {
+			ipos = state->buf + state->pos;
+			c->run(ConverterData(c), lc, &state->cvt, optr, oend, &ipos,
+			       state->buf + state->end);
+			state->pos = ipos - state->buf;
+		}
+		if (*iptr >= iend) {
+			return;
+		}
+		n = state->end - state->pos;
+		if (n > kMaxPending) {
+			// Too much is left for an incomplete sequence, so the output is
+			// full.
+			return;
+		}
+		memmove(state->buf, state->buf + state->pos, n);
+		state->pos = 0;
+		state->end = n;
+		istart = *iptr;
+
+		m = 0;
+		if (state->norm.npartial == 0) {
+			m = NormalizeQuickCheck(*iptr, iend);
+		}
+		if (m > 0) {
+			// The input is already normalized, and starts at a boundary, so
+			// the normalizer can be flushed. The prefix never includes the
+			// last character of the input.
+			if (state->norm.count != 0) {
+				bpos = FlushSegment(&state->norm, state->buf + n);
+				n = bpos - state->buf;
+				state->end = n;
+			}
+			if (n != 0) {
+				// The converter may need more text to finish the sequence at
+				// the end of the buffer. Copy some of the input after it, and
+				// if the converter gets past the buffer, continue converting
+				// directly from the input.
+				if (m > kCopyLength) {
+					m = kCopyLength;
+					while ((*iptr)[m] >= 0x80 && (*iptr)[m] < 0xc0) {
+						m--;
+					}
+				}
+				memcpy(state->buf + n, *iptr, m);
+				ipos = state->buf;
+				c->run(ConverterData(c), lc, &state->cvt, optr, oend, &ipos,
+				       state->buf + n + m);
+				if ((Size)(ipos - state->buf) >= n) {
+					*iptr += (ipos - state->buf) - n;
+					state->pos = 0;
+					state->end = 0;
+				} else {
+					*iptr += m;
+					state->pos = ipos - state->buf;
+					state->end = n + m;
+				}
+				continue;
+			}
+
+			// Fast path: convert the input directly.
+			ipos = *iptr;
+			istop = ipos + m;
+			c->run(ConverterData(c), lc, &state->cvt, optr, oend, &ipos, istop);
+			n = istop - ipos;
+			if (n > kMaxPending) {
+				*iptr = ipos;
+				return;
+			}
+			// Keep the rest with the normalized text, so it is converted
+			// together with the text after it.
+			memcpy(state->buf, ipos, n);
+			state->end = n;
+			*iptr = istop;
+		}
+
+		// Normalize as much input as fits in the buffer. The last byte of
+		// input is only consumed if there is room to convert everything in
+		// the buffer, so once the input is consumed, the only text left in
+		// the buffer is an incomplete sequence, which is part of the state.
+		bpos = state->buf + state->end;
+		while (*iptr < iend && bend - bpos >= kNormalizeMaxOutput) {
+			istop = iend;
+			if (oend - *optr < kMinOutputForEnd) {
+				istop = iend - 1;
+				if (*iptr >= istop) {
+					break;
+				}
+			}
+			NormalizeRun(&state->norm, &bpos, bend, iptr, istop);
+		}
+		state->end = bpos - state->buf;
+		if (*iptr == istart) {
+			return;
+		}
+	}
+}
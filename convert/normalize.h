@@ -0,0 +1,66 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_NORMALIZE_H
+#define CONVERT_NORMALIZE_H
+// normalize.h - Unicode normalization of text before conversion from UTF-8.
+#include "convert/convert.h"
+
+enum {
+	// Maximum number of code points held in the normalizer state. Longer
+	// sequences of combining characters are normalized in pieces.
+	kNormalizeSegmentLength = 32,
+
+	// Output space that NormalizeRun needs to make progress.
+	kNormalizeMaxOutput = kNormalizeSegmentLength * 16 + 4,
+
+	// Size of the buffer for normalized text in the converter state.
+	kNormalizeBufferSize = 1024
+};
+
+// The state of the normalizer. Must be zeroed prior to first use.
+struct NormalizeState {
+	// Code points which may still change or combine with the following input.
+	UInt32 segment[kNormalizeSegmentLength];
+	UInt8 count;
+	// Incomplete UTF-8 sequence at the end of the previous input.
+	UInt8 npartial;
+	UInt8 partial[3];
+};
+
+// Return the number of bytes at the start of the buffer which are already
+// normalized and can be converted without normalizing. The normalizer state may
+// continue from the end of this prefix with a zeroed state. Invalid UTF-8 is
+// treated as characters which are left unchanged.
+Size NormalizeQuickCheck(const UInt8 *ptr, const UInt8 *end);
+
+// Normalize UTF-8 text to NFC, except that starters which NFC would replace,
+// like singletons and composition exclusions, are left unchanged. Stops when
+// the input is consumed or there is less than kNormalizeMaxOutput space in the
+// output. Characters which may combine with the following input, and
+// incomplete sequences at the end of the input, are saved in the state.
+// Invalid UTF-8 is copied unchanged. A NUL byte flushes the state.
+void NormalizeRun(struct NormalizeState *state, UInt8 **optr, UInt8 *oend,
+                  const UInt8 **iptr, const UInt8 *iend);
+
+// The state of a converter with normalization. Must be zeroed prior to first
+// conversion.
+struct NormalizedConverterState {
+	struct ConverterState cvt;
+	struct NormalizeState norm;
+	// Normalized text which has not been converted yet, from pos to end.
+	UInt16 pos;
+	UInt16 end;
+	UInt8 buf[kNormalizeBufferSize];
+};
+
+// Normalize text to NFC and convert it from UTF-8 with the given converter.
+// This works like the converter's run function, except that text which is not
+// normalized is first decomposed, reordered, and recomposed, so decomposed
+// text from other systems converts the same way as precomposed text. Text
+// which is already in NFC is passed directly to the converter.
+void ConvertNormalized(const struct Converter *c, LineBreakConversion lc,
+                       struct NormalizedConverterState *state, UInt8 **optr,
+                       UInt8 *oend, const UInt8 **iptr, const UInt8 *iend);
+
+#endif
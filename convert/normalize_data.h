@@ -0,0 +1,58 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_NORMALIZE_DATA_H
+#define CONVERT_NORMALIZE_DATA_H
+// normalize_data.h - Unicode data for normalization, generated by
+// gen/normalize.go.
+
+#include "lib/defs.h"
+
+enum {
+	// Number of 256 code point blocks in Unicode.
+	kNormalizeBlockCount = 0x1100,
+
+	// Maximum length of a canonical decomposition.
+	kNormalizeMaxDecomposition = 4,
+
+	// Flag: the code point may change when normalized, or may combine with the
+	// code point before it.
+	kNormalizeSlow = 1,
+
+	// Flag: the code point may combine with the code point after it.
+	kNormalizeHold = 2
+};
+
+// A canonical composition pair.
+struct NormalizePair {
+	UInt32 first;
+	UInt32 second;
+	UInt32 composite;
+};
+
+// Index into kNormalizeFlags for each block. Block 0 has no flags set.
+extern const UInt8 kNormalizeBlocks[kNormalizeBlockCount];
+
+// Flags for each code point, 2 bits each, starting with the low bits.
+extern const UInt8 kNormalizeFlags[][64];
+
+// Canonical combining class of each code point with a nonzero class, stored as
+// code point << 8 | class, sorted.
+extern const int kNormalizeCombiningCount;
+extern const UInt32 kNormalizeCombining[];
+
+// Full canonical decompositions, except for Hangul syllables. The
+// decomposition of kNormalizeDecompositionChars[i] is stored in
+// kNormalizeDecompositionData, from kNormalizeDecompositionIndex[i] to
+// kNormalizeDecompositionIndex[i+1].
+extern const int kNormalizeDecompositionCount;
+extern const UInt32 kNormalizeDecompositionChars[];
+extern const UInt16 kNormalizeDecompositionIndex[];
+extern const UInt32 kNormalizeDecompositionData[];
+
+// Canonical composition pairs for primary composites, except for Hangul
+// syllables, sorted by first and second code point.
+extern const int kNormalizeCompositionCount;
+extern const struct NormalizePair kNormalizeComposition[];
+
+#endif
@@ -0,0 +1,333 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "convert/normalize.h"
+
+#include "convert/convert.h"
+#include "convert/data.h"
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+enum {
+	kBufferSize = 8 * 1024,
+};
+
+static UInt8 gInput[kBufferSize];
+static UInt8 gExpect[kBufferSize];
+static UInt8 gOutput[kBufferSize];
+
+struct NormalizeCase {
+	const char *input;
+	const char *output;
+};
+
+static const struct NormalizeCase kNormalizeCases[] = {
+	// Already normalized.
+	{"abc", "abc"},
+	{"caf\xc3\xa9", "caf\xc3\xa9"},
+	// Composition.
+	{"e\xcc\x81", "\xc3\xa9"},
+	{"A\xcc\x8a!", "\xc3\x85!"},
+	// Canonical ordering: dot below, then circumflex.
+	{"a\xcc\xa3\xcc\x82", "\xe1\xba\xad"},
+	{"a\xcc\x82\xcc\xa3", "\xe1\xba\xad"},
+	// Blocked: the second acute accent does not compose.
+	{"a\xcc\x81\xcc\x81", "\xc3\xa1\xcc\x81"},
+	// Singletons and composition exclusions are not changed: ANGSTROM SIGN,
+	// a CJK compatibility ideograph, and DEVANAGARI LETTER QA.
+	{"\xe2\x84\xab", "\xe2\x84\xab"},
+	{"\xe2\x84\xab\xcc\x81", "\xe2\x84\xab\xcc\x81"},
+	{"\xef\xa4\x80", "\xef\xa4\x80"},
+	{"\xe0\xa5\x98", "\xe0\xa5\x98"},
+	// Non-starter decomposition.
+	{"a\xcd\x81", "\xc3\xa1"},
+	// Hangul jamo.
+	{"\xe1\x84\x80\xe1\x85\xa1\xe1\x86\xa8", "\xea\xb0\x81"},
+	{"\xea\xb0\x80\xe1\x86\xa8", "\xea\xb0\x81"},
+	// Kana with voiced sound mark.
+	{"\xe3\x81\x8b\xe3\x82\x99", "\xe3\x81\x8c"},
+	// Combining mark at the start of the text.
+	{"\xcc\x81x", "\xcc\x81x"},
+	// Invalid UTF-8 is copied unchanged.
+	{"a\xff\xcc\x81", "a\xff\xcc\x81"},
+	{"e\xe3\x81", "e\xe3\x81"},
+	{"\xe3\x81!", "\xe3\x81!"},
+	{"\xed\xa0\x80", "\xed\xa0\x80"},
+};
+
+// Normalize the input, with the given number of bytes in each call, and a NUL
+// byte at the end to flush the state. Return the length of the output, without
+// the NUL byte.
+static int Normalize(const UInt8 *input, int inlen, int chunk)
+{
+	struct NormalizeState st;
+	const UInt8 *iptr, *iend, *end;
+	UInt8 *optr;
+
+	memcpy(gInput, input, inlen);
+	gInput[inlen] = 0;
+	end = gInput + inlen + 1;
+	MemClear(&st, sizeof(st));
+	iptr = gInput;
+	optr = gOutput;
+	iend = gInput;
+	do {
+		iend += chunk;
+		if (iend > end) {
+			iend = end;
+		}
+		NormalizeRun(&st, &optr, gOutput + kBufferSize, &iptr, iend);
+		if (iptr != iend) {
+			Failf("input not consumed");
+			return -1;
+		}
+	} while (iend < end);
+	if (optr == gOutput || optr[-1] != 0) {
+		Failf("missing NUL at end of output");
+		return -1;
+	}
+	return optr - gOutput - 1;
+}
+
+static void TestNormalize(void)
+{
+	const struct NormalizeCase *c;
+	int i, chunk, inlen, exlen, outlen;
+
+	for (i = 0; i < (int)ARRAY_COUNT(kNormalizeCases); i++) {
+		c = &kNormalizeCases[i];
+		inlen = strlen(c->input);
+		exlen = strlen(c->output);
+		for (chunk = 1; chunk <= inlen + 1; chunk++) {
+			SetTestNamef("normalize case %d chunk=%d", i, chunk);
+			outlen = Normalize((const UInt8 *)c->input, inlen, chunk);
+			if (outlen >= 0 && (outlen != exlen ||
+			                    memcmp(gOutput, c->output, exlen) != 0)) {
+				Failf("incorrect output");
+				break;
+			}
+		}
+	}
+}
+
+static void TestQuickCheck(void)
+{
+	static const struct {
+		const char *text;
+		int expect;
+	} kCases[] = {
+		{"", 0},
+		{"abc", 2},
+		{"caf\xc3\xa9!", 5},
+		{"e\xcc\x81x", 0},
+		{"xe\xcc\x81", 1},
+		{"ab\xe3\x81", 1},
+		{"a\xff" "b", 2},
+		{"\xe2\x84\xab!", 3},
+		{"a\xcd\x81", 0},
+	};
+	int i;
+	Size n;
+
+	for (i = 0; i < (int)ARRAY_COUNT(kCases); i++) {
+		SetTestNamef("quick check case %d", i);
+		n = NormalizeQuickCheck((const UInt8 *)kCases[i].text,
+		                        (const UInt8 *)kCases[i].text +
+		                            strlen(kCases[i].text));
+		if (n != kCases[i].expect) {
+			Failf("got %ld, expect %d", (long)n, kCases[i].expect);
+		}
+	}
+}
+
+// Build a converter from UTF-8 for the given charmap.
+static int BuildCharmap(struct Converter *c, const char *name)
+{
+	const char *id;
+	int i, err;
+
+	for (i = 0;; i++) {
+		id = CharmapID(i);
+		if (id == NULL) {
+			Failf("no charmap: %s", name);
+			return -1;
+		}
+		if (strcmp(id, name) == 0) {
+			break;
+		}
+	}
+	err = ConverterBuildCharmap(c, i, kFromUTF8);
+	if (err != 0) {
+		Failf("ConverterBuildCharmap: %s", ErrorDescriptionOrDie(err));
+		return -1;
+	}
+	return 0;
+}
+
+// Convert text with normalization, with the given number of bytes of input and
+// space for output in each call, and a NUL byte at the end to flush the state.
+// Return the length of the output, without the NUL byte.
+static int Convert(const struct Converter *c, const UInt8 *input, int inlen,
+                   int ichunk, int ochunk)
+{
+	static struct NormalizedConverterState st;
+	const UInt8 *iptr, *iend, *end;
+	UInt8 *optr, *oend, *olast;
+
+	memcpy(gInput, input, inlen);
+	gInput[inlen] = 0;
+	end = gInput + inlen + 1;
+	MemClear(&st, sizeof(st));
+	iptr = gInput;
+	optr = gOutput;
+	oend = gOutput;
+	iend = gInput;
+	for (;;) {
+		if (iptr == iend) {
+			if (iend == end) {
+				break;
+			}
+			iend += ichunk;
+			if (iend > end) {
+				iend = end;
+			}
+		}
+		olast = optr;
+		oend += ochunk;
+		if (oend > gOutput + kBufferSize) {
+			oend = gOutput + kBufferSize;
+		}
+		ConvertNormalized(c, kLineBreakKeep, &st, &optr, oend, &iptr, iend);
+		if (iptr != iend && optr == olast && oend == gOutput + kBufferSize) {
+			Failf("no progress");
+			return -1;
+		}
+	}
+	if (optr == gOutput || optr[-1] != 0) {
+		Failf("missing NUL at end of output");
+		return -1;
+	}
+	return optr - gOutput - 1;
+}
+
+struct ConvertCase {
+	const char *input;
+	const char *output;
+};
+
+static const struct ConvertCase kRomanCases[] = {
+	{"caf\xc3\xa9", "caf\x8e"},
+	{"cafe\xcc\x81", "caf\x8e"},
+	{"A\xcc\x8a", "\x81"},
+	// Both forms of a character which is not in the table give the same
+	// result.
+	{"\xc7\x98", "?"},
+	{"u\xcc\x88\xcc\x81", "?"},
+};
+
+static const struct ConvertCase kJapaneseCases[] = {
+	{"\xe3\x81\x8c", "\x82\xaa"},
+	{"\xe3\x81\x8b\xe3\x82\x99", "\x82\xaa"},
+	{"\xe3\x83\x8f\xe3\x82\x9a", "\x83\x70"},
+	// ANGSTROM SIGN has its own mapping, different from Å.
+	{"\xe2\x84\xab", "\x81\xf0"},
+};
+
+static void TestConvertCases(const char *name, const struct ConvertCase *cases,
+                             int count)
+{
+	struct Converter c;
+	int i, inlen, exlen, outlen;
+
+	if (BuildCharmap(&c, name) != 0) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		SetTestNamef("convert %s case %d", name, i);
+		inlen = strlen(cases[i].input);
+		exlen = strlen(cases[i].output);
+		outlen = Convert(&c, (const UInt8 *)cases[i].input, inlen, inlen + 1,
+		                 kBufferSize);
+		if (outlen >= 0 &&
+		    (outlen != exlen || memcmp(gOutput, cases[i].output, exlen) != 0)) {
+			Failf("incorrect output");
+		}
+	}
+	ConverterDispose(&c);
+}
+
+// Test that long decomposed text converts the same way as precomposed text,
+// with different input and output sizes for each call.
+static void TestLongText(void)
+{
+	static const char *const kPieces[][2] = {
+		{"\xc3\xa9", "e\xcc\x81"},
+		{"\xc3\x85", "A\xcc\x8a"},
+		{"\xc3\xbc", "u\xcc\x88"},
+		{"\xc3\xb1", "n\xcc\x83"},
+	};
+	struct Converter c;
+	static UInt8 text[2][kBufferSize];
+	int len[2], i, j, k, n, pos, exlen, outlen, ichunk, ochunk;
+
+	if (BuildCharmap(&c, "Roman") != 0) {
+		return;
+	}
+	for (k = 0; k < 2; k++) {
+		pos = 0;
+		for (i = 0; i < 150; i++) {
+			n = (i * 7) % 40;
+			for (j = 0; j < n; j++) {
+				text[k][pos++] = 'a' + (i + j) % 26;
+			}
+			if (i % 5 == 0) {
+				text[k][pos++] = kCharCR;
+			}
+			n = strlen(kPieces[i % 4][k]);
+			memcpy(text[k] + pos, kPieces[i % 4][k], n);
+			pos += n;
+		}
+		len[k] = pos;
+	}
+
+	SetTestName("long text precomposed");
+	exlen = Convert(&c, text[0], len[0], len[0] + 1, kBufferSize);
+	if (exlen < 0) {
+		goto done;
+	}
+	memcpy(gExpect, gOutput, exlen);
+	for (ichunk = 1; ichunk <= 4096; ichunk *= 4) {
+		for (ochunk = 1; ochunk <= 4096; ochunk *= 8) {
+			for (k = 0; k < 2; k++) {
+				SetTestNamef("long text %s ichunk=%d ochunk=%d",
+				             k == 0 ? "precomposed" : "decomposed", ichunk,
+				             ochunk);
+				outlen = Convert(&c, text[k], len[k], ichunk, ochunk);
+				if (outlen >= 0 && (outlen != exlen ||
+				                    memcmp(gOutput, gExpect, exlen) != 0)) {
+					Failf("incorrect output");
+					goto done;
+				}
+			}
+		}
+	}
+
+done:
+	ConverterDispose(&c);
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	TestNormalize();
+	TestQuickCheck();
+	TestConvertCases("Roman", kRomanCases, ARRAY_COUNT(kRomanCases));
+	TestConvertCases("Japanese", kJapaneseCases, ARRAY_COUNT(kJapaneseCases));
+	TestLongText();
+	return TestsDone();
+}
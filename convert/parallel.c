@@ -0,0 +1,256 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// parallel.c - conversion of large buffers using multiple threads.
+#include "convert/parallel.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+enum {
+	// Default size of each chunk.
+	kDefaultChunkSize = 1024 * 1024,
+
+	// Number of chunks to create for each thread, so the work is balanced
+	// when some chunks convert more slowly than others.
+	kChunksPerThread = 4,
+
+	// Maximum number of threads.
+	kMaxThreads = 64,
+
+	// Minimum amount of output space when calling the converter. This is
+	// enough for any single character, even in UTF-32.
+	kMinOutputRoom = 1024
+};
+
+struct Chunk {
+	const UInt8 *start;
+	const UInt8 *end;
+	// Output data and its size.
+	Handle out;
+	Size outsize;
+	// Where conversion stopped. Only the last chunk may stop early.
+	const UInt8 *stop;
+	ErrorCode err;
+};
+
+struct Job {
+	const struct Converter *c;
+	LineBreakConversion lc;
+	struct Chunk *chunks;
+	int count;
+	atomic_int next;
+};
+
+// Run the converter until it stops making progress, growing the output
+// buffer as needed.
+static ErrorCode RunAll(const struct Converter *c, LineBreakConversion lc,
+                        struct ConverterState *st, struct Chunk *chunk,
+                        Size *alloc, const UInt8 **iptr, const UInt8 *iend)
+{
+	const UInt8 *ipos, *istart;
+	UInt8 *optr, *ostart;
+
+	ipos = *iptr;
+	for (;;) {
+		if (*alloc - chunk->outsize < kMinOutputRoom) {
+			*alloc *= 2;
+			if (!ResizeHandle(chunk->out, *alloc)) {
+				return kErrorNoMemory;
+			}
+		}
+		istart = ipos;
+		ostart = (UInt8 *)*chunk->out + chunk->outsize;
+		optr = ostart;
+		c->run(ConverterData(c), lc, st, &optr, (UInt8 *)*chunk->out + *alloc,
+		       &ipos, iend);
+		chunk->outsize += optr - ostart;
+		if (ipos == iend || (ipos == istart && optr == ostart)) {
+			break;
+		}
+	}
+	*iptr = ipos;
+	return 0;
+}
+
+// Convert one chunk. Unless this is the last chunk, the converter is flushed
+// at the end with ConverterFlush. Since the next chunk starts with a byte that
+// can't continue a sequence, this gives the same output as converting the
+// input all at once.
+static ErrorCode ConvertChunk(const struct Converter *c, LineBreakConversion lc,
+                              struct Chunk *chunk, Boolean last)
+{
+	struct ConverterState st;
+	const UInt8 *ipos;
+	UInt8 *optr, *ostart;
+	Size alloc;
+	ErrorCode err;
+
+	alloc = (chunk->end - chunk->start) * 2 + kMinOutputRoom;
+	chunk->out = NewHandle(alloc);
+	if (chunk->out == NULL) {
+		return kErrorNoMemory;
+	}
+	chunk->outsize = 0;
+	MemClear(&st, sizeof(st));
+	ipos = chunk->start;
+	err = RunAll(c, lc, &st, chunk, &alloc, &ipos, chunk->end);
+	if (err != 0) {
+		return err;
+	}
+	if (!last) {
+		if (alloc - chunk->outsize < kMinOutputRoom) {
+			alloc += kMinOutputRoom;
+			if (!ResizeHandle(chunk->out, alloc)) {
+				return kErrorNoMemory;
+			}
+		}
+		ostart = (UInt8 *)*chunk->out + chunk->outsize;
+		optr = ostart;
+		err = ConverterFlush(c, lc, &st, &optr, (UInt8 *)*chunk->out + alloc,
+		                     ipos, chunk->end);
+		if (err != 0) {
+			return err;
+		}
+		chunk->outsize += optr - ostart;
+		ipos = chunk->end;
+	}
+	chunk->stop = ipos;
+	return 0;
+}
+
+static void *ConvertWorker(void *arg)
+{
+	struct Job *job = arg;
+	struct Chunk *chunk;
+	int i;
+
+	for (;;) {
+		i = atomic_fetch_add(&job->next, 1);
+		if (i >= job->count) {
+			break;
+		}
+		chunk = &job->chunks[i];
+		chunk->err = ConvertChunk(job->c, job->lc, chunk, i == job->count - 1);
+	}
+	return NULL;
+}
+
+int ConvertParallel(const struct Converter *c, LineBreakConversion lc,
+                    Handle *out, const UInt8 **iptr, const UInt8 *iend,
+                    int nthreads, Size chunksize)
+{
+	struct Job job;
+	Handle chunkh, result;
+	pthread_t threads[kMaxThreads];
+	const UInt8 *start, *pos, *split;
+	Size size, total;
+	int i, maxchunks, nstarted;
+	ErrorCode err;
+
+	start = *iptr;
+	size = iend - start;
+	if (nthreads < 1) {
+		nthreads = 1;
+	} else if (nthreads > kMaxThreads) {
+		nthreads = kMaxThreads;
+	}
+	if (chunksize <= 0) {
+		chunksize = size / (nthreads * kChunksPerThread);
+		if (chunksize < kDefaultChunkSize) {
+			chunksize = kDefaultChunkSize;
+		}
+	}
+
+	// Split the input into chunks.
+	maxchunks = size / chunksize + 1;
+	chunkh = NewHandle(maxchunks * sizeof(struct Chunk));
+	if (chunkh == NULL) {
+		return kErrorNoMemory;
+	}
+	job.c = c;
+	job.lc = lc;
+	job.chunks = (struct Chunk *)*chunkh;
+	job.count = 0;
+	atomic_init(&job.next, 0);
+	pos = start;
+	while (iend - pos > chunksize) {
+		split = ConverterSplit(c, start, pos + chunksize, iend);
+		if (split == NULL) {
+			break;
+		}
+		job.chunks[job.count].start = pos;
+		job.chunks[job.count].end = split;
+		job.count++;
+		pos = split;
+	}
+	job.chunks[job.count].start = pos;
+	job.chunks[job.count].end = iend;
+	job.count++;
+	for (i = 0; i < job.count; i++) {
+		job.chunks[i].out = NULL;
+		job.chunks[i].err = 0;
+	}
+
+	// Convert the chunks. This thread also does work. If a thread can't be
+	// started, the remaining threads do its work.
+	if (nthreads > job.count) {
+		nthreads = job.count;
+	}
+	nstarted = 0;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[nstarted], NULL, ConvertWorker, &job) !=
+		    0) {
+			break;
+		}
+		nstarted++;
+	}
+	ConvertWorker(&job);
+	for (i = 0; i < nstarted; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Concatenate the output.
+	err = 0;
+	total = 0;
+	for (i = 0; i < job.count; i++) {
+		if (job.chunks[i].err != 0) {
+			err = job.chunks[i].err;
+			goto done;
+		}
+		total += job.chunks[i].outsize;
+	}
+	if (job.count == 1) {
+		result = job.chunks[0].out;
+		job.chunks[0].out = NULL;
+		if (!ResizeHandle(result, total)) {
+			DisposeHandle(result);
+			err = kErrorNoMemory;
+			goto done;
+		}
+	} else {
+		result = NewHandle(total);
+		if (result == NULL) {
+			err = kErrorNoMemory;
+			goto done;
+		}
+		total = 0;
+		for (i = 0; i < job.count; i++) {
+			memcpy(*result + total, *job.chunks[i].out, job.chunks[i].outsize);
+			total += job.chunks[i].outsize;
+		}
+	}
+	*out = result;
+	*iptr = job.chunks[job.count - 1].stop;
+
+done:
+	for (i = 0; i < job.count; i++) {
+		if (job.chunks[i].out != NULL) {
+			DisposeHandle(job.chunks[i].out);
+		}
+	}
+	DisposeHandle(chunkh);
+	return err;
+}
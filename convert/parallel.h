@@ -0,0 +1,25 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_PARALLEL_H
+#define CONVERT_PARALLEL_H
+// parallel.h - conversion of large buffers using multiple threads, not used for
+// classic Mac OS builds.
+#include "convert/convert.h"
+
+// Convert a buffer using multiple threads. The input is split into chunks at
+// places where the converter state does not matter, the chunks are converted
+// concurrently, and the results are concatenated. The output is identical to
+// the output from calling the converter once on the entire input, starting
+// with a zeroed state, with unlimited output space.
+//
+// On success, stores a new handle containing the output in out, and advances
+// iptr past the input that was converted. Like the converter, this may stop
+// before an incomplete character or sequence at the end of the input.
+//
+// The chunk size is only a target, and may be zero to use the default size.
+int ConvertParallel(const struct Converter *c, LineBreakConversion lc,
+                    Handle *out, const UInt8 **iptr, const UInt8 *iend,
+                    int nthreads, Size chunksize);
+
+#endif
@@ -0,0 +1,143 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "convert/parallel.h"
+
+#include "convert/data.h"
+#include "convert/test.h"
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	// Size of generated input.
+	kInputSize = 256 * 1024,
+
+	// Size of buffer for serial output.
+	kOutputSize = kInputSize * 16
+};
+
+static const char *const kLineBreakName[4] = {"keep", "LF", "CR", "CRLF"};
+
+// Convert the input in one call. Return the size of the output.
+static Size ConvertSerial(const struct Converter *c, LineBreakConversion lc,
+                          UInt8 *obuf, const UInt8 **iptr, const UInt8 *iend)
+{
+	struct ConverterState st;
+	UInt8 *optr;
+
+	MemClear(&st, sizeof(st));
+	optr = obuf;
+	c->run(ConverterData(c), lc, &st, &optr, obuf + kOutputSize, iptr, iend);
+	return optr - obuf;
+}
+
+// Test that parallel conversion gives the same result as serial conversion.
+static void TestParallel(const char *name, const char *direction,
+                         const struct Converter *c, const UInt8 *ibuf,
+                         Size isize, UInt8 *obuf)
+{
+	static const Size kChunkSizes[] = {100, 1000, 7777, 100000};
+	Handle out;
+	const UInt8 *iptr, *sptr;
+	Size ssize, psize;
+	int lc, i;
+	ErrorCode err;
+
+	for (lc = 0; lc < 4; lc++) {
+		sptr = ibuf;
+		ssize = ConvertSerial(c, lc, obuf, &sptr, ibuf + isize);
+		for (i = 0; i < (int)ARRAY_COUNT(kChunkSizes); i++) {
+			SetTestNamef("%s %s %s chunk=%ld", name, direction,
+			             kLineBreakName[lc], (long)kChunkSizes[i]);
+			iptr = ibuf;
+			err = ConvertParallel(c, lc, &out, &iptr, ibuf + isize, 4,
+			                      kChunkSizes[i]);
+			if (err != 0) {
+				Failf("ConvertParallel: %s", ErrorDescriptionOrDie(err));
+				continue;
+			}
+			psize = GetHandleSize(out);
+			if (iptr != sptr) {
+				Failf("consumed %ld bytes, expect %ld", (long)(iptr - ibuf),
+				      (long)(sptr - ibuf));
+			} else if (psize != ssize) {
+				Failf("output size %ld, expect %ld", (long)psize, (long)ssize);
+			} else if (memcmp(*out, obuf, ssize) != 0) {
+				Failf("output does not match");
+			}
+			DisposeHandle(out);
+		}
+	}
+}
+
+static void TestCharmap(const char *name, struct CharmapData data, UInt8 **buf)
+{
+	struct TestConverters c;
+	struct ConverterState st;
+	const UInt8 *iptr;
+	UInt8 *optr;
+	Size size;
+
+	SetTestName(name);
+	if (!BuildTestConverters(&c, data, kToUTF16LE)) {
+		return;
+	}
+
+	// Reverse conversion input is the forward conversion output, which
+	// contains multi-character sequences, with some random bytes mixed in.
+	MakeText(buf[0], kInputSize);
+	TestParallel(name, "forward", &c.forward, buf[0], kInputSize, buf[2]);
+	TestParallel(name, "utf16", &c.wide, buf[0], kInputSize, buf[2]);
+	iptr = buf[0];
+	optr = buf[1];
+	MemClear(&st, sizeof(st));
+	c.forward.run(ConverterData(&c.forward), kLineBreakKeep, &st, &optr,
+	              buf[1] + kOutputSize, &iptr, buf[0] + kInputSize);
+	size = optr - buf[1];
+	if (size > kInputSize * 2) {
+		size = kInputSize * 2;
+	}
+	MakeText(buf[0], 64);
+	memcpy(buf[1] + size / 2, buf[0], 64);
+	TestParallel(name, "reverse", &c.reverse, buf[1], size, buf[2]);
+
+	DisposeTestConverters(&c);
+}
+
+int main(int argc, char **argv)
+{
+	struct CharmapData data;
+	const char *name;
+	UInt8 *buf[3];
+	int i;
+
+	(void)argc;
+	(void)argv;
+
+	for (i = 0; i < 3; i++) {
+		buf[i] = malloc(kOutputSize);
+		if (buf[i] == NULL) {
+			Fatalf("malloc failed");
+		}
+	}
+
+	TestCharmap("LineBreak", TestLineBreakData(), buf);
+	for (i = 0;; i++) {
+		name = CharmapName(i);
+		if (name == NULL) {
+			break;
+		}
+		data = CharmapData(i);
+		if (data.ptr != NULL) {
+			TestCharmap(name, data, buf);
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		free(buf[i]);
+	}
+	return TestsDone();
+}
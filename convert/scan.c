@@ -0,0 +1,233 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// scan.c - fast scanning of input text.
+#include "convert/scan.h"
+
+#include "convert/convert.h"
+
+// Pick a vector implementation, based on the target. These are only available
+// with GCC-compatible compilers, and the portable code is used everywhere else.
+#if __AVX2__
+#define SCAN_AVX2 1
+#define SCAN_SSE2 1
+#include <immintrin.h>
+#elif __SSE2__
+#define SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if !SCAN_SSE2
+#include <string.h>
+
+// Return nonzero if any byte in the word is zero. May report false positives
+// in bytes after a zero byte, but never reports a false positive if there are
+// no zero bytes.
+#define HAS_ZERO(x) (((x)-0x01010101u) & ~(x)&0x80808080u)
+#endif
+
+Size ScanASCII(const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos = ptr;
+	unsigned ch;
+#if SCAN_AVX2
+	__m256i cr32, lf32, v32, m32;
+#endif
+#if SCAN_SSE2
+	__m128i cr16, lf16, v16, m16;
+	unsigned mask;
+#endif
+#if !SCAN_SSE2
+	UInt32 w;
+#endif
+
+#if SCAN_AVX2
+	cr32 = _mm256_set1_epi8(kCharCR);
+	lf32 = _mm256_set1_epi8(kCharLF);
+	while (end - pos >= 32) {
+		// High bytes already have the sign bit set, and comparisons set all
+		// bits, so the mask has one bit for each byte which stops the scan.
+		v32 = _mm256_loadu_si256((const void *)pos);
+		m32 = _mm256_or_si256(v32, _mm256_or_si256(_mm256_cmpeq_epi8(v32, cr32),
+		                                           _mm256_cmpeq_epi8(v32, lf32)));
+		mask = (unsigned)_mm256_movemask_epi8(m32);
+		if (mask != 0) {
+			return pos - ptr + __builtin_ctz(mask);
+		}
+		pos += 32;
+	}
+#endif
+
+#if SCAN_SSE2
+	cr16 = _mm_set1_epi8(kCharCR);
+	lf16 = _mm_set1_epi8(kCharLF);
+	while (end - pos >= 16) {
+		v16 = _mm_loadu_si128((const void *)pos);
+		m16 = _mm_or_si128(v16, _mm_or_si128(_mm_cmpeq_epi8(v16, cr16),
+		                                     _mm_cmpeq_epi8(v16, lf16)));
+		mask = (unsigned)_mm_movemask_epi8(m16);
+		if (mask != 0) {
+			return pos - ptr + __builtin_ctz(mask);
+		}
+		pos += 16;
+	}
+#endif
+
+#if !SCAN_SSE2
+	// Portable version: check one aligned word at a time.
+	while (pos < end && ((unsigned long)pos & 3) != 0) {
+		ch = *pos;
+		if (ch >= 128 || ch == kCharCR || ch == kCharLF) {
+			return pos - ptr;
+		}
+		pos++;
+	}
+	while (end - pos >= 4) {
+		memcpy(&w, pos, 4);
+		if ((w & 0x80808080u) != 0 || HAS_ZERO(w ^ 0x0d0d0d0du) ||
+		    HAS_ZERO(w ^ 0x0a0a0a0au)) {
+			break;
+		}
+		pos += 4;
+	}
+#endif
+
+	while (pos < end) {
+		ch = *pos;
+		if (ch >= 128 || ch == kCharCR || ch == kCharLF) {
+			break;
+		}
+		pos++;
+	}
+	return pos - ptr;
+}
+
+Size ScanLineBreak(const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos = ptr;
+	unsigned ch;
+#if SCAN_AVX2
+	__m256i cr32, lf32, v32, m32;
+#endif
+#if SCAN_SSE2
+	__m128i cr16, lf16, v16, m16;
+	unsigned mask;
+#endif
+#if !SCAN_SSE2
+	UInt32 w;
+#endif
+
+#if SCAN_AVX2
+	cr32 = _mm256_set1_epi8(kCharCR);
+	lf32 = _mm256_set1_epi8(kCharLF);
+	while (end - pos >= 32) {
+		v32 = _mm256_loadu_si256((const void *)pos);
+		m32 = _mm256_or_si256(_mm256_cmpeq_epi8(v32, cr32),
+		                      _mm256_cmpeq_epi8(v32, lf32));
+		mask = (unsigned)_mm256_movemask_epi8(m32);
+		if (mask != 0) {
+			return pos - ptr + __builtin_ctz(mask);
+		}
+		pos += 32;
+	}
+#endif
+
+#if SCAN_SSE2
+	cr16 = _mm_set1_epi8(kCharCR);
+	lf16 = _mm_set1_epi8(kCharLF);
+	while (end - pos >= 16) {
+		v16 = _mm_loadu_si128((const void *)pos);
+		m16 = _mm_or_si128(_mm_cmpeq_epi8(v16, cr16), _mm_cmpeq_epi8(v16, lf16));
+		mask = (unsigned)_mm_movemask_epi8(m16);
+		if (mask != 0) {
+			return pos - ptr + __builtin_ctz(mask);
+		}
+		pos += 16;
+	}
+#endif
+
+#if !SCAN_SSE2
+	while (pos < end && ((unsigned long)pos & 3) != 0) {
+		ch = *pos;
+		if (ch == kCharCR || ch == kCharLF) {
+			return pos - ptr;
+		}
+		pos++;
+	}
+	while (end - pos >= 4) {
+		memcpy(&w, pos, 4);
+		if (HAS_ZERO(w ^ 0x0d0d0d0du) || HAS_ZERO(w ^ 0x0a0a0a0au)) {
+			break;
+		}
+		pos += 4;
+	}
+#endif
+
+	while (pos < end) {
+		ch = *pos;
+		if (ch == kCharCR || ch == kCharLF) {
+			break;
+		}
+		pos++;
+	}
+	return pos - ptr;
+}
+
+Size ScanHighByte(const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos = ptr;
+#if SCAN_AVX2
+	__m256i v32;
+#endif
+#if SCAN_SSE2
+	__m128i v16;
+	unsigned mask;
+#endif
+#if !SCAN_SSE2
+	UInt32 w;
+#endif
+
+#if SCAN_AVX2
+	while (end - pos >= 32) {
+		v32 = _mm256_loadu_si256((const void *)pos);
+		mask = (unsigned)_mm256_movemask_epi8(v32);
+		if (mask != 0) {
+			return pos - ptr + __builtin_ctz(mask);
+		}
+		pos += 32;
+	}
+#endif
+
+#if SCAN_SSE2
+	while (end - pos >= 16) {
+		v16 = _mm_loadu_si128((const void *)pos);
+		mask = (unsigned)_mm_movemask_epi8(v16);
+		if (mask != 0) {
+			return pos - ptr + __builtin_ctz(mask);
+		}
+		pos += 16;
+	}
+#endif
+
+#if !SCAN_SSE2
+	while (pos < end && ((unsigned long)pos & 3) != 0) {
+		if (*pos >= 128) {
+			return pos - ptr;
+		}
+		pos++;
+	}
+	while (end - pos >= 4) {
+		memcpy(&w, pos, 4);
+		if ((w & 0x80808080u) != 0) {
+			break;
+		}
+		pos += 4;
+	}
+#endif
+
+	while (pos < end && *pos < 128) {
+		pos++;
+	}
+	return pos - ptr;
+}
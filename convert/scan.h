@@ -0,0 +1,23 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_SCAN_H
+#define CONVERT_SCAN_H
+// scan.h - fast scanning of input text.
+
+#include "lib/defs.h"
+
+// Return the number of bytes at the start of the buffer which are ASCII
+// characters other than CR and LF. These characters are the same in every
+// supported encoding, so converters can copy them directly to the output.
+Size ScanASCII(const UInt8 *ptr, const UInt8 *end);
+
+// Return the number of bytes at the start of the buffer which are not CR or
+// LF.
+Size ScanLineBreak(const UInt8 *ptr, const UInt8 *end);
+
+// Return the number of bytes at the start of the buffer which are ASCII,
+// including CR and LF.
+Size ScanHighByte(const UInt8 *ptr, const UInt8 *end);
+
+#endif
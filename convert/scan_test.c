@@ -0,0 +1,101 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "convert/scan.h"
+
+#include "convert/convert.h"
+#include "lib/test.h"
+
+enum {
+	kBufferSize = 256,
+};
+
+static UInt8 gBuffer[kBufferSize];
+
+typedef Size (*ScanFunc)(const UInt8 *ptr, const UInt8 *end);
+
+// Reference implementation of ScanASCII.
+static Size ScanASCIISlow(const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos;
+
+	for (pos = ptr; pos < end; pos++) {
+		if (*pos >= 128 || *pos == kCharCR || *pos == kCharLF) {
+			break;
+		}
+	}
+	return pos - ptr;
+}
+
+// Reference implementation of ScanLineBreak.
+static Size ScanLineBreakSlow(const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos;
+
+	for (pos = ptr; pos < end; pos++) {
+		if (*pos == kCharCR || *pos == kCharLF) {
+			break;
+		}
+	}
+	return pos - ptr;
+}
+
+// Reference implementation of ScanHighByte.
+static Size ScanHighByteSlow(const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos;
+
+	for (pos = ptr; pos < end; pos++) {
+		if (*pos >= 128) {
+			break;
+		}
+	}
+	return pos - ptr;
+}
+
+// Test scanning with a single stop character at every position, from every
+// starting alignment.
+static void TestStop(const char *name, ScanFunc func, ScanFunc ref,
+                     unsigned stop)
+{
+	int i, start, pos, len;
+	Size expect, result;
+
+	for (pos = 0; pos < kBufferSize; pos++) {
+		for (i = 0; i < kBufferSize; i++) {
+			gBuffer[i] = 'a' + i % 26;
+		}
+		gBuffer[pos] = stop;
+		for (start = 0; start < 16 && start <= pos; start++) {
+			for (len = 0; start + len <= kBufferSize; len += 7) {
+				expect = ref(gBuffer + start, gBuffer + start + len);
+				result = func(gBuffer + start, gBuffer + start + len);
+				if (expect != result) {
+					SetTestNamef("%s stop=%u pos=%d start=%d len=%d", name,
+					             stop, pos, start, len);
+					Failf("got %ld, expect %ld", (long)result, (long)expect);
+					return;
+				}
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned kStops[] = {
+		kCharCR, kCharLF, 0x80, 0xff, 0x8d, 0x8a,
+	};
+	int i;
+
+	(void)argc;
+	(void)argv;
+
+	for (i = 0; i < (int)ARRAY_COUNT(kStops); i++) {
+		TestStop("ScanASCII", ScanASCII, ScanASCIISlow, kStops[i]);
+		TestStop("ScanLineBreak", ScanLineBreak, ScanLineBreakSlow,
+		         kStops[i]);
+		TestStop("ScanHighByte", ScanHighByte, ScanHighByteSlow, kStops[i]);
+	}
+	return TestsDone();
+}
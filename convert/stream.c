@@ -0,0 +1,344 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "convert/stream.h"
+
+#include <string.h>
+
+ErrorCode ConvertStreamInit(struct ConvertStream *s)
+{
+	MemClear(s, sizeof(*s));
+	s->inbuf = NewHandle(kStreamBufferSize);
+	s->outbuf = NewHandle(kStreamBufferSize);
+	if (s->inbuf == NULL || s->outbuf == NULL) {
+		ConvertStreamDispose(s);
+		return kErrorNoMemory;
+	}
+	return 0;
+}
+
+void ConvertStreamDispose(struct ConvertStream *s)
+{
+	if (s->inbuf != NULL) {
+		DisposeHandle(s->inbuf);
+		s->inbuf = NULL;
+	}
+	if (s->outbuf != NULL) {
+		DisposeHandle(s->outbuf);
+		s->outbuf = NULL;
+	}
+}
+
+void ConvertStreamReset(struct ConvertStream *s, const struct Converter *c,
+                        LineBreakConversion lc)
+{
+	s->converter = c;
+	s->lc = lc;
+	MemClear(&s->state, sizeof(s->state));
+	MemClear(&s->stats, sizeof(s->stats));
+	s->state.stats = &s->stats;
+	s->inlen = 0;
+	s->outpos = 0;
+	s->outend = 0;
+	s->starved = false;
+	s->finished = false;
+	s->error = 0;
+}
+
+// Pass the buffered output to the write function.
+static ErrorCode Flush(struct ConvertStream *s)
+{
+	ErrorCode err;
+
+	if (s->outpos < s->outend) {
+		err = s->write(s->writectx, (const UInt8 *)*s->outbuf + s->outpos,
+		               s->outend - s->outpos);
+		if (err != 0) {
+			s->error = err;
+			return err;
+		}
+	}
+	s->outpos = 0;
+	s->outend = 0;
+	return 0;
+}
+
+// Run the converter once, from the input into the given output range. Return
+// kErrorUnmappable if a strict converter stopped.
+static ErrorCode Run(struct ConvertStream *s, UInt8 **optr, UInt8 *oend,
+                     const UInt8 **iptr, const UInt8 *iend)
+{
+	ConverterRun(s->converter, s->lc, &s->state, optr, oend, iptr, iend);
+	if (s->state.unmapped != 0) {
+		s->error = kErrorUnmappable;
+		return kErrorUnmappable;
+	}
+	return 0;
+}
+
+// Convert input into the output buffer, writing the buffer whenever it fills
+// up, until the converter stops making progress.
+static ErrorCode RunPush(struct ConvertStream *s, const UInt8 **iptr,
+                         const UInt8 *iend)
+{
+	const UInt8 *ipos, *istart;
+	UInt8 *obuf, *optr;
+	ErrorCode err;
+
+	ipos = *iptr;
+	for (;;) {
+		if (kStreamBufferSize - s->outend < kStreamMinOutputRoom) {
+			err = Flush(s);
+			if (err != 0) {
+				break;
+			}
+		}
+		obuf = (UInt8 *)*s->outbuf;
+		optr = obuf + s->outend;
+		istart = ipos;
+		err = Run(s, &optr, obuf + kStreamBufferSize, &ipos, iend);
+		if (optr == obuf + s->outend && ipos == istart) {
+			break;
+		}
+		s->outend = optr - obuf;
+		if (err != 0 || ipos == iend) {
+			break;
+		}
+	}
+	*iptr = ipos;
+	return err;
+}
+
+// Flush the converter with the input held in the buffer. The output buffer
+// must have at least kStreamMinOutputRoom bytes of space.
+static ErrorCode RunTail(struct ConvertStream *s)
+{
+	const UInt8 *ibuf;
+	UInt8 *obuf, *optr;
+	ErrorCode err;
+
+	ibuf = (const UInt8 *)*s->inbuf;
+	obuf = (UInt8 *)*s->outbuf;
+	optr = obuf + s->outend;
+	err = ConverterFlush(s->converter, s->lc, &s->state, &optr,
+	                     obuf + kStreamBufferSize, ibuf, ibuf + s->inlen);
+	s->outend = optr - obuf;
+	if (err != 0) {
+		s->error = err;
+		return err;
+	}
+	s->inlen = 0;
+	s->finished = true;
+	return 0;
+}
+
+ErrorCode ConvertStreamWrite(struct ConvertStream *s, const UInt8 *ptr,
+                             Size size)
+{
+	const UInt8 *end, *ipos, *ibuf;
+	Size n, rem;
+	ErrorCode err;
+
+	if (s->error != 0) {
+		return s->error;
+	}
+	end = ptr + size;
+
+	// Complete the sequence left over from the last call by copying input
+	// after it. As soon as the converter consumes the leftover input, continue
+	// from the caller's buffer instead.
+	while (s->inlen > 0 && ptr < end) {
+		n = kStreamBufferSize - s->inlen;
+		if (n > end - ptr) {
+			n = end - ptr;
+		}
+		if (n == 0) {
+			s->error = kErrorBadData;
+			return kErrorBadData;
+		}
+		ibuf = (const UInt8 *)*s->inbuf;
+		memcpy(*s->inbuf + s->inlen, ptr, n);
+		ipos = ibuf;
+		err = RunPush(s, &ipos, ibuf + s->inlen + n);
+		if (err != 0) {
+			return err;
+		}
+		rem = ibuf + s->inlen + n - ipos;
+		if (rem <= n) {
+			s->inlen = 0;
+			ptr += n - rem;
+		} else {
+			memmove(*s->inbuf, ipos, rem);
+			s->inlen = rem;
+			ptr += n;
+		}
+	}
+
+	if (ptr < end) {
+		ipos = ptr;
+		err = RunPush(s, &ipos, end);
+		if (err != 0) {
+			return err;
+		}
+		// Keep the incomplete data at the end for the next call.
+		rem = end - ipos;
+		if (rem > kStreamBufferSize) {
+			s->error = kErrorBadData;
+			return kErrorBadData;
+		}
+		memcpy(*s->inbuf, ipos, rem);
+		s->inlen = rem;
+	}
+	return 0;
+}
+
+ErrorCode ConvertStreamFinish(struct ConvertStream *s)
+{
+	ErrorCode err;
+
+	err = s->error;
+	if (err == 0 && !s->finished) {
+		if (kStreamBufferSize - s->outend < kStreamMinOutputRoom) {
+			err = Flush(s);
+		}
+		if (err == 0) {
+			err = RunTail(s);
+		}
+	}
+	if (err == 0 || err == kErrorUnmappable) {
+		// Keep the output from before an unmappable character.
+		if (Flush(s) != 0) {
+			err = s->error;
+		}
+	}
+	return err;
+}
+
+ErrorCode ConvertStreamRead(struct ConvertStream *s, UInt8 *buf, Size size,
+                            Size *count)
+{
+	const UInt8 *ibuf, *ipos;
+	UInt8 *obuf, *optr, *oend;
+	Size n, rem;
+	ErrorCode err;
+
+	*count = 0;
+	for (;;) {
+		if (s->outpos < s->outend) {
+			n = s->outend - s->outpos;
+			if (n > size) {
+				n = size;
+			}
+			memcpy(buf, *s->outbuf + s->outpos, n);
+			s->outpos += n;
+			if (s->outpos == s->outend) {
+				s->outpos = 0;
+				s->outend = 0;
+			}
+			*count = n;
+			return 0;
+		}
+		if (s->error != 0) {
+			return s->error;
+		}
+		if (s->finished) {
+			return 0;
+		}
+
+		if (s->inlen > 0 && !s->starved) {
+			// Convert directly into the caller's buffer if it is large enough,
+			// and into the output buffer otherwise.
+			if (size >= kStreamMinOutputRoom) {
+				obuf = buf;
+				oend = buf + size;
+			} else {
+				obuf = (UInt8 *)*s->outbuf;
+				oend = obuf + kStreamBufferSize;
+			}
+			ibuf = (const UInt8 *)*s->inbuf;
+			ipos = ibuf;
+			optr = obuf;
+			err = Run(s, &optr, oend, &ipos, ibuf + s->inlen);
+			n = optr - obuf;
+			rem = ibuf + s->inlen - ipos;
+			if (n == 0 && rem == s->inlen) {
+				s->starved = true;
+			}
+			memmove(*s->inbuf, ipos, rem);
+			s->inlen = rem;
+			if (obuf == buf) {
+				*count = n;
+				if (n > 0) {
+					return 0;
+				}
+			} else {
+				s->outend = n;
+			}
+			if (err != 0) {
+				return err;
+			}
+			continue;
+		}
+
+		// Read more input after any incomplete sequence.
+		if (s->inlen >= kStreamBufferSize) {
+			s->error = kErrorBadData;
+			return kErrorBadData;
+		}
+		err = s->read(s->readctx, (UInt8 *)*s->inbuf + s->inlen,
+		              kStreamBufferSize - s->inlen, &n);
+		if (err != 0) {
+			s->error = err;
+			return err;
+		}
+		if (n == 0) {
+			err = RunTail(s);
+			if (err != 0) {
+				return err;
+			}
+		} else {
+			s->inlen += n;
+			s->starved = false;
+		}
+	}
+}
+
+ErrorCode ConvertStreamCopy(struct ConvertStream *s)
+{
+	const UInt8 *ibuf, *ipos;
+	Size n, avail;
+	ErrorCode err;
+
+	if (s->error != 0) {
+		return s->error;
+	}
+	for (;;) {
+		err = s->read(s->readctx, (UInt8 *)*s->inbuf + s->inlen,
+		              kStreamBufferSize - s->inlen, &n);
+		if (err != 0) {
+			s->error = err;
+			return err;
+		}
+		if (n == 0) {
+			break;
+		}
+		avail = s->inlen + n;
+		ibuf = (const UInt8 *)*s->inbuf;
+		ipos = ibuf;
+		err = RunPush(s, &ipos, ibuf + avail);
+		if (err != 0) {
+			if (err == kErrorUnmappable) {
+				break;
+			}
+			return err;
+		}
+		// Keep the incomplete data at the end for the next read.
+		s->inlen = ibuf + avail - ipos;
+		memmove(*s->inbuf, ipos, s->inlen);
+		if (s->inlen >= kStreamBufferSize) {
+			s->error = kErrorBadData;
+			return kErrorBadData;
+		}
+	}
+	return ConvertStreamFinish(s);
+}
@@ -0,0 +1,111 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_STREAM_H
+#define CONVERT_STREAM_H
+// stream.h - streaming conversion with reusable buffers.
+#include "convert/convert.h"
+
+enum {
+	// Size of each of the input and output buffers of a stream.
+	kStreamBufferSize = 64 * 1024,
+
+	// Minimum amount of output space when calling the converter. This is
+	// enough for any single character, even in UTF-32.
+	kStreamMinOutputRoom = 1024
+};
+
+// Function which supplies input to a stream. Stores up to size bytes in buf,
+// and sets count to the amount stored. A count of zero marks the end of the
+// input.
+typedef ErrorCode (*StreamReadf)(void *ctx, UInt8 *buf, Size size,
+                                 Size *count);
+
+// Function which consumes output from a stream. Must consume all of the data
+// or return an error.
+typedef ErrorCode (*StreamWritef)(void *ctx, const UInt8 *buf, Size size);
+
+// A stream which runs a converter over input that arrives in pieces. The
+// caller either pushes input with ConvertStreamWrite and receives output
+// through the write function, or pulls output with ConvertStreamRead and
+// supplies input through the read function. ConvertStreamCopy connects a read
+// function to a write function.
+//
+// The buffers are allocated once, by ConvertStreamInit, and the stream can be
+// reset and reused for any number of conversions. The stream keeps incomplete
+// input between calls, so input can be split anywhere. At the end of the input,
+// the converter is flushed with ConverterFlush. This converts a CR at the end
+// of the input and any partial match saved in the converter state.
+struct ConvertStream {
+	const struct Converter *converter;
+	LineBreakConversion lc;
+	struct ConverterState state;
+	// Statistics for the current conversion. The insize and outsize fields
+	// count the input consumed and output produced so far.
+	struct ConvertStats stats;
+
+	// Input and output functions, set by the caller.
+	StreamReadf read;
+	void *readctx;
+	StreamWritef write;
+	void *writectx;
+
+	// Buffers, each kStreamBufferSize bytes.
+	Handle inbuf;
+	Handle outbuf;
+	// Amount of unconverted input at the start of the input buffer.
+	Size inlen;
+	// Range of converted output in the output buffer which has not been read
+	// or written yet.
+	Size outpos;
+	Size outend;
+	// True if the converter can't make progress with the input in the buffer,
+	// and more input must be read first.
+	Boolean starved;
+	// True once the end of the input has been converted.
+	Boolean finished;
+	// Error which stopped the stream, if any. Once the stream stops with an
+	// error, every call returns the same error until it is reset.
+	ErrorCode error;
+};
+
+// Allocate the buffers for a stream. The stream must be reset before use.
+ErrorCode ConvertStreamInit(struct ConvertStream *s);
+
+// Free the buffers used by a stream.
+void ConvertStreamDispose(struct ConvertStream *s);
+
+// Start a new conversion with the given converter. The converter must remain
+// valid until the conversion is finished. The read and write functions are not
+// changed.
+void ConvertStreamReset(struct ConvertStream *s, const struct Converter *c,
+                        LineBreakConversion lc);
+
+// Convert the next part of the input, and pass the output to the write
+// function. Output may be held in the buffer until it fills up or the stream
+// is finished. Input is converted directly from the caller's buffer, and only
+// an incomplete sequence at the end is copied. With a strict converter,
+// returns kErrorUnmappable when the input contains a character with no
+// mapping. The state field holds the character, and the output before it is
+// written by ConvertStreamFinish.
+ErrorCode ConvertStreamWrite(struct ConvertStream *s, const UInt8 *ptr,
+                             Size size);
+
+// Mark the end of the input, convert any input or state held by the stream, and
+// pass the rest of the output to the write function. If the stream stopped at
+// an unmappable character, writes the output before it and returns
+// kErrorUnmappable.
+ErrorCode ConvertStreamFinish(struct ConvertStream *s);
+
+// Read up to size bytes of output, calling the read function for input as
+// needed. Sets count to the amount of output, which is zero only at the end of
+// the output. Output is converted directly into the caller's buffer when there
+// is enough room.
+ErrorCode ConvertStreamRead(struct ConvertStream *s, UInt8 *buf, Size size,
+                            Size *count);
+
+// Convert all input from the read function, pass the output to the write
+// function, and finish the stream.
+ErrorCode ConvertStreamCopy(struct ConvertStream *s);
+
+#endif
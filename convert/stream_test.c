@@ -0,0 +1,342 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "convert/stream.h"
+
+#include "convert/data.h"
+#include "convert/test.h"
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	// Size of generated input. Larger than the stream buffers.
+	kInputSize = 150 * 1024,
+
+	// Size of buffer for output.
+	kOutputSize = kInputSize * 16
+};
+
+// Ways to run the stream.
+typedef enum {
+	// Push input in small pieces.
+	kModePushSmall,
+	// Push input in large pieces.
+	kModePushLarge,
+	// Pull output in small pieces, from input read in small pieces.
+	kModePullSmall,
+	// Pull output in large pieces, from input read in large pieces.
+	kModePullLarge,
+	// Copy from the read function to the write function.
+	kModeCopy,
+
+	kModeCount
+} StreamMode;
+
+static const char *const kModeName[kModeCount] = {
+	"push-small", "push-large", "pull-small", "pull-large", "copy"};
+
+// Return the size of the next piece of data.
+static Size PieceSize(Boolean large, Size rem)
+{
+	Size n;
+
+	if (large) {
+		n = 1 + TestRand() % (kStreamBufferSize * 2);
+	} else {
+		n = 1 + TestRand() % 17;
+	}
+	return n < rem ? n : rem;
+}
+
+// Memory buffer used for input or output.
+struct Memory {
+	UInt8 *buf;
+	Size pos;
+	Size size;
+	Boolean large;
+};
+
+static ErrorCode ReadMemory(void *ctx, UInt8 *buf, Size size, Size *count)
+{
+	struct Memory *m = ctx;
+	Size n;
+
+	n = PieceSize(m->large, m->size - m->pos);
+	if (n > size) {
+		n = size;
+	}
+	memcpy(buf, m->buf + m->pos, n);
+	m->pos += n;
+	*count = n;
+	return 0;
+}
+
+static ErrorCode WriteMemory(void *ctx, const UInt8 *buf, Size size)
+{
+	struct Memory *m = ctx;
+
+	if (size > m->size - m->pos) {
+		Failf("output too large");
+		return kErrorBadData;
+	}
+	memcpy(m->buf + m->pos, buf, size);
+	m->pos += size;
+	return 0;
+}
+
+// Convert the input with the stream using the given mode. Return the error
+// code, and store the output size.
+static ErrorCode RunMode(struct ConvertStream *s, StreamMode mode,
+                         UInt8 *obuf, Size *osize, UInt8 *ibuf, Size isize)
+{
+	struct Memory in, out;
+	Boolean large;
+	Size pos, n, count;
+	ErrorCode err;
+
+	large = mode == kModePushLarge || mode == kModePullLarge;
+	in.buf = ibuf;
+	in.pos = 0;
+	in.size = isize;
+	in.large = large;
+	out.buf = obuf;
+	out.pos = 0;
+	out.size = kOutputSize;
+	out.large = large;
+	s->read = ReadMemory;
+	s->readctx = &in;
+	s->write = WriteMemory;
+	s->writectx = &out;
+	switch (mode) {
+	case kModePushSmall:
+	case kModePushLarge:
+		err = 0;
+		for (pos = 0; pos < isize && err == 0; pos += n) {
+			n = PieceSize(large, isize - pos);
+			err = ConvertStreamWrite(s, ibuf + pos, n);
+		}
+		if (err == 0 || err == kErrorUnmappable) {
+			err = ConvertStreamFinish(s);
+		}
+		break;
+	case kModePullSmall:
+	case kModePullLarge:
+		for (;;) {
+			n = PieceSize(large, kOutputSize - out.pos);
+			err = ConvertStreamRead(s, obuf + out.pos, n, &count);
+			out.pos += count;
+			if (err != 0 || count == 0) {
+				break;
+			}
+		}
+		break;
+	default:
+		err = ConvertStreamCopy(s);
+		break;
+	}
+	*osize = out.pos;
+	return err;
+}
+
+// Test that each way of running the stream gives the same result as
+// converting the input in memory.
+static void TestConverter(struct ConvertStream *s, const char *name,
+                          const char *direction, const struct Converter *c,
+                          UInt8 *ibuf, Size isize, UInt8 **buf)
+{
+	static const LineBreakConversion kLineBreaks[] = {kLineBreakKeep,
+	                                                  kLineBreakCRLF};
+	static const Size kSizes[] = {0, 1, 5000, kInputSize};
+	int mode, i, j;
+	Size size, expect, count;
+	ErrorCode err;
+
+	for (i = 0; i < (int)ARRAY_COUNT(kLineBreaks); i++) {
+		for (j = 0; j < (int)ARRAY_COUNT(kSizes); j++) {
+			count = kSizes[j] < isize ? kSizes[j] : isize;
+			expect = ConvertReference(c, kLineBreaks[i], buf[0], kOutputSize,
+			                          ibuf, count);
+			for (mode = 0; mode < kModeCount; mode++) {
+				SetTestNamef("%s %s %s lb=%d size=%ld", name, direction,
+				             kModeName[mode], i, (long)count);
+				ConvertStreamReset(s, c, kLineBreaks[i]);
+				err = RunMode(s, mode, buf[1], &size, ibuf, count);
+				if (err != 0) {
+					Failf("stream: %s", ErrorDescriptionOrDie(err));
+					continue;
+				}
+				if (size != expect) {
+					Failf("output size %ld, expect %ld", (long)size,
+					      (long)expect);
+				} else if (memcmp(buf[0], buf[1], size) != 0) {
+					Failf("output does not match");
+				}
+				if (s->stats.insize != count || s->stats.outsize != size) {
+					Failf("stats: insize = %ld, outsize = %ld",
+					      (long)s->stats.insize, (long)s->stats.outsize);
+				}
+			}
+		}
+	}
+}
+
+// Test that a trailing CR is converted when the stream is finished.
+static void TestTrailingCR(struct ConvertStream *s, const struct Converter *c)
+{
+	static const UInt8 kInput[] = {'a', kCharCR};
+	static const UInt8 kExpect[] = {'a', kCharLF};
+	UInt8 obuf[16];
+	struct Memory out;
+	ErrorCode err;
+
+	SetTestName("trailing CR");
+	ConvertStreamReset(s, c, kLineBreakLF);
+	out.buf = obuf;
+	out.pos = 0;
+	out.size = sizeof(obuf);
+	s->write = WriteMemory;
+	s->writectx = &out;
+	err = ConvertStreamWrite(s, kInput, sizeof(kInput));
+	if (err == 0) {
+		err = ConvertStreamFinish(s);
+	}
+	if (err != 0) {
+		Failf("stream: %s", ErrorDescriptionOrDie(err));
+	} else if (out.pos != sizeof(kExpect) ||
+	           memcmp(obuf, kExpect, sizeof(kExpect)) != 0) {
+		Failf("output does not match");
+	}
+}
+
+// Test that a strict converter stops at the incomplete sequence at the end of
+// the input, which is otherwise valid, and that the output before it matches.
+static void TestStrict(struct ConvertStream *s, const char *name,
+                       const struct Converter *c, UInt8 *ibuf, Size isize,
+                       UInt8 **buf, Size expect)
+{
+	int mode;
+	Size size;
+	ErrorCode err;
+
+	for (mode = 0; mode < kModeCount; mode++) {
+		SetTestNamef("%s strict %s", name, kModeName[mode]);
+		ConvertStreamReset(s, c, kLineBreakKeep);
+		err = RunMode(s, mode, buf[1], &size, ibuf, isize);
+		if (err != kErrorUnmappable) {
+			Failf("stream: got %s, expect %s", ErrorDescriptionOrDie(err),
+			      ErrorDescriptionOrDie(kErrorUnmappable));
+			continue;
+		}
+		if (s->state.unmapped != kCharInvalid) {
+			Failf("unmapped = U+%04lX, expect invalid",
+			      (unsigned long)s->state.unmapped);
+		}
+		if (s->stats.insize != isize - 1) {
+			Failf("insize = %ld, expect %ld", (long)s->stats.insize,
+			      (long)(isize - 1));
+		}
+		if (size != expect) {
+			Failf("output size %ld, expect %ld", (long)size, (long)expect);
+		} else if (memcmp(buf[0], buf[1], size) != 0) {
+			Failf("output does not match");
+		}
+	}
+}
+
+static void TestCharmap(struct ConvertStream *s, const char *name,
+                        struct CharmapData data, UInt8 **buf)
+{
+	struct TestConverters c;
+	struct Converter cs;
+	Ptr datap;
+	Size size;
+	ErrorCode err;
+
+	SetTestName(name);
+	if (!BuildTestConverters(&c, data, kToUTF32BE)) {
+		return;
+	}
+
+	// Reverse conversion input is the forward conversion output, ending with
+	// an incomplete sequence.
+	MakeText(buf[2], kInputSize);
+	TestConverter(s, name, "forward", &c.forward, buf[2], kInputSize, buf);
+	TestConverter(s, name, "utf32", &c.wide, buf[2], kInputSize, buf);
+	size = ConvertReference(&c.forward, kLineBreakKeep, buf[3], kOutputSize,
+	                        buf[2], kInputSize);
+	if (size > kInputSize * 2) {
+		size = kInputSize * 2;
+	}
+	buf[3][size++] = 0xe3;
+	TestConverter(s, name, "reverse", &c.reverse, buf[3], size, buf);
+
+	if (data.ptr[0] == kTableLineBreak) {
+		TestTrailingCR(s, &c.forward);
+	} else {
+		// Only text which is converted for line breaks has no unmappable
+		// characters.
+		datap = (Ptr)data.ptr;
+		err = ConverterBuild(&cs, &datap, data.size, kFromUTF8Strict);
+		if (err != 0) {
+			Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		} else {
+			TestStrict(s, name, &cs, buf[3], size, buf,
+			           ConvertReference(&c.reverse, kLineBreakKeep, buf[0],
+			                            kOutputSize, buf[3], size - 1));
+			ConverterDispose(&cs);
+		}
+	}
+
+	DisposeTestConverters(&c);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const kCharmaps[] = {"Roman", "Hebrew", "Japanese"};
+	struct ConvertStream s;
+	struct CharmapData data;
+	const char *name;
+	UInt8 *buf[4];
+	int i, j;
+	ErrorCode err;
+
+	(void)argc;
+	(void)argv;
+
+	for (i = 0; i < 4; i++) {
+		buf[i] = malloc(kOutputSize);
+		if (buf[i] == NULL) {
+			Fatalf("malloc failed");
+		}
+	}
+	err = ConvertStreamInit(&s);
+	if (err != 0) {
+		Fatalf("ConvertStreamInit: %s", ErrorDescriptionOrDie(err));
+	}
+
+	TestCharmap(&s, "LineBreak", TestLineBreakData(), buf);
+	for (i = 0;; i++) {
+		name = CharmapID(i);
+		if (name == NULL) {
+			break;
+		}
+		for (j = 0; j < (int)ARRAY_COUNT(kCharmaps); j++) {
+			if (strcmp(name, kCharmaps[j]) == 0) {
+				break;
+			}
+		}
+		data = CharmapData(i);
+		if (j < (int)ARRAY_COUNT(kCharmaps) && data.ptr != NULL) {
+			TestCharmap(&s, name, data, buf);
+		}
+	}
+
+	ConvertStreamDispose(&s);
+	for (i = 0; i < 4; i++) {
+		free(buf[i]);
+	}
+	return TestsDone();
+}
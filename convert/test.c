@@ -0,0 +1,104 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "convert/test.h"
+
+#include "lib/test.h"
+#include "lib/util.h"
+
+static const UInt8 kLineBreakTable[1] = {kTableLineBreak};
+
+struct CharmapData TestLineBreakData(void)
+{
+	struct CharmapData data;
+
+	data.ptr = kLineBreakTable;
+	data.size = sizeof(kLineBreakTable);
+	return data;
+}
+
+Boolean BuildTestConverters(struct TestConverters *c, struct CharmapData data,
+                            ConvertDirection wide)
+{
+	Ptr datap;
+	ErrorCode err;
+
+	datap = (Ptr)data.ptr;
+	err = ConverterBuild(&c->forward, &datap, data.size, kToUTF8);
+	if (err != 0) {
+		goto fail0;
+	}
+	err = ConverterBuild(&c->reverse, &datap, data.size, kFromUTF8);
+	if (err != 0) {
+		goto fail1;
+	}
+	err = ConverterBuild(&c->wide, &datap, data.size, wide);
+	if (err != 0) {
+		goto fail2;
+	}
+	return true;
+
+fail2:
+	ConverterDispose(&c->reverse);
+fail1:
+	ConverterDispose(&c->forward);
+fail0:
+	Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+	return false;
+}
+
+void DisposeTestConverters(struct TestConverters *c)
+{
+	ConverterDispose(&c->forward);
+	ConverterDispose(&c->reverse);
+	ConverterDispose(&c->wide);
+}
+
+void MakeText(UInt8 *ptr, Size size)
+{
+	Size i;
+	UInt32 r;
+
+	for (i = 0; i < size; i++) {
+		r = TestRand() % 64;
+		if (r < 24) {
+			ptr[i] = 'a' + TestRand() % 26;
+		} else if (r < 28) {
+			ptr[i] = kCharCR;
+		} else if (r < 30) {
+			ptr[i] = kCharLF;
+		} else if (r < 31) {
+			ptr[i] = 1 + TestRand() % 127;
+		} else {
+			ptr[i] = 128 + TestRand() % 128;
+		}
+	}
+}
+
+Size ConvertReference(const struct Converter *c, LineBreakConversion lc,
+                      UInt8 *obuf, Size osize, UInt8 *ibuf, Size isize)
+{
+	struct ConverterState st;
+	const UInt8 *iptr;
+	UInt8 *optr;
+	UInt8 save;
+	int i;
+
+	save = ibuf[isize];
+	ibuf[isize] = 0;
+	MemClear(&st, sizeof(st));
+	iptr = ibuf;
+	optr = obuf;
+	c->run(ConverterData(c), lc, &st, &optr, obuf + osize, &iptr,
+	       ibuf + isize + 1);
+	if (iptr != ibuf + isize + 1 || optr - obuf < c->unitsize) {
+		Fatalf("reference conversion failed");
+	}
+	for (i = 1; i <= c->unitsize; i++) {
+		if (optr[-i] != 0) {
+			Fatalf("reference conversion failed");
+		}
+	}
+	ibuf[isize] = save;
+	return optr - obuf - c->unitsize;
+}
@@ -0,0 +1,44 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_TEST_H
+#define CONVERT_TEST_H
+// test.h - test data and reference conversion for converter tests.
+
+#include "convert/convert.h"
+#include "convert/data.h"
+#include "lib/defs.h"
+
+// Converters built from one conversion table.
+struct TestConverters {
+	// Converters to and from UTF-8.
+	struct Converter forward;
+	struct Converter reverse;
+	// Converter to UTF-16 or UTF-32.
+	struct Converter wide;
+};
+
+// Get the conversion table which only converts line breaks.
+struct CharmapData TestLineBreakData(void);
+
+// Build the converters for a conversion table, with the given direction for
+// the wide converter. On failure, fail the test and return false, with no
+// converters to dispose.
+Boolean BuildTestConverters(struct TestConverters *c, struct CharmapData data,
+                            ConvertDirection wide);
+
+// Free the converters built by BuildTestConverters.
+void DisposeTestConverters(struct TestConverters *c);
+
+// Fill a buffer with random text: mostly ASCII, with high bytes and each kind
+// of line break. This does not have to be valid text.
+void MakeText(UInt8 *ptr, Size size);
+
+// Convert the input all the way to the end, flushing the converter state with
+// a NUL byte which is temporarily stored after the input, so the input buffer
+// must have room for one more byte. Return the size of the output. Fatal error
+// if the conversion fails.
+Size ConvertReference(const struct Converter *c, LineBreakConversion lc,
+                      UInt8 *obuf, Size osize, UInt8 *ibuf, Size isize);
+
+#endif
@@ -0,0 +1,394 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// wide.c - UTF-16 and UTF-32 output.
+#include "convert/wide.h"
+
+#include "convert/scan.h"
+#include "lib/utf8.h"
+
+#include <string.h>
+
+// Pick a vector implementation, the same way as scan.c.
+#if __SSE2__
+#define WIDE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+enum {
+	// Size of the buffer for UTF-8 output from the wrapped converter.
+	kWideBufferSize = 1024
+};
+
+// Data for a converter which widens the output of a UTF-8 converter. The
+// UTF-8 converter's data follows the header, at kWideHeaderSize.
+struct ConvertWideData {
+	ConvertRunf run;
+	ConvertSplitf split;
+};
+
+// Offset of the UTF-8 converter's data. This keeps the data aligned.
+#define kWideHeaderSize ((sizeof(struct ConvertWideData) + 15) & ~(Size)15)
+
+int WideUnitSize(ConvertDirection form)
+{
+	switch (form) {
+	case kToUTF16BE:
+	case kToUTF16LE:
+		return 2;
+	case kToUTF32BE:
+	case kToUTF32LE:
+		return 4;
+	default:
+		return 1;
+	}
+}
+
+// Write a code point to the output. This is the same as WideWriteChar, but can
+// be inlined.
+static UInt8 *PutChar(UInt8 *optr, UInt32 ch, ConvertDirection form)
+{
+	UInt32 hi, lo;
+
+	switch (form) {
+	case kToUTF16BE:
+		if (ch > 0xffff) {
+			hi = 0xd7c0 + (ch >> 10);
+			lo = 0xdc00 | (ch & 0x3ff);
+			optr[0] = hi >> 8;
+			optr[1] = hi;
+			optr[2] = lo >> 8;
+			optr[3] = lo;
+			return optr + 4;
+		}
+		optr[0] = ch >> 8;
+		optr[1] = ch;
+		return optr + 2;
+	case kToUTF16LE:
+		if (ch > 0xffff) {
+			hi = 0xd7c0 + (ch >> 10);
+			lo = 0xdc00 | (ch & 0x3ff);
+			optr[0] = hi;
+			optr[1] = hi >> 8;
+			optr[2] = lo;
+			optr[3] = lo >> 8;
+			return optr + 4;
+		}
+		optr[0] = ch;
+		optr[1] = ch >> 8;
+		return optr + 2;
+	case kToUTF32BE:
+		optr[0] = 0;
+		optr[1] = ch >> 16;
+		optr[2] = ch >> 8;
+		optr[3] = ch;
+		return optr + 4;
+	case kToUTF32LE:
+		optr[0] = ch;
+		optr[1] = ch >> 8;
+		optr[2] = ch >> 16;
+		optr[3] = 0;
+		return optr + 4;
+	default:
+		return optr;
+	}
+}
+
+UInt8 *WideWriteChar(UInt8 *optr, UInt32 ch, ConvertDirection form)
+{
+	return PutChar(optr, ch, form);
+}
+
+UInt8 *WideCopyASCII(UInt8 *optr, const UInt8 *ptr, const UInt8 *end,
+                     ConvertDirection form)
+{
+#if WIDE_SSE2
+	__m128i v, z, lo, hi;
+#endif
+
+	// Widen 16 characters at a time, by interleaving them with zero bytes.
+#if WIDE_SSE2
+	z = _mm_setzero_si128();
+	switch (form) {
+	case kToUTF16BE:
+		for (; end - ptr >= 16; ptr += 16, optr += 32) {
+			v = _mm_loadu_si128((const void *)ptr);
+			_mm_storeu_si128((void *)optr, _mm_unpacklo_epi8(z, v));
+			_mm_storeu_si128((void *)(optr + 16), _mm_unpackhi_epi8(z, v));
+		}
+		break;
+	case kToUTF16LE:
+		for (; end - ptr >= 16; ptr += 16, optr += 32) {
+			v = _mm_loadu_si128((const void *)ptr);
+			_mm_storeu_si128((void *)optr, _mm_unpacklo_epi8(v, z));
+			_mm_storeu_si128((void *)(optr + 16), _mm_unpackhi_epi8(v, z));
+		}
+		break;
+	case kToUTF32BE:
+		for (; end - ptr >= 16; ptr += 16, optr += 64) {
+			v = _mm_loadu_si128((const void *)ptr);
+			lo = _mm_unpacklo_epi8(z, v);
+			hi = _mm_unpackhi_epi8(z, v);
+			_mm_storeu_si128((void *)optr, _mm_unpacklo_epi16(z, lo));
+			_mm_storeu_si128((void *)(optr + 16), _mm_unpackhi_epi16(z, lo));
+			_mm_storeu_si128((void *)(optr + 32), _mm_unpacklo_epi16(z, hi));
+			_mm_storeu_si128((void *)(optr + 48), _mm_unpackhi_epi16(z, hi));
+		}
+		break;
+	case kToUTF32LE:
+		for (; end - ptr >= 16; ptr += 16, optr += 64) {
+			v = _mm_loadu_si128((const void *)ptr);
+			lo = _mm_unpacklo_epi8(v, z);
+			hi = _mm_unpackhi_epi8(v, z);
+			_mm_storeu_si128((void *)optr, _mm_unpacklo_epi16(lo, z));
+			_mm_storeu_si128((void *)(optr + 16), _mm_unpackhi_epi16(lo, z));
+			_mm_storeu_si128((void *)(optr + 32), _mm_unpacklo_epi16(hi, z));
+			_mm_storeu_si128((void *)(optr + 48), _mm_unpackhi_epi16(hi, z));
+		}
+		break;
+	default:
+		break;
+	}
+#endif
+
+	switch (form) {
+	case kToUTF16BE:
+		for (; ptr < end; ptr++, optr += 2) {
+			optr[0] = 0;
+			optr[1] = *ptr;
+		}
+		break;
+	case kToUTF16LE:
+		for (; ptr < end; ptr++, optr += 2) {
+			optr[0] = *ptr;
+			optr[1] = 0;
+		}
+		break;
+	case kToUTF32BE:
+		for (; ptr < end; ptr++, optr += 4) {
+			optr[0] = 0;
+			optr[1] = 0;
+			optr[2] = 0;
+			optr[3] = *ptr;
+		}
+		break;
+	case kToUTF32LE:
+		for (; ptr < end; ptr++, optr += 4) {
+			optr[0] = *ptr;
+			optr[1] = 0;
+			optr[2] = 0;
+			optr[3] = 0;
+		}
+		break;
+	default:
+		break;
+	}
+	return optr;
+}
+
+UInt8 *WideConvertUTF8(UInt8 *optr, const UInt8 *ptr, const UInt8 *end,
+                       ConvertDirection form)
+{
+	UInt32 ch;
+	Size n;
+	int len;
+	unsigned c;
+
+	while (ptr < end) {
+		c = *ptr;
+		if (c < 0x80) {
+			n = ScanHighByte(ptr, end);
+			optr = WideCopyASCII(optr, ptr, ptr + n, form);
+			ptr += n;
+			continue;
+		}
+		// Fast path for the common two and three byte sequences.
+		if (end - ptr >= 3 && (ptr[1] & 0xc0) == 0x80) {
+			if (0xc2 <= c && c < 0xe0) {
+				optr = PutChar(optr, ((c & 0x1f) << 6) | (ptr[1] & 0x3f), form);
+				ptr += 2;
+				continue;
+			}
+			if (0xe1 <= c && c < 0xf0 && c != 0xed && (ptr[2] & 0xc0) == 0x80) {
+				optr = PutChar(optr,
+				               ((c & 0x0f) << 12) | ((ptr[1] & 0x3f) << 6) |
+				                   (ptr[2] & 0x3f),
+				               form);
+				ptr += 3;
+				continue;
+			}
+		}
+		len = UTF8Decode(ptr, end, &ch);
+		if (len <= 0) {
+			ch = kCharReplacement;
+			len = len == 0 ? end - ptr : -len;
+		}
+		optr = PutChar(optr, ch, form);
+		ptr += len;
+	}
+	return optr;
+}
+
+Size WideCountUTF8(const UInt8 *ptr, const UInt8 *end, ConvertDirection form)
+{
+	UInt32 ch;
+	Size n, count;
+	int len, unit;
+
+	unit = WideUnitSize(form);
+	count = 0;
+	while (ptr < end) {
+		n = ScanHighByte(ptr, end);
+		count += n * unit;
+		ptr += n;
+		if (ptr == end) {
+			break;
+		}
+		len = UTF8Decode(ptr, end, &ch);
+		if (len <= 0) {
+			ch = kCharReplacement;
+			len = len == 0 ? end - ptr : -len;
+		}
+		count += ch > 0xffff ? 4 : unit;
+		ptr += len;
+	}
+	return count;
+}
+
+ErrorCode ConvertWideBuild(Handle *out, Handle data, ConvertRunf run,
+                           ConvertSplitf split)
+{
+	Handle h;
+	struct ConvertWideData *cvt;
+	Size size;
+
+	size = GetHandleSize(data);
+	h = NewHandle(kWideHeaderSize + size);
+	if (h == NULL) {
+		return kErrorNoMemory;
+	}
+	cvt = (void *)*h;
+	cvt->run = run;
+	cvt->split = split;
+	memcpy(*h + kWideHeaderSize, *data, size);
+	*out = h;
+	return 0;
+}
+
+static void ConvertWideRun(const void *cvtptr, LineBreakConversion lc,
+                           struct ConverterState *stateptr, UInt8 **optr,
+                           UInt8 *oend, const UInt8 **iptr, const UInt8 *iend,
+                           ConvertDirection form)
+{
+	const struct ConvertWideData *cvt = cvtptr;
+	const void *data = (const UInt8 *)cvtptr + kWideHeaderSize;
+	UInt8 buf[kWideBufferSize];
+	UInt8 *opos = *optr, *bpos;
+	const UInt8 *ipos = *iptr, *istart;
+	Size room;
+	int scale;
+
+	// Each byte of UTF-8 becomes at most 2 bytes of UTF-16 or 4 bytes of
+	// UTF-32, so limit the UTF-8 output to what will fit once widened.
+	scale = form == kToUTF16BE || form == kToUTF16LE ? 2 : 4;
+	for (;;) {
+		room = (oend - opos) / scale;
+		if (room > kWideBufferSize) {
+			room = kWideBufferSize;
+		}
+		istart = ipos;
+		bpos = buf;
+		cvt->run(data, lc, stateptr, &bpos, buf + room, &ipos, iend);
+		opos = WideConvertUTF8(opos, buf, bpos, form);
+		if (ipos == iend || (ipos == istart && bpos == buf)) {
+			break;
+		}
+	}
+
+	*optr = opos;
+	*iptr = ipos;
+}
+
+void ConvertWideRun16BE(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	ConvertWideRun(cvtptr, lc, stateptr, optr, oend, iptr, iend, kToUTF16BE);
+}
+
+void ConvertWideRun16LE(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	ConvertWideRun(cvtptr, lc, stateptr, optr, oend, iptr, iend, kToUTF16LE);
+}
+
+void ConvertWideRun32BE(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	ConvertWideRun(cvtptr, lc, stateptr, optr, oend, iptr, iend, kToUTF32BE);
+}
+
+void ConvertWideRun32LE(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, UInt8 **optr,
+                        UInt8 *oend, const UInt8 **iptr, const UInt8 *iend)
+{
+	ConvertWideRun(cvtptr, lc, stateptr, optr, oend, iptr, iend, kToUTF32LE);
+}
+
+static Size ConvertWideCount(const void *cvtptr, LineBreakConversion lc,
+                             struct ConverterState *stateptr,
+                             const UInt8 **iptr, const UInt8 *iend,
+                             ConvertDirection form)
+{
+	const struct ConvertWideData *cvt = cvtptr;
+	const void *data = (const UInt8 *)cvtptr + kWideHeaderSize;
+	UInt8 buf[kWideBufferSize];
+	UInt8 *bpos;
+	const UInt8 *ipos = *iptr, *istart;
+	struct ConvertStats *stats;
+	Size count;
+
+	// This runs the converter, but counting must not add to the statistics.
+	stats = stateptr->stats;
+	stateptr->stats = NULL;
+	count = 0;
+	for (;;) {
+		istart = ipos;
+		bpos = buf;
+		cvt->run(data, lc, stateptr, &bpos, buf + kWideBufferSize, &ipos, iend);
+		count += WideCountUTF8(buf, bpos, form);
+		if (ipos == iend || (ipos == istart && bpos == buf)) {
+			break;
+		}
+	}
+	stateptr->stats = stats;
+
+	*iptr = ipos;
+	return count;
+}
+
+Size ConvertWideCount16(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, const UInt8 **iptr,
+                        const UInt8 *iend)
+{
+	return ConvertWideCount(cvtptr, lc, stateptr, iptr, iend, kToUTF16BE);
+}
+
+Size ConvertWideCount32(const void *cvtptr, LineBreakConversion lc,
+                        struct ConverterState *stateptr, const UInt8 **iptr,
+                        const UInt8 *iend)
+{
+	return ConvertWideCount(cvtptr, lc, stateptr, iptr, iend, kToUTF32BE);
+}
+
+const UInt8 *ConvertWideSplit(const void *cvtptr, const UInt8 *start,
+                              const UInt8 *ptr, const UInt8 *end)
+{
+	const struct ConvertWideData *cvt = cvtptr;
+
+	return cvt->split((const UInt8 *)cvtptr + kWideHeaderSize, start, ptr,
+	                  end);
+}
@@ -0,0 +1,38 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef CONVERT_WIDE_H
+#define CONVERT_WIDE_H
+// wide.h - UTF-16 and UTF-32 output.
+#include "convert/convert.h"
+
+enum {
+	// Replacement character, for invalid UTF-8.
+	kCharReplacement = 0xfffd
+};
+
+// Return the size of a code unit in the output for the given direction, in
+// bytes.
+int WideUnitSize(ConvertDirection form);
+
+// Write a code point to the output in the given form, which must be one of the
+// UTF-16 or UTF-32 directions. Characters outside the BMP are written as
+// surrogate pairs in UTF-16. Needs up to 4 bytes of space. Return the new end
+// of the output.
+UInt8 *WideWriteChar(UInt8 *optr, UInt32 ch, ConvertDirection form);
+
+// Widen ASCII text to UTF-16 or UTF-32. The output must have room for one code
+// unit for each input byte. Return the new end of the output.
+UInt8 *WideCopyASCII(UInt8 *optr, const UInt8 *ptr, const UInt8 *end,
+                     ConvertDirection form);
+
+// Convert UTF-8 text to UTF-16 or UTF-32. Invalid and incomplete sequences are
+// replaced with U+FFFD. The output must have room for 2 bytes for each input
+// byte in UTF-16, or 4 bytes in UTF-32. Return the new end of the output.
+UInt8 *WideConvertUTF8(UInt8 *optr, const UInt8 *ptr, const UInt8 *end,
+                       ConvertDirection form);
+
+// Return the size of the output that WideConvertUTF8 would produce.
+Size WideCountUTF8(const UInt8 *ptr, const UInt8 *end, ConvertDirection form);
+
+#endif
@@ -0,0 +1,423 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "convert/wide.h"
+
+#include "convert/convert.h"
+#include "convert/data.h"
+#include "convert/test.h"
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	// Size of generated input.
+	kInputSize = 4 * 1024,
+
+	// Size of the output buffers.
+	kOutputSize = kInputSize * 16
+};
+
+static const char *const kFormName[] = {"UTF-16BE", "UTF-16LE", "UTF-32BE",
+                                        "UTF-32LE"};
+
+static const char *const kLineBreakName[4] = {"keep", "LF", "CR", "CRLF"};
+
+static UInt8 gInput[kInputSize + 1];
+static UInt8 gUTF8[kOutputSize];
+static UInt8 gExpect[kOutputSize];
+static UInt8 gOutput[kOutputSize];
+static UInt32 gChars[kOutputSize];
+
+// Fill a buffer with random text: mostly ASCII, with line breaks, high bytes,
+// and valid UTF-8 sequences.
+static void MakeMixedText(UInt8 *ptr, Size size)
+{
+	Size i;
+	UInt32 r, ch;
+
+	for (i = 0; i < size;) {
+		r = TestRand() % 64;
+		if (r < 24) {
+			ptr[i++] = 'a' + TestRand() % 26;
+		} else if (r < 28) {
+			ptr[i++] = kCharCR;
+		} else if (r < 30) {
+			ptr[i++] = kCharLF;
+		} else if (r < 31) {
+			ptr[i++] = 1 + TestRand() % 127;
+		} else if (r < 40) {
+			ptr[i++] = 128 + TestRand() % 128;
+		} else if (size - i >= 4) {
+			ch = TestRand() % 0x110000;
+			if (ch < 0x80 || (0xd800 <= ch && ch < 0xe000)) {
+				continue;
+			}
+			if (ch < 0x800) {
+				ptr[i++] = 0xc0 | (ch >> 6);
+			} else {
+				if (ch < 0x10000) {
+					ptr[i++] = 0xe0 | (ch >> 12);
+				} else {
+					ptr[i++] = 0xf0 | (ch >> 18);
+					ptr[i++] = 0x80 | ((ch >> 12) & 0x3f);
+				}
+				ptr[i++] = 0x80 | ((ch >> 6) & 0x3f);
+			}
+			ptr[i++] = 0x80 | (ch & 0x3f);
+		} else {
+			ptr[i++] = ' ';
+		}
+	}
+}
+
+// Return true if the bytes are a prefix of a valid UTF-8 sequence with the
+// given length. This checks the range of code points the sequence could
+// encode.
+static Boolean IsValidPrefix(const UInt8 *ptr, int n, int len)
+{
+	static const UInt32 kMin[5] = {0, 0, 0x80, 0x800, 0x10000};
+	UInt32 lo, hi;
+	int i;
+
+	lo = ptr[0] & (0x7f >> len);
+	for (i = 1; i < n; i++) {
+		if ((ptr[i] & 0xc0) != 0x80) {
+			return false;
+		}
+		lo = (lo << 6) | (ptr[i] & 0x3f);
+	}
+	hi = lo;
+	for (; i < len; i++) {
+		lo <<= 6;
+		hi = (hi << 6) | 0x3f;
+	}
+	if (lo < kMin[len]) {
+		lo = kMin[len];
+	}
+	if (hi > 0x10ffff) {
+		hi = 0x10ffff;
+	}
+	if (lo > hi) {
+		return false;
+	}
+	return lo < 0xd800 || hi > 0xdfff;
+}
+
+// Decode UTF-8, replacing each maximal subpart of an invalid sequence with
+// U+FFFD. Return the number of characters.
+static int DecodeReference(UInt32 *out, const UInt8 *ptr, const UInt8 *end)
+{
+	int n, len, i;
+	unsigned c;
+	UInt32 ch;
+
+	n = 0;
+	while (ptr < end) {
+		c = *ptr;
+		if (c < 0x80) {
+			out[n++] = c;
+			ptr++;
+			continue;
+		}
+		len = c >= 0xf8 ? 1 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+		for (i = 1; i <= len && ptr + i <= end; i++) {
+			if (len == 1 || !IsValidPrefix(ptr, i, len)) {
+				break;
+			}
+		}
+		i--;
+		if (i == len) {
+			ch = c & (0x7f >> len);
+			for (i = 1; i < len; i++) {
+				ch = (ch << 6) | (ptr[i] & 0x3f);
+			}
+			out[n++] = ch;
+			ptr += len;
+		} else {
+			out[n++] = kCharReplacement;
+			ptr += i > 0 ? i : 1;
+		}
+	}
+	return n;
+}
+
+// Encode characters as UTF-16 or UTF-32. Return the size of the output.
+static int EncodeReference(UInt8 *out, const UInt32 *chars, int count,
+                           ConvertDirection form)
+{
+	UInt32 u[2], ch;
+	int i, j, k, n, pos;
+
+	pos = 0;
+	for (i = 0; i < count; i++) {
+		ch = chars[i];
+		if (form == kToUTF32BE || form == kToUTF32LE) {
+			for (j = 0; j < 4; j++) {
+				k = form == kToUTF32BE ? 3 - j : j;
+				out[pos++] = ch >> (k * 8);
+			}
+			continue;
+		}
+		if (ch >= 0x10000) {
+			u[0] = 0xd800 + ((ch - 0x10000) >> 10);
+			u[1] = 0xdc00 + (ch & 0x3ff);
+			n = 2;
+		} else {
+			u[0] = ch;
+			n = 1;
+		}
+		for (j = 0; j < n; j++) {
+			if (form == kToUTF16BE) {
+				out[pos++] = u[j] >> 8;
+				out[pos++] = u[j];
+			} else {
+				out[pos++] = u[j];
+				out[pos++] = u[j] >> 8;
+			}
+		}
+	}
+	return pos;
+}
+
+static void TestCopyASCII(void)
+{
+	static UInt8 input[100], expect[400], output[400];
+	ConvertDirection form;
+	UInt8 *end;
+	int i, len, exlen;
+
+	for (i = 0; i < (int)sizeof(input); i++) {
+		input[i] = (i * 7 + 1) & 0x7f;
+	}
+	for (form = kToUTF16BE; form <= kToUTF32LE; form++) {
+		for (len = 0; len <= 70; len++) {
+			SetTestNamef("copy ASCII %s len=%d", kFormName[form - kToUTF16BE],
+			             len);
+			for (i = 0; i < len; i++) {
+				gChars[i] = input[i + 3];
+			}
+			exlen = EncodeReference(expect, gChars, len, form);
+			memset(output, 0xff, sizeof(output));
+			end = WideCopyASCII(output, input + 3, input + 3 + len, form);
+			if (end - output != exlen || memcmp(output, expect, exlen) != 0) {
+				Failf("incorrect output");
+			} else if (output[exlen] != 0xff) {
+				Failf("wrote past end of output");
+			}
+		}
+	}
+}
+
+struct LineBreakCase {
+	const char *input;
+	// Expected output, as UTF-16BE.
+	const char *output;
+	int outlen;
+};
+
+// Conversion of UTF-8 with the line break engine. The input is followed by a
+// NUL byte, so incomplete sequences are flushed.
+static const struct LineBreakCase kLineBreakCases[] = {
+	{"a\xc3\xa9", "\0a\0\xe9\0", 6},
+	{"\xe2\x82\xac", "\x20\xac\0", 4},
+	{"\xf0\x9f\x98\x80", "\xd8\x3d\xde\x00\0", 6},
+	{"\xc3", "\xff\xfd\0", 4},
+	{"\xe1\x80" "a", "\xff\xfd\0a\0", 6},
+	{"\xe0\x80\x80", "\xff\xfd\xff\xfd\xff\xfd\0", 8},
+	{"\xed\xa0\x80", "\xff\xfd\xff\xfd\xff\xfd\0", 8},
+	{"\xf4\x90\x80\x80", "\xff\xfd\xff\xfd\xff\xfd\xff\xfd\0", 10},
+	{"\xf1\x80\x80\xe1\x80\xc3", "\xff\xfd\xff\xfd\xff\xfd\0", 8},
+	{"\xff\x80", "\xff\xfd\xff\xfd\0", 6},
+	{"\r\xc3\n", "\0\r\xff\xfd\0\n\0", 8},
+};
+
+static void TestLineBreakCases(void)
+{
+	const struct LineBreakCase *c;
+	struct Converter cv;
+	struct ConverterState st;
+	struct CharmapData data;
+	Ptr datap;
+	const UInt8 *iptr, *iend, *end;
+	UInt8 *optr;
+	int i, chunk, inlen;
+	ErrorCode err;
+
+	data = TestLineBreakData();
+	datap = (Ptr)data.ptr;
+	err = ConverterBuild(&cv, &datap, data.size, kToUTF16BE);
+	if (err != 0) {
+		Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		return;
+	}
+	for (i = 0; i < (int)ARRAY_COUNT(kLineBreakCases); i++) {
+		c = &kLineBreakCases[i];
+		inlen = strlen(c->input) + 1;
+		memcpy(gInput, c->input, inlen);
+		end = gInput + inlen;
+		for (chunk = 1; chunk <= inlen; chunk++) {
+			SetTestNamef("line break case %d chunk=%d", i, chunk);
+			MemClear(&st, sizeof(st));
+			iptr = gInput;
+			optr = gOutput;
+			iend = gInput;
+			do {
+				iend += chunk;
+				if (iend > end) {
+					iend = end;
+				}
+				cv.run(ConverterData(&cv), kLineBreakKeep, &st, &optr,
+				       gOutput + kOutputSize, &iptr, iend);
+			} while (iend < end);
+			if (iptr != end) {
+				Failf("some data failed to convert");
+			} else if (optr - gOutput != c->outlen ||
+			           memcmp(gOutput, c->output, c->outlen) != 0) {
+				Failf("incorrect output");
+			}
+		}
+	}
+	ConverterDispose(&cv);
+}
+
+// Convert the input, with the given number of bytes of input and space for
+// output in each call. Return the size of the output, or -1 on failure.
+static int ConvertChunked(const struct Converter *c, LineBreakConversion lc,
+                          int ichunk, int ochunk, const UInt8 *ibuf, int ilen)
+{
+	struct ConverterState st;
+	const UInt8 *iptr, *iend, *end;
+	UInt8 *optr, *oend, *olast;
+
+	MemClear(&st, sizeof(st));
+	iptr = ibuf;
+	iend = ibuf;
+	end = ibuf + ilen;
+	optr = gOutput;
+	oend = gOutput;
+	for (;;) {
+		if (iptr == iend) {
+			if (iend == end) {
+				break;
+			}
+			iend += ichunk;
+			if (iend > end) {
+				iend = end;
+			}
+		}
+		olast = optr;
+		oend += ochunk;
+		if (oend > gOutput + kOutputSize) {
+			oend = gOutput + kOutputSize;
+		}
+		c->run(ConverterData(c), lc, &st, &optr, oend, &iptr, iend);
+		if (iptr != iend && optr == olast && oend == gOutput + kOutputSize) {
+			Failf("no progress");
+			return -1;
+		}
+	}
+	return optr - gOutput;
+}
+
+// Test that converting to UTF-16 or UTF-32 gives the same result as converting
+// to UTF-8 and then decoding it, and that counting gives the same size.
+static void TestConverter(const char *name, struct CharmapData data)
+{
+	static const int kIChunks[] = {1, 3, 64, kInputSize + 1};
+	static const int kOChunks[] = {9, kOutputSize};
+	struct Converter cf, cw;
+	struct ConverterState st;
+	ConvertDirection form;
+	Ptr datap;
+	const UInt8 *iptr;
+	UInt8 *optr;
+	Size count;
+	int lc, i, j, len, exlen, outlen;
+	ErrorCode err;
+
+	SetTestName(name);
+	datap = (Ptr)data.ptr;
+	err = ConverterBuild(&cf, &datap, data.size, kToUTF8);
+	if (err != 0) {
+		Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+		return;
+	}
+	MakeMixedText(gInput, kInputSize);
+	gInput[kInputSize] = 0;
+	for (form = kToUTF16BE; form <= kToUTF32LE; form++) {
+		SetTestNamef("%s %s", name, kFormName[form - kToUTF16BE]);
+		err = ConverterBuild(&cw, &datap, data.size, form);
+		if (err != 0) {
+			Failf("ConverterBuild: %s", ErrorDescriptionOrDie(err));
+			continue;
+		}
+		if (cw.unitsize != WideUnitSize(form)) {
+			Failf("unitsize = %d", cw.unitsize);
+		}
+		for (lc = 0; lc < 4; lc++) {
+			MemClear(&st, sizeof(st));
+			iptr = gInput;
+			optr = gUTF8;
+			cf.run(ConverterData(&cf), lc, &st, &optr, gUTF8 + kOutputSize,
+			       &iptr, gInput + kInputSize + 1);
+			len = DecodeReference(gChars, gUTF8, optr);
+			exlen = EncodeReference(gExpect, gChars, len, form);
+
+			for (i = 0; i < (int)ARRAY_COUNT(kIChunks); i++) {
+				for (j = 0; j < (int)ARRAY_COUNT(kOChunks); j++) {
+					SetTestNamef("%s %s %s ichunk=%d ochunk=%d", name,
+					             kFormName[form - kToUTF16BE],
+					             kLineBreakName[lc], kIChunks[i], kOChunks[j]);
+					outlen = ConvertChunked(&cw, lc, kIChunks[i], kOChunks[j],
+					                        gInput, kInputSize + 1);
+					if (outlen >= 0 && (outlen != exlen ||
+					                    memcmp(gOutput, gExpect, exlen) != 0)) {
+						Failf("incorrect output");
+					}
+				}
+			}
+
+			SetTestNamef("%s %s %s count", name, kFormName[form - kToUTF16BE],
+			             kLineBreakName[lc]);
+			MemClear(&st, sizeof(st));
+			iptr = gInput;
+			count = ConverterCount(&cw, lc, &st, &iptr, gInput + kInputSize + 1);
+			if (count != exlen) {
+				Failf("count = %ld, expect %d", (long)count, exlen);
+			}
+		}
+		ConverterDispose(&cw);
+	}
+	ConverterDispose(&cf);
+}
+
+int main(int argc, char **argv)
+{
+	struct CharmapData data;
+	const char *name;
+	int i;
+
+	(void)argc;
+	(void)argv;
+
+	TestCopyASCII();
+	TestLineBreakCases();
+
+	TestConverter("LineBreak", TestLineBreakData());
+	for (i = 0;; i++) {
+		name = CharmapName(i);
+		if (name == NULL) {
+			break;
+		}
+		data = CharmapData(i);
+		if (data.ptr != NULL) {
+			TestConverter(name, data);
+		}
+	}
+
+	return TestsDone();
+}
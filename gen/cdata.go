@@ -28,6 +28,21 @@ const datalookup = `struct CharmapData CharmapData(int cmap) {
 	data.size = off1 - off0;
 	return data;
 }
+
+const UInt8 *CharmapReverseData(int cmap, Size *size) {
+	UInt32 off0, off1;
+	*size = 0;
+	if (cmap < 0 || CHARMAP_COUNT <= cmap) {
+		return 0;
+	}
+	off0 = kCharmapReverseOffset[cmap];
+	off1 = kCharmapReverseOffset[cmap+1];
+	if (off0 == off1) {
+		return 0;
+	}
+	*size = (off1 - off0) * sizeof(UInt16);
+	return (const UInt8 *)(kCharmapReverse + off0);
+}
 `
 
 func writeInfo(d *scriptdata, filename string) error {
@@ -109,9 +124,46 @@ func writeData(d *scriptdata, filename string) error {
 	}
 	w.WriteString("\n};\n")
 
+	writeReverse(&s, d)
+
 	w.WriteString(formatOn)
 
 	w.WriteString(datalookup)
 
 	return s.flush()
 }
+
+// writeReverse writes the precompiled reverse conversion data. Offsets are in
+// 16-bit words.
+func writeReverse(s *csource, d *scriptdata) {
+	offsets := make([]int, len(d.charmaps)+1)
+	var offset, last int
+	for i, cm := range d.charmaps {
+		offsets[i] = offset
+		offset += len(cm.reverse)
+		if len(cm.reverse) != 0 {
+			last = i
+		}
+	}
+	offsets[len(offsets)-1] = offset
+
+	w := s.writer
+	fmt.Fprintf(w, "static const %s kCharmapReverseOffset[CHARMAP_COUNT + 1] = {", arrayIntType(offsets))
+	s.ints(offsets)
+	w.WriteString("\n};\n")
+
+	w.WriteString("static const UInt16 kCharmapReverse[] = {")
+	if offset == 0 {
+		w.WriteString("0")
+	}
+	for i, cm := range d.charmaps {
+		if len(cm.reverse) != 0 {
+			fmt.Fprintf(w, "\n\t/* %s */", cm.name)
+			s.words(cm.reverse, i == last)
+			if i != last {
+				w.WriteByte('\n')
+			}
+		}
+	}
+	w.WriteString("\n};\n")
+}
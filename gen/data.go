@@ -129,6 +129,7 @@ type charmapinfo struct {
 	script   int
 	regions  []int
 	data     []byte
+	reverse  []uint16
 }
 
 // readCharmaps reads and parses the charmaps.csv file.
@@ -217,6 +218,10 @@ func readCharmaps(srcdir, filename string, scripts, regions map[string]int) ([]c
 				return nil, fmt.Errorf("%s: %v", file, err)
 			}
 			ifo.data = t.Data()
+			ifo.reverse, err = t.ReverseData()
+			if err != nil {
+				return nil, fmt.Errorf("%s: %v", file, err)
+			}
 		}
 		arr = append(arr, ifo)
 	}
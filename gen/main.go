@@ -85,6 +85,9 @@ func mainE() error {
 	if err := writeRez(&d, filepath.Join(destdir, "charmap.r")); err != nil {
 		return err
 	}
+	if err := writeNorm(filepath.Join(destdir, "normalize_data.c")); err != nil {
+		return err
+	}
 	return nil
 }
 
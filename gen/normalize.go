@@ -0,0 +1,208 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"sort"
+	"unicode/utf8"
+
+	"golang.org/x/text/unicode/norm"
+)
+
+// This file creates the Unicode data for normalizing text before it is
+// converted from UTF-8. See convert/normalize.c.
+
+const (
+	maxRune = 0x10ffff
+
+	// Hangul syllables are decomposed and composed algorithmically.
+	hangulFirst = 0xac00
+	hangulLast  = 0xd7a3
+
+	// Must match kNormalizeMaxDecomposition in convert/normalize_data.h.
+	maxDecomposition = 4
+
+	// Flags for each code point, must match convert/normalize_data.h.
+	normSlow = 1 // May change when normalized, or combine with previous.
+	normHold = 2 // May combine with the following code point.
+)
+
+type normPair struct {
+	first, second, composite rune
+}
+
+type normdata struct {
+	blocks []int      // Index of the flag block for each 256 code points.
+	flags  [][]byte   // Flag blocks, 2 bits per code point.
+	ccc    []int      // Code point << 8 | combining class, sorted.
+	dchars []int      // Code points which decompose, sorted.
+	dindex []int      // Offset of each decomposition in ddata.
+	ddata  []int      // Decompositions, concatenated.
+	pairs  []normPair // Canonical composition pairs, sorted.
+}
+
+func isHangul(r rune) bool {
+	return hangulFirst <= r && r <= hangulLast
+}
+
+func genNorm() (*normdata, error) {
+	var d normdata
+	blockmap := make(map[string]int)
+	// Block 0 is the block with no flags.
+	zero := make([]byte, 64)
+	blockmap[string(zero)] = 0
+	d.flags = append(d.flags, zero)
+	var composites []rune
+	for b := 0; b < (maxRune+1)>>8; b++ {
+		block := make([]byte, 64)
+		for i := 0; i < 256; i++ {
+			r := rune(b<<8 | i)
+			if !utf8.ValidRune(r) {
+				continue
+			}
+			s := string(r)
+			p := norm.NFC.PropertiesString(s)
+			if p.CCC() == 0 && !isHangul(r) && norm.NFC.String(s) != s {
+				// Singletons and composition exclusions are left unchanged,
+				// because conversion tables map them to different characters
+				// than their decompositions.
+				continue
+			}
+			var f byte
+			if !p.BoundaryBefore() || !norm.NFC.IsNormalString(s) {
+				f |= normSlow
+			}
+			if !p.BoundaryAfter() {
+				f |= normHold
+			}
+			block[i>>2] |= f << ((i & 3) * 2)
+			if c := p.CCC(); c != 0 {
+				d.ccc = append(d.ccc, int(r)<<8|int(c))
+			}
+			if isHangul(r) {
+				continue
+			}
+			dec := []rune(norm.NFD.String(s))
+			if len(dec) == 1 && dec[0] == r {
+				continue
+			}
+			if len(dec) > maxDecomposition {
+				return nil, fmt.Errorf("decomposition of U+%04X is too long", r)
+			}
+			d.dchars = append(d.dchars, int(r))
+			d.dindex = append(d.dindex, len(d.ddata))
+			for _, c := range dec {
+				d.ddata = append(d.ddata, int(c))
+			}
+			if len(dec) >= 2 && norm.NFC.String(s) == s {
+				composites = append(composites, r)
+			}
+		}
+		idx, ok := blockmap[string(block)]
+		if !ok {
+			idx = len(d.flags)
+			blockmap[string(block)] = idx
+			d.flags = append(d.flags, block)
+		}
+		d.blocks = append(d.blocks, idx)
+	}
+	d.dindex = append(d.dindex, len(d.ddata))
+	if len(d.flags) > 256 {
+		return nil, errors.New("too many normalization flag blocks")
+	}
+	if len(d.ddata) > 0xffff {
+		return nil, errors.New("too much decomposition data")
+	}
+
+	// Find the pair that each primary composite is composed from. This is the
+	// last code point in its decomposition which composes with the NFC form of
+	// the rest.
+	for _, r := range composites {
+		dec := []rune(norm.NFD.String(string(r)))
+		var found bool
+		for i := len(dec) - 1; i > 0 && !found; i-- {
+			rest := make([]rune, 0, len(dec)-1)
+			rest = append(rest, dec[:i]...)
+			rest = append(rest, dec[i+1:]...)
+			first := []rune(norm.NFC.String(string(rest)))
+			if len(first) != 1 {
+				continue
+			}
+			if norm.NFC.String(string(first)+string(dec[i])) == string(r) {
+				d.pairs = append(d.pairs, normPair{first[0], dec[i], r})
+				found = true
+			}
+		}
+		if !found {
+			return nil, fmt.Errorf("could not find composition pair for U+%04X", r)
+		}
+	}
+	sort.Slice(d.pairs, func(i, j int) bool {
+		a, b := d.pairs[i], d.pairs[j]
+		return a.first < b.first || (a.first == b.first && a.second < b.second)
+	})
+	return &d, nil
+}
+
+func writeNorm(filename string) error {
+	d, err := genNorm()
+	if err != nil {
+		return err
+	}
+
+	s, err := createCSource(filename)
+	if err != nil {
+		return err
+	}
+	defer s.close()
+
+	w := s.writer
+	w.WriteString(formatOff)
+	s.include("normalize_data.h")
+	fmt.Fprintf(w, "/* Unicode %s */\n", norm.Version)
+
+	w.WriteString("const UInt8 kNormalizeBlocks[kNormalizeBlockCount] = {")
+	s.ints(d.blocks)
+	w.WriteString("\n};\n")
+
+	w.WriteString("const UInt8 kNormalizeFlags[][64] = {")
+	for i, b := range d.flags {
+		w.WriteString("\n\t{")
+		s.bytes(b, true)
+		w.WriteString("\n\t}")
+		if i < len(d.flags)-1 {
+			w.WriteByte(',')
+		}
+	}
+	w.WriteString("\n};\n")
+
+	fmt.Fprintf(w, "const int kNormalizeCombiningCount = %d;\n", len(d.ccc))
+	w.WriteString("const UInt32 kNormalizeCombining[] = {")
+	s.ints(d.ccc)
+	w.WriteString("\n};\n")
+
+	fmt.Fprintf(w, "const int kNormalizeDecompositionCount = %d;\n", len(d.dchars))
+	w.WriteString("const UInt32 kNormalizeDecompositionChars[] = {")
+	s.ints(d.dchars)
+	w.WriteString("\n};\n")
+	w.WriteString("const UInt16 kNormalizeDecompositionIndex[] = {")
+	s.ints(d.dindex)
+	w.WriteString("\n};\n")
+	w.WriteString("const UInt32 kNormalizeDecompositionData[] = {")
+	s.ints(d.ddata)
+	w.WriteString("\n};\n")
+
+	fmt.Fprintf(w, "const int kNormalizeCompositionCount = %d;\n", len(d.pairs))
+	w.WriteString("const struct NormalizePair kNormalizeComposition[] = {")
+	for i, p := range d.pairs {
+		fmt.Fprintf(w, "\n\t{%d, %d, %d}", p.first, p.second, p.composite)
+		if i < len(d.pairs)-1 {
+			w.WriteByte(',')
+		}
+	}
+	w.WriteString("\n};\n")
+
+	w.WriteString(formatOn)
+
+	return s.flush()
+}
@@ -101,6 +101,29 @@ func (s *csource) bytes(data []byte, final bool) {
 	s.writer.Write(line)
 }
 
+func (s *csource) words(data []uint16, final bool) {
+	if len(data) == 0 {
+		return
+	}
+	line := make([]byte, 0, width+8)
+	for i, x := range data {
+		cur := line
+		line = strconv.AppendUint(line, uint64(x), 10)
+		if i < len(data)-1 || !final {
+			line = append(line, ',')
+		}
+		if len(line) > width-4 {
+			s.writer.WriteString("\n\t")
+			s.writer.Write(cur)
+			nline := line[len(cur):]
+			copy(line, nline)
+			line = line[:len(nline)]
+		}
+	}
+	s.writer.WriteString("\n\t")
+	s.writer.Write(line)
+}
+
 func (s *csource) ints(data []int) {
 	if len(data) == 0 {
 		return
@@ -0,0 +1,277 @@
+package table
+
+import (
+	"bytes"
+	"fmt"
+	"unicode"
+	"unicode/utf8"
+
+	"golang.org/x/text/unicode/bidi"
+	"golang.org/x/text/unicode/norm"
+
+	"moria.us/macscript/charmap"
+)
+
+// This file creates tables for one-byte encodings where some characters
+// require left-to-right or right-to-left context, like Arabic and Hebrew. The
+// reverse tree must be identical to the one that Convert4rBuild creates.
+
+// Directions stored in the table.
+const (
+	bidiAny = iota
+	bidiLR
+	bidiRL
+)
+
+// Actions for direction control characters in the reverse tree. The tree
+// entry output is the action in the high byte, with a zero low byte.
+const (
+	bidiActionPop = iota + 1
+	bidiActionOverrideLR
+	bidiActionOverrideRL
+	bidiActionMarkLR
+	bidiActionMarkRL
+)
+
+// Flag in the reverse data header for ASCII characters which can be copied
+// without walking the tree.
+const bidiInfoCopy = 4
+
+// bidiControls are the direction control characters recognized when
+// converting from UTF-8. Embeddings and isolates are treated as overrides.
+var bidiControls = []struct {
+	char   rune
+	action uint16
+}{
+	{0x200E, bidiActionMarkLR},     // LEFT-TO-RIGHT MARK
+	{0x200F, bidiActionMarkRL},     // RIGHT-TO-LEFT MARK
+	{0x202A, bidiActionOverrideLR}, // LEFT-TO-RIGHT EMBEDDING
+	{0x202B, bidiActionOverrideRL}, // RIGHT-TO-LEFT EMBEDDING
+	{0x202C, bidiActionPop},        // POP DIRECTIONAL FORMATTING
+	{0x202D, bidiActionOverrideLR}, // LEFT-TO-RIGHT OVERRIDE
+	{0x202E, bidiActionOverrideRL}, // RIGHT-TO-LEFT OVERRIDE
+	{0x2066, bidiActionOverrideLR}, // LEFT-TO-RIGHT ISOLATE
+	{0x2067, bidiActionOverrideRL}, // RIGHT-TO-LEFT ISOLATE
+	{0x2069, bidiActionPop},        // POP DIRECTIONAL ISOLATE
+}
+
+// A BidiChar is a character in a bidirectional table.
+type BidiChar struct {
+	// Direction context that the character requires.
+	Direction charmap.Direction
+
+	// Unicode string, empty if the character is not mapped.
+	Unicode []rune
+}
+
+// direction returns the direction context the character requires.
+func (c *BidiChar) direction() int {
+	switch c.Direction {
+	case charmap.DirectionLR:
+		return bidiLR
+	case charmap.DirectionRL:
+		return bidiRL
+	}
+	return bidiAny
+}
+
+// strong returns the strong direction of the character, which is the
+// direction it requires, or the direction of the first strong character in its
+// Unicode string. Private use characters are skipped.
+func (c *BidiChar) strong() int {
+	if d := c.direction(); d != bidiAny {
+		return d
+	}
+	for _, r := range c.Unicode {
+		if unicode.Is(unicode.Co, r) {
+			continue
+		}
+		p, _ := bidi.LookupRune(r)
+		switch p.Class() {
+		case bidi.L:
+			return bidiLR
+		case bidi.R, bidi.AL:
+			return bidiRL
+		}
+	}
+	return bidiAny
+}
+
+// encodings returns the UTF-8 encoding of the character, and its NFD form if
+// that is different.
+func (c *BidiChar) encodings() (udata, ndata []byte) {
+	var ubuf [4]byte
+	for _, r := range c.Unicode {
+		n := utf8.EncodeRune(ubuf[:], r)
+		udata = append(udata, ubuf[:n]...)
+	}
+	if len(udata) == 0 {
+		return nil, nil
+	}
+	ndata = norm.NFD.Bytes(udata)
+	if bytes.Equal(udata, ndata) {
+		ndata = nil
+	}
+	return udata, ndata
+}
+
+// A Bidirectional is a table for converting from one-byte encodings where
+// some characters require a specific direction context.
+type Bidirectional struct {
+	Characters [256]BidiChar
+}
+
+func createBidirectional(m *charmap.Charmap) (Table, error) {
+	var t Bidirectional
+	// ASCII characters missing from the charmap are control characters, which
+	// map to themselves.
+	for c := 0; c < 128; c++ {
+		t.Characters[c].Unicode = []rune{rune(c)}
+	}
+	for c, e := range m.OneByte {
+		if c == 0 || c == '\r' || c == '\n' {
+			if e.Direction != charmap.DirectionAny || len(e.Unicode) != 1 ||
+				e.Unicode[0] != rune(c) {
+				return nil, fmt.Errorf("control character is not mapped to itself: 0x%02x", c)
+			}
+		}
+		t.Characters[c] = BidiChar{e.Direction, e.Unicode}
+	}
+	// If a character without a direction has the same Unicode string as a
+	// character with a direction, it has the other direction. For example,
+	// the ASCII digits are left-to-right, and right-to-left copies of them
+	// exist elsewhere in the table.
+	dirs := make(map[string]charmap.Direction)
+	for _, c := range t.Characters {
+		if c.Direction != charmap.DirectionAny {
+			dirs[string(c.Unicode)] = c.Direction
+		}
+	}
+	for i := range t.Characters {
+		c := &t.Characters[i]
+		if c.Direction != charmap.DirectionAny {
+			continue
+		}
+		switch dirs[string(c.Unicode)] {
+		case charmap.DirectionLR:
+			c.Direction = charmap.DirectionRL
+		case charmap.DirectionRL:
+			c.Direction = charmap.DirectionLR
+		}
+	}
+	return &t, nil
+}
+
+func (t *Bidirectional) Data() []byte {
+	d := []byte{bidirectionalTable}
+	for i := range t.Characters {
+		c := &t.Characters[i]
+		udata, ndata := c.encodings()
+		d = append(d, byte(c.direction()|c.strong()<<2))
+		d = append(d, byte(len(udata)))
+		d = append(d, udata...)
+		d = append(d, byte(len(ndata)))
+		d = append(d, ndata...)
+	}
+	return d
+}
+
+// ReverseData returns the data for converting from UTF-8, in the same layout
+// that Convert4rBuild creates. This is a header with information about each
+// byte, followed by the compacted tree, with offsets in bytes from the root.
+// Each tree output contains the character for left-to-right context in the low
+// byte and the character for right-to-left context in the high byte.
+func (t *Bidirectional) ReverseData() ([]uint16, error) {
+	tr := newRTree()
+	// Characters which require a direction take priority over characters
+	// which don't, and exact strings take priority over NFD strings. Each half
+	// of the output is only set once.
+	for pass := 0; pass < 4; pass++ {
+		for i := range t.Characters {
+			c := &t.Characters[i]
+			if i == 0 || i == '\r' || i == '\n' ||
+				(c.direction() != bidiAny) != (pass&1 == 0) {
+				continue
+			}
+			udata, ndata := c.encodings()
+			s := udata
+			if pass >= 2 {
+				s = ndata
+			}
+			if len(s) == 0 {
+				continue
+			}
+			for _, b := range s[1:] {
+				if b < 128 {
+					return nil, fmt.Errorf("ASCII after first byte of character: %q", s)
+				}
+			}
+			var output uint16
+			switch c.direction() {
+			case bidiAny:
+				output = uint16(i) | uint16(i)<<8
+			case bidiLR:
+				output = uint16(i)
+			case bidiRL:
+				output = uint16(i) << 8
+			}
+			e := tr.leaf(s)
+			if e.output&0xff == 0 {
+				e.output |= output & 0xff
+			}
+			if e.output&0xff00 == 0 {
+				e.output |= output & 0xff00
+			}
+		}
+	}
+	// Characters which only appear with one direction are used for both.
+	for _, n := range tr.nodes {
+		for c := range n.entries {
+			e := &n.entries[c]
+			if e.output&0xff == 0 {
+				e.output |= e.output >> 8
+			} else if e.output&0xff00 == 0 {
+				e.output |= e.output << 8
+			}
+		}
+	}
+	// Check that every character converts back to itself in the context it
+	// requires.
+	for i := range t.Characters {
+		c := &t.Characters[i]
+		udata, _ := c.encodings()
+		if i == 0 || i == '\r' || i == '\n' || len(udata) == 0 {
+			continue
+		}
+		e := tr.find(udata)
+		d := c.direction()
+		if e == nil || (d != bidiRL && e.output&0xff != uint16(i)) ||
+			(d != bidiLR && e.output>>8 != uint16(i)) {
+			return nil, fmt.Errorf("character does not round trip: 0x%02x", i)
+		}
+	}
+	for _, ctl := range bidiControls {
+		var ubuf [4]byte
+		n := utf8.EncodeRune(ubuf[:], ctl.char)
+		if e := tr.leaf(ubuf[:n]); e.output == 0 {
+			e.output = ctl.action << 8
+		}
+	}
+	if len(tr.nodes) > 0x10000 {
+		return nil, ErrTreeTooLarge
+	}
+	d := make([]uint16, 256)
+	root := tr.nodes[0]
+	for i := range t.Characters {
+		info := uint16(t.Characters[i].strong())
+		if i < 128 && root.entries[i].output == uint16(i)|uint16(i)<<8 {
+			info |= bidiInfoCopy
+		}
+		d[i] = info
+	}
+	ctree, err := tr.compact(nil, 1)
+	if err != nil {
+		return nil, err
+	}
+	return append(d, ctree...), nil
+}
@@ -0,0 +1,133 @@
+package table
+
+import (
+	"fmt"
+	"sort"
+	"unicode/utf8"
+
+	"moria.us/macscript/charmap"
+)
+
+// This file creates tables for one-byte encodings where some pairs of bytes
+// form a single character, like the Indic encodings based on ISCII, or where
+// a byte maps to several code points. The reverse tree is the same as for
+// multibyte tables, and must be identical to the one that Convert3rBuild
+// creates.
+
+// A DigraphChar is a pair of bytes which form a single character.
+type DigraphChar struct {
+	Bytes   [2]byte
+	Unicode []rune
+}
+
+// A Digraph is a table for converting from one-byte encodings with digraphs.
+type Digraph struct {
+	// Characters for each byte value. Empty if not mapped.
+	Characters [256][]rune
+
+	// Byte pairs with their own mapping, sorted.
+	Digraphs []DigraphChar
+}
+
+func createDigraph(m *charmap.Charmap) (Table, error) {
+	if m.TwoByte != nil {
+		return nil, &UnsupportedError{"contains both digraphs and two-byte characters"}
+	}
+	var t Digraph
+	for c := 0; c < 128; c++ {
+		t.Characters[c] = []rune{rune(c)}
+	}
+	for c, e := range m.OneByte {
+		if e.Direction != charmap.DirectionAny {
+			return nil, &UnsupportedError{
+				fmt.Sprintf("character has bidirectional context: 0x%02x", c)}
+		}
+		if c == 0 || c == '\r' || c == '\n' {
+			if len(e.Unicode) != 1 || e.Unicode[0] != rune(c) {
+				return nil, fmt.Errorf("control character is not mapped to itself: 0x%02x", c)
+			}
+		}
+		t.Characters[c] = e.Unicode
+	}
+	for c, e := range m.Digraph {
+		if e.Direction != charmap.DirectionAny {
+			return nil, &UnsupportedError{
+				fmt.Sprintf("character has bidirectional context: 0x%02x+0x%02x", c[0], c[1])}
+		}
+		// Digraphs only contain high bytes, so the input can be split before
+		// any ASCII byte.
+		if c[0] < 128 || c[1] < 128 {
+			return nil, &UnsupportedError{
+				fmt.Sprintf("digraph contains ASCII: 0x%02x+0x%02x", c[0], c[1])}
+		}
+		if len(e.Unicode) == 0 {
+			continue
+		}
+		t.Digraphs = append(t.Digraphs, DigraphChar{c, e.Unicode})
+	}
+	if len(t.Digraphs) > 255 {
+		return nil, &UnsupportedError{"too many digraphs"}
+	}
+	sort.Slice(t.Digraphs, func(i, j int) bool {
+		a, b := t.Digraphs[i].Bytes, t.Digraphs[j].Bytes
+		return a[0] < b[0] || (a[0] == b[0] && a[1] < b[1])
+	})
+	return &t, nil
+}
+
+// encodeRunes returns the UTF-8 encoding of a Unicode string.
+func encodeRunes(s []rune) []byte {
+	var ubuf [4]byte
+	var b []byte
+	for _, r := range s {
+		n := utf8.EncodeRune(ubuf[:], r)
+		b = append(b, ubuf[:n]...)
+	}
+	return b
+}
+
+func (t *Digraph) Data() []byte {
+	d := []byte{digraphTable}
+	for _, u := range t.Characters {
+		b := encodeRunes(u)
+		d = append(d, byte(len(b)))
+		d = append(d, b...)
+	}
+	d = append(d, byte(len(t.Digraphs)))
+	for _, c := range t.Digraphs {
+		b := encodeRunes(c.Unicode)
+		d = append(d, c.Bytes[0], c.Bytes[1], byte(len(b)))
+		d = append(d, b...)
+	}
+	return d
+}
+
+// ReverseData returns the compacted tree for converting from UTF-8, in the
+// same layout as for multibyte tables. Digraphs are stored as two-byte
+// outputs.
+func (t *Digraph) ReverseData() ([]uint16, error) {
+	tr := newRTree()
+	for c, u := range t.Characters {
+		// NUL, CR, and LF are handled by the decoder.
+		if len(u) == 0 || c == 0 || c == '\r' || c == '\n' {
+			continue
+		}
+		if err := tr.add(encodeRunes(u), uint16(c)); err != nil {
+			return nil, err
+		}
+	}
+	for _, c := range t.Digraphs {
+		if err := tr.add(encodeRunes(c.Unicode),
+			uint16(c.Bytes[0])<<8|uint16(c.Bytes[1])); err != nil {
+			return nil, err
+		}
+	}
+	if len(tr.nodes) > 0x8000 {
+		return nil, ErrTreeTooLarge
+	}
+	var asciicopy uint16
+	if tr.canCopyASCII() {
+		asciicopy = 1
+	}
+	return tr.compact([]uint16{asciicopy, tr.splitLength()}, 4)
+}
@@ -0,0 +1,253 @@
+package table
+
+import (
+	"errors"
+	"fmt"
+)
+
+// This file creates the compacted trees used for converting from UTF-8. The
+// output must be identical to the trees that Convert1rBuild and Convert3rBuild
+// create at runtime, so the nodes are created in the same order. The trees are
+// arrays of 16-bit words, so they work with either byte order.
+
+// ErrTreeTooLarge indicates that a reverse conversion tree does not fit in
+// the compacted format.
+var ErrTreeTooLarge = errors.New("reverse conversion tree is too large")
+
+type rentry struct {
+	output uint16
+	next   int
+}
+
+type rnode struct {
+	entries [256]rentry
+}
+
+func (n *rnode) isEmpty(c int) bool {
+	e := &n.entries[c]
+	return e.output == 0 && e.next == 0
+}
+
+// An rtree is a tree for converting from UTF-8, with one node for each prefix.
+type rtree struct {
+	nodes []*rnode
+}
+
+func newRTree() *rtree {
+	return &rtree{nodes: []*rnode{new(rnode)}}
+}
+
+// leaf returns the entry for the last byte of a UTF-8 string, creating nodes
+// for the prefixes as necessary.
+func (t *rtree) leaf(s []byte) *rentry {
+	state := 0
+	for _, c := range s[:len(s)-1] {
+		next := t.nodes[state].entries[c].next
+		if next == 0 {
+			next = len(t.nodes)
+			t.nodes = append(t.nodes, new(rnode))
+			t.nodes[state].entries[c].next = next
+		}
+		state = next
+	}
+	return &t.nodes[state].entries[s[len(s)-1]]
+}
+
+// find returns the entry for the last byte of a UTF-8 string, or nil if the
+// string's prefix is not in the tree.
+func (t *rtree) find(s []byte) *rentry {
+	state := 0
+	for _, c := range s[:len(s)-1] {
+		state = t.nodes[state].entries[c].next
+		if state == 0 {
+			return nil
+		}
+	}
+	return &t.nodes[state].entries[s[len(s)-1]]
+}
+
+// add adds a UTF-8 string to the tree, producing the given output.
+func (t *rtree) add(s []byte, output uint16) error {
+	e := t.leaf(s)
+	if e.output != 0 {
+		return fmt.Errorf("duplicate UTF-8 sequence: %q", s)
+	}
+	e.output = output
+	return nil
+}
+
+// compact returns the compacted tree. Each node is stored as its first byte
+// and its number of entries minus one, followed by an output and next node
+// offset for each entry. The header is stored first. Offsets are in units of
+// unitBytes bytes.
+func (t *rtree) compact(header []uint16, unitBytes int) ([]uint16, error) {
+	type info struct{ min, max, offset int }
+	infos := make([]info, len(t.nodes))
+	words := len(header)
+	for i, n := range t.nodes {
+		min := 0
+		for min < 255 && n.isEmpty(min) {
+			min++
+		}
+		max := 255
+		for max > min && n.isEmpty(max) {
+			max--
+		}
+		infos[i] = info{min, max, words * 2 / unitBytes}
+		words += 2 + 2*(max-min+1)
+		if words*2/unitBytes >= 0x10000 {
+			return nil, ErrTreeTooLarge
+		}
+	}
+	d := make([]uint16, 0, words)
+	d = append(d, header...)
+	for i, n := range t.nodes {
+		ifo := infos[i]
+		d = append(d, uint16(ifo.min), uint16(ifo.max-ifo.min))
+		for c := ifo.min; c <= ifo.max; c++ {
+			e := &n.entries[c]
+			var next int
+			if e.next != 0 {
+				next = infos[e.next].offset
+			}
+			d = append(d, e.output, uint16(next))
+		}
+	}
+	return d, nil
+}
+
+// ReverseData returns the compacted tree for converting from UTF-8, in the
+// same layout that Convert1rBuild creates. Offsets are in bytes.
+func (t *ExtendedASCII) ReverseData() ([]uint16, error) {
+	tr := newRTree()
+	root := tr.nodes[0]
+	for c := 0; c < 128; c++ {
+		if c != '\r' && c != '\n' {
+			root.entries[c].output = uint16(c)
+		}
+	}
+	for i, u := range t.HighCharacters {
+		udata, ndata := highEncodings(u)
+		for _, s := range [][]byte{udata, ndata} {
+			if len(s) == 0 {
+				continue
+			}
+			for _, c := range s[1:] {
+				if c < 128 {
+					return nil, fmt.Errorf("ASCII after first byte of character: %q", s)
+				}
+			}
+			if err := tr.add(s, uint16(i|0x80)); err != nil {
+				return nil, err
+			}
+		}
+	}
+	// Node indexes are stored in a byte while the tree is built.
+	if len(tr.nodes) > 256 {
+		return nil, ErrTreeTooLarge
+	}
+	return tr.compact(nil, 1)
+}
+
+// ReverseData returns the compacted tree for converting from UTF-8, in the
+// same layout that Convert3rBuild creates. Offsets are in 4-byte units, and
+// the tree starts with a header containing the asciicopy flag.
+func (t *Multibyte) ReverseData() ([]uint16, error) {
+	tr := newRTree()
+	add := func(c uint16) error {
+		s := t.encode(c)
+		// NUL, CR, and LF are handled by the decoder.
+		if len(s) == 0 || c == 0 || c == '\r' || c == '\n' {
+			return nil
+		}
+		return tr.add(s, c)
+	}
+	for c := 0; c < 256; c++ {
+		if !t.LeadBytes[c] {
+			if err := add(uint16(c)); err != nil {
+				return nil, err
+			}
+			continue
+		}
+		first, last := t.trailRange(c)
+		for c2 := first; c2 <= last; c2++ {
+			if err := add(uint16(c)<<8 | uint16(c2)); err != nil {
+				return nil, err
+			}
+		}
+	}
+	if len(tr.nodes) > 0x8000 {
+		return nil, ErrTreeTooLarge
+	}
+	var asciicopy uint16
+	if tr.canCopyASCII() {
+		asciicopy = 1
+	}
+	return tr.compact([]uint16{asciicopy, tr.splitLength()}, 4)
+}
+
+// noSplit is the split length for trees where the input can't be split.
+const noSplit = 0xffff
+
+// splitLength returns the number of ASCII bytes needed before an ASCII byte
+// to split the input there. Nodes are always created after their parents.
+func (t *rtree) splitLength() uint16 {
+	type info struct {
+		depth      int
+		asciistart bool
+	}
+	infos := make([]info, len(t.nodes))
+	var maxdepth int
+	var asciicont bool
+	for i, n := range t.nodes {
+		ifo := infos[i]
+		if ifo.depth > maxdepth {
+			maxdepth = ifo.depth
+		}
+		for c := range n.entries {
+			if n.isEmpty(c) {
+				continue
+			}
+			if i != 0 && c < 128 {
+				if ifo.asciistart {
+					return noSplit
+				}
+				asciicont = true
+			}
+			if next := n.entries[c].next; next != 0 {
+				if ifo.depth >= 0x7f {
+					return noSplit
+				}
+				infos[next] = info{ifo.depth + 1, ifo.asciistart || (i == 0 && c < 128)}
+			}
+		}
+	}
+	if !asciicont {
+		return 0
+	}
+	return uint16(maxdepth)
+}
+
+// canCopyASCII returns true if all ASCII characters other than NUL, CR, and
+// LF map to themselves, and never start longer sequences containing ASCII.
+func (t *rtree) canCopyASCII() bool {
+	root := t.nodes[0]
+	for c := 1; c < 128; c++ {
+		if c == '\r' || c == '\n' {
+			continue
+		}
+		e := &root.entries[c]
+		if e.output != uint16(c) {
+			return false
+		}
+		if e.next != 0 {
+			n := t.nodes[e.next]
+			for c2 := 0; c2 < 128; c2++ {
+				if !n.isEmpty(c2) {
+					return false
+				}
+			}
+		}
+	}
+	return true
+}
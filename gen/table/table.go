@@ -24,21 +24,39 @@ func (e *UnsupportedError) Error() string {
 // Table type identifiers.
 const (
 	extendedASCIITable = iota + 1
+	lineBreakTable     // Not generated, has no data.
+	multibyteTable
+	bidirectionalTable
+	digraphTable
 )
 
 type Table interface {
+	// Data returns the conversion table data. See Formats.md.
 	Data() []byte
+
+	// ReverseData returns the precompiled data for converting from UTF-8.
+	ReverseData() ([]uint16, error)
 }
 
 func Create(m *charmap.Charmap) (Table, error) {
 	if m.OneByte == nil {
 		return nil, errors.New("missing one-byte map")
 	}
+	if m.Digraph != nil {
+		return createDigraph(m)
+	}
 	if m.TwoByte != nil {
-		return nil, &UnsupportedError{"multibyte encoding"}
+		return createMultibyte(m)
 	}
-	if m.Digraph != nil {
-		return nil, &UnsupportedError{"contains digraphs"}
+	for _, e := range m.OneByte {
+		if e.Direction != charmap.DirectionAny {
+			return createBidirectional(m)
+		}
+	}
+	for _, e := range m.OneByte {
+		if len(e.Unicode) > 1 {
+			return createDigraph(m)
+		}
 	}
 	var t ExtendedASCII
 	for c, e := range m.OneByte {
@@ -47,13 +65,8 @@ func Create(m *charmap.Charmap) (Table, error) {
 				fmt.Sprintf("character has bidirectional context: 0x%02x", c)}
 		}
 		var u rune
-		switch len(e.Unicode) {
-		case 0:
-		case 1:
+		if len(e.Unicode) != 0 {
 			u = e.Unicode[0]
-		default:
-			return nil, &UnsupportedError{
-				fmt.Sprintf("character maps to multiple code points: 0x%02x", c)}
 		}
 		if c < 128 {
 			if u != rune(c) {
@@ -72,20 +85,26 @@ type ExtendedASCII struct {
 	HighCharacters [128]rune
 }
 
-func (t *ExtendedASCII) Data() []byte {
+// highEncodings returns the UTF-8 encoding of a high character, and its NFD
+// form if that is different. Both are empty if the character is not mapped.
+func highEncodings(u rune) (udata, ndata []byte) {
+	if u == 0 {
+		return nil, nil
+	}
 	var ubuf [4]byte
-	var nbuf [16]byte
+	n := utf8.EncodeRune(ubuf[:], u)
+	udata = ubuf[:n]
+	ndata = norm.NFD.Bytes(udata)
+	if bytes.Equal(udata, ndata) {
+		ndata = nil
+	}
+	return udata, ndata
+}
+
+func (t *ExtendedASCII) Data() []byte {
 	d := []byte{extendedASCIITable}
 	for _, u := range t.HighCharacters {
-		var udata, ndata []byte
-		if u != 0 {
-			n := utf8.EncodeRune(ubuf[:], u)
-			udata = ubuf[:n]
-			ndata = norm.NFD.Append(nbuf[:0], udata...)
-			if bytes.Equal(udata, ndata) {
-				ndata = nil
-			}
-		}
+		udata, ndata := highEncodings(u)
 		d = append(d, byte(len(udata)))
 		d = append(d, udata...)
 		d = append(d, byte(len(ndata)))
@@ -93,3 +112,104 @@ func (t *ExtendedASCII) Data() []byte {
 	}
 	return d
 }
+
+// A Multibyte is a table for converting from encodings with both one-byte and
+// two-byte characters.
+type Multibyte struct {
+	// Characters for each one-byte value, or for each two-byte value if the
+	// key is a lead byte. Missing entries are not mapped.
+	Characters map[uint16][]rune
+
+	// Lead bytes for two-byte characters.
+	LeadBytes [256]bool
+}
+
+func createMultibyte(m *charmap.Charmap) (Table, error) {
+	t := Multibyte{Characters: make(map[uint16][]rune)}
+	for c, e := range m.TwoByte {
+		if e.Direction != charmap.DirectionAny {
+			return nil, &UnsupportedError{
+				fmt.Sprintf("character has bidirectional context: 0x%02x%02x", c[0], c[1])}
+		}
+		if len(e.Unicode) == 0 {
+			continue
+		}
+		t.LeadBytes[c[0]] = true
+		t.Characters[uint16(c[0])<<8|uint16(c[1])] = e.Unicode
+	}
+	for c := 0; c < 128; c++ {
+		t.Characters[uint16(c)] = []rune{rune(c)}
+	}
+	for c, e := range m.OneByte {
+		if e.Direction != charmap.DirectionAny {
+			return nil, &UnsupportedError{
+				fmt.Sprintf("character has bidirectional context: 0x%02x", c)}
+		}
+		if t.LeadBytes[c] {
+			return nil, fmt.Errorf("one-byte character is also a lead byte: 0x%02x", c)
+		}
+		if c == '\r' || c == '\n' {
+			if len(e.Unicode) != 1 || e.Unicode[0] != rune(c) {
+				return nil, fmt.Errorf("line break is not mapped to itself: 0x%02x", c)
+			}
+		}
+		if len(e.Unicode) == 0 {
+			delete(t.Characters, uint16(c))
+		} else {
+			t.Characters[uint16(c)] = e.Unicode
+		}
+	}
+	return &t, nil
+}
+
+// encode returns the UTF-8 encoding of a character.
+func (t *Multibyte) encode(c uint16) []byte {
+	var ubuf [4]byte
+	var b []byte
+	for _, r := range t.Characters[c] {
+		n := utf8.EncodeRune(ubuf[:], r)
+		b = append(b, ubuf[:n]...)
+	}
+	return b
+}
+
+func (t *Multibyte) appendChar(d []byte, c uint16) []byte {
+	b := t.encode(c)
+	d = append(d, byte(len(b)))
+	return append(d, b...)
+}
+
+// trailRange returns the first and last mapped trail bytes for a lead byte.
+func (t *Multibyte) trailRange(lead int) (first, last int) {
+	first, last = 255, 0
+	for c2 := 0; c2 < 256; c2++ {
+		if _, ok := t.Characters[uint16(lead)<<8|uint16(c2)]; ok {
+			if c2 < first {
+				first = c2
+			}
+			last = c2
+		}
+	}
+	return first, last
+}
+
+func (t *Multibyte) Data() []byte {
+	d := []byte{multibyteTable}
+	for c := 0; c < 256; c++ {
+		if !t.LeadBytes[c] {
+			if _, ok := t.Characters[uint16(c)]; !ok {
+				d = append(d, 0)
+			} else {
+				d = append(d, 1)
+				d = t.appendChar(d, uint16(c))
+			}
+			continue
+		}
+		first, last := t.trailRange(c)
+		d = append(d, 2, byte(first), byte(last-first))
+		for c2 := first; c2 <= last; c2++ {
+			d = t.appendChar(d, uint16(c)<<8|uint16(c2))
+		}
+	}
+	return d
+}
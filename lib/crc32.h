@@ -9,4 +9,9 @@
 // Incrementally calculate a CRC32. This is the same CRC32 used by Gzip.
 UInt32 CRC32Update(UInt32 crc, const void *ptr, Size size);
 
+// Combine the CRCs of two consecutive pieces of data. Given the CRC of the
+// first piece, and the CRC of the second piece and its length, return the CRC
+// of both pieces together.
+UInt32 CRC32Combine(UInt32 crc1, UInt32 crc2, Size len2);
+
 #endif
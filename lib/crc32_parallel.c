@@ -0,0 +1,248 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// crc32_parallel.c - CRC32 of large buffers and files using multiple threads.
+#define _POSIX_C_SOURCE 200809L
+
+#include "lib/crc32_parallel.h"
+
+#include "lib/crc32.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+	// Size of each chunk.
+	kChunkSize = 1024 * 1024,
+
+	// Maximum number of threads.
+	kMaxThreads = 64
+};
+
+struct Chunk {
+	UInt32 crc;
+	// Amount of data read, which is less than the chunk size if a file is
+	// shorter than expected.
+	Size size;
+	ErrorCode err;
+	int errnum;
+};
+
+struct Job {
+	// Buffer to checksum, or NULL to read from the file.
+	const UInt8 *ptr;
+	int fd;
+	Size size;
+	struct Chunk *chunks;
+	int count;
+	atomic_int next;
+};
+
+// Read one chunk of a file and calculate its CRC.
+static void ReadChunk(int fd, UInt8 *buf, Size offset, Size size,
+                      struct Chunk *chunk)
+{
+	Size pos;
+	ssize_t n;
+
+	pos = 0;
+	while (pos < size) {
+		n = pread(fd, buf + pos, size - pos, offset + pos);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			chunk->err = kErrorSystem;
+			chunk->errnum = errno;
+			return;
+		}
+		if (n == 0) {
+			break;
+		}
+		pos += n;
+	}
+	chunk->crc = CRC32Update(0, buf, pos);
+	chunk->size = pos;
+}
+
+static void *CRCWorker(void *arg)
+{
+	struct Job *job = arg;
+	struct Chunk *chunk;
+	Handle buf;
+	Size offset, size;
+	int i;
+
+	buf = NULL;
+	for (;;) {
+		i = atomic_fetch_add(&job->next, 1);
+		if (i >= job->count) {
+			break;
+		}
+		chunk = &job->chunks[i];
+		offset = (Size)i * kChunkSize;
+		size = job->size - offset;
+		if (size > kChunkSize) {
+			size = kChunkSize;
+		}
+		if (job->ptr != NULL) {
+			chunk->crc = CRC32Update(0, job->ptr + offset, size);
+			chunk->size = size;
+		} else {
+			if (buf == NULL) {
+				buf = NewHandle(kChunkSize);
+				if (buf == NULL) {
+					chunk->err = kErrorNoMemory;
+					continue;
+				}
+			}
+			ReadChunk(job->fd, (UInt8 *)*buf, offset, size, chunk);
+		}
+	}
+	if (buf != NULL) {
+		DisposeHandle(buf);
+	}
+	return NULL;
+}
+
+// Checksum the chunks of a job and combine the results. Stores the total size
+// of the chunks.
+static ErrorCode RunJob(struct Job *job, int nthreads, UInt32 *crc,
+                        Size *total)
+{
+	pthread_t threads[kMaxThreads];
+	Handle chunkh;
+	struct Chunk *chunk;
+	int i, nstarted;
+	ErrorCode err;
+
+	job->count = (job->size + kChunkSize - 1) / kChunkSize;
+	chunkh = NewHandle(job->count * sizeof(struct Chunk));
+	if (chunkh == NULL) {
+		return kErrorNoMemory;
+	}
+	job->chunks = (struct Chunk *)*chunkh;
+	MemClear(job->chunks, job->count * sizeof(struct Chunk));
+	atomic_init(&job->next, 0);
+
+	// This thread also does work. If a thread can't be started, the remaining
+	// threads do its work.
+	if (nthreads > kMaxThreads) {
+		nthreads = kMaxThreads;
+	}
+	if (nthreads > job->count) {
+		nthreads = job->count;
+	}
+	nstarted = 0;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[nstarted], NULL, CRCWorker, job) != 0) {
+			break;
+		}
+		nstarted++;
+	}
+	CRCWorker(job);
+	for (i = 0; i < nstarted; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	err = 0;
+	*total = 0;
+	for (i = 0; i < job->count; i++) {
+		chunk = &job->chunks[i];
+		if (chunk->err != 0) {
+			err = chunk->err;
+			errno = chunk->errnum;
+			break;
+		}
+		*crc = CRC32Combine(*crc, chunk->crc, chunk->size);
+		*total += chunk->size;
+	}
+	DisposeHandle(chunkh);
+	return err;
+}
+
+UInt32 CRC32Parallel(UInt32 crc, const void *ptr, Size size, int nthreads)
+{
+	struct Job job;
+	UInt32 result;
+	Size total;
+
+	if (nthreads <= 1 || size <= kChunkSize) {
+		return CRC32Update(crc, ptr, size);
+	}
+	job.ptr = ptr;
+	job.fd = -1;
+	job.size = size;
+	result = crc;
+	if (RunJob(&job, nthreads, &result, &total) != 0) {
+		// Out of memory for the list of chunks.
+		return CRC32Update(crc, ptr, size);
+	}
+	return result;
+}
+
+// Read a file which is not a regular file sequentially.
+static ErrorCode CRC32Stream(int fd, UInt32 *crc, Size *size)
+{
+	Handle buf;
+	ssize_t n;
+	ErrorCode err;
+
+	buf = NewHandle(kChunkSize);
+	if (buf == NULL) {
+		return kErrorNoMemory;
+	}
+	err = 0;
+	for (;;) {
+		n = read(fd, *buf, kChunkSize);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err = kErrorSystem;
+			break;
+		}
+		if (n == 0) {
+			break;
+		}
+		*crc = CRC32Update(*crc, *buf, n);
+		*size += n;
+	}
+	DisposeHandle(buf);
+	return err;
+}
+
+ErrorCode CRC32File(int fd, int nthreads, UInt32 *crc, Size *size)
+{
+	struct Job job;
+	struct stat st;
+	UInt32 result;
+	Size total;
+	ErrorCode err;
+
+	result = 0;
+	total = 0;
+	if (fstat(fd, &st) != 0) {
+		return kErrorSystem;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		err = CRC32Stream(fd, &result, &total);
+	} else if (st.st_size == 0) {
+		err = 0;
+	} else {
+		job.ptr = NULL;
+		job.fd = fd;
+		job.size = st.st_size;
+		err = RunJob(&job, nthreads, &result, &total);
+	}
+	if (err != 0) {
+		return err;
+	}
+	*crc = result;
+	*size = total;
+	return 0;
+}
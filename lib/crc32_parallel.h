@@ -0,0 +1,26 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef LIB_CRC32_PARALLEL_H
+#define LIB_CRC32_PARALLEL_H
+// crc32_parallel.h - CRC32 of large buffers and files using multiple threads,
+// not used for classic Mac OS builds.
+#include "lib/defs.h"
+#include "lib/error.h"
+
+// Calculate a CRC32 using multiple threads, continuing from the given CRC. The
+// buffer is split into chunks, the chunks are checksummed concurrently, and the
+// results are combined with CRC32Combine. The result is identical to
+// CRC32Update. If threads can't be started, the remaining threads do the work.
+UInt32 CRC32Parallel(UInt32 crc, const void *ptr, Size size, int nthreads);
+
+// Calculate the CRC32 of the contents of a file, using multiple threads. The
+// file is read from the start, independent of the file offset. If the file is
+// not a regular file, it is read from the current position to the end by the
+// calling thread. On success, stores the CRC and the amount of data read.
+//
+// Returns an error code. If the error code is kErrorSystem, the error is stored
+// in errno.
+ErrorCode CRC32File(int fd, int nthreads, UInt32 *crc, Size *size);
+
+#endif
@@ -0,0 +1,137 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#define _POSIX_C_SOURCE 200809L
+
+#include "lib/crc32_parallel.h"
+
+#include "lib/crc32.h"
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+	// Size of the test data. Several chunks, and not a multiple of the chunk
+	// size.
+	kDataSize = 5 * 1024 * 1024 + 12345,
+
+	// Amount of data written to a pipe, which fits in the pipe buffer.
+	kPipeSize = 4000
+};
+
+static const int kThreads[] = {1, 2, 3, 8};
+
+static void TestBuffer(const UInt8 *data)
+{
+	static const Size kSizes[] = {0, 100, 1024 * 1024, 1024 * 1024 + 1,
+	                              kDataSize};
+	UInt32 expect, val;
+	int i, j;
+
+	for (i = 0; i < (int)ARRAY_COUNT(kSizes); i++) {
+		expect = CRC32Update(0x12345678, data, kSizes[i]);
+		for (j = 0; j < (int)ARRAY_COUNT(kThreads); j++) {
+			SetTestNamef("buffer size=%ld threads=%d", (long)kSizes[i],
+			             kThreads[j]);
+			val = CRC32Parallel(0x12345678, data, kSizes[i], kThreads[j]);
+			if (val != expect) {
+				Failf("CRC = 0x%08x, expect 0x%08x", val, expect);
+			}
+		}
+	}
+}
+
+// Check the CRC of a file.
+static void CheckFile(int fd, int nthreads, UInt32 expect, Size expectsize)
+{
+	UInt32 crc;
+	Size size;
+	ErrorCode err;
+
+	err = CRC32File(fd, nthreads, &crc, &size);
+	if (err != 0) {
+		Failf("CRC32File: %s", err == kErrorSystem ?
+		                           strerror(errno) :
+		                           ErrorDescriptionOrDie(err));
+		return;
+	}
+	if (size != expectsize) {
+		Failf("size = %ld, expect %ld", (long)size, (long)expectsize);
+	}
+	if (crc != expect) {
+		Failf("CRC = 0x%08x, expect 0x%08x", crc, expect);
+	}
+}
+
+static void TestFile(const UInt8 *data)
+{
+	char path[256];
+	const char *dir;
+	UInt32 expect;
+	int i, fd;
+
+	dir = getenv("TEST_TMPDIR");
+	if (dir == NULL) {
+		dir = "/tmp";
+	}
+	snprintf(path, sizeof(path), "%s/crc32_parallel_test.%ld", dir,
+	         (long)getpid());
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		Fatalf("open: %s", strerror(errno));
+	}
+	unlink(path);
+	if (write(fd, data, kDataSize) != kDataSize) {
+		Fatalf("write failed");
+	}
+	expect = CRC32Update(0, data, kDataSize);
+	for (i = 0; i < (int)ARRAY_COUNT(kThreads); i++) {
+		SetTestNamef("file threads=%d", kThreads[i]);
+		CheckFile(fd, kThreads[i], expect, kDataSize);
+	}
+	close(fd);
+}
+
+static void TestPipe(const UInt8 *data)
+{
+	int fds[2];
+
+	SetTestName("pipe");
+	if (pipe(fds) != 0) {
+		Fatalf("pipe: %s", strerror(errno));
+	}
+	if (write(fds[1], data, kPipeSize) != kPipeSize) {
+		Fatalf("write failed");
+	}
+	close(fds[1]);
+	CheckFile(fds[0], 4, CRC32Update(0, data, kPipeSize), kPipeSize);
+	close(fds[0]);
+}
+
+int main(int argc, char **argv)
+{
+	UInt8 *data;
+	Size i;
+
+	(void)argc;
+	(void)argv;
+
+	data = malloc(kDataSize);
+	if (data == NULL) {
+		Fatalf("malloc failed");
+	}
+	for (i = 0; i < kDataSize; i++) {
+		data[i] = TestRand();
+	}
+	TestBuffer(data);
+	TestFile(data);
+	TestPipe(data);
+	free(data);
+	return TestsDone();
+}
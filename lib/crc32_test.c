@@ -3,10 +3,100 @@
 // Mozilla Public License, version 2.0. See LICENSE.txt for details.
 #include "lib/crc32.h"
 
+#include "lib/test.h"
+
 #include <stdio.h>
 
+enum {
+	kBufferSize = 4096
+};
+
 static const char kTest[9] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
 
+// Calculate the CRC one bit at a time.
+static UInt32 CRC32Reference(UInt32 crc, const UInt8 *ptr, Size size)
+{
+	int i;
+
+	crc = ~crc;
+	while (size-- > 0) {
+		crc ^= *ptr++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+// Test buffers with every alignment and sizes around the block sizes used by
+// the table and folding code, split into two parts at random.
+static int TestRandom(void)
+{
+	static UInt8 buf[kBufferSize + 16];
+	Size size, split;
+	int i, offset, failed;
+	UInt32 init, expect, val;
+
+	for (i = 0; i < (int)sizeof(buf); i++) {
+		buf[i] = TestRand();
+	}
+	failed = 0;
+	for (i = 0; i < 2000; i++) {
+		offset = i % 16;
+		size = i < 300 ? i : (Size)(TestRand() % kBufferSize);
+		split = size > 0 ? (Size)(TestRand() % size) : 0;
+		init = TestRand();
+		expect = CRC32Reference(init, buf + offset, size);
+		val = CRC32Update(init, buf + offset, size);
+		if (val != expect) {
+			fprintf(stderr,
+			        "Error: size %ld offset %d: CRC = 0x%08x, expect 0x%08x\n",
+			        (long)size, offset, val, expect);
+			failed = 1;
+		}
+		val = CRC32Update(init, buf + offset, split);
+		val = CRC32Update(val, buf + offset + split, size - split);
+		if (val != expect) {
+			fprintf(stderr,
+			        "Error: size %ld offset %d split %ld: CRC = 0x%08x, "
+			        "expect 0x%08x\n",
+			        (long)size, offset, (long)split, val, expect);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+// Test that combining the CRCs of two pieces gives the CRC of the whole.
+static int TestCombine(void)
+{
+	static UInt8 buf[kBufferSize];
+	Size size, split;
+	int i, failed;
+	UInt32 crc1, crc2, expect, val;
+
+	for (i = 0; i < kBufferSize; i++) {
+		buf[i] = TestRand();
+	}
+	failed = 0;
+	for (i = 0; i < 500; i++) {
+		size = TestRand() % kBufferSize;
+		split = i < 100 ? size : (Size)(TestRand() % (size + 1));
+		expect = CRC32Update(0, buf, size);
+		crc1 = CRC32Update(0, buf, split);
+		crc2 = CRC32Update(0, buf + split, size - split);
+		val = CRC32Combine(crc1, crc2, size - split);
+		if (val != expect) {
+			fprintf(stderr,
+			        "Error: combine size %ld split %ld: CRC = 0x%08x, "
+			        "expect 0x%08x\n",
+			        (long)size, (long)split, val, expect);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
 int main(int argc, char **argv)
 {
 	UInt32 expect;
@@ -21,5 +111,5 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Error: CRC = 0x%08x, expect 0x%08x\n", val, expect);
 		return 1;
 	}
-	return 0;
+	return TestRandom() | TestCombine();
 }
@@ -0,0 +1,123 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// crc32_thread_test.c - test calling CRC32Update from many threads at once.
+// This test uses threads, so it is not part of the classic Mac OS project.
+#include "lib/crc32.h"
+
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <pthread.h>
+
+enum {
+	kBufferSize = 4096,
+
+	// Number of threads and pieces of data.
+	kThreadCount = 8,
+	kThreadPieces = 64
+};
+
+static const char kTest[9] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+
+// Data shared by the threads.
+struct ThreadTest {
+	UInt8 buf[kBufferSize];
+	Size offset[kThreadPieces];
+	Size size[kThreadPieces];
+	// The CRC of each piece, computed by each thread.
+	UInt32 crc[kThreadCount][kThreadPieces];
+
+	// Start gate. The threads wait until all of them are ready, so the first
+	// calls overlap.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int waiting;
+};
+
+struct ThreadArg {
+	struct ThreadTest *test;
+	int index;
+};
+
+static void *CRCThread(void *arg)
+{
+	struct ThreadArg *a = arg;
+	struct ThreadTest *t = a->test;
+	int i, j;
+
+	pthread_mutex_lock(&t->lock);
+	t->waiting--;
+	if (t->waiting == 0) {
+		pthread_cond_broadcast(&t->cond);
+	}
+	while (t->waiting > 0) {
+		pthread_cond_wait(&t->cond, &t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	for (i = 0; i < 20; i++) {
+		for (j = 0; j < kThreadPieces; j++) {
+			t->crc[a->index][j] =
+				CRC32Update(0, t->buf + t->offset[j], t->size[j]);
+		}
+	}
+	return NULL;
+}
+
+// Test that CRC32Update can be called from many threads at once, including the
+// very first call in the process. The results are checked after the threads
+// finish, against a single-threaded call. Run under ThreadSanitizer with:
+//
+//     bazel test --config=tsan //lib:crc32_thread_test
+int main(int argc, char **argv)
+{
+	static struct ThreadTest t;
+	struct ThreadArg args[kThreadCount];
+	pthread_t threads[kThreadCount];
+	int i, j, n;
+	UInt32 expect;
+
+	(void)argc;
+	(void)argv;
+
+	SetTestName("threads");
+	for (i = 0; i < kBufferSize; i++) {
+		t.buf[i] = (UInt8)(i * 7 + (i >> 8));
+	}
+	for (i = 0; i < kThreadPieces; i++) {
+		t.offset[i] = i % 16;
+		t.size[i] = (i * 997) % (kBufferSize - 16);
+	}
+	pthread_mutex_init(&t.lock, NULL);
+	pthread_cond_init(&t.cond, NULL);
+	t.waiting = kThreadCount;
+	for (n = 0; n < kThreadCount; n++) {
+		args[n].test = &t;
+		args[n].index = n;
+		if (pthread_create(&threads[n], NULL, CRCThread, &args[n]) != 0) {
+			Fatalf("pthread_create failed");
+		}
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_cond_destroy(&t.cond);
+	pthread_mutex_destroy(&t.lock);
+
+	expect = 0xcbf43926;
+	if (CRC32Update(0, kTest, sizeof(kTest)) != expect) {
+		Failf("wrong CRC for check value");
+	}
+	for (j = 0; j < kThreadPieces; j++) {
+		expect = CRC32Update(0, t.buf + t.offset[j], t.size[j]);
+		for (i = 0; i < kThreadCount; i++) {
+			if (t.crc[i][j] != expect) {
+				Failf("thread %d piece %d: CRC = 0x%08x, expect 0x%08x", i, j,
+				      t.crc[i][j], expect);
+			}
+		}
+	}
+	return TestsDone();
+}
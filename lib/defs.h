@@ -120,6 +120,105 @@ Handle NewHandle(Size byteSize);
 // Free a relocatable block of memory.
 void DisposeHandle(Handle h);
 
+// Get the size of a relocatable block of memory.
+Size GetHandleSize(Handle h);
+
+// Return the number of calls to malloc and realloc made by the handle
+// functions so far. Used by benchmarks.
+long HandleSystemAllocCount(void);
+
+// Handle statistics. These are only collected if the library is compiled with
+// HANDLE_STATS=1 (bazel build --config=handlestats), otherwise they cost
+// nothing and the query functions return false. When enabled, each handle is
+// tagged with the source location of the NewHandle call which created it, and
+// a report is printed to stderr when the program exits.
+struct HandleStats {
+	// Source location of the NewHandle call, or NULL for the total.
+	const char *site;
+	// Number of calls to NewHandle, ResizeHandle, and DisposeHandle.
+	long newCount;
+	long resizeCount;
+	long disposeCount;
+	// Number of live handles and their total size in bytes.
+	long handles;
+	long bytes;
+	// Largest total size of live handles, in bytes.
+	long peakBytes;
+};
+
+// Get the statistics for all handles. Returns false if statistics are not
+// enabled.
+Boolean GetHandleStats(struct HandleStats *stats);
+
+// Get the statistics for handles created at one call site, by index starting
+// from 0. Returns false if there is no call site with that index.
+Boolean GetHandleSiteStats(int index, struct HandleStats *stats);
+
+// Reset the peak sizes to the current sizes.
+void ResetHandlePeak(void);
+
+#if HANDLE_STATS
+
+// Allocate a relocatable block of memory, tagged with a call site.
+Handle NewHandleAt(Size byteSize, const char *site);
+
+#define HANDLE_SITE2(file, line) file ":" #line
+#define HANDLE_SITE(file, line) HANDLE_SITE2(file, line)
+#define NewHandle(byteSize) \
+	NewHandleAt(byteSize, HANDLE_SITE(__FILE__, __LINE__))
+
+#endif
+
+#endif
+
+// A scope for short-lived handles. While a scope is active, handles created by
+// NewHandle on the same thread have their contents allocated from large chunks
+// owned by the scope, and the memory is released all at once when the scope
+// ends. Handles created in a scope must only be resized or disposed by the
+// thread which created them, until the scope ends. The fields are private.
+//
+// Only NewHandle calls made while a scope is active are scoped. Handles which
+// are created before a scope starts, on other threads, or while the scope is
+// suspended with HandleScopeSuspend are never scoped. Long-lived data shared
+// between threads, like the converter cache, must be created with the scope
+// suspended.
+struct HandleScope {
+	struct HandleScope *parent;
+	void *chunks;
+	char *pos;
+	char *end;
+	char *last;
+	void *handles;
+};
+
+#if TARGET_API_MAC_OS8
+
+// The Memory Manager already suballocates handles from the heap.
+#define HandleScopeBegin(scope) ((void)(scope))
+#define HandleScopeEnd(scope) ((void)(scope))
+#define HandleScopeSuspend(scope) ((void)(scope))
+#define HandleScopeResume(scope) ((void)(scope))
+
+#else
+
+// Start a scope for short-lived handles on the current thread. Scopes nest, and
+// must be ended in the reverse order they were started.
+void HandleScopeBegin(struct HandleScope *scope);
+
+// End a scope and release its memory. Handles created in the scope which have
+// not been disposed remain valid, but their contents are moved, just like when
+// a handle is relocated by the Memory Manager. Exits the program if there is
+// not enough memory to move them.
+void HandleScopeEnd(struct HandleScope *scope);
+
+// Suspend the current scope on this thread, if any, so new handles are
+// allocated with malloc until HandleScopeResume is called with the same scope
+// structure. Suspending can nest with other scopes.
+void HandleScopeSuspend(struct HandleScope *scope);
+
+// Resume the scope which was active before HandleScopeSuspend.
+void HandleScopeResume(struct HandleScope *scope);
+
 #endif
 
 /// Resize a relocatable block of memory. Return true on success.
@@ -17,6 +17,12 @@ typedef enum {
 
 	// Too many files in one directory.
 	kErrorDirectoryTooLarge,
+
+	// Operating system call failed. The error is stored in errno.
+	kErrorSystem,
+
+	// Text contains a character which has no mapping in the character set.
+	kErrorUnmappable,
 } ErrorCode;
 
 #endif
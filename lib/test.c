@@ -13,6 +13,8 @@ int gFailCount;
 
 static char gTestName[256];
 
+static UInt32 gRandom = 1;
+
 void SetTestName(const char *name)
 {
 	size_t n;
@@ -66,6 +68,17 @@ const char *ErrorDescriptionOrDie(ErrorCode err)
 	return desc;
 }
 
+UInt32 TestRand(void)
+{
+	gRandom = 1664525 * gRandom + 1013904223;
+	return gRandom >> 8;
+}
+
+void TestRandReset(void)
+{
+	gRandom = 1;
+}
+
 int TestsDone(void)
 {
 	if (gFailCount > 0) {
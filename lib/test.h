@@ -24,6 +24,13 @@ void Failf(const char *msg, ...) __attribute__((format(printf, 1, 2)));
 // invalid.
 const char *ErrorDescriptionOrDie(ErrorCode err);
 
+// Return a pseudorandom number from 0 to 0xffffff. The sequence is the same
+// every time the test runs.
+UInt32 TestRand(void);
+
+// Restart the sequence returned by TestRand from the beginning.
+void TestRandReset(void);
+
 // Print information about completed tests and return the status code.
 int TestsDone(void);
 
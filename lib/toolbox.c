@@ -6,55 +6,610 @@
 #include "lib/defs.h"
 #include "lib/util.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
-Handle NewHandle(Size byteCount)
+#if HANDLE_STATS
+#include <stdint.h>
+#include <stdio.h>
+
+#undef NewHandle
+#endif
+
+enum {
+	// Number of master pointers allocated at once.
+	kMasterPointerBlockCount = 256,
+
+	// Size of a chunk of scope memory, including the header.
+	kScopeChunkSize = 64 * 1024,
+
+	// Largest handle allocated from a scope. Larger handles use malloc, so
+	// they can grow with realloc, and don't need to be copied if they escape
+	// the scope.
+	kScopeMaxSize = kScopeChunkSize / 4,
+
+	// Alignment of handle contents allocated from a scope.
+	kScopeAlign = 16,
+
+	// Maximum number of call sites with separate statistics.
+	kMaxHandleSites = 1024,
+
+	// Number of call sites listed in the report printed at exit.
+	kReportSites = 40
+};
+
+// The master pointer for a handle. The handle points to the ptr field. Master
+// pointers are allocated in blocks and never freed, like the master pointer
+// blocks in the classic Mac OS Memory Manager.
+struct MasterPointer {
+	Ptr ptr;
+	Size size;
+	// The scope which owns the contents, or NULL if the contents were
+	// allocated with malloc.
+	struct HandleScope *scope;
+	// Links in the list of handles owned by a scope. The next field also links
+	// the list of free master pointers.
+	struct MasterPointer *prev;
+	struct MasterPointer *next;
+#if HANDLE_STATS
+	// Statistics for the call site which created the handle.
+	struct HandleStats *stats;
+#endif
+};
+
+// A block of master pointers.
+struct MasterPointerBlock {
+	struct MasterPointerBlock *next;
+	struct MasterPointer pointers[kMasterPointerBlockCount];
+};
+
+// A chunk of memory owned by a scope. The memory follows the header.
+union ScopeChunk {
+	union ScopeChunk *next;
+	char align[kScopeAlign];
+};
+
+static pthread_mutex_t gMasterPointerLock = PTHREAD_MUTEX_INITIALIZER;
+static struct MasterPointerBlock *gMasterPointerBlocks;
+static struct MasterPointer *gFreeMasterPointers;
+
+static _Thread_local struct HandleScope *gHandleScope;
+
+static atomic_long gSystemAllocCount;
+
+static void *SystemAlloc(Size size)
+{
+	atomic_fetch_add_explicit(&gSystemAllocCount, 1, memory_order_relaxed);
+	return malloc(size);
+}
+
+static void *SystemRealloc(void *ptr, Size size)
+{
+	atomic_fetch_add_explicit(&gSystemAllocCount, 1, memory_order_relaxed);
+	return realloc(ptr, size);
+}
+
+long HandleSystemAllocCount(void)
+{
+	return atomic_load_explicit(&gSystemAllocCount, memory_order_relaxed);
+}
+
+#if HANDLE_STATS
+
+static pthread_mutex_t gStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct HandleStats gStats;
+
+// Statistics for each call site, in order of first use. If the table fills
+// up, the last entry is used for the remaining call sites.
+static struct HandleStats gSites[kMaxHandleSites];
+static int gSiteCount;
+
+// Hash table of call sites. Each entry is an index into gSites plus one, or
+// zero for an empty entry.
+static short gSiteTable[kMaxHandleSites * 2];
+
+static void PrintHandleStats(void);
+
+// Get the statistics for a call site. The lock must be held.
+static struct HandleStats *GetSite(const char *site)
+{
+	struct HandleStats *st;
+	unsigned i;
+	int n;
+
+	if (site == NULL) {
+		site = "unknown";
+	}
+	if (gSiteCount == 0) {
+		atexit(PrintHandleStats);
+	}
+	i = (unsigned)(((uintptr_t)site >> 3) * 0x9e3779b1u);
+	for (;;) {
+		i &= ARRAY_COUNT(gSiteTable) - 1;
+		n = gSiteTable[i];
+		if (n == 0) {
+			break;
+		}
+		st = &gSites[n - 1];
+		if (st->site == site || strcmp(st->site, site) == 0) {
+			return st;
+		}
+		i++;
+	}
+	if (gSiteCount >= kMaxHandleSites - 1) {
+		// The last entry is reserved for all the sites which don't fit, and
+		// is never in the hash table.
+		st = &gSites[kMaxHandleSites - 1];
+		st->site = "other";
+		gSiteCount = kMaxHandleSites;
+		return st;
+	}
+	st = &gSites[gSiteCount++];
+	st->site = site;
+	gSiteTable[i] = gSiteCount;
+	return st;
+}
+
+// Add to the size of live handles.
+static void AddBytes(struct HandleStats *st, long bytes)
+{
+	st->bytes += bytes;
+	if (st->bytes > st->peakBytes) {
+		st->peakBytes = st->bytes;
+	}
+}
+
+static void StatsNew(struct MasterPointer *mp, const char *site)
+{
+	struct HandleStats *st;
+
+	pthread_mutex_lock(&gStatsLock);
+	st = GetSite(site);
+	mp->stats = st;
+	st->newCount++;
+	st->handles++;
+	AddBytes(st, mp->size);
+	gStats.newCount++;
+	gStats.handles++;
+	AddBytes(&gStats, mp->size);
+	pthread_mutex_unlock(&gStatsLock);
+}
+
+static void StatsResize(struct MasterPointer *mp, Size oldSize)
+{
+	pthread_mutex_lock(&gStatsLock);
+	mp->stats->resizeCount++;
+	AddBytes(mp->stats, mp->size - oldSize);
+	gStats.resizeCount++;
+	AddBytes(&gStats, mp->size - oldSize);
+	pthread_mutex_unlock(&gStatsLock);
+}
+
+static void StatsDispose(struct MasterPointer *mp)
+{
+	pthread_mutex_lock(&gStatsLock);
+	mp->stats->disposeCount++;
+	mp->stats->handles--;
+	mp->stats->bytes -= mp->size;
+	gStats.disposeCount++;
+	gStats.handles--;
+	gStats.bytes -= mp->size;
+	pthread_mutex_unlock(&gStatsLock);
+}
+
+Boolean GetHandleStats(struct HandleStats *stats)
+{
+	pthread_mutex_lock(&gStatsLock);
+	*stats = gStats;
+	pthread_mutex_unlock(&gStatsLock);
+	return true;
+}
+
+Boolean GetHandleSiteStats(int index, struct HandleStats *stats)
+{
+	Boolean ok;
+
+	pthread_mutex_lock(&gStatsLock);
+	ok = index >= 0 && index < gSiteCount;
+	if (ok) {
+		*stats = gSites[index];
+	}
+	pthread_mutex_unlock(&gStatsLock);
+	return ok;
+}
+
+void ResetHandlePeak(void)
+{
+	int i;
+
+	pthread_mutex_lock(&gStatsLock);
+	gStats.peakBytes = gStats.bytes;
+	for (i = 0; i < gSiteCount; i++) {
+		gSites[i].peakBytes = gSites[i].bytes;
+	}
+	pthread_mutex_unlock(&gStatsLock);
+}
+
+static int ComparePeak(const void *x, const void *y)
+{
+	const struct HandleStats *a = x, *b = y;
+
+	if (a->peakBytes != b->peakBytes) {
+		return a->peakBytes > b->peakBytes ? -1 : 1;
+	}
+	return strcmp(a->site, b->site);
+}
+
+// Print the statistics, with the call sites that used the most memory first.
+static void PrintHandleStats(void)
+{
+	static struct HandleStats sites[kMaxHandleSites];
+	int i, n;
+
+	pthread_mutex_lock(&gStatsLock);
+	n = gSiteCount;
+	memcpy(sites, gSites, sizeof(*sites) * n);
+	fprintf(stderr,
+	        "Handle statistics: %ld new, %ld resize, %ld dispose, "
+	        "%ld live (%ld bytes), peak %ld bytes\n",
+	        gStats.newCount, gStats.resizeCount, gStats.disposeCount,
+	        gStats.handles, gStats.bytes, gStats.peakBytes);
+	pthread_mutex_unlock(&gStatsLock);
+	qsort(sites, n, sizeof(*sites), ComparePeak);
+	fprintf(stderr, "%12s %12s %8s %10s %10s  %s\n", "peak", "bytes", "live",
+	        "new", "resize", "site");
+	for (i = 0; i < n && i < kReportSites; i++) {
+		fprintf(stderr, "%12ld %12ld %8ld %10ld %10ld  %s\n",
+		        sites[i].peakBytes, sites[i].bytes, sites[i].handles,
+		        sites[i].newCount, sites[i].resizeCount, sites[i].site);
+	}
+}
+
+#else
+
+#define StatsNew(mp, site) ((void)(site))
+#define StatsResize(mp, oldSize) ((void)(oldSize))
+#define StatsDispose(mp) ((void)0)
+
+Boolean GetHandleStats(struct HandleStats *stats)
+{
+	(void)stats;
+	return false;
+}
+
+Boolean GetHandleSiteStats(int index, struct HandleStats *stats)
+{
+	(void)index;
+	(void)stats;
+	return false;
+}
+
+void ResetHandlePeak(void)
 {
+}
+
+#endif
+
+// Get an unused master pointer. Returns NULL if out of memory.
+static struct MasterPointer *NewMasterPointer(void)
+{
+	struct MasterPointerBlock *block;
+	struct MasterPointer *mp;
+	int i;
+
+	pthread_mutex_lock(&gMasterPointerLock);
+	mp = gFreeMasterPointers;
+	if (mp == NULL) {
+		block = SystemAlloc(sizeof(*block));
+		if (block == NULL) {
+			pthread_mutex_unlock(&gMasterPointerLock);
+			return NULL;
+		}
+		block->next = gMasterPointerBlocks;
+		gMasterPointerBlocks = block;
+		for (i = 1; i < kMasterPointerBlockCount - 1; i++) {
+			block->pointers[i].next = &block->pointers[i + 1];
+		}
+		block->pointers[i].next = NULL;
+		mp = &block->pointers[0];
+		mp->next = &block->pointers[1];
+	}
+	gFreeMasterPointers = mp->next;
+	pthread_mutex_unlock(&gMasterPointerLock);
+	return mp;
+}
+
+// Return a master pointer to the free list.
+static void FreeMasterPointer(struct MasterPointer *mp)
+{
+	pthread_mutex_lock(&gMasterPointerLock);
+	mp->next = gFreeMasterPointers;
+	gFreeMasterPointers = mp;
+	pthread_mutex_unlock(&gMasterPointerLock);
+}
+
+// Get the amount of scope memory used by a handle of the given size. Empty
+// handles still use some memory, so every handle in a scope has a different
+// address, and the last allocation can be identified by its address.
+static Size ScopeSize(Size size)
+{
+	if (size == 0) {
+		return kScopeAlign;
+	}
+	return (size + kScopeAlign - 1) & ~(Size)(kScopeAlign - 1);
+}
+
+// Allocate memory from a scope. The size must not be larger than
+// kScopeMaxSize. The new memory becomes the last allocation in the scope.
+// Returns NULL if out of memory.
+static Ptr ScopeAlloc(struct HandleScope *scope, Size size)
+{
+	union ScopeChunk *chunk;
+	Size asize;
+	char *p;
+
+	asize = ScopeSize(size);
+	if (scope->end - scope->pos < asize) {
+		chunk = SystemAlloc(kScopeChunkSize);
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->next = scope->chunks;
+		scope->chunks = chunk;
+		scope->pos = (char *)(chunk + 1);
+		scope->end = (char *)chunk + kScopeChunkSize;
+	}
+	p = scope->pos;
+	scope->pos = p + asize;
+	scope->last = p;
+	return p;
+}
+
+// Add a master pointer to the list of handles owned by a scope.
+static void ScopeLink(struct HandleScope *scope, struct MasterPointer *mp)
+{
+	mp->scope = scope;
+	mp->prev = NULL;
+	mp->next = scope->handles;
+	if (mp->next != NULL) {
+		mp->next->prev = mp;
+	}
+	scope->handles = mp;
+}
+
+// Remove a master pointer from the list of handles owned by its scope, and
+// give back its memory if it was the last allocation.
+static void ScopeUnlink(struct MasterPointer *mp)
+{
+	struct HandleScope *scope = mp->scope;
+
+	if (mp->ptr == scope->last) {
+		scope->pos = scope->last;
+		scope->last = NULL;
+	}
+	if (mp->prev != NULL) {
+		mp->prev->next = mp->next;
+	} else {
+		scope->handles = mp->next;
+	}
+	if (mp->next != NULL) {
+		mp->next->prev = mp->prev;
+	}
+	mp->scope = NULL;
+}
+
+void HandleScopeBegin(struct HandleScope *scope)
+{
+	scope->parent = gHandleScope;
+	scope->chunks = NULL;
+	scope->pos = NULL;
+	scope->end = NULL;
+	scope->last = NULL;
+	scope->handles = NULL;
+	gHandleScope = scope;
+}
+
+void HandleScopeEnd(struct HandleScope *scope)
+{
+	struct MasterPointer *mp;
+	union ScopeChunk *chunk, *next;
+	Ptr p;
+
+	if (scope != gHandleScope) {
+		Fatalf("HandleScopeEnd: scope is not the current scope");
+	}
+	// Handles which escape the scope get their own memory.
+	for (mp = scope->handles; mp != NULL; mp = mp->next) {
+		p = SystemAlloc(mp->size);
+		if (mp->size > 0 && p == NULL) {
+			Fatalf("HandleScopeEnd: out of memory");
+		}
+		if (mp->size > 0) {
+			memcpy(p, mp->ptr, mp->size);
+		}
+		mp->ptr = p;
+		mp->scope = NULL;
+	}
+	for (chunk = scope->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	gHandleScope = scope->parent;
+}
+
+void HandleScopeSuspend(struct HandleScope *scope)
+{
+	scope->parent = gHandleScope;
+	scope->chunks = NULL;
+	scope->pos = NULL;
+	scope->end = NULL;
+	scope->last = NULL;
+	scope->handles = NULL;
+	gHandleScope = NULL;
+}
+
+void HandleScopeResume(struct HandleScope *scope)
+{
+	if (gHandleScope != NULL) {
+		Fatalf("HandleScopeResume: a scope is still active");
+	}
+	gHandleScope = scope->parent;
+}
+
+// Allocate a handle, tagged with a call site for statistics.
+static Handle AllocHandle(Size byteCount, const char *site)
+{
+	struct HandleScope *scope;
+	struct MasterPointer *h;
 	Ptr p;
-	Handle h;
 
 	if (byteCount < 0) {
 		Fatalf("NewHandle: byteCount = %ld", byteCount);
 	}
-	p = malloc(byteCount);
-	if (byteCount > 0 && p == NULL) {
-		return NULL;
-	}
-	h = malloc(sizeof(Ptr));
+	h = NewMasterPointer();
 	if (h == NULL) {
-		free(p);
 		return NULL;
 	}
-	*h = p;
-	return h;
+	scope = gHandleScope;
+	if (scope != NULL && byteCount <= kScopeMaxSize) {
+		p = ScopeAlloc(scope, byteCount);
+		if (p == NULL) {
+			FreeMasterPointer(h);
+			return NULL;
+		}
+		ScopeLink(scope, h);
+	} else {
+		p = SystemAlloc(byteCount);
+		if (byteCount > 0 && p == NULL) {
+			FreeMasterPointer(h);
+			return NULL;
+		}
+		h->scope = NULL;
+	}
+	h->ptr = p;
+	h->size = byteCount;
+	StatsNew(h, site);
+	return &h->ptr;
+}
+
+Handle NewHandle(Size byteCount)
+{
+	return AllocHandle(byteCount, NULL);
 }
 
+#if HANDLE_STATS
+
+Handle NewHandleAt(Size byteCount, const char *site)
+{
+	return AllocHandle(byteCount, site);
+}
+
+#endif
+
 void DisposeHandle(Handle h)
 {
-	if (h != NULL) {
-		free(*h);
-		free(h);
+	struct MasterPointer *mp = (struct MasterPointer *)h;
+
+	if (h == NULL) {
+		return;
+	}
+	StatsDispose(mp);
+	if (mp->scope != NULL) {
+		ScopeUnlink(mp);
+	} else {
+		free(mp->ptr);
+	}
+	FreeMasterPointer(mp);
+}
+
+// Resize a handle owned by a scope.
+static Boolean ScopeResize(struct MasterPointer *mp, Size newSize)
+{
+	struct HandleScope *scope = mp->scope;
+	char *pos, *last;
+	Ptr p;
+	Size asize;
+
+	if (newSize > kScopeMaxSize) {
+		// Move large handles out of the scope.
+		p = SystemAlloc(newSize);
+		if (p == NULL) {
+			return false;
+		}
+		memcpy(p, mp->ptr, mp->size);
+		ScopeUnlink(mp);
+		mp->ptr = p;
+		mp->size = newSize;
+		return true;
+	}
+	asize = ScopeSize(newSize);
+	pos = scope->pos;
+	last = scope->last;
+	if (mp->ptr == last) {
+		// The last allocation can grow or shrink in place. Otherwise, it is
+		// released before allocating a new chunk, which leaves the old chunk
+		// and its contents intact.
+		if (scope->end - last >= asize) {
+			scope->pos = last + asize;
+			mp->size = newSize;
+			return true;
+		}
+		scope->pos = last;
+	} else if (newSize <= mp->size) {
+		mp->size = newSize;
+		return true;
 	}
+	p = ScopeAlloc(scope, newSize);
+	if (p == NULL) {
+		scope->pos = pos;
+		scope->last = last;
+		return false;
+	}
+	memcpy(p, mp->ptr, mp->size < newSize ? mp->size : newSize);
+	mp->ptr = p;
+	mp->size = newSize;
+	return true;
 }
 
 Boolean ResizeHandle(Handle h, Size newSize)
 {
+	struct MasterPointer *mp = (struct MasterPointer *)h;
 	Ptr p;
+	Size oldSize;
+
 	if (h == NULL) {
 		Fatalf("ResizeHandle: h = NULL");
 	}
 	if (newSize < 0) {
 		Fatalf("ResizeHandle: newSize = %ld", newSize);
 	}
-	p = realloc(*h, newSize);
-	if (newSize > 0 && p == NULL) {
-		return false;
+	oldSize = mp->size;
+	if (mp->scope != NULL) {
+		if (!ScopeResize(mp, newSize)) {
+			return false;
+		}
+	} else {
+		p = SystemRealloc(*h, newSize);
+		if (newSize > 0 && p == NULL) {
+			return false;
+		}
+		*h = p;
+		mp->size = newSize;
 	}
-	*h = p;
+	StatsResize(mp, oldSize);
 	return true;
 }
 
+Size GetHandleSize(Handle h)
+{
+	if (h == NULL) {
+		Fatalf("GetHandleSize: h = NULL");
+	}
+	return ((struct MasterPointer *)h)->size;
+}
+
 void MemClear(void *ptr, Size size)
 {
 	memset(ptr, 0, size);
@@ -0,0 +1,402 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	// Number of handles used by the random test.
+	kHandleCount = 100,
+
+	// Largest handle size used by the random test. Some handles are larger
+	// than the largest handle allocated from a scope.
+	kMaxHandleSize = 40000,
+
+	// Number of call sites used by the site test. More than the number of
+	// sites which get separate statistics.
+	kSiteCount = 1500
+};
+
+// Fill a handle with a pattern derived from a seed.
+static void Fill(Handle h, UInt8 seed)
+{
+	Size i, n;
+	UInt8 *p;
+
+	n = GetHandleSize(h);
+	p = (UInt8 *)*h;
+	for (i = 0; i < n; i++) {
+		p[i] = (UInt8)(seed + i * 7);
+	}
+}
+
+// Check that the first size bytes of a handle match Fill.
+static void Check(Handle h, UInt8 seed, Size size)
+{
+	Size i;
+	const UInt8 *p;
+
+	p = (const UInt8 *)*h;
+	for (i = 0; i < size; i++) {
+		if (p[i] != (UInt8)(seed + i * 7)) {
+			Failf("byte %ld = %d, expect %d", (long)i, p[i],
+			      (UInt8)(seed + i * 7));
+			return;
+		}
+	}
+}
+
+static Handle NewHandleOrDie(Size size)
+{
+	Handle h;
+
+	h = NewHandle(size);
+	if (h == NULL) {
+		Fatalf("NewHandle(%ld) failed", (long)size);
+	}
+	return h;
+}
+
+static void ResizeOrDie(Handle h, Size size)
+{
+	if (!ResizeHandle(h, size)) {
+		Fatalf("ResizeHandle(%ld) failed", (long)size);
+	}
+	if (GetHandleSize(h) != size) {
+		Failf("size = %ld, expect %ld", (long)GetHandleSize(h), (long)size);
+	}
+}
+
+// Create, resize, and dispose many handles at random, checking that the
+// contents are preserved. The handles and their seeds are stored in the arrays.
+static void RandomHandles(Handle *handles, UInt8 *seeds)
+{
+	Size size, oldsize;
+	int i, j;
+
+	for (i = 0; i < kHandleCount; i++) {
+		size = TestRand() % 200;
+		handles[i] = NewHandleOrDie(size);
+		seeds[i] = TestRand();
+		Fill(handles[i], seeds[i]);
+	}
+	for (i = 0; i < 2000; i++) {
+		j = TestRand() % kHandleCount;
+		switch (TestRand() % 4) {
+		case 0:
+			DisposeHandle(handles[j]);
+			size = TestRand() % 200;
+			handles[j] = NewHandleOrDie(size);
+			seeds[j] = TestRand();
+			Fill(handles[j], seeds[j]);
+			break;
+		case 1:
+		case 2:
+			oldsize = GetHandleSize(handles[j]);
+			size = TestRand() % 8 == 0 ? (Size)(TestRand() % kMaxHandleSize) :
+			                             (Size)(TestRand() % 400);
+			ResizeOrDie(handles[j], size);
+			Check(handles[j], seeds[j], oldsize < size ? oldsize : size);
+			Fill(handles[j], seeds[j]);
+			break;
+		case 3:
+			Check(handles[j], seeds[j], GetHandleSize(handles[j]));
+			break;
+		}
+	}
+}
+
+static void TestHandles(Boolean scoped)
+{
+	struct HandleScope scope;
+	Handle handles[kHandleCount];
+	UInt8 seeds[kHandleCount];
+	int i;
+
+	SetTestNamef("handles scoped=%d", scoped);
+	if (scoped) {
+		HandleScopeBegin(&scope);
+	}
+	RandomHandles(handles, seeds);
+	// Dispose half the handles, and let the rest escape the scope.
+	for (i = 0; i < kHandleCount; i += 2) {
+		DisposeHandle(handles[i]);
+	}
+	if (scoped) {
+		HandleScopeEnd(&scope);
+	}
+	for (i = 1; i < kHandleCount; i += 2) {
+		Check(handles[i], seeds[i], GetHandleSize(handles[i]));
+		// Handles can still be resized after the scope ends.
+		ResizeOrDie(handles[i], GetHandleSize(handles[i]) + 1000);
+		Fill(handles[i], seeds[i]);
+		DisposeHandle(handles[i]);
+	}
+}
+
+// Test that a growing handle at the end of a scope is resized in place.
+static void TestGrow(void)
+{
+	struct HandleScope scope;
+	Handle h;
+	Ptr p;
+	long allocs;
+
+	SetTestName("grow");
+	HandleScopeBegin(&scope);
+	h = NewHandleOrDie(16);
+	p = *h;
+	allocs = HandleSystemAllocCount();
+	ResizeOrDie(h, 1000);
+	if (*h != p) {
+		Failf("handle moved");
+	}
+	if (HandleSystemAllocCount() != allocs) {
+		Failf("resize allocated memory");
+	}
+	if (((uintptr_t)p & 15) != 0) {
+		Failf("misaligned: %p", (void *)p);
+	}
+	DisposeHandle(h);
+	// The memory is reused.
+	h = NewHandleOrDie(8);
+	if (*h != p) {
+		Failf("memory not reused");
+	}
+	DisposeHandle(h);
+	HandleScopeEnd(&scope);
+}
+
+// Test empty handles in a scope.
+static void TestEmpty(void)
+{
+	struct HandleScope scope;
+	Handle h0, h1, h2;
+
+	SetTestName("empty");
+	HandleScopeBegin(&scope);
+	// An empty handle is the first allocation in a new scope.
+	h0 = NewHandleOrDie(0);
+	h1 = NewHandleOrDie(32);
+	Fill(h1, 1);
+	if (*h0 == *h1) {
+		Failf("empty handle has the same address as the next handle");
+	}
+	// Disposing an empty handle must not free the memory after it.
+	DisposeHandle(h0);
+	h2 = NewHandleOrDie(32);
+	Fill(h2, 2);
+	if (*h2 == *h1) {
+		Failf("new handle has the same address as a live handle");
+	}
+	Check(h1, 1, 32);
+	// Resize to and from empty.
+	ResizeOrDie(h2, 0);
+	h0 = NewHandleOrDie(0);
+	ResizeOrDie(h2, 64);
+	Fill(h2, 2);
+	ResizeOrDie(h0, 100);
+	Fill(h0, 3);
+	Check(h1, 1, 32);
+	Check(h2, 2, 64);
+	DisposeHandle(h1);
+	DisposeHandle(h2);
+	HandleScopeEnd(&scope);
+	Check(h0, 3, 100);
+	DisposeHandle(h0);
+}
+
+// Test that handles created while a scope is suspended are not in the scope.
+static void TestSuspend(void)
+{
+	struct HandleScope scope, suspend;
+	Handle h1, h2;
+	Ptr p1, p2;
+
+	SetTestName("suspend");
+	HandleScopeBegin(&scope);
+	h1 = NewHandleOrDie(100);
+	HandleScopeSuspend(&suspend);
+	h2 = NewHandleOrDie(100);
+	HandleScopeResume(&suspend);
+	Fill(h1, 1);
+	Fill(h2, 2);
+	p1 = *h1;
+	p2 = *h2;
+	HandleScopeEnd(&scope);
+	if (*h1 == p1) {
+		Failf("scoped handle did not move");
+	}
+	if (*h2 != p2) {
+		Failf("handle created while suspended moved");
+	}
+	Check(h1, 1, 100);
+	Check(h2, 2, 100);
+	DisposeHandle(h1);
+	DisposeHandle(h2);
+}
+
+// Test nested scopes.
+static void TestNested(void)
+{
+	struct HandleScope outer, inner;
+	Handle h1, h2, h3;
+
+	SetTestName("nested");
+	HandleScopeBegin(&outer);
+	h1 = NewHandleOrDie(100);
+	Fill(h1, 1);
+	HandleScopeBegin(&inner);
+	h2 = NewHandleOrDie(100);
+	Fill(h2, 2);
+	// Resize a handle from the outer scope while the inner scope is active.
+	ResizeOrDie(h1, 300);
+	Fill(h1, 1);
+	HandleScopeEnd(&inner);
+	h3 = NewHandleOrDie(100);
+	Fill(h3, 3);
+	HandleScopeEnd(&outer);
+	Check(h1, 1, 300);
+	Check(h2, 2, 100);
+	Check(h3, 3, 100);
+	DisposeHandle(h1);
+	DisposeHandle(h2);
+	DisposeHandle(h3);
+}
+
+// Test handle statistics, if they are enabled.
+static void TestStats(void)
+{
+	struct HandleStats before, after, site;
+	Handle h1, h2;
+	int i;
+
+	SetTestName("stats");
+	if (!GetHandleStats(&before)) {
+		return;
+	}
+	ResetHandlePeak();
+	h1 = NewHandleOrDie(100);
+	ResizeOrDie(h1, 1000);
+	h2 = NewHandle(50);
+	if (h2 == NULL) {
+		Fatalf("NewHandle failed");
+	}
+	DisposeHandle(h1);
+	GetHandleStats(&after);
+	if (after.newCount - before.newCount != 2 ||
+	    after.resizeCount - before.resizeCount != 1 ||
+	    after.disposeCount - before.disposeCount != 1) {
+		Failf("counts: new %ld, resize %ld, dispose %ld; expect 2, 1, 1",
+		      after.newCount - before.newCount,
+		      after.resizeCount - before.resizeCount,
+		      after.disposeCount - before.disposeCount);
+	}
+	if (after.handles - before.handles != 1 ||
+	    after.bytes - before.bytes != 50) {
+		Failf("live: %ld handles, %ld bytes; expect 1, 50",
+		      after.handles - before.handles, after.bytes - before.bytes);
+	}
+	if (after.peakBytes - before.bytes != 1050) {
+		Failf("peak: %ld, expect 1050", after.peakBytes - before.bytes);
+	}
+	// The second handle is tagged with this file.
+	for (i = 0; GetHandleSiteStats(i, &site); i++) {
+		if (strstr(site.site, "toolbox_test.c") != NULL && site.handles == 1 &&
+		    site.bytes == 50) {
+			break;
+		}
+	}
+	if (!GetHandleSiteStats(i, &site)) {
+		Failf("call site not found");
+	}
+	DisposeHandle(h2);
+}
+
+#if HANDLE_STATS
+// Find the statistics for a call site by name. Returns false if the site does
+// not have its own statistics.
+static Boolean FindSite(const char *name, struct HandleStats *site)
+{
+	int i;
+
+	for (i = 0; GetHandleSiteStats(i, site); i++) {
+		if (strcmp(site->site, name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+#endif
+
+// Test that call sites past the limit are counted together, without changing
+// the statistics for the sites before the limit.
+static void TestManySites(void)
+{
+#if HANDLE_STATS
+	static char names[kSiteCount][16];
+	static Handle handles[kSiteCount];
+	static Boolean named[kSiteCount];
+	struct HandleStats site;
+	int i, count;
+
+	SetTestName("many sites");
+	count = 0;
+	for (i = 0; i < kSiteCount; i++) {
+		snprintf(names[i], sizeof(names[i]), "site %d", i);
+		handles[i] = NewHandleAt(i + 1, names[i]);
+		if (handles[i] == NULL) {
+			Fatalf("NewHandle failed");
+		}
+		named[i] = FindSite(names[i], &site);
+		if (named[i]) {
+			count++;
+		}
+	}
+	if (count == 0 || count == kSiteCount) {
+		Failf("%d sites have their own statistics", count);
+	}
+	// Sites keep their statistics after the limit is reached.
+	for (i = 0; i < kSiteCount; i++) {
+		if (!named[i]) {
+			continue;
+		}
+		if (!FindSite(names[i], &site)) {
+			Failf("%s: statistics lost", names[i]);
+		} else if (site.handles != 1 || site.bytes != i + 1) {
+			Failf("%s: %ld handles, %ld bytes; expect 1, %d", names[i],
+			      site.handles, site.bytes, i + 1);
+		}
+	}
+	if (!FindSite("other", &site)) {
+		Failf("no statistics for other sites");
+	} else if (site.handles != kSiteCount - count) {
+		Failf("other: %ld handles, expect %d", site.handles,
+		      kSiteCount - count);
+	}
+	for (i = 0; i < kSiteCount; i++) {
+		DisposeHandle(handles[i]);
+	}
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	TestHandles(false);
+	TestHandles(true);
+	TestGrow();
+	TestEmpty();
+	TestSuspend();
+	TestNested();
+	TestStats();
+	TestManySites();
+	return TestsDone();
+}
@@ -0,0 +1,299 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// utf8.c - UTF-8 decoding and validation.
+//
+// The vector implementations check each byte together with the three bytes
+// before it, using three 16-entry lookup tables indexed by the high and low
+// nibbles of the previous byte and the high nibble of the current byte. Each
+// table entry is a set of error bits, and a pair of bytes is invalid when all
+// three lookups share an error bit. Continuation bytes which must follow a
+// three or four byte lead are checked separately. This is the algorithm
+// described in "Validating UTF-8 In Less Than One Instruction Per Byte" by
+// John Keiser and Daniel Lemire.
+#include "lib/utf8.h"
+
+// Pick a vector implementation, based on the target. These are only available
+// with GCC-compatible compilers, and the portable code is used everywhere else.
+// Without SSSE3, only runs of ASCII text are vectorized.
+#if __AVX2__
+#define UTF8_AVX2 1
+#include <immintrin.h>
+#elif __SSSE3__
+#define UTF8_SSSE3 1
+#include <tmmintrin.h>
+#elif __SSE2__
+#define UTF8_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if UTF8_AVX2 || UTF8_SSSE3
+#define UTF8_LOOKUP 1
+
+// Error bits in the lookup tables. Each describes a pair of bytes, the first
+// byte and the second byte, which is invalid.
+enum {
+	// 11______ 0_______ or 11______ 11______
+	kTooShort = 1 << 0,
+	// 0_______ 10______
+	kTooLong = 1 << 1,
+	// 11100000 100_____
+	kOverlong3 = 1 << 2,
+	// 11110100 1001____, 11110100 101_____, 11110101+ 1001____ or higher
+	kTooLarge = 1 << 3,
+	// 11101101 101_____
+	kSurrogate = 1 << 4,
+	// 1100000_ 10______
+	kOverlong2 = 1 << 5,
+	// 11110101+ 1000____, or 11110000 1000____
+	kTooLarge1000 = 1 << 6,
+	kOverlong4 = 1 << 6,
+	// 10______ 10______
+	kTwoConts = 1 << 7,
+
+	// Errors which do not depend on the low nibble of the first byte.
+	kCarry = kTooShort | kTooLong | kTwoConts
+};
+
+// Lookup tables, as arguments to _mm_setr_epi8 and similar.
+
+// Indexed by the high nibble of the first byte.
+#define BYTE_1_HIGH                                                          \
+	kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,    \
+		kTooLong, kTwoConts, kTwoConts, kTwoConts, kTwoConts,                \
+		kTooShort | kOverlong2, kTooShort,                                   \
+		kTooShort | kOverlong3 | kSurrogate,                                 \
+		kTooShort | kTooLarge | kTooLarge1000 | kOverlong4
+
+// Indexed by the low nibble of the first byte.
+#define BYTE_1_LOW                                                           \
+	kCarry | kOverlong3 | kOverlong2 | kOverlong4, kCarry | kOverlong2,      \
+		kCarry, kCarry, kCarry | kTooLarge,                                  \
+		kCarry | kTooLarge | kTooLarge1000,                                  \
+		kCarry | kTooLarge | kTooLarge1000,                                  \
+		kCarry | kTooLarge | kTooLarge1000,                                  \
+		kCarry | kTooLarge | kTooLarge1000,                                  \
+		kCarry | kTooLarge | kTooLarge1000,                                  \
+		kCarry | kTooLarge | kTooLarge1000,                                  \
+		kCarry | kTooLarge | kTooLarge1000,                                  \
+		kCarry | kTooLarge | kTooLarge1000,                                  \
+		kCarry | kTooLarge | kTooLarge1000 | kSurrogate,                     \
+		kCarry | kTooLarge | kTooLarge1000,                                  \
+		kCarry | kTooLarge | kTooLarge1000
+
+// Indexed by the high nibble of the second byte.
+#define BYTE_2_HIGH                                                          \
+	kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,        \
+		kTooShort, kTooShort,                                                \
+		kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 |     \
+			kOverlong4,                                                      \
+		kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,          \
+		kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,          \
+		kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,          \
+		kTooShort, kTooShort, kTooShort, kTooShort
+
+// Largest byte values which do not start an incomplete sequence, for the last
+// three bytes of a vector.
+#define INCOMPLETE_MAX 0xef, 0xdf, 0xbf
+#endif
+
+#if UTF8_AVX2
+// Validate the text 32 bytes at a time. Return the position of the first block
+// which contains an error or which was not checked. All text before this
+// position is valid, except possibly for an incomplete sequence at the end.
+static const UInt8 *ValidateAVX2(const UInt8 *pos, const UInt8 *end)
+{
+	__m256i t1h, t1l, t2h, nib, imax, c80, c1, c2;
+	__m256i prev, in, prev1, prev2, prev3, shifted, sc, must23, err;
+
+	t1h = _mm256_setr_epi8(BYTE_1_HIGH, BYTE_1_HIGH);
+	t1l = _mm256_setr_epi8(BYTE_1_LOW, BYTE_1_LOW);
+	t2h = _mm256_setr_epi8(BYTE_2_HIGH, BYTE_2_HIGH);
+	nib = _mm256_set1_epi8(0x0f);
+	imax = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	                        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	                        -1, -1, -1, -1, -1, (char)0xef, (char)0xdf,
+	                        (char)0xbf);
+	c80 = _mm256_set1_epi8((char)0x80);
+	c1 = _mm256_set1_epi8((char)(0xe0 - 0x80));
+	c2 = _mm256_set1_epi8((char)(0xf0 - 0x80));
+	prev = _mm256_setzero_si256();
+	while (end - pos >= 32) {
+		in = _mm256_loadu_si256((const void *)pos);
+		if (_mm256_movemask_epi8(in) == 0) {
+			// ASCII text. The only possible error is an incomplete sequence
+			// at the end of the previous block.
+			if (!_mm256_testz_si256(_mm256_subs_epu8(prev, imax),
+			                        _mm256_subs_epu8(prev, imax))) {
+				break;
+			}
+		} else {
+			shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+			prev1 = _mm256_alignr_epi8(in, shifted, 15);
+			prev2 = _mm256_alignr_epi8(in, shifted, 14);
+			prev3 = _mm256_alignr_epi8(in, shifted, 13);
+			sc = _mm256_and_si256(
+				_mm256_and_si256(
+					_mm256_shuffle_epi8(
+						t1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nib)),
+					_mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, nib))),
+				_mm256_shuffle_epi8(
+					t2h, _mm256_and_si256(_mm256_srli_epi16(in, 4), nib)));
+			must23 = _mm256_and_si256(
+				_mm256_or_si256(_mm256_subs_epu8(prev2, c1),
+			                    _mm256_subs_epu8(prev3, c2)),
+				c80);
+			err = _mm256_xor_si256(must23, sc);
+			if (!_mm256_testz_si256(err, err)) {
+				break;
+			}
+		}
+		prev = in;
+		pos += 32;
+	}
+	return pos;
+}
+#endif
+
+#if UTF8_SSSE3
+// Validate the text 16 bytes at a time. Works like ValidateAVX2.
+static const UInt8 *ValidateSSSE3(const UInt8 *pos, const UInt8 *end)
+{
+	__m128i t1h, t1l, t2h, nib, imax, c80, c1, c2, zero;
+	__m128i prev, in, prev1, prev2, prev3, sc, must23, err;
+
+	t1h = _mm_setr_epi8(BYTE_1_HIGH);
+	t1l = _mm_setr_epi8(BYTE_1_LOW);
+	t2h = _mm_setr_epi8(BYTE_2_HIGH);
+	nib = _mm_set1_epi8(0x0f);
+	imax = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	                     (char)0xef, (char)0xdf, (char)0xbf);
+	c80 = _mm_set1_epi8((char)0x80);
+	c1 = _mm_set1_epi8((char)(0xe0 - 0x80));
+	c2 = _mm_set1_epi8((char)(0xf0 - 0x80));
+	zero = _mm_setzero_si128();
+	prev = zero;
+	while (end - pos >= 16) {
+		in = _mm_loadu_si128((const void *)pos);
+		if (_mm_movemask_epi8(in) == 0) {
+			err = _mm_subs_epu8(prev, imax);
+		} else {
+			prev1 = _mm_alignr_epi8(in, prev, 15);
+			prev2 = _mm_alignr_epi8(in, prev, 14);
+			prev3 = _mm_alignr_epi8(in, prev, 13);
+			sc = _mm_and_si128(
+				_mm_and_si128(
+					_mm_shuffle_epi8(
+						t1h, _mm_and_si128(_mm_srli_epi16(prev1, 4), nib)),
+					_mm_shuffle_epi8(t1l, _mm_and_si128(prev1, nib))),
+				_mm_shuffle_epi8(t2h,
+			                     _mm_and_si128(_mm_srli_epi16(in, 4), nib)));
+			must23 = _mm_and_si128(
+				_mm_or_si128(_mm_subs_epu8(prev2, c1), _mm_subs_epu8(prev3, c2)),
+				c80);
+			err = _mm_xor_si128(must23, sc);
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, zero)) != 0xffff) {
+			break;
+		}
+		prev = in;
+		pos += 16;
+	}
+	return pos;
+}
+#endif
+
+int UTF8Decode(const UInt8 *ptr, const UInt8 *end, UInt32 *chp)
+{
+	unsigned c, lo, hi;
+	UInt32 ch;
+	int len, i;
+
+	c = ptr[0];
+	if (c < 0x80) {
+		*chp = c;
+		return 1;
+	}
+	// The range of the first continuation byte excludes overlong forms,
+	// surrogates, and values past U+10FFFF.
+	if (c < 0xc2) {
+		return -1;
+	} else if (c < 0xe0) {
+		len = 2;
+		ch = c & 0x1f;
+		lo = 0x80;
+		hi = 0xbf;
+	} else if (c < 0xf0) {
+		len = 3;
+		ch = c & 0x0f;
+		lo = c == 0xe0 ? 0xa0 : 0x80;
+		hi = c == 0xed ? 0x9f : 0xbf;
+	} else if (c < 0xf5) {
+		len = 4;
+		ch = c & 0x07;
+		lo = c == 0xf0 ? 0x90 : 0x80;
+		hi = c == 0xf4 ? 0x8f : 0xbf;
+	} else {
+		return -1;
+	}
+	for (i = 1; i < len; i++) {
+		if (ptr + i >= end) {
+			return 0;
+		}
+		c = ptr[i];
+		if (c < lo || hi < c) {
+			return -i;
+		}
+		ch = (ch << 6) | (c & 0x3f);
+		lo = 0x80;
+		hi = 0xbf;
+	}
+	*chp = ch;
+	return len;
+}
+
+Size UTF8Validate(const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos = ptr;
+	UInt32 ch;
+	int n;
+#if UTF8_LOOKUP
+	int i;
+#endif
+
+#if UTF8_LOOKUP
+#if UTF8_AVX2
+	pos = ValidateAVX2(pos, end);
+#elif UTF8_SSSE3
+	pos = ValidateSSSE3(pos, end);
+#endif
+	// Back up to the start of the last character, which may be incomplete or
+	// may be the start of an error. The remaining text is checked below.
+	for (i = 0; i < 4 && pos > ptr; i++) {
+		pos--;
+		if ((*pos & 0xc0) != 0x80) {
+			break;
+		}
+	}
+#endif
+
+	while (pos < end) {
+		if (*pos < 0x80) {
+			pos++;
+#if UTF8_SSE2
+			while (end - pos >= 16 &&
+			       _mm_movemask_epi8(_mm_loadu_si128((const void *)pos)) == 0) {
+				pos += 16;
+			}
+#endif
+			continue;
+		}
+		n = UTF8Decode(pos, end, &ch);
+		if (n <= 0) {
+			break;
+		}
+		pos += n;
+	}
+	return pos - ptr;
+}
@@ -0,0 +1,27 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#ifndef LIB_UTF8_H
+#define LIB_UTF8_H
+// utf8.h - UTF-8 decoding and validation.
+
+#include "lib/defs.h"
+
+// Decode the UTF-8 sequence at the start of the buffer, which must not be
+// empty, and store its code point. Return the length of the sequence. If the
+// sequence is invalid, return the negated length of its maximal subpart, which
+// should be replaced with one U+FFFD. Return 0 if the buffer ends before the
+// sequence is complete. Overlong sequences, surrogates, and code points above
+// U+10FFFF are invalid.
+int UTF8Decode(const UInt8 *ptr, const UInt8 *end, UInt32 *chp);
+
+// Return the number of bytes at the start of the buffer which are valid UTF-8.
+// This stops before the first invalid sequence, or before an incomplete
+// sequence at the end of the buffer. Overlong sequences, surrogates, and code
+// points above U+10FFFF are invalid.
+//
+// This can be used as a pre-pass before conversion, to check that text is
+// well-formed before any of it is converted.
+Size UTF8Validate(const UInt8 *ptr, const UInt8 *end);
+
+#endif
@@ -0,0 +1,244 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+#include "lib/utf8.h"
+
+#include "lib/test.h"
+#include "lib/util.h"
+
+#include <string.h>
+
+enum {
+	kBufferSize = 256,
+};
+
+// Reference implementation: decode each character, and check the code point.
+static Size Validate(const UInt8 *ptr, const UInt8 *end)
+{
+	const UInt8 *pos = ptr;
+	UInt32 ch, min;
+	int i, n;
+
+	while (pos < end) {
+		ch = *pos;
+		if (ch < 0x80) {
+			n = 1;
+			min = 0;
+		} else if ((ch & 0xe0) == 0xc0) {
+			n = 2;
+			ch &= 0x1f;
+			min = 0x80;
+		} else if ((ch & 0xf0) == 0xe0) {
+			n = 3;
+			ch &= 0x0f;
+			min = 0x800;
+		} else if ((ch & 0xf8) == 0xf0) {
+			n = 4;
+			ch &= 0x07;
+			min = 0x10000;
+		} else {
+			break;
+		}
+		if (end - pos < n) {
+			break;
+		}
+		for (i = 1; i < n; i++) {
+			if ((pos[i] & 0xc0) != 0x80) {
+				goto done;
+			}
+			ch = (ch << 6) | (pos[i] & 0x3f);
+		}
+		if (ch < min || ch > 0x10ffff || (ch >= 0xd800 && ch < 0xe000)) {
+			break;
+		}
+		pos += n;
+	}
+done:
+	return pos - ptr;
+}
+
+static void Check(const UInt8 *ptr, Size len)
+{
+	Size expect, got;
+
+	expect = Validate(ptr, ptr + len);
+	got = UTF8Validate(ptr, ptr + len);
+	if (got != expect) {
+		Failf("got %ld, expect %ld", (long)got, (long)expect);
+	}
+}
+
+// Test decoding single sequences.
+static void TestDecode(void)
+{
+	static const struct {
+		const char *text;
+		int expect;
+		UInt32 ch;
+	} kCases[] = {
+		{"a", 1, 0x61},
+		{"\xc3\xa9", 2, 0xe9},
+		{"\xe2\x82\xac", 3, 0x20ac},
+		{"\xf0\x9f\x98\x80", 4, 0x1f600},
+		{"\xf4\x8f\xbf\xbf", 4, 0x10ffff},
+		// Incomplete sequences.
+		{"\xc3", 0, 0},
+		{"\xe2\x82", 0, 0},
+		{"\xf0\x9f\x98", 0, 0},
+		// Invalid sequences, with the length of the maximal subpart.
+		{"\x80", -1, 0},
+		{"\xc0\x80", -1, 0},
+		{"\xe0\x9f\xbf", -1, 0},
+		{"\xed\xa0\x80", -1, 0},
+		{"\xf4\x90\x80\x80", -1, 0},
+		{"\xf5\x80\x80\x80", -1, 0},
+		{"\xe2\x82z", -2, 0},
+		{"\xf0\x9f\x98z", -3, 0},
+	};
+	const UInt8 *ptr;
+	UInt32 ch;
+	int i, n;
+
+	for (i = 0; i < (int)ARRAY_COUNT(kCases); i++) {
+		SetTestNamef("decode %d", i);
+		ptr = (const UInt8 *)kCases[i].text;
+		ch = 0;
+		n = UTF8Decode(ptr, ptr + strlen(kCases[i].text), &ch);
+		if (n != kCases[i].expect) {
+			Failf("got %d, expect %d", n, kCases[i].expect);
+		} else if (n > 0 && ch != kCases[i].ch) {
+			Failf("got U+%04lX, expect U+%04lX", (unsigned long)ch,
+			      (unsigned long)kCases[i].ch);
+		}
+	}
+}
+
+static void TestCases(void)
+{
+	static const struct {
+		const char *text;
+		int expect;
+	} kCases[] = {
+		{"", 0},
+		{"abc", 3},
+		{"caf\xc3\xa9", 5},
+		{"\xe2\x82\xac\xf0\x9f\x98\x80", 7},
+		{"\xef\xbf\xbf\xf4\x8f\xbf\xbf", 7},
+		// Incomplete sequences at the end.
+		{"a\xc3", 1},
+		{"a\xe2\x82", 1},
+		{"a\xf0\x9f\x98", 1},
+		// Unexpected continuation bytes.
+		{"a\x80", 1},
+		{"\xc3\xa9\xa9", 2},
+		// Overlong sequences.
+		{"a\xc0\x80", 1},
+		{"a\xc1\xbf", 1},
+		{"a\xe0\x9f\xbf", 1},
+		{"a\xf0\x8f\xbf\xbf", 1},
+		// Surrogates.
+		{"a\xed\xa0\x80", 1},
+		{"a\xed\xbf\xbf", 1},
+		{"\xed\x9f\xbf", 3},
+		// Too large.
+		{"a\xf4\x90\x80\x80", 1},
+		{"a\xf5\x80\x80\x80", 1},
+		{"a\xff", 1},
+		// Lead byte followed by ASCII.
+		{"a\xe2\x82z", 1},
+	};
+	static UInt8 buf[kBufferSize];
+	Size n, len;
+	int i, pad;
+
+	for (i = 0; i < (int)ARRAY_COUNT(kCases); i++) {
+		len = strlen(kCases[i].text);
+		SetTestNamef("case %d", i);
+		n = UTF8Validate((const UInt8 *)kCases[i].text,
+		                 (const UInt8 *)kCases[i].text + len);
+		if (n != (Size)kCases[i].expect) {
+			Failf("got %ld, expect %d", (long)n, kCases[i].expect);
+		}
+		// The same text at every position in a block of ASCII, which must
+		// agree with the reference implementation.
+		for (pad = 0; pad < 80; pad++) {
+			SetTestNamef("case %d pad=%d", i, pad);
+			memset(buf, 'x', sizeof(buf));
+			memcpy(buf + pad, kCases[i].text, len);
+			Check(buf, sizeof(buf));
+			Check(buf, pad + len);
+		}
+	}
+}
+
+// Test random text built from valid and invalid pieces.
+static void TestRandom(void)
+{
+	static const char *const kPieces[] = {
+		"a",
+		"abcdefghijklmnopqrstuvwxyz",
+		"\r\n",
+		"\xc3\xa9",
+		"\xdf\xbf",
+		"\xe0\xa0\x80",
+		"\xe2\x82\xac",
+		"\xed\x9f\xbf",
+		"\xee\x80\x80",
+		"\xf0\x90\x80\x80",
+		"\xf4\x8f\xbf\xbf",
+		// Invalid.
+		"\x80",
+		"\xc1\xbf",
+		"\xe0\x9f\xbf",
+		"\xed\xa0\x80",
+		"\xf4\x90\x80\x80",
+		"\xf8",
+		"\xe2\x82",
+	};
+	static UInt8 buf[kBufferSize];
+	Size len, plen;
+	int i, j, piece, nvalid;
+
+	nvalid = ARRAY_COUNT(kPieces) - 7;
+	for (i = 0; i < 10000; i++) {
+		SetTestNamef("random %d", i);
+		len = 0;
+		for (;;) {
+			// Mostly valid text, with an occasional invalid piece.
+			if (TestRand() % 32 == 0) {
+				piece = TestRand() % ARRAY_COUNT(kPieces);
+			} else {
+				piece = TestRand() % nvalid;
+			}
+			plen = strlen(kPieces[piece]);
+			if (len + plen > kBufferSize) {
+				break;
+			}
+			memcpy(buf + len, kPieces[piece], plen);
+			len += plen;
+		}
+		for (j = 0; j < 4; j++) {
+			Check(buf, len);
+			if (gFailCount != 0) {
+				return;
+			}
+			len -= TestRand() % 4;
+		}
+		// Random bytes.
+		for (j = 0; j < (int)sizeof(buf); j++) {
+			buf[j] = TestRand();
+		}
+		Check(buf, sizeof(buf));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	TestDecode();
+	TestCases();
+	TestRandom();
+	return TestsDone();
+}
@@ -6,6 +6,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 void Fatalf(const char *msg, ...)
 {
@@ -23,6 +24,8 @@ static const char *const kErrorNames[] = {
 	"no memory",
 	"bad data",
 	"too many files in one directory",
+	"system error",
+	"character has no mapping",
 };
 
 const char *ErrorDescription(ErrorCode err)
@@ -32,3 +35,15 @@ const char *ErrorDescription(ErrorCode err)
 	}
 	return kErrorNames[err];
 }
+
+double TimeNow(void)
+{
+#if TARGET_API_MAC_OS8
+	return (double)clock() / CLOCKS_PER_SEC;
+#else
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
@@ -13,4 +13,8 @@ void Fatalf(const char *msg, ...)
 // is unknown.
 const char *ErrorDescription(ErrorCode err);
 
+// Return the current time in seconds, for measuring elapsed time. The start of
+// the count is unspecified.
+double TimeNow(void);
+
 #endif
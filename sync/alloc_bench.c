@@ -0,0 +1,137 @@
+// Copyright 2022 Dietrich Epp.
+// This file is part of SyncFiles. SyncFiles is licensed under the terms of the
+// Mozilla Public License, version 2.0. See LICENSE.txt for details.
+
+// alloc_bench.c - allocation count benchmark for building trees and tables.
+#include "convert/convert.h"
+#include "convert/data.h"
+#include "lib/util.h"
+#include "sync/tree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int kTreeSizes[] = {100, 10000, 100000, 1000000};
+
+// Minimum time to run each benchmark, in seconds.
+static const double kMinTime = 0.1;
+
+// Number of extended ASCII tables, and the tables.
+static int gTableCount;
+static struct CharmapData gTables[64];
+
+// Build a tree with the given number of files in the root directory.
+static void BuildTree(int count)
+{
+	struct FileTree tree;
+	FileName key;
+	FileRef ref;
+	UInt32 n;
+	int i;
+
+	MemClear(&tree, sizeof(tree));
+	MemClear(&key, sizeof(key));
+	key.u8[0] = 4;
+	n = 1;
+	for (i = 0; i < count; i++) {
+		n = 1664525 * n + 1013904223;
+		key.u8[1] = n >> 24;
+		key.u8[2] = n >> 16;
+		key.u8[3] = n >> 8;
+		key.u8[4] = n;
+		ref = TreeInsert(&tree, 0, &key);
+		if (ref < 0) {
+			Fatalf("TreeInsert: %s", ErrorDescription(-ref));
+		}
+	}
+	DisposeHandle((Handle)tree.nodes);
+}
+
+// Build the reverse conversion table for every extended ASCII charmap.
+static void BuildTables(int count)
+{
+	Ptr datap;
+	Handle out;
+	int i;
+	ErrorCode err;
+
+	(void)count;
+	for (i = 0; i < gTableCount; i++) {
+		datap = (void *)gTables[i].ptr;
+		err = Convert1rBuild(&out, &datap, gTables[i].size);
+		if (err != 0) {
+			Fatalf("Convert1rBuild: %s", ErrorDescription(err));
+		}
+		DisposeHandle(out);
+	}
+}
+
+// Run one benchmark and print the result, either inside or outside a handle
+// scope.
+static void Bench(const char *name, void (*func)(int), int count,
+                  Boolean scoped)
+{
+	struct HandleScope scope;
+	struct HandleStats stats;
+	double start, elapsed;
+	long reps, allocs;
+	char peak[32];
+
+	reps = 0;
+	ResetHandlePeak();
+	allocs = HandleSystemAllocCount();
+	start = TimeNow();
+	do {
+		if (scoped) {
+			HandleScopeBegin(&scope);
+		}
+		func(count);
+		if (scoped) {
+			HandleScopeEnd(&scope);
+		}
+		reps++;
+		elapsed = TimeNow() - start;
+	} while (elapsed < kMinTime);
+	allocs = HandleSystemAllocCount() - allocs;
+	// The peak is only available if handle statistics are enabled.
+	if (GetHandleStats(&stats)) {
+		snprintf(peak, sizeof(peak), "%ld", stats.peakBytes);
+	} else {
+		strcpy(peak, "-");
+	}
+	printf("%s\t%d\t%s\t%.1f\t%s\t%.1f\n", name, count,
+	       scoped ? "yes" : "no", (double)allocs / (double)reps, peak,
+	       elapsed * 1e6 / (double)reps);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	struct CharmapData data;
+	int i, j;
+
+	(void)argc;
+	(void)argv;
+
+	for (i = 0; gTableCount < (int)ARRAY_COUNT(gTables); i++) {
+		if (CharmapID(i) == NULL) {
+			break;
+		}
+		data = CharmapData(i);
+		if (data.ptr != NULL && data.ptr[0] == kTableExtendedASCII) {
+			gTables[gTableCount++] = data;
+		}
+	}
+
+	puts("benchmark\tcount\tscope\tallocs\tpeak\tusec");
+	for (i = 0; i < (int)ARRAY_COUNT(kTreeSizes); i++) {
+		for (j = 0; j < 2; j++) {
+			Bench("TreeInsert", BuildTree, kTreeSizes[i], j);
+		}
+	}
+	for (j = 0; j < 2; j++) {
+		Bench("Convert1rBuild", BuildTables, gTableCount, j);
+	}
+	return 0;
+}